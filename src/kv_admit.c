@@ -0,0 +1,351 @@
+#include "kv_store.h"
+
+// Admission control
+//
+// A request holds one of a fixed number of in-flight slots while it runs.
+// When they are all taken, a connection thread may wait for one in a
+// bounded queue, up to the queue timeout; past that, or with the queue
+// full, the request is answered KV_STATUS_BUSY at once instead of piling up
+// behind the store and the log. Event-loop threads never wait. Requests
+// from peers (replication, membership) and metrics scrapes are always
+// admitted, so a node under load keeps its replicas current and stays
+// observable.
+//
+// Token buckets refill continuously at their rate, in millionths of a
+// request, up to their burst. Client addresses map onto a fixed table of
+// buckets; an address that finds its entry held by another takes it over
+// with a full bucket, so a collision can only make the limit looser.
+//
+// Connections over the cap are handed to a shedder thread that reads their
+// first request, answers it busy and closes them, so clients see the same
+// status whether the server is out of slots or out of connections.
+
+#define SHED_QUEUE 256             // Connections waiting for the shedder; a power of two
+#define SHED_READ_MS 100           // How long the shedder waits for a request
+
+// Slots are taken with a compare-and-swap; only a request that has to wait
+// takes the lock, and a finishing request only does so when someone waits
+static struct {
+    _Atomic int inflight;      // Slots in use, including by exempt requests
+    _Atomic int waiting;
+    pthread_mutex_t lock;      // Guards sleeping on cond
+    pthread_cond_t cond;
+    int max_inflight;
+    int max_waiting;
+    uint64_t wait_ns;
+} admit = { 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+            KV_ADMIT_INFLIGHT, KV_ADMIT_QUEUE, KV_ADMIT_WAIT_US * 1000ULL };
+
+typedef struct {
+    uint32_t addr;
+    KVTokenBucket bucket;
+} AddrBucket;
+
+static AddrBucket addr_buckets[KV_RATE_ADDRS];
+static pthread_mutex_t addr_locks[KV_RATE_STRIPES];
+static pthread_once_t addr_once = PTHREAD_ONCE_INIT;
+static uint64_t addr_rate = 0, addr_burst = 0;
+static uint64_t conn_rate = 0, conn_burst = 0;
+
+static _Atomic int connections = 0;
+static int max_connections = KV_MAX_CONNECTIONS;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fds[SHED_QUEUE];
+    unsigned int head;
+    unsigned int tail;
+    bool started;
+} shed = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, { 0 }, 0, 0, false };
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t used;
+    size_t limit;
+} peer_budget = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, KV_PEER_INFLIGHT_BYTES };
+
+// Set the in-flight limit, the queue length and the longest wait (call before serving)
+void kv_admit_configure(int max_inflight, int max_waiting, uint64_t wait_us) {
+    admit.max_inflight = max_inflight > 0 ? max_inflight : 1;
+    admit.max_waiting = max_waiting >= 0 ? max_waiting : 0;
+    admit.wait_ns = wait_us * 1000ULL;
+}
+
+// Limit each client address and each connection to rate requests a second
+// with bursts of burst (rate 0 = unlimited; call before serving)
+void kv_rate_configure(uint64_t per_addr, uint64_t per_addr_burst, uint64_t per_conn, uint64_t per_conn_burst) {
+    addr_rate = per_addr;
+    addr_burst = per_addr_burst > 0 ? per_addr_burst : per_addr;
+    conn_rate = per_conn;
+    conn_burst = per_conn_burst > 0 ? per_conn_burst : per_conn;
+}
+
+void kv_admit_set_max_connections(int max) {
+    max_connections = max > 0 ? max : 1;
+}
+
+void kv_rate_bucket_init(KVTokenBucket* bucket, uint64_t rate, uint64_t burst) {
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->tokens = burst * 1000000ULL;
+    bucket->last = kv_stats_now();
+}
+
+// Take one request's worth of tokens, refilling for the time since the last
+// take; a bucket shared between threads is taken under the caller's lock
+bool kv_rate_bucket_take(KVTokenBucket* bucket) {
+    if (bucket->rate == 0) {
+        return true;
+    }
+
+    // Whole microseconds times requests a second is millionths of a request
+    uint64_t full = bucket->burst * 1000000ULL;
+    uint64_t elapsed_us = (kv_stats_now() - bucket->last) / 1000;
+    uint64_t refill = elapsed_us * bucket->rate;
+    bucket->tokens = bucket->tokens + refill < full ? bucket->tokens + refill : full;
+    bucket->last += elapsed_us * 1000;
+
+    if (bucket->tokens < 1000000ULL) {
+        return false;
+    }
+    bucket->tokens -= 1000000ULL;
+    return true;
+}
+
+void kv_rate_conn_init(KVTokenBucket* bucket) {
+    kv_rate_bucket_init(bucket, conn_rate, conn_burst);
+}
+
+static void addr_locks_init(void) {
+    for (int i = 0; i < KV_RATE_STRIPES; i++) {
+        pthread_mutex_init(&addr_locks[i], NULL);
+    }
+}
+
+static bool addr_take(uint32_t addr) {
+    if (addr_rate == 0) {
+        return true;
+    }
+    pthread_once(&addr_once, addr_locks_init);
+
+    unsigned int i = (addr * 0x9e3779b1U) >> (32 - __builtin_ctz(KV_RATE_ADDRS));
+    pthread_mutex_t* lock = &addr_locks[i % KV_RATE_STRIPES];
+    pthread_mutex_lock(lock);
+    AddrBucket* entry = &addr_buckets[i];
+    if (entry->addr != addr || entry->bucket.rate == 0) {
+        entry->addr = addr;
+        kv_rate_bucket_init(&entry->bucket, addr_rate, addr_burst);
+    }
+    bool allowed = kv_rate_bucket_take(&entry->bucket);
+    pthread_mutex_unlock(lock);
+    return allowed;
+}
+
+// Requests that are never shed: peer traffic and metrics
+static bool exempt(OperationCode op) {
+    return op == OP_REPLICATE || op == OP_NODE_JOIN || op == OP_NODE_LEAVE || op == OP_STATS;
+}
+
+static bool take_slot(void) {
+    int inflight = atomic_load_explicit(&admit.inflight, memory_order_relaxed);
+    while (inflight < admit.max_inflight) {
+        if (atomic_compare_exchange_weak(&admit.inflight, &inflight, inflight + 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Decide whether to serve a request from a client address (network order)
+// on a connection with the given bucket; wait says the caller may block for
+// a slot. On true the caller holds a slot until kv_admit_exit.
+bool kv_admit_request(const Message* msg, uint32_t addr, KVTokenBucket* conn, bool wait) {
+    if (exempt(msg->op_code)) {
+        atomic_fetch_add(&admit.inflight, 1);
+        return true;
+    }
+    if ((conn && !kv_rate_bucket_take(conn)) || !addr_take(addr) || !kv_keyspace_admit(msg)) {
+        kv_stats_add(KV_STAT_SHED_RATE, 1);
+        return false;
+    }
+    if (take_slot()) {
+        return true;
+    }
+
+    // Out of slots: join the queue if there is room in it
+    if (!wait || admit.wait_ns == 0) {
+        kv_stats_add(KV_STAT_SHED_BUSY, 1);
+        return false;
+    }
+    if (atomic_fetch_add(&admit.waiting, 1) >= admit.max_waiting) {
+        atomic_fetch_sub(&admit.waiting, 1);
+        kv_stats_add(KV_STAT_SHED_BUSY, 1);
+        return false;
+    }
+    kv_stats_add(KV_STAT_ADMIT_WAITS, 1);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    uint64_t ns = (uint64_t)deadline.tv_nsec + admit.wait_ns;
+    deadline.tv_sec += (time_t)(ns / 1000000000ULL);
+    deadline.tv_nsec = (long)(ns % 1000000000ULL);
+
+    // waiting is raised before the retry, so a request finishing after it
+    // fails sees a waiter and signals under the lock
+    pthread_mutex_lock(&admit.lock);
+    bool admitted;
+    while (!(admitted = take_slot())) {
+        if (pthread_cond_timedwait(&admit.cond, &admit.lock, &deadline) == ETIMEDOUT) {
+            admitted = take_slot();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&admit.lock);
+    atomic_fetch_sub(&admit.waiting, 1);
+
+    if (!admitted) {
+        kv_stats_add(KV_STAT_SHED_BUSY, 1);
+    }
+    return admitted;
+}
+
+void kv_admit_exit(void) {
+    atomic_fetch_sub(&admit.inflight, 1);
+    if (atomic_load(&admit.waiting) > 0) {
+        pthread_mutex_lock(&admit.lock);
+        pthread_cond_signal(&admit.cond);
+        pthread_mutex_unlock(&admit.lock);
+    }
+}
+
+int kv_admit_inflight(void) {
+    return atomic_load_explicit(&admit.inflight, memory_order_relaxed);
+}
+
+// Count a new connection; false if it would go over the cap
+bool kv_admit_connection(void) {
+    if (atomic_fetch_add(&connections, 1) >= max_connections) {
+        atomic_fetch_sub(&connections, 1);
+        return false;
+    }
+    return true;
+}
+
+void kv_admit_connection_closed(void) {
+    atomic_fetch_sub(&connections, 1);
+}
+
+// Answer a request with a bare status in the shape the client asked for
+bool kv_send_status(int fd, const Message* request, int status) {
+    if (request->op_code == OP_GET && (request->flags & KV_FLAG_VARLEN_REPLY)) {
+        ResponseHeader header;
+        memset(&header, 0, sizeof(header));
+        header.op_code = OP_GET;
+        header.status = status;
+        return send(fd, &header, sizeof(header), MSG_NOSIGNAL) == sizeof(header);
+    }
+
+    Message reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.op_code = request->op_code;
+    reply.status = status;
+    return send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) == sizeof(reply);
+}
+
+bool kv_send_busy(int fd, const Message* request) {
+    return kv_send_status(fd, request, KV_STATUS_BUSY);
+}
+
+// Shedder thread: answer each rejected connection's first request busy
+static void* shed_main(void* arg) {
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&shed.lock);
+        while (shed.head == shed.tail) {
+            pthread_cond_wait(&shed.cond, &shed.lock);
+        }
+        int fd = shed.fds[shed.head++ & (SHED_QUEUE - 1)];
+        pthread_mutex_unlock(&shed.lock);
+
+        struct timeval timeout = { 0, SHED_READ_MS * 1000 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        Message msg;
+        if (recv_message(fd, &msg)) {
+            kv_send_busy(fd, &msg);
+        }
+        close(fd);
+    }
+
+    return NULL;
+}
+
+// Turn away a connection over the cap; it is closed once answered, or at
+// once if the shedder is behind
+void kv_admit_shed_connection(int fd) {
+    kv_stats_add(KV_STAT_SHED_CONNECTIONS, 1);
+
+    pthread_mutex_lock(&shed.lock);
+    if (!shed.started) {
+        pthread_t tid;
+        shed.started = pthread_create(&tid, NULL, shed_main, NULL) == 0;
+        if (shed.started) {
+            pthread_detach(tid);
+        }
+    }
+    bool queued = shed.started && shed.tail - shed.head < SHED_QUEUE;
+    if (queued) {
+        shed.fds[shed.tail++ & (SHED_QUEUE - 1)] = fd;
+        pthread_cond_signal(&shed.cond);
+    }
+    pthread_mutex_unlock(&shed.lock);
+
+    if (!queued) {
+        close(fd);
+    }
+}
+
+// Bytes allowed in flight to peers for replication and rebalancing
+void kv_peer_budget_configure(size_t bytes) {
+    peer_budget.limit = bytes > 0 ? bytes : sizeof(Message);
+}
+
+// Take bytes from the budget if they fit; a single request larger than the
+// whole budget fits when nothing else is in flight
+bool kv_peer_budget_try_acquire(size_t bytes) {
+    pthread_mutex_lock(&peer_budget.lock);
+    bool fits = peer_budget.used == 0 || peer_budget.used + bytes <= peer_budget.limit;
+    if (fits) {
+        peer_budget.used += bytes;
+    }
+    pthread_mutex_unlock(&peer_budget.lock);
+    return fits;
+}
+
+void kv_peer_budget_acquire(size_t bytes) {
+    pthread_mutex_lock(&peer_budget.lock);
+    if (peer_budget.used > 0 && peer_budget.used + bytes > peer_budget.limit) {
+        kv_stats_add(KV_STAT_PEER_BUDGET_WAITS, 1);
+    }
+    while (peer_budget.used > 0 && peer_budget.used + bytes > peer_budget.limit) {
+        pthread_cond_wait(&peer_budget.cond, &peer_budget.lock);
+    }
+    peer_budget.used += bytes;
+    pthread_mutex_unlock(&peer_budget.lock);
+}
+
+void kv_peer_budget_release(size_t bytes) {
+    pthread_mutex_lock(&peer_budget.lock);
+    peer_budget.used -= bytes;
+    pthread_cond_broadcast(&peer_budget.cond);
+    pthread_mutex_unlock(&peer_budget.lock);
+}
+
+size_t kv_peer_budget_used(void) {
+    pthread_mutex_lock(&peer_budget.lock);
+    size_t used = peer_budget.used;
+    pthread_mutex_unlock(&peer_budget.lock);
+    return used;
+}
@@ -0,0 +1,473 @@
+#include "kv_store.h"
+#include "kv_async.h"
+
+#include <sys/epoll.h>
+
+// Asynchronous client
+//
+// Each connection holds an output buffer of encoded requests that have not
+// been sent and a FIFO of requests whose replies are awaited. Requests are
+// only encoded when they are issued; kv_async_poll sends every connection's
+// buffer, so a burst of requests costs one send per connection. A send that
+// would block arms EPOLLOUT until the rest has gone. Replies are read into
+// a per-connection buffer and cut up by the oldest request's opcode: a GET
+// asks for a reply header followed by the value, anything else gets a whole
+// Message back.
+//
+// A connection that fails completes all of its requests with
+// KV_ASYNC_DISCONNECTED and is reopened by the next request to its node.
+
+_Static_assert(KV_ASYNC_BUSY == KV_STATUS_BUSY, "busy status must match the server's");
+_Static_assert(KV_ASYNC_NO_KEYSPACE == KV_STATUS_NO_KEYSPACE, "keyspace status must match the server's");
+
+#define ASYNC_EVENTS 64
+#define ASYNC_RECV_BUFFER (64 * 1024)
+#define ASYNC_OUT_INITIAL 16       // Requests the output buffer first holds
+
+typedef struct AsyncRequest {
+    struct AsyncRequest* next;
+    OperationCode op;
+    KVAsyncCallback callback;
+    void* arg;
+} AsyncRequest;
+
+struct AsyncNode;
+
+typedef struct {
+    int fd;                    // -1 while closed
+    struct AsyncNode* node;
+    char* out;                 // Encoded requests; out_sent of out_len have gone
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+    char* in;                  // Reply bytes not yet matched to a request
+    size_t in_len;
+    AsyncRequest* head;        // Awaiting replies, oldest first
+    AsyncRequest* tail;
+    size_t pending;
+    bool writing;              // EPOLLOUT is armed
+} AsyncConn;
+
+typedef struct AsyncNode {
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    AsyncConn conns[KV_ASYNC_MAX_CONNS];
+} AsyncNode;
+
+struct KVAsync {
+    int epfd;
+    int conns;                 // Connections per node
+    uint64_t seed;
+    uint32_t keyspace;         // Id requests are tagged with; 0 is the default keyspace
+    AsyncNode nodes[MAX_NODES];
+    int node_count;
+    AsyncRequest* free_requests;
+    size_t pending;
+    uint64_t completed;        // Callbacks run
+};
+
+KVAsync* kv_async_create(int conns) {
+    KVAsync* client = (KVAsync*)calloc(1, sizeof(KVAsync));
+    if (!client) {
+        return NULL;
+    }
+
+    client->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (client->epfd < 0) {
+        free(client);
+        return NULL;
+    }
+    if (conns <= 0) {
+        conns = KV_ASYNC_CONNS;
+    }
+    client->conns = conns < KV_ASYNC_MAX_CONNS ? conns : KV_ASYNC_MAX_CONNS;
+    client->seed = KV_HASH_DEFAULT_SEED;
+    return client;
+}
+
+static void conn_close(KVAsync* client, AsyncConn* conn) {
+    if (conn->fd >= 0) {
+        epoll_ctl(client->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    conn->in_len = 0;
+    conn->writing = false;
+}
+
+static bool conn_open(KVAsync* client, AsyncConn* conn) {
+    if (!conn->in) {
+        conn->in = (char*)malloc(ASYNC_RECV_BUFFER);
+        if (!conn->in) {
+            return false;
+        }
+    }
+
+    int fd = connect_to_server(conn->node->ip, conn->node->port);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0 ||
+        epoll_ctl(client->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        return false;
+    }
+    conn->fd = fd;
+    return true;
+}
+
+static void complete(KVAsync* client, AsyncRequest* req, const KVAsyncResult* result) {
+    KVAsyncCallback callback = req->callback;
+    void* arg = req->arg;
+    req->next = client->free_requests;
+    client->free_requests = req;
+    client->pending--;
+    client->completed++;
+    callback(arg, result);
+}
+
+// Close a broken connection and fail everything it was carrying. The
+// requests are detached first, since their callbacks may issue new ones.
+static void conn_fail(KVAsync* client, AsyncConn* conn) {
+    AsyncRequest* req = conn->head;
+    conn->head = NULL;
+    conn->tail = NULL;
+    conn->pending = 0;
+    conn_close(client, conn);
+
+    KVAsyncResult result;
+    memset(&result, 0, sizeof(result));
+    result.status = KV_ASYNC_DISCONNECTED;
+    result.value = "";
+    while (req) {
+        AsyncRequest* next = req->next;
+        complete(client, req, &result);
+        req = next;
+    }
+}
+
+static void set_writing(KVAsync* client, AsyncConn* conn, bool writing) {
+    if (conn->writing != writing) {
+        struct epoll_event ev;
+        ev.events = writing ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        ev.data.ptr = conn;
+        epoll_ctl(client->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->writing = writing;
+    }
+}
+
+// Send as much of the output buffer as the socket takes
+static void conn_send(KVAsync* client, AsyncConn* conn) {
+    while (conn->out_sent < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            set_writing(client, conn, true);
+            return;
+        }
+        if (n < 0) {
+            conn_fail(client, conn);
+            return;
+        }
+        conn->out_sent += (size_t)n;
+    }
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    set_writing(client, conn, false);
+}
+
+static void flush(KVAsync* client) {
+    for (int i = 0; i < client->node_count; i++) {
+        for (int c = 0; c < client->conns; c++) {
+            AsyncConn* conn = &client->nodes[i].conns[c];
+            if (conn->fd >= 0 && !conn->writing && conn->out_sent < conn->out_len) {
+                conn_send(client, conn);
+            }
+        }
+    }
+}
+
+// Match buffered reply bytes to requests, oldest first; false if a reply
+// cannot be valid
+static bool conn_parse(KVAsync* client, AsyncConn* conn) {
+    size_t offset = 0;
+    while (conn->head) {
+        AsyncRequest* req = conn->head;
+        size_t available = conn->in_len - offset;
+        const char* reply = conn->in + offset;
+        char value[MAX_VALUE_SIZE];
+        KVAsyncResult result;
+        memset(&result, 0, sizeof(result));
+        result.value = value;
+        value[0] = '\0';
+
+        size_t need;
+        if (req->op == OP_GET) {
+            ResponseHeader header;
+            if (available < sizeof(ResponseHeader)) {
+                break;
+            }
+            memcpy(&header, reply, sizeof(ResponseHeader));
+            if (header.value_len > ASYNC_RECV_BUFFER - sizeof(ResponseHeader)) {
+                return false;
+            }
+            need = sizeof(ResponseHeader) + header.value_len;
+            if (available < need) {
+                break;
+            }
+            result.status = header.status;
+            result.version = header.version;
+            result.value_len = header.value_len < MAX_VALUE_SIZE - 1 ? header.value_len : MAX_VALUE_SIZE - 1;
+            memcpy(value, reply + sizeof(ResponseHeader), result.value_len);
+            value[result.value_len] = '\0';
+        } else {
+            if (available < sizeof(Message)) {
+                break;
+            }
+            need = sizeof(Message);
+            memcpy(&result.status, reply + offsetof(Message, status), sizeof(result.status));
+            memcpy(&result.version, reply + offsetof(Message, version), sizeof(result.version));
+        }
+
+        offset += need;
+        conn->head = req->next;
+        if (!conn->head) {
+            conn->tail = NULL;
+        }
+        conn->pending--;
+        complete(client, req, &result);
+    }
+
+    memmove(conn->in, conn->in + offset, conn->in_len - offset);
+    conn->in_len -= offset;
+    return true;
+}
+
+static void conn_recv(KVAsync* client, AsyncConn* conn) {
+    while (true) {
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len, ASYNC_RECV_BUFFER - conn->in_len, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0 || !conn->head) {
+            // Closed, failed, or sent a reply nobody asked for
+            conn_fail(client, conn);
+            return;
+        }
+        conn->in_len += (size_t)n;
+        if (!conn_parse(client, conn)) {
+            conn_fail(client, conn);
+            return;
+        }
+    }
+}
+
+bool kv_async_add_node(KVAsync* client, const char* ip, int port) {
+    if (client->node_count == MAX_NODES || strlen(ip) >= INET_ADDRSTRLEN) {
+        return false;
+    }
+
+    AsyncNode* node = &client->nodes[client->node_count];
+    memset(node, 0, sizeof(AsyncNode));
+    strcpy(node->ip, ip);
+    node->port = port;
+    for (int c = 0; c < KV_ASYNC_MAX_CONNS; c++) {
+        node->conns[c].fd = -1;
+        node->conns[c].node = node;
+    }
+
+    for (int c = 0; c < client->conns; c++) {
+        if (!conn_open(client, &node->conns[c])) {
+            for (int i = 0; i < client->conns; i++) {
+                conn_close(client, &node->conns[i]);
+                free(node->conns[i].in);
+            }
+            return false;
+        }
+    }
+    client->node_count++;
+    return true;
+}
+
+void kv_async_set_hash_seed(KVAsync* client, uint64_t seed) {
+    client->seed = seed;
+}
+
+void kv_async_set_keyspace(KVAsync* client, unsigned int id) {
+    client->keyspace = id;
+}
+
+// The open connection to a key's owner with the fewest replies outstanding,
+// reopening one if they have all failed. Routing matches the servers':
+// the high half of the key hash is scaled onto the nodes.
+static AsyncConn* route(KVAsync* client, const char* key) {
+    if (client->node_count == 0) {
+        return NULL;
+    }
+
+    uint64_t hash = kv_hash(key, strlen(key), client->seed);
+    AsyncNode* node = &client->nodes[((hash >> 32) * (uint64_t)client->node_count) >> 32];
+    AsyncConn* best = NULL;
+    for (int c = 0; c < client->conns; c++) {
+        AsyncConn* conn = &node->conns[c];
+        if (conn->fd >= 0 && (!best || conn->pending < best->pending)) {
+            best = conn;
+        }
+    }
+    if (!best && conn_open(client, &node->conns[0])) {
+        best = &node->conns[0];
+    }
+    return best;
+}
+
+static bool submit(KVAsync* client, OperationCode op, const char* key, const char* value,
+                   KVAsyncCallback callback, void* arg) {
+    if (!key || !callback) {
+        return false;
+    }
+    AsyncConn* conn = route(client, key);
+    if (!conn) {
+        return false;
+    }
+
+    if (conn->out_len + sizeof(Message) > conn->out_cap) {
+        size_t cap = conn->out_cap ? conn->out_cap * 2 : ASYNC_OUT_INITIAL * sizeof(Message);
+        char* grown = (char*)realloc(conn->out, cap);
+        if (!grown) {
+            return false;
+        }
+        conn->out = grown;
+        conn->out_cap = cap;
+    }
+
+    AsyncRequest* req = client->free_requests;
+    if (req) {
+        client->free_requests = req->next;
+    } else if (!(req = (AsyncRequest*)malloc(sizeof(AsyncRequest)))) {
+        return false;
+    }
+    req->next = NULL;
+    req->op = op;
+    req->callback = callback;
+    req->arg = arg;
+
+    // Encode straight into the output buffer
+    Message* msg = (Message*)(conn->out + conn->out_len);
+    memset(msg, 0, sizeof(Message));
+    msg->op_code = op;
+    msg->flags = KV_KEYSPACE_FLAGS(client->keyspace);
+    strncpy(msg->key, key, MAX_KEY_SIZE - 1);
+    if (value) {
+        strncpy(msg->value, value, MAX_VALUE_SIZE - 1);
+    }
+    if (op == OP_GET) {
+        msg->flags |= KV_FLAG_VARLEN_REPLY;
+    }
+    conn->out_len += sizeof(Message);
+
+    if (conn->tail) {
+        conn->tail->next = req;
+    } else {
+        conn->head = req;
+    }
+    conn->tail = req;
+    conn->pending++;
+    client->pending++;
+    return true;
+}
+
+bool kv_async_get(KVAsync* client, const char* key, KVAsyncCallback callback, void* arg) {
+    return submit(client, OP_GET, key, NULL, callback, arg);
+}
+
+bool kv_async_put(KVAsync* client, const char* key, const char* value, KVAsyncCallback callback, void* arg) {
+    return value && submit(client, OP_PUT, key, value, callback, arg);
+}
+
+bool kv_async_delete(KVAsync* client, const char* key, KVAsyncCallback callback, void* arg) {
+    return submit(client, OP_DELETE, key, NULL, callback, arg);
+}
+
+int kv_async_poll(KVAsync* client, int timeout_ms) {
+    uint64_t before = client->completed;
+    flush(client);
+    if (client->pending == 0) {
+        return (int)(client->completed - before);
+    }
+
+    struct epoll_event events[ASYNC_EVENTS];
+    int n = epoll_wait(client->epfd, events, ASYNC_EVENTS, timeout_ms);
+    if (n < 0 && errno != EINTR) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        AsyncConn* conn = (AsyncConn*)events[i].data.ptr;
+        if (conn->fd >= 0 && (events[i].events & EPOLLOUT)) {
+            conn_send(client, conn);
+        }
+        if (conn->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+            conn_recv(client, conn);
+        }
+    }
+
+    // Send what the callbacks issued
+    flush(client);
+    return (int)(client->completed - before);
+}
+
+bool kv_async_run(KVAsync* client) {
+    while (client->pending > 0) {
+        if (kv_async_poll(client, -1) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t kv_async_pending(const KVAsync* client) {
+    return client->pending;
+}
+
+int kv_async_fd(const KVAsync* client) {
+    return client->epfd;
+}
+
+// Requests still outstanding are dropped without their callbacks
+void kv_async_destroy(KVAsync* client) {
+    if (!client) {
+        return;
+    }
+
+    for (int i = 0; i < client->node_count; i++) {
+        for (int c = 0; c < KV_ASYNC_MAX_CONNS; c++) {
+            AsyncConn* conn = &client->nodes[i].conns[c];
+            conn_close(client, conn);
+            while (conn->head) {
+                AsyncRequest* next = conn->head->next;
+                free(conn->head);
+                conn->head = next;
+            }
+            free(conn->out);
+            free(conn->in);
+        }
+    }
+    while (client->free_requests) {
+        AsyncRequest* next = client->free_requests->next;
+        free(client->free_requests);
+        client->free_requests = next;
+    }
+    close(client->epfd);
+    free(client);
+}
@@ -0,0 +1,92 @@
+#ifndef KV_ASYNC_H
+#define KV_ASYNC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Asynchronous client library (libkvclient.a)
+//
+// A client keeps a few connections to every node and sends each request to
+// the node that owns its key, on the connection with the fewest replies
+// outstanding. Requests are pipelined: a connection may carry any number at
+// once, and since a server answers a connection's requests in order, replies
+// are matched to requests first in, first out. Nothing blocks once the
+// connections are open; sockets are non-blocking and driven by one epoll
+// instance, and a request's callback runs from kv_async_poll when its reply
+// has arrived. Requests issued between polls go out together, in one send
+// per connection.
+//
+// A client belongs to one thread: it takes no locks, and callbacks run on
+// the thread that polls. Callbacks may issue further requests but must not
+// destroy the client. src/kv_async.hpp wraps the library for C++20
+// coroutines.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Result statuses; the positive and negative ones match the server's reply
+#define KV_ASYNC_OK 1              // Done; GET found the key
+#define KV_ASYNC_NOT_FOUND 0       // GET or DELETE found no key, or the PUT failed
+#define KV_ASYNC_REDIRECT -1       // The node does not own the key; the node list differs from the cluster's
+#define KV_ASYNC_BUSY -3           // Shed by the server's admission control; retry later
+#define KV_ASYNC_NO_KEYSPACE -4    // The server holds no keyspace with the client's id
+#define KV_ASYNC_DISCONNECTED -100 // The connection failed before the reply arrived
+
+#define KV_ASYNC_CONNS 2           // Default connections per node
+#define KV_ASYNC_MAX_CONNS 16      // Most connections per node
+
+typedef struct KVAsync KVAsync;
+
+typedef struct {
+    int status;                // KV_ASYNC_*
+    uint64_t version;          // Version of the value read or written (0 if none)
+    const char* value;         // GET value, NUL-terminated; valid during the callback only
+    size_t value_len;
+} KVAsyncResult;
+
+typedef void (*KVAsyncCallback)(void* arg, const KVAsyncResult* result);
+
+// Create a client with conns connections per node (0 for the default)
+KVAsync* kv_async_create(int conns);
+void kv_async_destroy(KVAsync* client);
+
+// Nodes must be added in the order they joined the cluster, which is the
+// order the servers route keys by. Connections open here, blocking.
+bool kv_async_add_node(KVAsync* client, const char* ip, int port);
+
+// Key hashing seed; must match the servers' --hash-seed
+void kv_async_set_hash_seed(KVAsync* client, uint64_t seed);
+
+// Send later requests to the keyspace with this id: its place in the
+// servers' --keyspace list, counting from 1 (0, the default, is the
+// servers' own store)
+void kv_async_set_keyspace(KVAsync* client, unsigned int id);
+
+// Queue a request; false if its node cannot be reached, in which case the
+// callback never runs. Keys and values are copied before these return.
+bool kv_async_get(KVAsync* client, const char* key, KVAsyncCallback callback, void* arg);
+bool kv_async_put(KVAsync* client, const char* key, const char* value, KVAsyncCallback callback, void* arg);
+bool kv_async_delete(KVAsync* client, const char* key, KVAsyncCallback callback, void* arg);
+
+// Send what is queued, wait up to timeout_ms (-1 forever) for replies and run
+// their callbacks. Returns the number of callbacks run, or -1 on an epoll error.
+int kv_async_poll(KVAsync* client, int timeout_ms);
+
+// Poll until no request is outstanding
+bool kv_async_run(KVAsync* client);
+
+// Requests sent or queued whose callbacks have not run yet
+size_t kv_async_pending(const KVAsync* client);
+
+// The epoll descriptor, for adding the client to another event loop: call
+// kv_async_poll with a timeout of 0 when it is readable and after issuing
+// requests
+int kv_async_fd(const KVAsync* client);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // KV_ASYNC_H
@@ -0,0 +1,132 @@
+#ifndef KV_ASYNC_HPP
+#define KV_ASYNC_HPP
+
+#include "kv_async.h"
+
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <new>
+#include <string>
+#include <utility>
+
+// C++20 coroutine wrapper for the asynchronous client
+//
+//     kv::Task lookup(kv::Client& client, std::string key) {
+//         kv::Result r = co_await client.get(key);
+//         if (r.ok()) { ... r.value ... }
+//     }
+//
+//     kv::Client client;
+//     client.add_node("127.0.0.1", 8080);
+//     for (auto& key : keys) lookup(client, key);
+//     client.run();
+//
+// A request is issued when it is awaited, and the coroutine is resumed from
+// the client's poll when the reply arrives, on the polling thread. Tasks
+// start at once and free themselves when they finish; nothing awaits them.
+
+namespace kv {
+
+struct Result {
+    int status = KV_ASYNC_DISCONNECTED;
+    uint64_t version = 0;
+    std::string value;
+
+    bool ok() const { return status == KV_ASYNC_OK; }
+};
+
+// Fire-and-forget coroutine; an exception escaping it terminates
+struct Task {
+    struct promise_type {
+        Task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+class Client {
+public:
+    // Awaitable for one request; the key and value are copied when it is issued
+    class Request {
+    public:
+        Request(KVAsync* client, int op, std::string key, std::string value)
+            : client_(client), op_(op), key_(std::move(key)), value_(std::move(value)) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        // Resume at once, with a disconnected result, if the request could not be issued
+        bool await_suspend(std::coroutine_handle<> handle) noexcept {
+            handle_ = handle;
+            bool issued;
+            switch (op_) {
+                case Get:
+                    issued = kv_async_get(client_, key_.c_str(), &Request::done, this);
+                    break;
+                case Put:
+                    issued = kv_async_put(client_, key_.c_str(), value_.c_str(), &Request::done, this);
+                    break;
+                default:
+                    issued = kv_async_delete(client_, key_.c_str(), &Request::done, this);
+                    break;
+            }
+            return issued;
+        }
+
+        Result await_resume() noexcept { return std::move(result_); }
+
+    private:
+        friend class Client;
+        enum { Get, Put, Delete };
+
+        static void done(void* arg, const KVAsyncResult* result) {
+            Request* self = static_cast<Request*>(arg);
+            self->result_.status = result->status;
+            self->result_.version = result->version;
+            self->result_.value.assign(result->value ? result->value : "", result->value_len);
+            self->handle_.resume();
+        }
+
+        KVAsync* client_;
+        int op_;
+        std::string key_;
+        std::string value_;
+        Result result_;
+        std::coroutine_handle<> handle_;
+    };
+
+    explicit Client(int conns = KV_ASYNC_CONNS) : client_(kv_async_create(conns)) {
+        if (!client_) {
+            throw std::bad_alloc();
+        }
+    }
+    ~Client() { kv_async_destroy(client_); }
+
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    bool add_node(const std::string& ip, int port) { return kv_async_add_node(client_, ip.c_str(), port); }
+    void set_hash_seed(uint64_t seed) { kv_async_set_hash_seed(client_, seed); }
+    void set_keyspace(unsigned int id) { kv_async_set_keyspace(client_, id); }
+
+    Request get(std::string key) { return Request(client_, Request::Get, std::move(key), {}); }
+    Request put(std::string key, std::string value) {
+        return Request(client_, Request::Put, std::move(key), std::move(value));
+    }
+    Request del(std::string key) { return Request(client_, Request::Delete, std::move(key), {}); }
+
+    int poll(int timeout_ms) { return kv_async_poll(client_, timeout_ms); }
+    bool run() { return kv_async_run(client_); }
+    size_t pending() const { return kv_async_pending(client_); }
+    int fd() const { return kv_async_fd(client_); }
+    KVAsync* handle() { return client_; }
+
+private:
+    KVAsync* client_;
+};
+
+} // namespace kv
+
+#endif // KV_ASYNC_HPP
@@ -0,0 +1,134 @@
+// Asynchronous client demo: many concurrent coroutine lookups from one thread
+//
+//   ./kv_async_demo [--server IP:PORT]... [--concurrency N] [--requests N] [--keys N] [--conns N]
+//
+// Loads the keys with PUTs, then has --concurrency coroutines each GET keys in
+// turn until --requests GETs have been issued, and reports the throughput.
+
+#include "kv_async.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Totals {
+    uint64_t issued = 0;
+    uint64_t requests = 0;
+    uint64_t keys = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t busy = 0;
+    uint64_t errors = 0;
+};
+
+void count(Totals& totals, const kv::Result& result) {
+    if (result.ok()) {
+        totals.hits++;
+    } else if (result.status == KV_ASYNC_NOT_FOUND) {
+        totals.misses++;
+    } else if (result.status == KV_ASYNC_BUSY) {
+        totals.busy++;
+    } else {
+        totals.errors++;
+    }
+}
+
+kv::Task loader(kv::Client& client, Totals& totals, uint64_t first, uint64_t step) {
+    for (uint64_t i = first; i < totals.keys; i += step) {
+        kv::Result result = co_await client.put("key" + std::to_string(i), "value" + std::to_string(i));
+        if (!result.ok()) {
+            totals.errors++;
+        }
+    }
+}
+
+kv::Task reader(kv::Client& client, Totals& totals, uint64_t seed) {
+    while (totals.issued < totals.requests) {
+        totals.issued++;
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        std::string n = std::to_string((seed >> 33) % totals.keys);
+        kv::Result result = co_await client.get("key" + n);
+        if (result.ok() && result.value != "value" + n) {
+            totals.errors++;
+        } else {
+            count(totals, result);
+        }
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    int concurrency = 1000;
+    int conns = KV_ASYNC_CONNS;
+    Totals totals;
+    totals.requests = 1000000;
+    totals.keys = 10000;
+    std::vector<std::pair<std::string, int>> servers;
+
+    for (int i = 1; i < argc; i++) {
+        const char* next = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (strcmp(argv[i], "--server") == 0 && next) {
+            const char* colon = strchr(next, ':');
+            servers.emplace_back(colon ? std::string(next, colon - next) : std::string(next),
+                                 colon ? atoi(colon + 1) : 8080);
+            i++;
+        } else if (strcmp(argv[i], "--concurrency") == 0 && next) {
+            concurrency = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--requests") == 0 && next) {
+            totals.requests = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--keys") == 0 && next) {
+            totals.keys = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--conns") == 0 && next) {
+            conns = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--server IP:PORT]... [--concurrency N] [--requests N] [--keys N] [--conns N]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (servers.empty()) {
+        servers.emplace_back("127.0.0.1", 8080);
+    }
+    if (concurrency < 1 || totals.keys == 0) {
+        fprintf(stderr, "Concurrency and keys must be positive\n");
+        return 1;
+    }
+
+    kv::Client client(conns);
+    for (const auto& server : servers) {
+        if (!client.add_node(server.first, server.second)) {
+            fprintf(stderr, "Failed to connect to %s:%d\n", server.first.c_str(), server.second);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < concurrency; i++) {
+        loader(client, totals, (uint64_t)i, (uint64_t)concurrency);
+    }
+    if (!client.run()) {
+        perror("epoll_wait");
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < concurrency; i++) {
+        reader(client, totals, (uint64_t)i + 1);
+    }
+    if (!client.run()) {
+        perror("epoll_wait");
+        return 1;
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("GETs: %llu in %.2f s, %.0f ops/s with %d in flight\n", (unsigned long long)totals.issued, elapsed,
+           totals.issued / (elapsed > 0 ? elapsed : 1), concurrency);
+    printf("Hits: %llu  Misses: %llu  Busy: %llu  Errors: %llu\n", (unsigned long long)totals.hits,
+           (unsigned long long)totals.misses, (unsigned long long)totals.busy, (unsigned long long)totals.errors);
+    return 0;
+}
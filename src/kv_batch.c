@@ -0,0 +1,842 @@
+#include "kv_store.h"
+#include <ctype.h>
+#include <limits.h>
+
+// Client batch modes
+//
+// Batch mode reads commands a line at a time and answers each with output
+// lines of its own, without prompts. Consecutive PUT, GET and DELETE
+// commands are gathered into a window and pipelined on the connection;
+// any other command, a full window or a key that is already in the window
+// sends the window first, so commands take effect in the order written
+// even when busy replies are resent.
+//
+// Import has every thread read a window of records from the dump under a
+// lock, then pipeline the PUTs on its own connection. Export walks the keys
+// in hash order on one connection and hands them out in windows to threads
+// that pipeline GETs on theirs and append the records to the output. A key
+// deleted between the walk and its GET is left out; a table resizing under
+// the walk may repeat a key.
+
+#define BAD_RECORDS_REPORTED 10    // Bad dump records reported by line before going quiet
+
+// Batch mode
+
+typedef struct {
+    int sockfd;
+    int pipeline;
+    Message* requests;
+    Message* replies;
+    int count;
+    bool ok;                   // Every command so far succeeded
+} BatchWindow;
+
+static const char* status_text(int status) {
+    if (status == -1) {
+        return "key owned by another node";
+    }
+    if (status == KV_STATUS_BUSY) {
+        return "server busy";
+    }
+    return "failed";
+}
+
+static void window_flush(BatchWindow* window) {
+    if (window->count == 0) {
+        return;
+    }
+
+    if (!kv_client_pipeline(window->sockfd, window->requests, window->replies, window->count)) {
+        for (int i = 0; i < window->count; i++) {
+            printf("ERROR connection lost\n");
+        }
+        window->count = 0;
+        window->ok = false;
+        return;
+    }
+
+    for (int i = 0; i < window->count; i++) {
+        Message* reply = &window->replies[i];
+        OperationCode op = window->requests[i].op_code;
+        reply->value[MAX_VALUE_SIZE - 1] = '\0';
+        if (reply->status == 1) {
+            printf("%s\n", op == OP_GET ? reply->value : "OK");
+        } else if (reply->status == 0 && op != OP_PUT) {
+            printf("(nil)\n");
+        } else {
+            printf("ERROR %s\n", status_text(reply->status));
+            window->ok = false;
+        }
+    }
+    window->count = 0;
+}
+
+static bool window_has_key(const BatchWindow* window, const char* key) {
+    for (int i = 0; i < window->count; i++) {
+        if (strcmp(window->requests[i].key, key) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void window_add(BatchWindow* window, OperationCode op, const char* key, const char* value) {
+    if (window->count == window->pipeline || window_has_key(window, key)) {
+        window_flush(window);
+    }
+
+    Message* msg = &window->requests[window->count++];
+    kv_client_prepare(msg, op);
+    strncpy(msg->key, key, MAX_KEY_SIZE - 1);
+    if (value) {
+        strncpy(msg->value, value, MAX_VALUE_SIZE - 1);
+    }
+}
+
+// Split the next whitespace-separated word off *line
+static char* next_word(char** line) {
+    char* p = *line;
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    if (*p == '\0') {
+        *line = p;
+        return NULL;
+    }
+
+    char* word = p;
+    while (*p && !isspace((unsigned char)*p)) {
+        p++;
+    }
+    if (*p) {
+        *p++ = '\0';
+    }
+    *line = p;
+    return word;
+}
+
+// The rest of the line after the separating whitespace, or NULL if empty
+static char* rest_of_line(char* line) {
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+    return *line ? line : NULL;
+}
+
+static void print_walked_key(const char* key, void* arg) {
+    (void)arg;
+    printf("%s\n", key);
+}
+
+static void print_streamed_text(const char* text, void* arg) {
+    (void)arg;
+    fputs(text, stdout);
+}
+
+// Run one command that is not pipelined; false if it failed
+static bool run_command(int sockfd, const char* command, char* args) {
+    char result[MAX_VALUE_SIZE];
+    char* key = next_word(&args);
+    bool ok;
+
+    if (strcmp(command, "INCR") == 0 || strcmp(command, "DECR") == 0) {
+        char* by = next_word(&args);
+        long long delta = 1;
+        if (by) {
+            char* end;
+            errno = 0;
+            delta = strtoll(by, &end, 10);
+            if (errno != 0 || end == by || *end != '\0' || delta == LLONG_MIN) {
+                printf("ERROR bad delta %s\n", by);
+                return false;
+            }
+        }
+        long long value;
+        ok = key && kv_client_incr(sockfd, key, command[0] == 'D' ? -delta : delta, &value);
+        if (ok) {
+            printf("%lld\n", value);
+        }
+    } else if (strcmp(command, "APPEND") == 0 || strcmp(command, "GETSET") == 0) {
+        char* value = rest_of_line(args);
+        ok = key && value &&
+             (command[0] == 'A' ? kv_client_append(sockfd, key, value, result)
+                                : kv_client_getset(sockfd, key, value, result));
+        if (ok) {
+            printf("%s\n", result);
+        }
+    } else if (strcmp(command, "CAS") == 0) {
+        char* expected = next_word(&args);
+        char* value = rest_of_line(args);
+        uint64_t version = 0;
+        ok = key && expected && value;
+        if (ok && kv_client_cas(sockfd, key, strtoull(expected, NULL, 10), value, result, &version)) {
+            printf("OK %llu\n", (unsigned long long)version);
+        } else if (ok) {
+            printf("MISMATCH %llu %s\n", (unsigned long long)version, result);
+        }
+    } else if (strcmp(command, "KEYS") == 0 || strcmp(command, "LIST") == 0) {
+        // Hash-order walk, or an ordered scan where the engine cannot walk
+        uint64_t cursor = 0;
+        ok = kv_client_scan_cursor(sockfd, &cursor, key, print_walked_key, NULL) ||
+             (cursor == 0 && kv_client_scan(sockfd, NULL, NULL, key, print_walked_key, NULL));
+    } else if (strcmp(command, "SCAN") == 0) {
+        char* end = next_word(&args);
+        ok = kv_client_scan(sockfd, key && strcmp(key, "-") != 0 ? key : NULL,
+                            end && strcmp(end, "-") != 0 ? end : NULL, NULL, print_walked_key, NULL);
+    } else if (strcmp(command, "PREFIX") == 0) {
+        ok = key && kv_client_scan(sockfd, NULL, NULL, key, print_walked_key, NULL);
+    } else if (strcmp(command, "STATS") == 0) {
+        ok = kv_client_stats(sockfd, print_streamed_text, NULL);
+    } else if (strcmp(command, "HOTKEYS") == 0) {
+        ok = kv_client_hot_keys(sockfd, print_streamed_text, NULL);
+    } else if (strcmp(command, "USE") == 0) {
+        // Later commands go to this keyspace
+        uint32_t id;
+        ok = key && kv_client_keyspace(sockfd, key, &id);
+        if (ok) {
+            kv_client_set_keyspace(id);
+            printf("OK\n");
+        }
+    } else {
+        printf("ERROR unknown command %s\n", command);
+        return false;
+    }
+
+    if (!ok) {
+        printf("ERROR %s failed\n", command);
+    }
+    return ok;
+}
+
+// Run the commands in a stream, one per line; blank lines and lines starting
+// with # are skipped. True if every command succeeded.
+bool kv_batch_run(int sockfd, FILE* in, int pipeline) {
+    BatchWindow window;
+    window.sockfd = sockfd;
+    window.pipeline = pipeline;
+    window.requests = (Message*)malloc(sizeof(Message) * (size_t)pipeline);
+    window.replies = (Message*)malloc(sizeof(Message) * (size_t)pipeline);
+    window.count = 0;
+    window.ok = true;
+    if (!window.requests || !window.replies) {
+        free(window.requests);
+        free(window.replies);
+        return false;
+    }
+
+    char* line = NULL;
+    size_t line_size = 0;
+    long line_no = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_size, in)) >= 0) {
+        line_no++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+
+        char* args = line;
+        char* command = next_word(&args);
+        if (!command || command[0] == '#') {
+            continue;
+        }
+        for (char* c = command; *c; c++) {
+            *c = (char)toupper((unsigned char)*c);
+        }
+
+        if (strcmp(command, "PUT") == 0 || strcmp(command, "GET") == 0 ||
+            strcmp(command, "DELETE") == 0 || strcmp(command, "DEL") == 0) {
+            char* key = next_word(&args);
+            char* value = command[0] == 'P' ? rest_of_line(args) : NULL;
+            if (!key || (command[0] == 'P' && !value)) {
+                fprintf(stderr, "Line %ld: missing key or value\n", line_no);
+                window.ok = false;
+                continue;
+            }
+            window_add(&window, command[0] == 'P' ? OP_PUT : (command[0] == 'G' ? OP_GET : OP_DELETE),
+                       key, value);
+            continue;
+        }
+
+        window_flush(&window);
+        if (strcmp(command, "QUIT") == 0) {
+            break;
+        }
+        if (!run_command(sockfd, command, args)) {
+            window.ok = false;
+        }
+    }
+    window_flush(&window);
+    fflush(stdout);
+
+    free(line);
+    free(window.requests);
+    free(window.replies);
+    return window.ok;
+}
+
+// Dump records
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} TextBuffer;
+
+static bool text_put(TextBuffer* text, char c) {
+    if (text->len == text->cap) {
+        size_t cap = text->cap ? text->cap * 2 : 4096;
+        char* grown = (char*)realloc(text->data, cap);
+        if (!grown) {
+            return false;
+        }
+        text->data = grown;
+        text->cap = cap;
+    }
+    text->data[text->len++] = c;
+    return true;
+}
+
+static void put_tsv_field(TextBuffer* text, const char* s) {
+    for (; *s; s++) {
+        char escape = *s == '\t' ? 't' : *s == '\n' ? 'n' : *s == '\r' ? 'r' : *s == '\\' ? '\\' : 0;
+        if (escape) {
+            text_put(text, '\\');
+            text_put(text, escape);
+        } else {
+            text_put(text, *s);
+        }
+    }
+}
+
+// Quote a CSV field only if it needs it
+static void put_csv_field(TextBuffer* text, const char* s) {
+    size_t len = strlen(s);
+    bool quote = len > 0 && (s[0] == ' ' || s[len - 1] == ' ' || strpbrk(s, ",\"\r\n") != NULL);
+    if (!quote) {
+        while (*s) {
+            text_put(text, *s++);
+        }
+        return;
+    }
+
+    text_put(text, '"');
+    for (; *s; s++) {
+        if (*s == '"') {
+            text_put(text, '"');
+        }
+        text_put(text, *s);
+    }
+    text_put(text, '"');
+}
+
+static void put_record(TextBuffer* text, KVDumpFormat format, const char* key, const char* value) {
+    if (format == KV_DUMP_CSV) {
+        put_csv_field(text, key);
+        text_put(text, ',');
+        put_csv_field(text, value);
+    } else {
+        put_tsv_field(text, key);
+        text_put(text, '\t');
+        put_tsv_field(text, value);
+    }
+    text_put(text, '\n');
+}
+
+// Undo put_tsv_field into dst; false if it does not fit
+static bool unescape_tsv(const char* src, char* dst, size_t size) {
+    size_t len = 0;
+    for (; *src; src++) {
+        char c = *src;
+        if (c == '\\' && src[1]) {
+            c = *++src;
+            c = c == 't' ? '\t' : c == 'n' ? '\n' : c == 'r' ? '\r' : c;
+        }
+        if (len == size - 1) {
+            return false;
+        }
+        dst[len++] = c;
+    }
+    dst[len] = '\0';
+    return true;
+}
+
+// Import
+
+typedef struct {
+    FILE* in;
+    KVDumpFormat format;
+    pthread_mutex_t lock;      // Serializes reading records
+    char* line;                // TSV line buffer
+    size_t line_size;
+    long line_no;
+    uint64_t records;          // Records read, good or bad
+    uint64_t bad;
+    const KVTransferOptions* options;
+    _Atomic uint64_t stored;
+    _Atomic uint64_t failed;
+} ImportJob;
+
+// One connection's thread and its window buffers
+typedef struct {
+    void* job;
+    int sockfd;
+    Message* requests;
+    Message* replies;
+    char (*keys)[MAX_KEY_SIZE];
+    pthread_t thread;
+} TransferWorker;
+
+// Read one TSV record; 1 on success, 0 at the end, -1 for a bad record
+static int read_tsv(ImportJob* job, char* key, char* value) {
+    while (true) {
+        ssize_t len = getline(&job->line, &job->line_size, job->in);
+        if (len < 0) {
+            return 0;
+        }
+        job->line_no++;
+        while (len > 0 && (job->line[len - 1] == '\n' || job->line[len - 1] == '\r')) {
+            job->line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+
+        char* tab = strchr(job->line, '\t');
+        if (!tab) {
+            return -1;
+        }
+        *tab = '\0';
+        if (!unescape_tsv(job->line, key, MAX_KEY_SIZE) || !unescape_tsv(tab + 1, value, MAX_VALUE_SIZE) ||
+            key[0] == '\0') {
+            return -1;
+        }
+        return 1;
+    }
+}
+
+// Read one CSV field; returns the character that ended it: ',', '\n' or EOF
+static int read_csv_field(ImportJob* job, char* buf, size_t size, bool* overflow) {
+    size_t len = 0;
+    bool quoted = false;
+    int c = getc(job->in);
+    if (c == '"') {
+        quoted = true;
+        c = getc(job->in);
+    }
+
+    while (c != EOF) {
+        if (quoted && c == '"') {
+            c = getc(job->in);
+            if (c != '"') {
+                // Closing quote; what follows is read unquoted
+                quoted = false;
+                continue;
+            }
+        } else if (!quoted && (c == ',' || c == '\n')) {
+            break;
+        } else if (!quoted && c == '\r') {
+            int next = getc(job->in);
+            if (next == '\n') {
+                c = next;
+                break;
+            }
+            ungetc(next, job->in);
+        }
+        if (c == '\n') {
+            job->line_no++;
+        }
+
+        if (len < size - 1) {
+            buf[len++] = (char)c;
+        } else {
+            *overflow = true;
+        }
+        c = getc(job->in);
+    }
+    buf[len] = '\0';
+    if (c == '\n') {
+        job->line_no++;
+    }
+    return c;
+}
+
+// Read one CSV record of two fields; returns like read_tsv. A "key,value"
+// header on the first line is skipped.
+static int read_csv(ImportJob* job, char* key, char* value) {
+    while (true) {
+        bool overflow = false;
+        int end = read_csv_field(job, key, MAX_KEY_SIZE, &overflow);
+        if (end != ',') {
+            if (key[0] == '\0' && !overflow) {
+                if (end == EOF) {
+                    return 0;
+                }
+                continue;
+            }
+            return -1;
+        }
+
+        end = read_csv_field(job, value, MAX_VALUE_SIZE, &overflow);
+        bool extra = false;
+        while (end == ',') {
+            char discard[MAX_VALUE_SIZE];
+            bool ignored = false;
+            end = read_csv_field(job, discard, sizeof(discard), &ignored);
+            extra = true;
+        }
+        if (overflow || extra || key[0] == '\0') {
+            return -1;
+        }
+        if (job->records == 0 && strcmp(key, "key") == 0 && strcmp(value, "value") == 0) {
+            continue;
+        }
+        return 1;
+    }
+}
+
+static void* import_main(void* arg) {
+    TransferWorker* worker = (TransferWorker*)arg;
+    ImportJob* job = (ImportJob*)worker->job;
+    int pipeline = job->options->pipeline;
+    Message* requests = worker->requests;
+    Message* replies = worker->replies;
+
+    while (true) {
+        int count = 0;
+        pthread_mutex_lock(&job->lock);
+        while (count < pipeline) {
+            Message* msg = &requests[count];
+            kv_client_prepare(msg, OP_PUT);
+            long line_no = job->line_no + 1;
+            int got = job->format == KV_DUMP_CSV ? read_csv(job, msg->key, msg->value)
+                                                 : read_tsv(job, msg->key, msg->value);
+            if (got == 0) {
+                break;
+            }
+            job->records++;
+            if (got < 0) {
+                if (job->bad++ < BAD_RECORDS_REPORTED) {
+                    fprintf(stderr, "Skipping bad record at line %ld\n", line_no);
+                }
+                continue;
+            }
+            count++;
+        }
+        pthread_mutex_unlock(&job->lock);
+        if (count == 0) {
+            break;
+        }
+
+        // A lost connection fails the rest of this worker's share
+        if (worker->sockfd >= 0 && !kv_client_pipeline(worker->sockfd, requests, replies, count)) {
+            close(worker->sockfd);
+            worker->sockfd = -1;
+        }
+        if (worker->sockfd < 0) {
+            atomic_fetch_add(&job->failed, (uint64_t)count);
+            continue;
+        }
+
+        uint64_t stored = 0;
+        for (int i = 0; i < count; i++) {
+            stored += replies[i].status == 1;
+        }
+        atomic_fetch_add(&job->stored, stored);
+        atomic_fetch_add(&job->failed, (uint64_t)count - stored);
+    }
+    return NULL;
+}
+
+static void workers_free(TransferWorker* workers, int count) {
+    for (int i = 0; i < count; i++) {
+        if (workers[i].sockfd >= 0) {
+            close(workers[i].sockfd);
+        }
+        free(workers[i].requests);
+        free(workers[i].replies);
+        free(workers[i].keys);
+    }
+}
+
+// Connect and set up every worker before any starts, so a bad address
+// fails at once
+static bool workers_open(TransferWorker* workers, void* job, const KVTransferOptions* options) {
+    memset(workers, 0, sizeof(TransferWorker) * (size_t)options->parallel);
+    for (int i = 0; i < options->parallel; i++) {
+        TransferWorker* worker = &workers[i];
+        worker->job = job;
+        worker->sockfd = connect_to_server(options->ip, options->port);
+        worker->requests = (Message*)malloc(sizeof(Message) * (size_t)options->pipeline);
+        worker->replies = (Message*)malloc(sizeof(Message) * (size_t)options->pipeline);
+        worker->keys = malloc(sizeof(*worker->keys) * (size_t)options->pipeline);
+        if (worker->sockfd < 0 || !worker->requests || !worker->replies || !worker->keys) {
+            if (worker->sockfd < 0) {
+                fprintf(stderr, "Failed to connect to server at %s:%d\n", options->ip, options->port);
+            }
+            workers_free(workers, i + 1);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Run import_main or export_main on every worker; the number started
+static int workers_start(TransferWorker* workers, int count, void* (*main)(void*)) {
+    int running = 0;
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, main, &workers[i]) != 0) {
+            break;
+        }
+        running++;
+    }
+    return running;
+}
+
+// Store every record of a dump; true if all were stored
+bool kv_import(FILE* in, const KVTransferOptions* options) {
+    ImportJob job;
+    memset(&job, 0, sizeof(job));
+    job.in = in;
+    job.format = options->format;
+    job.options = options;
+    pthread_mutex_init(&job.lock, NULL);
+    atomic_init(&job.stored, 0);
+    atomic_init(&job.failed, 0);
+
+    TransferWorker workers[KV_BATCH_MAX_PARALLEL];
+    if (!workers_open(workers, &job, options)) {
+        pthread_mutex_destroy(&job.lock);
+        return false;
+    }
+
+    uint64_t started = kv_stats_now();
+    int running = workers_start(workers, options->parallel, import_main);
+    for (int i = 0; i < running; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    workers_free(workers, options->parallel);
+
+    double seconds = (double)(kv_stats_now() - started) / 1e9;
+    uint64_t stored = atomic_load(&job.stored);
+    uint64_t failed = atomic_load(&job.failed);
+    fprintf(stderr, "Imported %llu keys in %.2f s (%.0f keys/s); %llu failed, %llu bad records skipped\n",
+            (unsigned long long)stored, seconds, seconds > 0 ? (double)stored / seconds : 0.0,
+            (unsigned long long)failed, (unsigned long long)job.bad);
+
+    free(job.line);
+    pthread_mutex_destroy(&job.lock);
+    return running > 0 && failed == 0 && job.bad == 0;
+}
+
+// Export
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    char (*keys)[MAX_KEY_SIZE];    // depth windows of pipeline keys
+    int* counts;
+    int depth;
+    int head;
+    int size;
+    bool done;                 // The walk is over; no more windows will come
+    int pipeline;
+    FILE* out;
+    pthread_mutex_t out_lock;
+    KVDumpFormat format;
+    bool write_failed;
+    _Atomic uint64_t exported;
+    _Atomic uint64_t vanished;
+    _Atomic uint64_t failed;
+} ExportJob;
+
+// The walker's window being filled
+typedef struct {
+    ExportJob* job;
+    char (*keys)[MAX_KEY_SIZE];
+    int count;
+    uint64_t walked;
+} ExportWalk;
+
+static void queue_push(ExportJob* job, char (*keys)[MAX_KEY_SIZE], int count) {
+    pthread_mutex_lock(&job->lock);
+    while (job->size == job->depth) {
+        pthread_cond_wait(&job->not_full, &job->lock);
+    }
+    int slot = (job->head + job->size) % job->depth;
+    memcpy(job->keys + (size_t)slot * job->pipeline, keys, sizeof(*keys) * (size_t)count);
+    job->counts[slot] = count;
+    job->size++;
+    pthread_cond_signal(&job->not_empty);
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Take the next window of keys; 0 once the walk is over and all are taken
+static int queue_pop(ExportJob* job, char (*keys)[MAX_KEY_SIZE]) {
+    pthread_mutex_lock(&job->lock);
+    while (job->size == 0 && !job->done) {
+        pthread_cond_wait(&job->not_empty, &job->lock);
+    }
+    int count = 0;
+    if (job->size > 0) {
+        count = job->counts[job->head];
+        memcpy(keys, job->keys + (size_t)job->head * job->pipeline, sizeof(*keys) * (size_t)count);
+        job->head = (job->head + 1) % job->depth;
+        job->size--;
+        pthread_cond_signal(&job->not_full);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return count;
+}
+
+static void walk_key(const char* key, void* arg) {
+    ExportWalk* walk = (ExportWalk*)arg;
+    snprintf(walk->keys[walk->count++], MAX_KEY_SIZE, "%s", key);
+    walk->walked++;
+    if (walk->count == walk->job->pipeline) {
+        queue_push(walk->job, walk->keys, walk->count);
+        walk->count = 0;
+    }
+}
+
+static void* export_main(void* arg) {
+    TransferWorker* worker = (TransferWorker*)arg;
+    ExportJob* job = (ExportJob*)worker->job;
+    char (*keys)[MAX_KEY_SIZE] = worker->keys;
+    Message* requests = worker->requests;
+    Message* replies = worker->replies;
+    TextBuffer text;
+    memset(&text, 0, sizeof(text));
+
+    // Windows keep being taken after the connection is lost, so the walker never stalls
+    int count;
+    while ((count = queue_pop(job, keys)) > 0) {
+        for (int i = 0; i < count; i++) {
+            kv_client_prepare(&requests[i], OP_GET);
+            memcpy(requests[i].key, keys[i], MAX_KEY_SIZE);
+        }
+        if (worker->sockfd >= 0 && !kv_client_pipeline(worker->sockfd, requests, replies, count)) {
+            close(worker->sockfd);
+            worker->sockfd = -1;
+        }
+        if (worker->sockfd < 0) {
+            atomic_fetch_add(&job->failed, (uint64_t)count);
+            continue;
+        }
+
+        uint64_t exported = 0;
+        uint64_t vanished = 0;
+        text.len = 0;
+        for (int i = 0; i < count; i++) {
+            if (replies[i].status == 1) {
+                replies[i].value[MAX_VALUE_SIZE - 1] = '\0';
+                put_record(&text, job->format, requests[i].key, replies[i].value);
+                exported++;
+            } else if (replies[i].status == 0) {
+                vanished++;
+            }
+        }
+
+        pthread_mutex_lock(&job->out_lock);
+        if (fwrite(text.data, 1, text.len, job->out) != text.len) {
+            job->write_failed = true;
+        }
+        pthread_mutex_unlock(&job->out_lock);
+        atomic_fetch_add(&job->exported, exported);
+        atomic_fetch_add(&job->vanished, vanished);
+        atomic_fetch_add(&job->failed, (uint64_t)count - exported - vanished);
+    }
+
+    free(text.data);
+    return NULL;
+}
+
+// Write every key (under options->prefix) and its value as a dump; true if
+// all were written
+bool kv_export(FILE* out, const KVTransferOptions* options) {
+    ExportJob job;
+    memset(&job, 0, sizeof(job));
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.not_empty, NULL);
+    pthread_cond_init(&job.not_full, NULL);
+    pthread_mutex_init(&job.out_lock, NULL);
+    job.pipeline = options->pipeline;
+    job.depth = options->parallel * 2;
+    job.out = out;
+    job.format = options->format;
+    atomic_init(&job.exported, 0);
+    atomic_init(&job.vanished, 0);
+    atomic_init(&job.failed, 0);
+
+    ExportWalk walk;
+    walk.job = &job;
+    walk.count = 0;
+    walk.walked = 0;
+    job.keys = malloc(sizeof(*job.keys) * (size_t)job.pipeline * (size_t)job.depth);
+    job.counts = (int*)malloc(sizeof(int) * (size_t)job.depth);
+    walk.keys = malloc(sizeof(*walk.keys) * (size_t)job.pipeline);
+
+    // The keys are walked on a connection of their own
+    TransferWorker workers[KV_BATCH_MAX_PARALLEL];
+    int walker = -1;
+    bool ok = job.keys && job.counts && walk.keys && workers_open(workers, &job, options);
+    if (ok) {
+        walker = connect_to_server(options->ip, options->port);
+        if (walker < 0) {
+            fprintf(stderr, "Failed to connect to server at %s:%d\n", options->ip, options->port);
+            workers_free(workers, options->parallel);
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        uint64_t started = kv_stats_now();
+        int running = workers_start(workers, options->parallel, export_main);
+
+        // Engines that cannot walk in hash order stream an ordered scan instead
+        uint64_t cursor = 0;
+        bool walked = running > 0 && kv_client_scan_cursor(walker, &cursor, options->prefix, walk_key, &walk);
+        if (running > 0 && !walked && walk.walked == 0 && cursor == 0) {
+            walked = kv_client_scan(walker, NULL, NULL, options->prefix, walk_key, &walk);
+        }
+        if (walk.count > 0) {
+            queue_push(&job, walk.keys, walk.count);
+        }
+        close(walker);
+
+        pthread_mutex_lock(&job.lock);
+        job.done = true;
+        pthread_cond_broadcast(&job.not_empty);
+        pthread_mutex_unlock(&job.lock);
+        for (int i = 0; i < running; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        workers_free(workers, options->parallel);
+
+        if (fflush(out) != 0) {
+            job.write_failed = true;
+        }
+        double seconds = (double)(kv_stats_now() - started) / 1e9;
+        uint64_t exported = atomic_load(&job.exported);
+        uint64_t failed = atomic_load(&job.failed);
+        fprintf(stderr, "Exported %llu keys in %.2f s (%.0f keys/s); %llu failed, %llu deleted during the export\n",
+                (unsigned long long)exported, seconds, seconds > 0 ? (double)exported / seconds : 0.0,
+                (unsigned long long)failed, (unsigned long long)atomic_load(&job.vanished));
+        if (!walked) {
+            fprintf(stderr, "The key walk failed after %llu keys\n", (unsigned long long)walk.walked);
+        }
+        if (job.write_failed) {
+            perror("Failed to write the export");
+        }
+        ok = walked && failed == 0 && !job.write_failed;
+    }
+
+    free(job.keys);
+    free(job.counts);
+    free(walk.keys);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.not_empty);
+    pthread_cond_destroy(&job.not_full);
+    pthread_mutex_destroy(&job.out_lock);
+    return ok;
+}
@@ -0,0 +1,714 @@
+#include "kv_store.h"
+#include <math.h>
+#include <stddef.h> // For offsetof
+#include <poll.h>
+
+// Load generator
+//
+// Worker threads drive one or more servers over persistent connections,
+// keeping up to --pipeline requests in flight on each. Every reply is timed
+// from when its request was sent and recorded in a per-thread HDR-style
+// histogram; the histograms are merged at the end for the report.
+
+#define BENCH_MAX_PIPELINE 64
+#define BENCH_MAX_CONNS 256            // Connections per thread
+#define BENCH_RECV_BUFFER (64 * 1024)
+
+// Histogram layout: values below 2^(HIST_SUB_BITS + 1) are recorded exactly;
+// above that every power of two is split into 2^HIST_SUB_BITS linear
+// sub-buckets, which keeps the relative error under 0.1%
+#define HIST_SUB_BITS 10
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_SHIFT 30              // Values up to ~2^41 ns (about 36 minutes)
+#define HIST_SLOTS ((HIST_MAX_SHIFT + 2) * HIST_SUB_COUNT)
+
+typedef struct {
+    uint64_t counts[HIST_SLOTS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} Histogram;
+
+typedef enum {
+    BENCH_GET = 0,
+    BENCH_PUT,
+    BENCH_OP_TYPES
+} BenchOp;
+
+static const char* bench_op_names[BENCH_OP_TYPES] = { "GET", "PUT" };
+
+typedef struct {
+    char ip[64];
+    int port;
+} BenchServer;
+
+typedef struct {
+    BenchServer servers[MAX_NODES];
+    int server_count;
+    int threads;
+    int connections;           // Per thread
+    int pipeline;              // Requests in flight per connection
+    double duration;           // Seconds, when requests is 0
+    long long requests;        // Total requests to issue (0 = run for duration)
+    long long keys;            // Size of the key space
+    bool zipf;                 // Zipfian instead of uniform key choice
+    double zipf_theta;
+    int value_min;
+    int value_max;
+    double read_ratio;         // Fraction of requests that are GETs
+    bool varlen_get;           // GETs ask for variable-length replies
+    bool load;                 // Write every key once before measuring
+    bool json;                 // Print one JSON object instead of a table
+    uint64_t seed;
+} BenchConfig;
+
+// Precomputed constants for the zipfian generator (Gray et al., as in YCSB)
+typedef struct {
+    long long n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} Zipf;
+
+typedef struct {
+    int fd;
+    uint64_t sent_at[BENCH_MAX_PIPELINE]; // Send times of requests in flight, oldest first
+    BenchOp ops[BENCH_MAX_PIPELINE];
+    int head;
+    int inflight;
+    char* rbuf;
+    size_t rlen;
+} BenchConn;
+
+typedef struct {
+    int id;
+    const Zipf* zipf;
+    uint64_t rng;
+    long long load_next;       // Load phase: next key to write
+    long long load_end;
+    Histogram* hist[BENCH_OP_TYPES];
+    uint64_t misses;
+    uint64_t busy;             // Replies shed by the server's admission control
+    uint64_t errors;
+} BenchThread;
+
+static BenchConfig config;
+static _Atomic long long requests_left;    // Budget when --requests is set
+static _Atomic bool stop_issuing;
+static bool load_phase;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift64* generator, one per thread
+static uint64_t next_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double next_double(uint64_t* state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Histogram
+
+static int hist_index(uint64_t value) {
+    if (value < 2 * HIST_SUB_COUNT) {
+        return (int)value;
+    }
+
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    if (shift > HIST_MAX_SHIFT) {
+        return HIST_SLOTS - 1;
+    }
+    return (shift + 1) * HIST_SUB_COUNT + (int)((value >> shift) - HIST_SUB_COUNT);
+}
+
+// Largest value that maps to the same slot
+static uint64_t hist_value(int index) {
+    if (index < 2 * HIST_SUB_COUNT) {
+        return (uint64_t)index;
+    }
+
+    int shift = index / HIST_SUB_COUNT - 1;
+    uint64_t sub = (uint64_t)(index % HIST_SUB_COUNT + HIST_SUB_COUNT);
+    return ((sub + 1) << shift) - 1;
+}
+
+static Histogram* hist_create(void) {
+    Histogram* hist = (Histogram*)calloc(1, sizeof(Histogram));
+    if (hist) {
+        hist->min = UINT64_MAX;
+    }
+    return hist;
+}
+
+static void hist_record(Histogram* hist, uint64_t value) {
+    hist->counts[hist_index(value)]++;
+    hist->total++;
+    hist->sum += (double)value;
+    if (value < hist->min) {
+        hist->min = value;
+    }
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+static void hist_merge(Histogram* into, const Histogram* from) {
+    for (int i = 0; i < HIST_SLOTS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->min < into->min) {
+        into->min = from->min;
+    }
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+// Value at the given percentile (0-100)
+static uint64_t hist_percentile(const Histogram* hist, double percentile) {
+    if (hist->total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)ceil(percentile / 100.0 * (double)hist->total);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_SLOTS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t value = hist_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+// Key choice
+
+static double zeta(long long n, double theta) {
+    double sum = 0;
+    for (long long i = 1; i <= n; i++) {
+        sum += 1.0 / pow((double)i, theta);
+    }
+    return sum;
+}
+
+static void zipf_init(Zipf* zipf, long long n, double theta) {
+    zipf->n = n;
+    zipf->theta = theta;
+    zipf->alpha = 1.0 / (1.0 - theta);
+    zipf->zetan = zeta(n, theta);
+    double zeta2 = zeta(2, theta);
+    zipf->eta = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) / (1.0 - zeta2 / zipf->zetan);
+}
+
+// Rank of the next key; rank 0 is the most popular
+static long long zipf_next(const Zipf* zipf, uint64_t* rng) {
+    double u = next_double(rng);
+    double uz = u * zipf->zetan;
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, zipf->theta)) {
+        return 1;
+    }
+
+    long long rank = (long long)((double)zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+    return rank < zipf->n ? rank : zipf->n - 1;
+}
+
+// Spread popular ranks over the key space so they do not share a shard
+static long long scramble(long long rank, long long n) {
+    uint64_t x = (uint64_t)rank;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return (long long)(x % (uint64_t)n);
+}
+
+static long long next_key(BenchThread* t) {
+    if (load_phase) {
+        return t->load_next++;
+    }
+    if (t->zipf) {
+        return scramble(zipf_next(t->zipf, &t->rng), config.keys);
+    }
+    return (long long)(next_random(&t->rng) % (uint64_t)config.keys);
+}
+
+// Requests
+
+// Take one request from the budget; false once the run is over
+static bool claim_request(BenchThread* t) {
+    if (atomic_load_explicit(&stop_issuing, memory_order_relaxed)) {
+        return false;
+    }
+    if (load_phase) {
+        return t->load_next < t->load_end;
+    }
+    if (config.requests > 0) {
+        return atomic_fetch_sub(&requests_left, 1) > 0;
+    }
+    return true;
+}
+
+static bool send_request(BenchThread* t, BenchConn* conn) {
+    Message msg;
+    memset(&msg, 0, sizeof(Message));
+
+    BenchOp op = (!load_phase && next_double(&t->rng) < config.read_ratio) ? BENCH_GET : BENCH_PUT;
+    snprintf(msg.key, MAX_KEY_SIZE, "key%012lld", next_key(t));
+
+    if (op == BENCH_GET) {
+        msg.op_code = OP_GET;
+        if (config.varlen_get) {
+            msg.flags = KV_FLAG_VARLEN_REPLY;
+        }
+    } else {
+        msg.op_code = OP_PUT;
+        int span = config.value_max - config.value_min + 1;
+        int len = config.value_min + (int)(next_random(&t->rng) % (uint64_t)span);
+        memset(msg.value, 'a' + (int)(next_random(&t->rng) % 26), (size_t)len);
+        msg.value[len] = '\0';
+    }
+
+    int slot = (conn->head + conn->inflight) % BENCH_MAX_PIPELINE;
+    conn->ops[slot] = op;
+    conn->sent_at[slot] = now_ns();
+    conn->inflight++;
+
+    size_t sent = 0;
+    while (sent < sizeof(Message)) {
+        ssize_t n = send(conn->fd, (char*)&msg + sent, sizeof(Message) - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        sent += (size_t)n;
+    }
+    return true;
+}
+
+// Consume every complete reply in the receive buffer
+static void parse_replies(BenchThread* t, BenchConn* conn) {
+    size_t offset = 0;
+
+    while (conn->inflight > 0) {
+        BenchOp op = conn->ops[conn->head];
+        size_t available = conn->rlen - offset;
+        size_t need;
+        int status;
+
+        if (op == BENCH_GET && config.varlen_get) {
+            ResponseHeader header;
+            if (available < sizeof(ResponseHeader)) {
+                break;
+            }
+            memcpy(&header, conn->rbuf + offset, sizeof(ResponseHeader));
+            need = sizeof(ResponseHeader) + header.value_len;
+            status = header.status;
+        } else {
+            Message reply;
+            if (available < sizeof(Message)) {
+                break;
+            }
+            memcpy(&reply.status, conn->rbuf + offset + offsetof(Message, status), sizeof(int));
+            need = sizeof(Message);
+            status = reply.status;
+        }
+        if (available < need) {
+            break;
+        }
+
+        hist_record(t->hist[op], now_ns() - conn->sent_at[conn->head]);
+        if (status == 0 && op == BENCH_GET) {
+            t->misses++;
+        } else if (status == KV_STATUS_BUSY) {
+            t->busy++;
+        } else if (status != 1) {
+            t->errors++;
+        }
+
+        offset += need;
+        conn->head = (conn->head + 1) % BENCH_MAX_PIPELINE;
+        conn->inflight--;
+
+        if (claim_request(t) && !send_request(t, conn)) {
+            t->errors++;
+        }
+    }
+
+    memmove(conn->rbuf, conn->rbuf + offset, conn->rlen - offset);
+    conn->rlen -= offset;
+}
+
+static void* bench_thread(void* arg) {
+    BenchThread* t = (BenchThread*)arg;
+    int count = config.connections;
+    BenchConn conns[BENCH_MAX_CONNS];
+    struct pollfd fds[BENCH_MAX_CONNS];
+
+    for (int i = 0; i < count; i++) {
+        const BenchServer* server = &config.servers[(t->id * count + i) % config.server_count];
+        memset(&conns[i], 0, sizeof(BenchConn));
+        conns[i].fd = connect_to_server(server->ip, server->port);
+        conns[i].rbuf = (char*)malloc(BENCH_RECV_BUFFER);
+        if (conns[i].fd < 0 || !conns[i].rbuf) {
+            fprintf(stderr, "Failed to connect to %s:%d\n", server->ip, server->port);
+            t->errors++;
+            continue;
+        }
+
+        for (int d = 0; d < config.pipeline && claim_request(t); d++) {
+            if (!send_request(t, &conns[i])) {
+                t->errors++;
+                break;
+            }
+        }
+    }
+
+    while (1) {
+        int active = 0;
+        for (int i = 0; i < count; i++) {
+            fds[i].fd = conns[i].inflight > 0 ? conns[i].fd : -1;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+            active += conns[i].inflight > 0;
+        }
+        if (active == 0) {
+            break;
+        }
+
+        if (poll(fds, count, 1000) <= 0) {
+            if (atomic_load(&stop_issuing)) {
+                // Replies that have not arrived by now are not coming
+                break;
+            }
+            continue;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            BenchConn* conn = &conns[i];
+            ssize_t n = recv(conn->fd, conn->rbuf + conn->rlen, BENCH_RECV_BUFFER - conn->rlen, MSG_DONTWAIT);
+            if (n <= 0) {
+                if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                    continue;
+                }
+                // Server went away; everything in flight is lost
+                t->errors += (uint64_t)conn->inflight;
+                conn->inflight = 0;
+                continue;
+            }
+
+            conn->rlen += (size_t)n;
+            parse_replies(t, conn);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (conns[i].fd >= 0) {
+            close(conns[i].fd);
+        }
+        free(conns[i].rbuf);
+    }
+    return NULL;
+}
+
+// Run every thread once; returns the wall time in seconds
+static double run_phase(BenchThread* threads) {
+    pthread_t tids[config.threads];
+    atomic_store(&stop_issuing, false);
+    atomic_store(&requests_left, config.requests);
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < config.threads; i++) {
+        pthread_create(&tids[i], NULL, bench_thread, &threads[i]);
+    }
+
+    if (!load_phase && config.requests == 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)config.duration;
+        ts.tv_nsec = (long)((config.duration - (double)ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+        atomic_store(&stop_issuing, true);
+    }
+
+    for (int i = 0; i < config.threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    return (double)(now_ns() - start) / 1e9;
+}
+
+// Reporting
+
+static void print_row(const char* name, const Histogram* hist) {
+    printf("%-6s %12llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, (unsigned long long)hist->total,
+           hist->total ? hist->sum / (double)hist->total / 1000.0 : 0.0,
+           hist_percentile(hist, 50.0) / 1000.0, hist_percentile(hist, 99.0) / 1000.0,
+           hist_percentile(hist, 99.9) / 1000.0, hist->total ? hist->max / 1000.0 : 0.0);
+}
+
+static void print_json_op(const char* name, const Histogram* hist, bool last) {
+    printf("\"%s\":{\"count\":%llu,\"mean_us\":%.2f,\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f,\"max_us\":%.2f}%s",
+           name, (unsigned long long)hist->total,
+           hist->total ? hist->sum / (double)hist->total / 1000.0 : 0.0,
+           hist_percentile(hist, 50.0) / 1000.0, hist_percentile(hist, 99.0) / 1000.0,
+           hist_percentile(hist, 99.9) / 1000.0, hist->total ? hist->max / 1000.0 : 0.0,
+           last ? "" : ",");
+}
+
+static void report(Histogram** merged, Histogram* all, double elapsed, uint64_t misses, uint64_t busy,
+                   uint64_t errors) {
+    double ops_per_sec = elapsed > 0 ? (double)all->total / elapsed : 0.0;
+
+    if (config.json) {
+        printf("{\"threads\":%d,\"connections\":%d,\"pipeline\":%d,\"keys\":%lld,\"distribution\":\"%s\","
+               "\"read_ratio\":%.3f,\"value_min\":%d,\"value_max\":%d,\"elapsed_s\":%.3f,"
+               "\"ops\":%llu,\"ops_per_sec\":%.1f,\"misses\":%llu,\"busy\":%llu,\"errors\":%llu,",
+               config.threads, config.threads * config.connections, config.pipeline, config.keys,
+               config.zipf ? "zipf" : "uniform", config.read_ratio, config.value_min, config.value_max,
+               elapsed, (unsigned long long)all->total, ops_per_sec,
+               (unsigned long long)misses, (unsigned long long)busy, (unsigned long long)errors);
+        for (int op = 0; op < BENCH_OP_TYPES; op++) {
+            print_json_op(bench_op_names[op], merged[op], false);
+        }
+        print_json_op("ALL", all, true);
+        printf("}\n");
+        return;
+    }
+
+    printf("Throughput: %.1f ops/s (%llu ops in %.2f s)\n", ops_per_sec, (unsigned long long)all->total, elapsed);
+    printf("%-6s %12s %10s %10s %10s %10s %10s\n", "Op", "Count", "Mean(us)", "p50(us)", "p99(us)", "p999(us)", "Max(us)");
+    for (int op = 0; op < BENCH_OP_TYPES; op++) {
+        print_row(bench_op_names[op], merged[op]);
+    }
+    print_row("ALL", all);
+    printf("Misses: %llu  Busy: %llu  Errors: %llu\n", (unsigned long long)misses, (unsigned long long)busy,
+           (unsigned long long)errors);
+}
+
+// Command line
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --server <ip:port>        Server to drive; repeat for several (default: 127.0.0.1:%d)\n"
+            "  --threads <n>             Worker threads (default: 1)\n"
+            "  --connections <n>         Connections per thread (default: 1)\n"
+            "  --pipeline <n>            Requests in flight per connection (default: 1, max %d)\n"
+            "  --duration <seconds>      How long to run (default: 10)\n"
+            "  --requests <n>            Issue exactly n requests instead of running for a duration\n"
+            "  --keys <n>                Size of the key space (default: 1000)\n"
+            "  --dist <uniform|zipf>     Key distribution (default: uniform)\n"
+            "  --zipf-theta <theta>      Skew of the zipfian distribution (default: 0.99)\n"
+            "  --value-size <n|min-max>  Value size in bytes, uniform over the range (default: 100)\n"
+            "  --read-ratio <fraction>   Fraction of requests that are GETs (default: 0.9)\n"
+            "  --varlen-get              Ask for variable-length GET replies\n"
+            "  --load                    Write every key once before measuring\n"
+            "  --seed <n>                Random seed (default: 1)\n"
+            "  --json                    Print the results as one JSON object\n",
+            prog, DEFAULT_PORT, BENCH_MAX_PIPELINE);
+}
+
+static bool parse_server(const char* arg, BenchServer* server) {
+    const char* colon = strrchr(arg, ':');
+    size_t ip_len = colon ? (size_t)(colon - arg) : strlen(arg);
+    if (ip_len == 0 || ip_len >= sizeof(server->ip)) {
+        return false;
+    }
+
+    memcpy(server->ip, arg, ip_len);
+    server->ip[ip_len] = '\0';
+    server->port = colon ? atoi(colon + 1) : DEFAULT_PORT;
+    return server->port > 0;
+}
+
+int main(int argc, char* argv[]) {
+    config.threads = 1;
+    config.connections = 1;
+    config.pipeline = 1;
+    config.duration = 10.0;
+    config.keys = 1000;
+    config.zipf_theta = 0.99;
+    config.value_min = 100;
+    config.value_max = 100;
+    config.read_ratio = 0.9;
+    config.seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* next = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--server") == 0 && next) {
+            if (config.server_count >= MAX_NODES || !parse_server(next, &config.servers[config.server_count])) {
+                fprintf(stderr, "Bad or too many servers: %s\n", next);
+                return 1;
+            }
+            config.server_count++;
+            i++;
+        } else if (strcmp(arg, "--threads") == 0 && next) {
+            config.threads = atoi(next);
+            i++;
+        } else if (strcmp(arg, "--connections") == 0 && next) {
+            config.connections = atoi(next);
+            i++;
+        } else if (strcmp(arg, "--pipeline") == 0 && next) {
+            config.pipeline = atoi(next);
+            i++;
+        } else if (strcmp(arg, "--duration") == 0 && next) {
+            config.duration = atof(next);
+            i++;
+        } else if (strcmp(arg, "--requests") == 0 && next) {
+            config.requests = atoll(next);
+            i++;
+        } else if (strcmp(arg, "--keys") == 0 && next) {
+            config.keys = atoll(next);
+            i++;
+        } else if (strcmp(arg, "--dist") == 0 && next) {
+            config.zipf = strcmp(next, "zipf") == 0;
+            i++;
+        } else if (strcmp(arg, "--zipf-theta") == 0 && next) {
+            config.zipf_theta = atof(next);
+            i++;
+        } else if (strcmp(arg, "--value-size") == 0 && next) {
+            const char* dash = strchr(next, '-');
+            config.value_min = atoi(next);
+            config.value_max = dash ? atoi(dash + 1) : config.value_min;
+            i++;
+        } else if (strcmp(arg, "--read-ratio") == 0 && next) {
+            config.read_ratio = atof(next);
+            i++;
+        } else if (strcmp(arg, "--seed") == 0 && next) {
+            config.seed = strtoull(next, NULL, 10);
+            i++;
+        } else if (strcmp(arg, "--varlen-get") == 0) {
+            config.varlen_get = true;
+        } else if (strcmp(arg, "--load") == 0) {
+            config.load = true;
+        } else if (strcmp(arg, "--json") == 0) {
+            config.json = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.server_count == 0) {
+        strcpy(config.servers[0].ip, "127.0.0.1");
+        config.servers[0].port = DEFAULT_PORT;
+        config.server_count = 1;
+    }
+
+    if (config.threads < 1 || config.connections < 1 || config.connections > BENCH_MAX_CONNS ||
+        config.pipeline < 1 || config.pipeline > BENCH_MAX_PIPELINE || config.keys < 1 ||
+        config.value_min < 0 || config.value_max < config.value_min || config.value_max >= MAX_VALUE_SIZE ||
+        (config.zipf && (config.zipf_theta <= 0.0 || config.zipf_theta == 1.0))) {
+        fprintf(stderr, "Invalid configuration\n");
+        usage(argv[0]);
+        return 1;
+    }
+
+    Zipf zipf;
+    if (config.zipf) {
+        zipf_init(&zipf, config.keys, config.zipf_theta);
+    }
+
+    BenchThread* threads = (BenchThread*)calloc((size_t)config.threads, sizeof(BenchThread));
+    if (!threads) {
+        return 1;
+    }
+    for (int i = 0; i < config.threads; i++) {
+        threads[i].id = i;
+        threads[i].zipf = config.zipf ? &zipf : NULL;
+        threads[i].rng = (config.seed + (uint64_t)i + 1) * 0x9E3779B97F4A7C15ULL;
+        for (int op = 0; op < BENCH_OP_TYPES; op++) {
+            threads[i].hist[op] = hist_create();
+            if (!threads[i].hist[op]) {
+                return 1;
+            }
+        }
+    }
+
+    if (config.load) {
+        // Each thread writes its own slice of the key space
+        load_phase = true;
+        for (int i = 0; i < config.threads; i++) {
+            threads[i].load_next = config.keys * i / config.threads;
+            threads[i].load_end = config.keys * (i + 1) / config.threads;
+        }
+        double load_time = run_phase(threads);
+        if (!config.json) {
+            printf("Loaded %lld keys in %.2f s\n", config.keys, load_time);
+        }
+
+        // Measurements start from a clean slate
+        for (int i = 0; i < config.threads; i++) {
+            for (int op = 0; op < BENCH_OP_TYPES; op++) {
+                free(threads[i].hist[op]);
+                threads[i].hist[op] = hist_create();
+            }
+            threads[i].misses = 0;
+            threads[i].busy = 0;
+            threads[i].errors = 0;
+        }
+        load_phase = false;
+    }
+
+    double elapsed = run_phase(threads);
+
+    Histogram* merged[BENCH_OP_TYPES];
+    Histogram* all = hist_create();
+    uint64_t misses = 0;
+    uint64_t busy = 0;
+    uint64_t errors = 0;
+    for (int op = 0; op < BENCH_OP_TYPES; op++) {
+        merged[op] = hist_create();
+        for (int i = 0; i < config.threads; i++) {
+            hist_merge(merged[op], threads[i].hist[op]);
+        }
+        hist_merge(all, merged[op]);
+    }
+    for (int i = 0; i < config.threads; i++) {
+        misses += threads[i].misses;
+        busy += threads[i].busy;
+        errors += threads[i].errors;
+    }
+
+    report(merged, all, elapsed, misses, busy, errors);
+
+    for (int op = 0; op < BENCH_OP_TYPES; op++) {
+        free(merged[op]);
+        for (int i = 0; i < config.threads; i++) {
+            free(threads[i].hist[op]);
+        }
+    }
+    free(all);
+    free(threads);
+
+    return errors == 0 ? 0 : 2;
+}
@@ -1,100 +1,262 @@
 #include "kv_store.h"
 #include <ctype.h>
+#include <limits.h>
+#include <poll.h>
 
-// Connect to a server
-int connect_to_server(const char* ip, int port) {
-    int sockfd;
-    struct sockaddr_in server_addr;
+// A request answered busy is resent after a pause that doubles each time
+#define BUSY_RETRIES 6
+#define BUSY_BACKOFF_US 1000
+
+// Keyspace every request is tagged with; 0 is the server's default keyspace
+static uint32_t client_keyspace = 0;
+
+// Send a request and wait for its response, resending while the server
+// answers busy
+static bool client_roundtrip(int sockfd, Message* msg) {
+    Message request = *msg;
+    for (int attempt = 0;; attempt++) {
+        // Send message
+        if (send(sockfd, msg, sizeof(Message), 0) <= 0) {
+            return false;
+        }
+        
+        // Receive response
+        if (recv(sockfd, msg, sizeof(Message), MSG_WAITALL) <= 0) {
+            return false;
+        }
+        if (msg->status != KV_STATUS_BUSY || attempt == BUSY_RETRIES) {
+            break;
+        }
+        usleep(BUSY_BACKOFF_US << attempt);
+        *msg = request;
+    }
+    
+    // A redirect would need the owning node's address, which is not implemented here
+    return msg->status != -1;
+}
+
+// Send count requests back to back and receive as many replies. Sending
+// and receiving overlap, so the requests never fill both sides' socket
+// buffers while the replies go unread.
+static bool pipeline_exchange(int sockfd, const Message* requests, Message* replies, int count) {
+    const char* out = (const char*)requests;
+    char* in = (char*)replies;
+    size_t total = sizeof(Message) * (size_t)count;
+    size_t sent = 0;
+    size_t received = 0;
     
-    // Create socket
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        return -1;
+    while (received < total) {
+        struct pollfd pfd;
+        pfd.fd = sockfd;
+        pfd.events = POLLIN | (sent < total ? POLLOUT : 0);
+        pfd.revents = 0;
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+    
+        if (sent < total && (pfd.revents & POLLOUT)) {
+            ssize_t n = send(sockfd, out + sent, total - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                return false;
+            }
+            if (n > 0) {
+                sent += (size_t)n;
+            }
+        }
+        if (pfd.revents & (POLLIN | POLLERR | POLLHUP)) {
+            ssize_t n = recv(sockfd, in + received, total - received, MSG_DONTWAIT);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                return false;
+            }
+            if (n > 0) {
+                received += (size_t)n;
+            }
+        }
+    }
+    return true;
+}
+
+// Client function to send count requests without waiting for each reply;
+// the replies land in replies in request order. A server answers a
+// connection's requests in order, so this only saves round trips. Requests
+// answered busy are resent together, in order, after a pause that doubles
+// each time. A GET is answered with a whole Message, value included.
+bool kv_client_pipeline(int sockfd, const Message* requests, Message* replies, int count) {
+    if (sockfd < 0 || count <= 0) {
+        return count == 0;
+    }
+    if (!pipeline_exchange(sockfd, requests, replies, count)) {
+        return false;
     }
     
-    // Configure server address
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
+    for (int attempt = 0; attempt < BUSY_RETRIES; attempt++) {
+        int busy = 0;
+        for (int i = 0; i < count; i++) {
+            busy += replies[i].status == KV_STATUS_BUSY;
+        }
+        if (busy == 0) {
+            break;
+        }
     
-    // Convert IP address
-    if (inet_pton(AF_INET, ip, &server_addr.sin_addr) <= 0) {
-        close(sockfd);
-        return -1;
+        // Gather the shed requests, resend them and scatter their replies back
+        Message* retry = (Message*)malloc(sizeof(Message) * (size_t)busy * 2);
+        if (!retry) {
+            return true;
+        }
+        int n = 0;
+        for (int i = 0; i < count; i++) {
+            if (replies[i].status == KV_STATUS_BUSY) {
+                retry[n++] = requests[i];
+            }
+        }
+        usleep(BUSY_BACKOFF_US << attempt);
+        bool ok = pipeline_exchange(sockfd, retry, retry + busy, busy);
+        n = 0;
+        for (int i = 0; ok && i < count; i++) {
+            if (replies[i].status == KV_STATUS_BUSY) {
+                replies[i] = retry[busy + n++];
+            }
+        }
+        free(retry);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Send subsequent requests to the keyspace with this id (see kv_client_keyspace)
+void kv_client_set_keyspace(uint32_t id) {
+    client_keyspace = id;
+}
+
+// Start a request: clear it and tag it with the current keyspace
+void kv_client_prepare(Message* msg, OperationCode op) {
+    memset(msg, 0, sizeof(Message));
+    msg->op_code = op;
+    msg->flags = KV_KEYSPACE_FLAGS(client_keyspace);
+}
+
+// Client function to look up a keyspace's id by name; false if the server
+// holds no keyspace of that name
+bool kv_client_keyspace(int sockfd, const char* name, uint32_t* id) {
+    if (sockfd < 0 || !name || !id) {
+        return false;
     }
     
-    // Connect to server
-    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        close(sockfd);
-        return -1;
+    // Create message; the lookup itself is answered by any keyspace
+    Message msg;
+    memset(&msg, 0, sizeof(Message));
+    msg.op_code = OP_KEYSPACE;
+    strncpy(msg.key, name, MAX_KEY_SIZE - 1);
+    msg.key[MAX_KEY_SIZE - 1] = '\0';
+    
+    if (!client_roundtrip(sockfd, &msg) || msg.status != 1) {
+        return false;
     }
     
-    return sockfd;
+    *id = (uint32_t)strtoul(msg.value, NULL, 10);
+    return true;
 }
 
 // Client function to put a key-value pair
-bool kv_client_put(int sockfd, const char* key, const char* value) {
+bool kv_client_put(int sockfd, const char* key, const char* value, uint64_t* version) {
     if (sockfd < 0 || !key || !value) {
         return false;
     }
     
     // Create message
     Message msg;
-    msg.op_code = OP_PUT;
+    kv_client_prepare(&msg, OP_PUT);
     strncpy(msg.key, key, MAX_KEY_SIZE - 1);
     msg.key[MAX_KEY_SIZE - 1] = '\0';
     strncpy(msg.value, value, MAX_VALUE_SIZE - 1);
     msg.value[MAX_VALUE_SIZE - 1] = '\0';
     
-    // Send message
-    if (send(sockfd, &msg, sizeof(Message), 0) <= 0) {
+    if (!client_roundtrip(sockfd, &msg)) {
         return false;
     }
     
-    // Receive response
-    if (recv(sockfd, &msg, sizeof(Message), 0) <= 0) {
-        return false;
-    }
-    
-    // Check if we need to redirect
-    if (msg.status == -1) {
-        // We would need to get the new node's IP and port from node list
-        // For simplicity, this is not implemented here
-        return false;
+    if (msg.status == 1 && version) {
+        *version = msg.version;
     }
     
     return msg.status == 1;
 }
 
 // Client function to get a value by key
-bool kv_client_get(int sockfd, const char* key, char* value) {
+bool kv_client_get(int sockfd, const char* key, char* value, uint64_t* version) {
     if (sockfd < 0 || !key || !value) {
         return false;
     }
     
-    // Create message
+    // Create message; ask for a header plus the value as stored instead of a full Message
     Message msg;
-    msg.op_code = OP_GET;
+    kv_client_prepare(&msg, OP_GET);
+    msg.flags |= KV_FLAG_VARLEN_REPLY | KV_FLAG_ACCEPT_COMPRESSED;
     strncpy(msg.key, key, MAX_KEY_SIZE - 1);
     msg.key[MAX_KEY_SIZE - 1] = '\0';
     
-    // Send message
-    if (send(sockfd, &msg, sizeof(Message), 0) <= 0) {
-        return false;
+    // Send message, and again while the server is too busy to take it
+    ResponseHeader header;
+    for (int attempt = 0;; attempt++) {
+        if (send(sockfd, &msg, sizeof(Message), 0) <= 0) {
+            return false;
+        }
+        
+        // Receive response header, then the value bytes
+        if (recv(sockfd, &header, sizeof(ResponseHeader), MSG_WAITALL) != sizeof(ResponseHeader)) {
+            return false;
+        }
+        if (header.status != KV_STATUS_BUSY || attempt == BUSY_RETRIES) {
+            break;
+        }
+        usleep(BUSY_BACKOFF_US << attempt);
     }
     
-    // Receive response
-    if (recv(sockfd, &msg, sizeof(Message), 0) <= 0) {
+    // Values that would not fit the caller's buffer are truncated
+    char packed[MAX_VALUE_SIZE];
+    bool compressed = (header.flags & KV_FLAG_COMPRESSED) != 0;
+    char* dst = compressed ? packed : value;
+    size_t remaining = header.value_len;
+    size_t kept = remaining < MAX_VALUE_SIZE - 1 ? remaining : MAX_VALUE_SIZE - 1;
+    if (kept > 0 && recv(sockfd, dst, kept, MSG_WAITALL) != (ssize_t)kept) {
         return false;
     }
+    dst[kept] = '\0';
+    
+    // A compressed value always fits, being smaller than the value it packs
+    if (compressed) {
+        int len = kv_lz4_decompress(packed, (int)kept, value, MAX_VALUE_SIZE - 1);
+        if (len < 0) {
+            return false;
+        }
+        value[len] = '\0';
+    }
+    
+    for (remaining -= kept; remaining > 0;) {
+        char discard[256];
+        ssize_t n = recv(sockfd, discard, remaining < sizeof(discard) ? remaining : sizeof(discard), 0);
+        if (n <= 0) {
+            return false;
+        }
+        remaining -= n;
+    }
     
     // Check if we need to redirect
-    if (msg.status == -1) {
+    if (header.status == -1) {
         // We would need to get the new node's IP and port from node list
         // For simplicity, this is not implemented here
         return false;
     }
     
-    if (msg.status == 1) {
-        strncpy(value, msg.value, MAX_VALUE_SIZE);
+    if (header.status == 1) {
+        if (version) {
+            *version = header.version;
+        }
         return true;
     }
     
@@ -109,10 +271,27 @@ bool kv_client_delete(int sockfd, const char* key) {
     
     // Create message
     Message msg;
-    msg.op_code = OP_DELETE;
+    kv_client_prepare(&msg, OP_DELETE);
     strncpy(msg.key, key, MAX_KEY_SIZE - 1);
     msg.key[MAX_KEY_SIZE - 1] = '\0';
     
+    if (!client_roundtrip(sockfd, &msg)) {
+        return false;
+    }
+    
+    return msg.status == 1;
+}
+
+// Client function to list all keys
+bool kv_client_list_keys(int sockfd, char* buffer, int buffer_size) {
+    if (sockfd < 0 || !buffer || buffer_size <= 0) {
+        return false;
+    }
+    
+    // Create message
+    Message msg;
+    kv_client_prepare(&msg, OP_LIST_KEYS);
+    
     // Send message
     if (send(sockfd, &msg, sizeof(Message), 0) <= 0) {
         return false;
@@ -123,25 +302,305 @@ bool kv_client_delete(int sockfd, const char* key) {
         return false;
     }
     
-    // Check if we need to redirect
-    if (msg.status == -1) {
-        // We would need to get the new node's IP and port from node list
-        // For simplicity, this is not implemented here
+    if (msg.status == 1) {
+        strncpy(buffer, msg.value, buffer_size - 1);
+        buffer[buffer_size - 1] = '\0';
+        return true;
+    }
+    
+    return false;
+}
+
+// Client function to compare-and-set a value by version (0 = key must not exist)
+bool kv_client_cas(int sockfd, const char* key, uint64_t expected_version, const char* value,
+                   char* current, uint64_t* version) {
+    if (sockfd < 0 || !key || !value) {
+        return false;
+    }
+    
+    // Create message
+    Message msg;
+    kv_client_prepare(&msg, OP_CAS);
+    msg.flags |= KV_CAS_VERSION;
+    msg.version = expected_version;
+    strncpy(msg.key, key, MAX_KEY_SIZE - 1);
+    strncpy(msg.value, value, MAX_VALUE_SIZE - 1);
+    
+    if (!client_roundtrip(sockfd, &msg)) {
         return false;
     }
     
+    // On a mismatch the server returns the current value and version
+    if (current) {
+        strncpy(current, msg.value, MAX_VALUE_SIZE);
+    }
+    if (version) {
+        *version = msg.version;
+    }
+    
     return msg.status == 1;
 }
 
-// Client function to list all keys
-bool kv_client_list_keys(int sockfd, char* buffer, int buffer_size) {
-    if (sockfd < 0 || !buffer || buffer_size <= 0) {
+// Client function to compare-and-set a value by its current contents
+bool kv_client_cas_value(int sockfd, const char* key, const char* expected, const char* value,
+                         char* current, uint64_t* version) {
+    if (sockfd < 0 || !key || !expected || !value) {
+        return false;
+    }
+    
+    // Expected and new values share the value field, separated by a NUL
+    size_t expected_len = strlen(expected);
+    size_t value_len = strlen(value);
+    if (expected_len + value_len + 2 > MAX_VALUE_SIZE) {
+        return false;
+    }
+    
+    // Create message
+    Message msg;
+    kv_client_prepare(&msg, OP_CAS);
+    msg.flags |= KV_CAS_VALUE;
+    strncpy(msg.key, key, MAX_KEY_SIZE - 1);
+    memcpy(msg.value, expected, expected_len + 1);
+    memcpy(msg.value + expected_len + 1, value, value_len + 1);
+    
+    if (!client_roundtrip(sockfd, &msg)) {
+        return false;
+    }
+    
+    if (current) {
+        strncpy(current, msg.value, MAX_VALUE_SIZE);
+    }
+    if (version) {
+        *version = msg.version;
+    }
+    
+    return msg.status == 1;
+}
+
+// Client function to add to an integer value (negative delta decrements)
+bool kv_client_incr(int sockfd, const char* key, long long delta, long long* result) {
+    // LLONG_MIN has no magnitude to send with DECR
+    if (sockfd < 0 || !key || delta == LLONG_MIN) {
+        return false;
+    }
+    
+    // Create message
+    Message msg;
+    kv_client_prepare(&msg, delta < 0 ? OP_DECR : OP_INCR);
+    strncpy(msg.key, key, MAX_KEY_SIZE - 1);
+    snprintf(msg.value, MAX_VALUE_SIZE, "%lld", delta < 0 ? -delta : delta);
+    
+    if (!client_roundtrip(sockfd, &msg) || msg.status != 1) {
+        return false;
+    }
+    
+    if (result) {
+        *result = strtoll(msg.value, NULL, 10);
+    }
+    return true;
+}
+
+// Client function to append to a value
+bool kv_client_append(int sockfd, const char* key, const char* suffix, char* result) {
+    if (sockfd < 0 || !key || !suffix) {
+        return false;
+    }
+    
+    // Create message
+    Message msg;
+    kv_client_prepare(&msg, OP_APPEND);
+    strncpy(msg.key, key, MAX_KEY_SIZE - 1);
+    strncpy(msg.value, suffix, MAX_VALUE_SIZE - 1);
+    
+    if (!client_roundtrip(sockfd, &msg) || msg.status != 1) {
+        return false;
+    }
+    
+    if (result) {
+        strncpy(result, msg.value, MAX_VALUE_SIZE);
+    }
+    return true;
+}
+
+// Client function to set a value and fetch the previous one
+bool kv_client_getset(int sockfd, const char* key, const char* value, char* old_value) {
+    if (sockfd < 0 || !key || !value) {
+        return false;
+    }
+    
+    // Create message
+    Message msg;
+    kv_client_prepare(&msg, OP_GETSET);
+    strncpy(msg.key, key, MAX_KEY_SIZE - 1);
+    strncpy(msg.value, value, MAX_VALUE_SIZE - 1);
+    
+    if (!client_roundtrip(sockfd, &msg) || msg.status != 1) {
+        return false;
+    }
+    
+    if (old_value) {
+        strncpy(old_value, msg.value, MAX_VALUE_SIZE);
+    }
+    return true;
+}
+
+// Client function to scan keys in sorted order. Keys in [start, end) are
+// passed to callback one at a time; give a prefix instead to scan just the
+// keys that share it. NULL or empty arguments leave that side unbounded.
+bool kv_client_scan(int sockfd, const char* start, const char* end, const char* prefix,
+                    void (*callback)(const char* key, void* arg), void* arg) {
+    if (sockfd < 0 || !callback) {
+        return false;
+    }
+    
+    // Create message
+    Message msg;
+    kv_client_prepare(&msg, OP_SCAN);
+    if (start) {
+        strncpy(msg.key, start, MAX_KEY_SIZE - 1);
+    }
+    if (prefix && prefix[0]) {
+        msg.flags |= KV_SCAN_PREFIX;
+        strncpy(msg.value, prefix, MAX_VALUE_SIZE - 1);
+    } else if (end) {
+        strncpy(msg.value, end, MAX_VALUE_SIZE - 1);
+    }
+    
+    // Send message
+    if (send(sockfd, &msg, sizeof(Message), 0) <= 0) {
+        return false;
+    }
+    
+    // Receive pages until the final frame arrives
+    do {
+        if (recv(sockfd, &msg, sizeof(Message), MSG_WAITALL) != sizeof(Message)) {
+            return false;
+        }
+        
+        msg.value[MAX_VALUE_SIZE - 1] = '\0';
+        char* line = msg.value;
+        char* newline;
+        while ((newline = strchr(line, '\n')) != NULL) {
+            *newline = '\0';
+            callback(line, arg);
+            line = newline + 1;
+        }
+    } while (msg.status == KV_SCAN_MORE);
+    
+    return msg.status == 1;
+}
+
+// Client function to walk keys in hash order from a cursor ("0" or 0 to
+// start), passing them to callback one at a time; give a prefix to keep only
+// the keys that share it. The walk never blocks writers on the server and
+// survives tables resizing under it, but may repeat a key. cursor is updated
+// as each page arrives, so a walk cut short can be resumed from it on a new
+// connection; it is 0 once the walk is complete.
+bool kv_client_scan_cursor(int sockfd, uint64_t* cursor, const char* prefix,
+                           void (*callback)(const char* key, void* arg), void* arg) {
+    if (sockfd < 0 || !cursor || !callback) {
+        return false;
+    }
+    
+    // Create message
+    Message msg;
+    kv_client_prepare(&msg, OP_SCAN);
+    msg.flags |= KV_SCAN_HASH;
+    snprintf(msg.key, MAX_KEY_SIZE, "%llu", (unsigned long long)*cursor);
+    if (prefix) {
+        strncpy(msg.value, prefix, MAX_VALUE_SIZE - 1);
+    }
+    
+    // Send message
+    if (send(sockfd, &msg, sizeof(Message), 0) <= 0) {
+        return false;
+    }
+    
+    // Receive pages until the final frame arrives
+    do {
+        if (recv(sockfd, &msg, sizeof(Message), MSG_WAITALL) != sizeof(Message)) {
+            return false;
+        }
+        if (msg.status == 0) {
+            // The server's engine cannot walk in hash order
+            return false;
+        }
+        
+        msg.value[MAX_VALUE_SIZE - 1] = '\0';
+        char* line = msg.value;
+        char* newline;
+        while ((newline = strchr(line, '\n')) != NULL) {
+            *newline = '\0';
+            callback(line, arg);
+            line = newline + 1;
+        }
+        
+        msg.key[MAX_KEY_SIZE - 1] = '\0';
+        *cursor = strtoull(msg.key, NULL, 10);
+    } while (msg.status == KV_SCAN_MORE);
+    
+    return msg.status == 1;
+}
+
+// Print one scanned key
+static void print_key(const char* key, void* arg) {
+    int* count = (int*)arg;
+    printf("%s\n", key);
+    (*count)++;
+}
+
+// Send a request whose reply is streamed text, passing each frame's piece
+// of the text to callback as it arrives
+static bool fetch_text(int sockfd, OperationCode op, void (*callback)(const char* text, void* arg), void* arg) {
+    if (sockfd < 0 || !callback) {
+        return false;
+    }
+    
+    // Create message
+    Message msg;
+    kv_client_prepare(&msg, op);
+    
+    // Send message
+    if (send(sockfd, &msg, sizeof(Message), 0) <= 0) {
+        return false;
+    }
+    
+    // Receive frames until the final one arrives
+    do {
+        if (recv(sockfd, &msg, sizeof(Message), MSG_WAITALL) != sizeof(Message)) {
+            return false;
+        }
+        
+        msg.value[MAX_VALUE_SIZE - 1] = '\0';
+        callback(msg.value, arg);
+    } while (msg.status == KV_SCAN_MORE);
+    
+    return msg.status == 1;
+}
+
+// Client function to fetch the server's metrics. The text is passed to
+// callback in pieces as the frames arrive; concatenated they form the
+// Prometheus exposition text.
+bool kv_client_stats(int sockfd, void (*callback)(const char* text, void* arg), void* arg) {
+    return fetch_text(sockfd, OP_STATS, callback, arg);
+}
+
+// Client function to fetch the server's hot keys, one "key requests error
+// gets puts" line per key, hottest first; delivered like kv_client_stats
+bool kv_client_hot_keys(int sockfd, void (*callback)(const char* text, void* arg), void* arg) {
+    return fetch_text(sockfd, OP_HOTKEYS, callback, arg);
+}
+
+// Client function to have the server dump its request trace. On success the
+// path of the trace file on the server is copied to path.
+bool kv_client_trace(int sockfd, char* path, int path_size) {
+    if (sockfd < 0 || !path || path_size <= 0) {
         return false;
     }
     
     // Create message
     Message msg;
-    msg.op_code = OP_LIST_KEYS;
+    kv_client_prepare(&msg, OP_TRACE);
     
     // Send message
     if (send(sockfd, &msg, sizeof(Message), 0) <= 0) {
@@ -149,17 +608,51 @@ bool kv_client_list_keys(int sockfd, char* buffer, int buffer_size) {
     }
     
     // Receive response
-    if (recv(sockfd, &msg, sizeof(Message), 0) <= 0) {
+    if (recv(sockfd, &msg, sizeof(Message), MSG_WAITALL) != sizeof(Message)) {
         return false;
     }
     
-    if (msg.status == 1) {
-        strncpy(buffer, msg.value, buffer_size - 1);
-        buffer[buffer_size - 1] = '\0';
-        return true;
+    if (msg.status != 1) {
+        return false;
     }
     
-    return false;
+    msg.value[MAX_VALUE_SIZE - 1] = '\0';
+    snprintf(path, path_size, "%s", msg.value);
+    return true;
+}
+
+// Print a piece of streamed text
+static void print_text(const char* text, void* arg) {
+    (void)arg;
+    fputs(text, stdout);
+}
+
+// Print hot-key lines as a table; a line may be split across frames
+static void print_hot_keys(const char* text, void* arg) {
+    static char partial[MAX_KEY_SIZE + 128];
+    (void)arg;
+    
+    const char* line = text;
+    const char* newline;
+    while ((newline = strchr(line, '\n')) != NULL) {
+        size_t used = strlen(partial);
+        size_t len = (size_t)(newline - line);
+        if (len > sizeof(partial) - 1 - used) {
+            len = sizeof(partial) - 1 - used;
+        }
+        memcpy(partial + used, line, len);
+        partial[used + len] = '\0';
+        
+        char key[MAX_KEY_SIZE];
+        unsigned long long requests, error, gets, puts;
+        int fields = sscanf(partial, "%127s %llu %llu %llu %llu", key, &requests, &error, &gets, &puts);
+        partial[0] = '\0';
+        if (fields == 5) {
+            printf("%-32s %12llu %12llu %12llu %12llu\n", key, requests, error, gets, puts);
+        }
+        line = newline + 1;
+    }
+    strncat(partial, line, sizeof(partial) - strlen(partial) - 1);
 }
 
 // Client function to join the cluster
@@ -170,7 +663,7 @@ bool kv_client_join(int sockfd, const char* ip, int port) {
     
     // Create message
     Message msg;
-    msg.op_code = OP_NODE_JOIN;
+    kv_client_prepare(&msg, OP_NODE_JOIN);
     strncpy(msg.key, ip, MAX_KEY_SIZE - 1);
     msg.key[MAX_KEY_SIZE - 1] = '\0';
     snprintf(msg.value, MAX_VALUE_SIZE, "%d", port);
@@ -196,7 +689,7 @@ bool kv_client_leave(int sockfd, const char* ip, int port) {
     
     // Create message
     Message msg;
-    msg.op_code = OP_NODE_LEAVE;
+    kv_client_prepare(&msg, OP_NODE_LEAVE);
     strncpy(msg.key, ip, MAX_KEY_SIZE - 1);
     msg.key[MAX_KEY_SIZE - 1] = '\0';
     snprintf(msg.value, MAX_VALUE_SIZE, "%d", port);
@@ -214,18 +707,109 @@ bool kv_client_leave(int sockfd, const char* ip, int port) {
     return msg.status == 1;
 }
 
+// Look a keyspace up by name and send later requests to it
+static bool use_keyspace(int sockfd, const char* name) {
+    uint32_t id;
+    if (!kv_client_keyspace(sockfd, name, &id)) {
+        fprintf(stderr, "No keyspace named '%s'\n", name);
+        return false;
+    }
+    kv_client_set_keyspace(id);
+    return true;
+}
+
 // Sample client program
 int main(int argc, char* argv[]) {
     const char* server_ip = "127.0.0.1";
     int server_port = DEFAULT_PORT;
+    const char* batch_path = NULL;
+    const char* import_path = NULL;
+    const char* export_path = NULL;
+    const char* format = NULL;
+    const char* keyspace = NULL;
+    KVTransferOptions transfer;
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.parallel = KV_BATCH_PARALLEL;
+    transfer.pipeline = KV_BATCH_PIPELINE;
     
-    // Parse command line arguments
-    if (argc > 1) {
-        server_ip = argv[1];
+    // Parse command line arguments: the server address and port, then options
+    int positional = 0;
+    for (int i = 1; i < argc; i++) {
+        const char* next = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--batch") == 0 && next) {
+            batch_path = argv[++i];
+        } else if (strcmp(argv[i], "--import") == 0 && next) {
+            import_path = argv[++i];
+        } else if (strcmp(argv[i], "--export") == 0 && next) {
+            export_path = argv[++i];
+        } else if (strcmp(argv[i], "--format") == 0 && next) {
+            format = argv[++i];
+        } else if (strcmp(argv[i], "--parallel") == 0 && next) {
+            transfer.parallel = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pipeline") == 0 && next) {
+            transfer.pipeline = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--prefix") == 0 && next) {
+            transfer.prefix = argv[++i];
+        } else if (strcmp(argv[i], "--keyspace") == 0 && next) {
+            keyspace = argv[++i];
+        } else if (argv[i][0] != '-' && positional == 0) {
+            server_ip = argv[i];
+            positional++;
+        } else if (argv[i][0] != '-' && positional == 1) {
+            server_port = atoi(argv[i]);
+            positional++;
+        } else {
+            fprintf(stderr, "Usage: %s [ip] [port] [--keyspace NAME] [--batch FILE | --import FILE | --export FILE]\n"
+                    "       [--format tsv|csv] [--parallel N] [--pipeline N] [--prefix PREFIX]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (transfer.parallel < 1 || transfer.parallel > KV_BATCH_MAX_PARALLEL ||
+        transfer.pipeline < 1 || transfer.pipeline > KV_BATCH_MAX_PIPELINE) {
+        fprintf(stderr, "--parallel must be 1-%d and --pipeline 1-%d\n", KV_BATCH_MAX_PARALLEL, KV_BATCH_MAX_PIPELINE);
+        return 1;
+    }
+    
+    // Dumps are CSV if asked for or named .csv, tab-separated otherwise
+    const char* dump_path = import_path ? import_path : export_path;
+    const char* extension = dump_path ? strrchr(dump_path, '.') : NULL;
+    if (format ? strcmp(format, "csv") == 0 : (extension && strcmp(extension, ".csv") == 0)) {
+        transfer.format = KV_DUMP_CSV;
+    } else if (format && strcmp(format, "tsv") != 0) {
+        fprintf(stderr, "Unknown format: %s\n", format);
+        return 1;
+    }
+    
+    // Every request goes to the keyspace named, import and export ones included
+    if (keyspace) {
+        int sockfd = connect_to_server(server_ip, server_port);
+        if (sockfd < 0) {
+            fprintf(stderr, "Failed to connect to server at %s:%d\n", server_ip, server_port);
+            return 1;
+        }
+        bool found = use_keyspace(sockfd, keyspace);
+        close(sockfd);
+        if (!found) {
+            return 1;
+        }
     }
     
-    if (argc > 2) {
-        server_port = atoi(argv[2]);
+    // Import and export open connections of their own; "-" is stdin or stdout
+    if (import_path || export_path) {
+        transfer.ip = server_ip;
+        transfer.port = server_port;
+        bool to_stdio = strcmp(dump_path, "-") == 0;
+        FILE* file = to_stdio ? (import_path ? stdin : stdout) : fopen(dump_path, import_path ? "r" : "w");
+        if (!file) {
+            perror(dump_path);
+            return 1;
+        }
+        bool ok = import_path ? kv_import(file, &transfer) : kv_export(file, &transfer);
+        if (!to_stdio && fclose(file) != 0) {
+            perror(dump_path);
+            ok = false;
+        }
+        return ok ? 0 : 1;
     }
     
     // Connect to server
@@ -235,6 +819,22 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
+    // Run a script of commands instead of prompting
+    if (batch_path) {
+        FILE* in = strcmp(batch_path, "-") == 0 ? stdin : fopen(batch_path, "r");
+        if (!in) {
+            perror(batch_path);
+            close(sockfd);
+            return 1;
+        }
+        bool ok = kv_batch_run(sockfd, in, transfer.pipeline);
+        if (in != stdin) {
+            fclose(in);
+        }
+        close(sockfd);
+        return ok ? 0 : 1;
+    }
+    
     printf("Connected to server at %s:%d\n", server_ip, server_port);
     
     // Interactive command loop
@@ -244,7 +844,7 @@ int main(int argc, char* argv[]) {
     char buffer[MAX_VALUE_SIZE];
     
     while (1) {
-        printf("\nCommands: PUT, GET, DELETE, LIST, JOIN, LEAVE, QUIT\n");
+        printf("\nCommands: PUT, GET, DELETE, LIST, KEYS, SCAN, PREFIX, CAS, INCR, DECR, APPEND, GETSET, STATS, HOTKEYS, TRACE, USE, JOIN, LEAVE, QUIT\n");
         printf("> ");
         
         if (scanf("%19s", command) != 1) {
@@ -269,7 +869,7 @@ int main(int argc, char* argv[]) {
             }
             
             // Put key-value pair
-            if (kv_client_put(sockfd, key, value)) {
+            if (kv_client_put(sockfd, key, value, NULL)) {
                 printf("Successfully stored key '%s'\n", key);
             } else {
                 printf("Failed to store key '%s'\n", key);
@@ -283,8 +883,10 @@ int main(int argc, char* argv[]) {
             }
             
             // Get value
-            if (kv_client_get(sockfd, key, value)) {
+            uint64_t version;
+            if (kv_client_get(sockfd, key, value, &version)) {
                 printf("Value: %s\n", value);
+                printf("Version: %llu\n", (unsigned long long)version);
             } else {
                 printf("Key '%s' not found\n", key);
             }
@@ -304,11 +906,162 @@ int main(int argc, char* argv[]) {
             }
         } 
         else if (strcmp(command, "LIST") == 0) {
-            // List keys
-            if (kv_client_list_keys(sockfd, buffer, MAX_VALUE_SIZE)) {
-                printf("Keys:\n%s", buffer);
+            // Stream every key; older engines can only send the first page
+            int count = 0;
+            uint64_t cursor = 0;
+            printf("Keys:\n");
+            if (kv_client_scan_cursor(sockfd, &cursor, NULL, print_key, &count)) {
+                printf("(%d keys)\n", count);
+            } else if (count == 0 && kv_client_list_keys(sockfd, buffer, MAX_VALUE_SIZE)) {
+                printf("%s", buffer);
+            } else {
+                printf("Failed to list keys after %d keys (resume with KEYS from cursor %llu)\n", count,
+                       (unsigned long long)cursor);
+            }
+        } 
+        else if (strcmp(command, "KEYS") == 0) {
+            // Hash-order walk from a cursor, optionally under a prefix
+            unsigned long long start;
+            printf("Prefix (- for all): ");
+            if (scanf("%127s", key) != 1) {
+                continue;
+            }
+            
+            printf("Cursor (0 to start): ");
+            if (scanf("%llu", &start) != 1) {
+                continue;
+            }
+            
+            int count = 0;
+            uint64_t cursor = start;
+            printf("Keys:\n");
+            if (kv_client_scan_cursor(sockfd, &cursor, strcmp(key, "-") == 0 ? NULL : key, print_key, &count)) {
+                printf("(%d keys)\n", count);
+            } else {
+                printf("Walk failed after %d keys; resume from cursor %llu\n", count, (unsigned long long)cursor);
+            }
+        } 
+        else if (strcmp(command, "SCAN") == 0 || strcmp(command, "PREFIX") == 0) {
+            // Get the range; "-" leaves a bound open
+            int count = 0;
+            bool ok;
+            if (command[0] == 'S') {
+                printf("Start key (- for first): ");
+                if (scanf("%127s", key) != 1) {
+                    continue;
+                }
+                
+                printf("End key (- for last): ");
+                if (scanf("%127s", buffer) != 1) {
+                    continue;
+                }
+                
+                printf("Keys:\n");
+                ok = kv_client_scan(sockfd, strcmp(key, "-") == 0 ? NULL : key,
+                                    strcmp(buffer, "-") == 0 ? NULL : buffer, NULL, print_key, &count);
+            } else {
+                printf("Prefix: ");
+                if (scanf("%127s", key) != 1) {
+                    continue;
+                }
+                
+                printf("Keys:\n");
+                ok = kv_client_scan(sockfd, NULL, NULL, key, print_key, &count);
+            }
+            
+            if (ok) {
+                printf("(%d keys)\n", count);
+            } else {
+                printf("Scan failed after %d keys\n", count);
+            }
+        } 
+        else if (strcmp(command, "CAS") == 0) {
+            // Get key, expected version and new value
+            printf("Key: ");
+            if (scanf("%127s", key) != 1) {
+                continue;
+            }
+            
+            printf("Expected version (0 if absent): ");
+            unsigned long long expected_version;
+            if (scanf("%llu", &expected_version) != 1) {
+                continue;
+            }
+            
+            printf("Value: ");
+            if (scanf(" %1023[^\n]", value) != 1) {
+                continue;
+            }
+            
+            uint64_t version;
+            if (kv_client_cas(sockfd, key, expected_version, value, buffer, &version)) {
+                printf("Swapped key '%s', new version %llu\n", key, (unsigned long long)version);
+            } else {
+                printf("Version mismatch, current value '%s' at version %llu\n",
+                       buffer, (unsigned long long)version);
+            }
+        } 
+        else if (strcmp(command, "INCR") == 0 || strcmp(command, "DECR") == 0) {
+            // Get key and amount
+            printf("Key: ");
+            if (scanf("%127s", key) != 1) {
+                continue;
+            }
+            
+            printf("By: ");
+            long long delta;
+            if (scanf("%lld", &delta) != 1) {
+                continue;
+            }
+            if (command[0] == 'D') {
+                if (delta == LLONG_MIN) {
+                    printf("Delta out of range\n");
+                    continue;
+                }
+                delta = -delta;
+            }
+            
+            long long result;
+            if (kv_client_incr(sockfd, key, delta, &result)) {
+                printf("Value: %lld\n", result);
+            } else {
+                printf("Failed to update key '%s' (not an integer?)\n", key);
+            }
+        } 
+        else if (strcmp(command, "APPEND") == 0) {
+            // Get key and suffix
+            printf("Key: ");
+            if (scanf("%127s", key) != 1) {
+                continue;
+            }
+            
+            printf("Value: ");
+            if (scanf(" %1023[^\n]", value) != 1) {
+                continue;
+            }
+            
+            if (kv_client_append(sockfd, key, value, buffer)) {
+                printf("Value: %s\n", buffer);
+            } else {
+                printf("Failed to append to key '%s'\n", key);
+            }
+        } 
+        else if (strcmp(command, "GETSET") == 0) {
+            // Get key and new value
+            printf("Key: ");
+            if (scanf("%127s", key) != 1) {
+                continue;
+            }
+            
+            printf("Value: ");
+            if (scanf(" %1023[^\n]", value) != 1) {
+                continue;
+            }
+            
+            if (kv_client_getset(sockfd, key, value, buffer)) {
+                printf("Old value: %s\n", buffer);
             } else {
-                printf("Failed to list keys\n");
+                printf("Failed to set key '%s'\n", key);
             }
         } 
         else if (strcmp(command, "JOIN") == 0) {
@@ -351,6 +1104,39 @@ int main(int argc, char* argv[]) {
                 printf("Failed to leave cluster\n");
             }
         } 
+        else if (strcmp(command, "STATS") == 0) {
+            // Dump the server's metrics
+            if (!kv_client_stats(sockfd, print_text, NULL)) {
+                printf("Failed to get stats\n");
+            }
+        } 
+        else if (strcmp(command, "HOTKEYS") == 0) {
+            // Most requested keys with estimated request counts
+            printf("%-32s %12s %12s %12s %12s\n", "Key", "Requests", "Error", "Gets", "Puts");
+            if (!kv_client_hot_keys(sockfd, print_hot_keys, NULL)) {
+                printf("Failed to get hot keys\n");
+            }
+        } 
+        else if (strcmp(command, "TRACE") == 0) {
+            // Have the server write out its request trace
+            char path[MAX_VALUE_SIZE];
+            if (kv_client_trace(sockfd, path, sizeof(path))) {
+                printf("Trace written on the server to %s\n", path);
+            } else {
+                printf("Failed to dump trace (is the server built with TRACING=1?)\n");
+            }
+        } 
+        else if (strcmp(command, "USE") == 0) {
+            // Switch keyspace; "default" is the server's own
+            printf("Keyspace: ");
+            if (scanf("%127s", key) != 1) {
+                continue;
+            }
+            
+            if (use_keyspace(sockfd, key)) {
+                printf("Using keyspace '%s'\n", key);
+            }
+        } 
         else if (strcmp(command, "QUIT") == 0) {
             break;
         } 
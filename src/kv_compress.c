@@ -0,0 +1,201 @@
+#include "kv_store.h"
+
+// Value compression in the LZ4 block format
+//
+// The compressor is the greedy single-probe one from the LZ4 reference
+// design: a hash of the next four bytes finds the last position with the
+// same hash, and a match is taken whenever those four bytes agree. The
+// output is a plain LZ4 block, so any LZ4 decoder can read it. Inputs are
+// values or snapshot blocks of at most KV_SNAPSHOT_BLOCK_SIZE bytes, so the
+// hash table lives on the stack and few matches fall outside LZ4's 64 KB
+// window.
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5        // A block always ends with this many literals
+#define LZ4_MFLIMIT 12             // No match may start this close to the end
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+
+static inline uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned int lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+// Write a length continuation: runs of 255 then the remainder
+static inline bool write_length(uint8_t** out, const uint8_t* out_end, size_t len) {
+    while (len >= 255) {
+        if (*out >= out_end) {
+            return false;
+        }
+        *(*out)++ = 255;
+        len -= 255;
+    }
+    if (*out >= out_end) {
+        return false;
+    }
+    *(*out)++ = (uint8_t)len;
+    return true;
+}
+
+// Write one sequence; match_len 0 writes the final literals-only sequence
+static bool write_sequence(uint8_t** out, const uint8_t* out_end, const uint8_t* literals, size_t literal_len,
+                           size_t offset, size_t match_len) {
+    if (*out >= out_end) {
+        return false;
+    }
+    uint8_t* token = (*out)++;
+    *token = (uint8_t)((literal_len < 15 ? literal_len : 15) << 4);
+    if (literal_len >= 15 && !write_length(out, out_end, literal_len - 15)) {
+        return false;
+    }
+
+    if ((size_t)(out_end - *out) < literal_len) {
+        return false;
+    }
+    memcpy(*out, literals, literal_len);
+    *out += literal_len;
+
+    if (match_len == 0) {
+        return true;
+    }
+
+    if (out_end - *out < 2) {
+        return false;
+    }
+    *(*out)++ = (uint8_t)offset;
+    *(*out)++ = (uint8_t)(offset >> 8);
+
+    size_t extra = match_len - LZ4_MIN_MATCH;
+    *token |= (uint8_t)(extra < 15 ? extra : 15);
+    return extra < 15 || write_length(out, out_end, extra - 15);
+}
+
+// Compress src into dst; returns the compressed size, or 0 if it would not
+// fit in dst_capacity bytes
+int kv_lz4_compress(const char* src, int src_len, char* dst, int dst_capacity) {
+    const uint8_t* in = (const uint8_t*)src;
+    const uint8_t* in_end = in + src_len;
+    const uint8_t* anchor = in;
+    uint8_t* out = (uint8_t*)dst;
+    const uint8_t* out_end = out + dst_capacity;
+
+    if (src_len > LZ4_MFLIMIT) {
+        uint32_t table[1 << LZ4_HASH_BITS];
+        memset(table, 0, sizeof(table));
+
+        const uint8_t* match_limit = in_end - LZ4_MFLIMIT;
+        const uint8_t* match_end_limit = in_end - LZ4_LAST_LITERALS;
+        const uint8_t* ip = in + 1;
+
+        while (ip < match_limit) {
+            uint32_t sequence = read32(ip);
+            unsigned int h = lz4_hash(sequence);
+            const uint8_t* ref = in + table[h];
+            table[h] = (uint32_t)(ip - in);
+
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != sequence) {
+                ip++;
+                continue;
+            }
+
+            // Grow the match backwards over pending literals, then forwards
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            size_t match_len = LZ4_MIN_MATCH;
+            while (ip + match_len < match_end_limit && ip[match_len] == ref[match_len]) {
+                match_len++;
+            }
+
+            if (!write_sequence(&out, out_end, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), match_len)) {
+                return 0;
+            }
+            ip += match_len;
+            anchor = ip;
+
+            if (ip < match_limit) {
+                table[lz4_hash(read32(ip - 2))] = (uint32_t)(ip - 2 - in);
+            }
+        }
+    }
+
+    if (!write_sequence(&out, out_end, anchor, (size_t)(in_end - anchor), 0, 0)) {
+        return 0;
+    }
+    return (int)(out - (uint8_t*)dst);
+}
+
+// Read a length continuation
+static inline bool read_length(const uint8_t** in, const uint8_t* in_end, size_t* len) {
+    uint8_t b;
+    do {
+        if (*in >= in_end) {
+            return false;
+        }
+        b = *(*in)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decompress an LZ4 block into dst; returns the decompressed size, or -1 if
+// the block is malformed or does not fit in dst_capacity bytes
+int kv_lz4_decompress(const char* src, int src_len, char* dst, int dst_capacity) {
+    const uint8_t* in = (const uint8_t*)src;
+    const uint8_t* in_end = in + src_len;
+    uint8_t* out = (uint8_t*)dst;
+    uint8_t* out_end = out + dst_capacity;
+
+    while (in < in_end) {
+        uint8_t token = *in++;
+
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && !read_length(&in, in_end, &literal_len)) {
+            return -1;
+        }
+        if (literal_len > (size_t)(in_end - in) || literal_len > (size_t)(out_end - out)) {
+            return -1;
+        }
+        memcpy(out, in, literal_len);
+        in += literal_len;
+        out += literal_len;
+
+        // The last sequence has no match
+        if (in == in_end) {
+            break;
+        }
+
+        if (in_end - in < 2) {
+            return -1;
+        }
+        size_t offset = (size_t)in[0] | ((size_t)in[1] << 8);
+        in += 2;
+        if (offset == 0 || offset > (size_t)(out - (uint8_t*)dst)) {
+            return -1;
+        }
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && !read_length(&in, in_end, &match_len)) {
+            return -1;
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > (size_t)(out_end - out)) {
+            return -1;
+        }
+
+        // Matches may overlap their own output, so copy forwards a byte at a time
+        const uint8_t* ref = out - offset;
+        for (size_t i = 0; i < match_len; i++) {
+            out[i] = ref[i];
+        }
+        out += match_len;
+    }
+
+    return (int)(out - (uint8_t*)dst);
+}
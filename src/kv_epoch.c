@@ -0,0 +1,191 @@
+#include "kv_store.h"
+#include <sched.h>
+
+// Epoch-based reclamation
+//
+// Readers announce the global epoch in a per-thread slot while they hold
+// pointers into shared structures. Writers unlink objects and retire them
+// with the epoch current at the time; an object is freed only once the
+// global epoch has moved two steps past that, which cannot happen while any
+// reader that might still see it is inside its critical section.
+
+#define KV_EPOCH_RECLAIM_BATCH 64  // Retired objects between reclaim attempts
+
+// Per-thread announcement, padded so readers never share a cache line
+typedef struct {
+    _Atomic uint64_t epoch;   // 0 = quiescent, otherwise the epoch entered
+    _Atomic bool in_use;      // Slot is owned by a live thread
+    char pad[64 - sizeof(uint64_t) - sizeof(bool)];
+} __attribute__((aligned(64))) EpochSlot;
+
+// Object waiting for a grace period
+typedef struct RetiredObject {
+    void* ptr;
+    void (*free_fn)(void*);
+    uint64_t epoch;
+    struct RetiredObject* next;
+} RetiredObject;
+
+static EpochSlot epoch_slots[KV_EPOCH_MAX_THREADS];
+static _Atomic int epoch_slot_high = 0;        // Slots below this may be in use
+static _Atomic uint64_t global_epoch = 1;
+
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+static RetiredObject* retired_list = NULL;
+static int retired_count = 0;
+static int reclaim_at = KV_EPOCH_RECLAIM_BATCH;  // Count that triggers the next attempt
+
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t epoch_key;
+
+static __thread int thread_slot = -1;
+static __thread int thread_depth = 0;
+
+// Release a thread's slot when it exits
+static void release_slot(void* arg) {
+    EpochSlot* slot = (EpochSlot*)arg;
+    atomic_store(&slot->epoch, 0);
+    atomic_store(&slot->in_use, false);
+}
+
+static void create_epoch_key(void) {
+    pthread_key_create(&epoch_key, release_slot);
+}
+
+// Claim a slot for the calling thread
+static int acquire_slot(void) {
+    pthread_once(&epoch_key_once, create_epoch_key);
+
+    while (1) {
+        for (int i = 0; i < KV_EPOCH_MAX_THREADS; i++) {
+            bool expected = false;
+            if (!atomic_load_explicit(&epoch_slots[i].in_use, memory_order_relaxed) &&
+                atomic_compare_exchange_strong(&epoch_slots[i].in_use, &expected, true)) {
+                // Widen the scan range for reclaimers if needed
+                int high = atomic_load(&epoch_slot_high);
+                while (high < i + 1 && !atomic_compare_exchange_weak(&epoch_slot_high, &high, i + 1)) {
+                }
+
+                pthread_setspecific(epoch_key, &epoch_slots[i]);
+                return i;
+            }
+        }
+
+        // Every slot is taken; wait for a thread to exit
+        sched_yield();
+    }
+}
+
+// Enter a read-side critical section; calls may nest
+void kv_epoch_enter(void) {
+    if (thread_depth++ > 0) {
+        return;
+    }
+
+    if (thread_slot < 0) {
+        thread_slot = acquire_slot();
+    }
+
+    // The announcement must be visible before any shared pointer is loaded
+    atomic_store(&epoch_slots[thread_slot].epoch, atomic_load(&global_epoch));
+}
+
+// Leave a read-side critical section
+void kv_epoch_exit(void) {
+    if (--thread_depth > 0) {
+        return;
+    }
+
+    atomic_store_explicit(&epoch_slots[thread_slot].epoch, 0, memory_order_release);
+}
+
+// Advance the global epoch if every active reader has caught up with it
+static uint64_t try_advance(void) {
+    uint64_t current = atomic_load(&global_epoch);
+    int high = atomic_load(&epoch_slot_high);
+
+    for (int i = 0; i < high; i++) {
+        uint64_t announced = atomic_load(&epoch_slots[i].epoch);
+        if (announced != 0 && announced != current) {
+            return current;
+        }
+    }
+
+    atomic_compare_exchange_strong(&global_epoch, &current, current + 1);
+    return atomic_load(&global_epoch);
+}
+
+// Free every retired object whose grace period has passed (caller holds retired_lock)
+static RetiredObject* collect_expired(uint64_t epoch) {
+    RetiredObject* expired = NULL;
+    RetiredObject** link = &retired_list;
+
+    while (*link) {
+        RetiredObject* object = *link;
+        if (object->epoch + 2 <= epoch) {
+            *link = object->next;
+            object->next = expired;
+            expired = object;
+            retired_count--;
+        } else {
+            link = &object->next;
+        }
+    }
+
+    return expired;
+}
+
+// Free a batch of objects outside the lock
+static void free_objects(RetiredObject* object) {
+    while (object) {
+        RetiredObject* next = object->next;
+        object->free_fn(object->ptr);
+        free(object);
+        object = next;
+    }
+}
+
+// Hand an unlinked object over for freeing once no reader can still see it
+void kv_epoch_retire(void* ptr, void (*free_fn)(void*)) {
+    if (!ptr) {
+        return;
+    }
+
+    RetiredObject* object = (RetiredObject*)malloc(sizeof(RetiredObject));
+    if (!object) {
+        // Leaking is safer than freeing under a reader
+        return;
+    }
+
+    object->ptr = ptr;
+    object->free_fn = free_fn;
+    object->epoch = atomic_load(&global_epoch);
+
+    pthread_mutex_lock(&retired_lock);
+    object->next = retired_list;
+    retired_list = object;
+    retired_count++;
+
+    RetiredObject* expired = NULL;
+    if (retired_count >= reclaim_at) {
+        // Objects still in their grace period stay on the list; wait for
+        // another batch before walking it again
+        expired = collect_expired(try_advance());
+        reclaim_at = retired_count + KV_EPOCH_RECLAIM_BATCH;
+    }
+    pthread_mutex_unlock(&retired_lock);
+
+    free_objects(expired);
+}
+
+// Free everything still waiting; only safe once no readers remain
+void kv_epoch_drain(void) {
+    pthread_mutex_lock(&retired_lock);
+    RetiredObject* pending = retired_list;
+    retired_list = NULL;
+    retired_count = 0;
+    reclaim_at = KV_EPOCH_RECLAIM_BATCH;
+    pthread_mutex_unlock(&retired_lock);
+
+    free_objects(pending);
+}
@@ -0,0 +1,213 @@
+#include "kv_store.h"
+
+// Key filters
+//
+// The blocked Bloom filter maps a key to one 64-byte block with the high
+// half of its hash and sets its probe bits inside that block by double
+// hashing the low half, so a lookup costs one cache miss whatever the
+// filter size. At 10 bits per key it gives about 1% false positives, a
+// little more than a flat filter of the same size.
+//
+// The cuckoo filter keeps a 16-bit fingerprint of each key in one of two
+// buckets of four slots; the second bucket is derived from the first and
+// the fingerprint, so a fingerprint can be moved to make room without its
+// key. For the memory it has a far lower false-positive rate than a Bloom
+// filter, and it knows when it is full. Writers are serialized by the
+// caller.
+// Readers take no lock: an insert that has to move fingerprints makes the
+// sequence count odd while they are in flight, and a reader that would
+// answer "absent" retries if the count moved under it. Once an insert fails
+// the filter is full and answers "may contain" for every key; the owner
+// replaces it with a larger one.
+
+#define BLOOM_BLOCK_BITS (KV_BLOOM_BLOCK * 8)
+#define CUCKOO_LOAD 90             // Percent of slots a new filter is sized to fill
+
+// Filter bytes for this many keys, in whole blocks
+size_t kv_bloom_bytes(uint64_t keys, int bits_per_key) {
+    uint64_t blocks = (keys * (uint64_t)bits_per_key + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+    return (size_t)(blocks > 0 ? blocks : 1) * KV_BLOOM_BLOCK;
+}
+
+// Probes that minimize false positives: ln 2 times the bits per key
+int kv_bloom_probes(int bits_per_key) {
+    int probes = bits_per_key * 69 / 100;
+    return probes < 1 ? 1 : (probes > 16 ? 16 : probes);
+}
+
+static inline const uint8_t* bloom_block(const uint8_t* bloom, size_t bytes, uint64_t hash) {
+    uint64_t blocks = bytes / KV_BLOOM_BLOCK;
+    return bloom + ((hash >> 32) * blocks >> 32) * KV_BLOOM_BLOCK;
+}
+
+void kv_bloom_add(uint8_t* bloom, size_t bytes, int probes, uint64_t hash) {
+    uint8_t* block = (uint8_t*)bloom_block(bloom, bytes, hash);
+    uint32_t h = (uint32_t)hash;
+    uint32_t delta = (h >> 17) | (h << 15);
+    for (int i = 0; i < probes; i++) {
+        uint32_t bit = h % BLOOM_BLOCK_BITS;
+        block[bit / 8] |= (uint8_t)(1 << (bit % 8));
+        h += delta;
+    }
+}
+
+bool kv_bloom_may_contain(const uint8_t* bloom, size_t bytes, int probes, uint64_t hash) {
+    const uint8_t* block = bloom_block(bloom, bytes, hash);
+    uint32_t h = (uint32_t)hash;
+    uint32_t delta = (h >> 17) | (h << 15);
+    for (int i = 0; i < probes; i++) {
+        uint32_t bit = h % BLOOM_BLOCK_BITS;
+        if (!(block[bit / 8] & (1 << (bit % 8)))) {
+            return false;
+        }
+        h += delta;
+    }
+    return true;
+}
+
+// Cuckoo filter
+
+struct KVCuckoo {
+    _Atomic uint16_t* slots;   // KV_CUCKOO_SLOTS per bucket; 0 is empty
+    uint32_t mask;             // Buckets minus one
+    _Atomic uint32_t seq;      // Odd while an insert is moving fingerprints
+    _Atomic bool full;         // An insert failed; every key may be present
+    uint64_t count;            // Fingerprints held (writers only)
+    uint32_t rng;
+};
+
+static inline uint16_t fingerprint(uint64_t hash) {
+    uint16_t fp = (uint16_t)(hash >> 32);
+    return fp ? fp : 1;
+}
+
+static inline uint32_t alt_bucket(const struct KVCuckoo* filter, uint32_t bucket, uint16_t fp) {
+    return (bucket ^ (fp * 0x5bd1e995U)) & filter->mask;
+}
+
+struct KVCuckoo* kv_cuckoo_create(uint64_t keys) {
+    uint64_t want = keys * 100 / (KV_CUCKOO_SLOTS * CUCKOO_LOAD) + 1;
+    uint64_t buckets = 1;
+    while (buckets < want && buckets < (1ULL << 31)) {
+        buckets <<= 1;
+    }
+
+    struct KVCuckoo* filter = (struct KVCuckoo*)calloc(1, sizeof(struct KVCuckoo));
+    _Atomic uint16_t* slots = (_Atomic uint16_t*)calloc(buckets * KV_CUCKOO_SLOTS, sizeof(_Atomic uint16_t));
+    if (!filter || !slots) {
+        free(filter);
+        free(slots);
+        return NULL;
+    }
+
+    filter->slots = slots;
+    filter->mask = (uint32_t)(buckets - 1);
+    atomic_init(&filter->seq, 0);
+    atomic_init(&filter->full, false);
+    filter->rng = (uint32_t)(uintptr_t)filter | 1;
+    return filter;
+}
+
+void kv_cuckoo_free(struct KVCuckoo* filter) {
+    if (filter) {
+        free(filter->slots);
+        free(filter);
+    }
+}
+
+static bool bucket_insert(struct KVCuckoo* filter, uint32_t bucket, uint16_t fp) {
+    _Atomic uint16_t* slot = &filter->slots[(size_t)bucket * KV_CUCKOO_SLOTS];
+    for (int i = 0; i < KV_CUCKOO_SLOTS; i++) {
+        if (atomic_load_explicit(&slot[i], memory_order_relaxed) == 0) {
+            atomic_store_explicit(&slot[i], fp, memory_order_release);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool bucket_contains(struct KVCuckoo* filter, uint32_t bucket, uint16_t fp) {
+    _Atomic uint16_t* slot = &filter->slots[(size_t)bucket * KV_CUCKOO_SLOTS];
+    for (int i = 0; i < KV_CUCKOO_SLOTS; i++) {
+        if (atomic_load_explicit(&slot[i], memory_order_relaxed) == fp) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Add a key; false once the filter is full
+bool kv_cuckoo_add(struct KVCuckoo* filter, uint64_t hash) {
+    if (atomic_load_explicit(&filter->full, memory_order_relaxed)) {
+        return false;
+    }
+
+    uint16_t fp = fingerprint(hash);
+    uint32_t bucket = (uint32_t)hash & filter->mask;
+    uint32_t other = alt_bucket(filter, bucket, fp);
+    if (bucket_insert(filter, bucket, fp) || bucket_insert(filter, other, fp)) {
+        filter->count++;
+        return true;
+    }
+
+    // Both buckets are full: evict fingerprints to their other bucket until
+    // one lands in a free slot
+    uint32_t seq = atomic_load_explicit(&filter->seq, memory_order_relaxed);
+    atomic_store_explicit(&filter->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    bool placed = false;
+    bucket = (filter->rng & 1) ? bucket : other;
+    for (int kick = 0; kick < KV_CUCKOO_MAX_KICKS && !placed; kick++) {
+        filter->rng ^= filter->rng << 13;
+        filter->rng ^= filter->rng >> 17;
+        filter->rng ^= filter->rng << 5;
+        _Atomic uint16_t* slot = &filter->slots[(size_t)bucket * KV_CUCKOO_SLOTS + filter->rng % KV_CUCKOO_SLOTS];
+        uint16_t victim = atomic_load_explicit(slot, memory_order_relaxed);
+        atomic_store_explicit(slot, fp, memory_order_relaxed);
+        fp = victim;
+        bucket = alt_bucket(filter, bucket, fp);
+        placed = bucket_insert(filter, bucket, fp);
+    }
+
+    if (placed) {
+        filter->count++;
+    } else {
+        // A fingerprint is left homeless, so no answer can be "absent" any more
+        atomic_store_explicit(&filter->full, true, memory_order_relaxed);
+    }
+    atomic_store_explicit(&filter->seq, seq + 2, memory_order_release);
+    return placed;
+}
+
+// False only if the key was never added; safe against a concurrent writer
+bool kv_cuckoo_may_contain(struct KVCuckoo* filter, uint64_t hash) {
+    uint16_t fp = fingerprint(hash);
+    uint32_t bucket = (uint32_t)hash & filter->mask;
+    uint32_t other = alt_bucket(filter, bucket, fp);
+
+    while (true) {
+        uint32_t seq = atomic_load_explicit(&filter->seq, memory_order_acquire);
+        if ((seq & 1) || atomic_load_explicit(&filter->full, memory_order_relaxed) ||
+            bucket_contains(filter, bucket, fp) || bucket_contains(filter, other, fp)) {
+            return true;
+        }
+        // A miss only counts if no fingerprint moved while we looked
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&filter->seq, memory_order_relaxed) == seq) {
+            return false;
+        }
+    }
+}
+
+bool kv_cuckoo_full(struct KVCuckoo* filter) {
+    return atomic_load_explicit(&filter->full, memory_order_relaxed);
+}
+
+uint64_t kv_cuckoo_count(const struct KVCuckoo* filter) {
+    return filter->count;
+}
+
+size_t kv_cuckoo_bytes(const struct KVCuckoo* filter) {
+    return sizeof(struct KVCuckoo) + ((size_t)filter->mask + 1) * KV_CUCKOO_SLOTS * sizeof(uint16_t);
+}
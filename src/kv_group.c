@@ -0,0 +1,89 @@
+#include "kv_store.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KV_GROUP_X86 1
+#endif
+
+// Control-byte group matching
+//
+// A table keeps one control byte per slot and probes a group of them at a
+// time. The vector versions compare a whole group against the tag with one
+// instruction and turn the result into a bitmask with movemask; the
+// scalar version walks the bytes. The widest version the CPU supports is
+// picked once, before the first table is built, and every table in the
+// process is probed with it.
+
+static uint32_t match_scalar(const uint8_t* group, uint8_t tag, uint32_t* empty) {
+    uint32_t match = 0;
+    uint32_t free_empty = 0;
+    for (unsigned int i = 0; i < 16; i++) {
+        match |= (uint32_t)(group[i] == tag) << i;
+        free_empty |= (uint32_t)(group[i] == KV_CTRL_EMPTY) << i;
+    }
+    *empty = free_empty;
+    return match;
+}
+
+static uint32_t free_scalar(const uint8_t* group) {
+    uint32_t mask = 0;
+    for (unsigned int i = 0; i < 16; i++) {
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    }
+    return mask;
+}
+
+static const KVGroupOps group_scalar = { 16, "scalar", match_scalar, free_scalar };
+
+#ifdef KV_GROUP_X86
+
+__attribute__((target("sse2")))
+static uint32_t match_sse2(const uint8_t* group, uint8_t tag, uint32_t* empty) {
+    __m128i ctrl = _mm_load_si128((const __m128i*)group);
+    *empty = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)KV_CTRL_EMPTY)));
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)tag)));
+}
+
+// Empty and deleted bytes are the ones with the top bit set
+__attribute__((target("sse2")))
+static uint32_t free_sse2(const uint8_t* group) {
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i*)group));
+}
+
+__attribute__((target("avx2")))
+static uint32_t match_avx2(const uint8_t* group, uint8_t tag, uint32_t* empty) {
+    __m256i ctrl = _mm256_load_si256((const __m256i*)group);
+    *empty = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8((char)KV_CTRL_EMPTY)));
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8((char)tag)));
+}
+
+__attribute__((target("avx2")))
+static uint32_t free_avx2(const uint8_t* group) {
+    return (uint32_t)_mm256_movemask_epi8(_mm256_load_si256((const __m256i*)group));
+}
+
+static const KVGroupOps group_sse2 = { 16, "sse2", match_sse2, free_sse2 };
+static const KVGroupOps group_avx2 = { 32, "avx2", match_avx2, free_avx2 };
+
+#endif
+
+static const KVGroupOps* group_ops = NULL;
+static pthread_once_t group_once = PTHREAD_ONCE_INIT;
+
+static void group_select(void) {
+    group_ops = &group_scalar;
+#ifdef KV_GROUP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        group_ops = &group_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        group_ops = &group_sse2;
+    }
+#endif
+}
+
+// The group functions for this CPU
+const KVGroupOps* kv_group_ops(void) {
+    pthread_once(&group_once, group_select);
+    return group_ops;
+}
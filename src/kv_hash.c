@@ -0,0 +1,196 @@
+#include "kv_store.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define KV_CRC_X86 1
+#endif
+
+// Key hashing
+//
+// Keys are hashed with wyhash (final version 4): eight bytes at a time,
+// folded with 64x64->128-bit multiplies, so short keys cost a handful of
+// instructions and long keys are read a word at a time. The seed is shared
+// by the whole cluster because it decides which node owns each key.
+// Multi-byte reads are little-endian on every host so that nodes of
+// different architectures agree on placement.
+
+static const uint64_t wyp[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL, 0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static uint64_t hash_seed = KV_HASH_DEFAULT_SEED;
+static bool hash_seed_set = false;
+
+// 64x64 -> 128-bit multiply, returning the low and high halves
+static inline void wymum(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32);
+    uint64_t c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    *a = lo;
+    *b = hi;
+#endif
+}
+
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+    wymum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint64_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+// One to three bytes, read as first, middle and last
+static inline uint64_t read_small(const uint8_t* p, size_t k) {
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+uint64_t kv_hash(const void* data, size_t len, uint64_t seed) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint64_t a, b;
+
+    seed ^= wymix(seed ^ wyp[0], wyp[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (read32(p) << 32) | read32(p + ((len >> 3) << 2));
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = read_small(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            // Three independent lanes keep the multipliers busy on long keys
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymix(read64(p) ^ wyp[1], read64(p + 8) ^ seed);
+                see1 = wymix(read64(p + 16) ^ wyp[2], read64(p + 24) ^ see1);
+                see2 = wymix(read64(p + 32) ^ wyp[3], read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wymix(read64(p) ^ wyp[1], read64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+
+    a ^= wyp[1];
+    b ^= seed;
+    wymum(&a, &b);
+    return wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+}
+
+// Hash a key with the cluster seed. Requests hash their key once and pass
+// the result to routing and to the store.
+uint64_t kv_key_hash(const char* key) {
+    return kv_hash(key, strlen(key), hash_seed);
+}
+
+// Set the cluster seed; every node must use the same one
+void kv_hash_set_seed(uint64_t seed) {
+    hash_seed = seed;
+    hash_seed_set = true;
+}
+
+uint64_t kv_hash_get_seed(void) {
+    return hash_seed;
+}
+
+// Whether a seed was chosen explicitly rather than left at the default
+bool kv_hash_seed_is_set(void) {
+    return hash_seed_set;
+}
+
+// CRC32C
+//
+// Checksums use the Castagnoli polynomial, which SSE4.2 computes eight bytes
+// per instruction. Other CPUs use a byte-at-a-time table built on first
+// use. Both give the same result, so files move freely between hosts.
+
+#define CRC32C_POLY 0x82f63b78U    // Reflected Castagnoli polynomial
+
+static uint32_t crc_table[256];
+static uint32_t (*crc_update)(uint32_t crc, const uint8_t* p, size_t len) = NULL;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc_update_table(uint32_t crc, const uint8_t* p, size_t len) {
+    while (len--) {
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef KV_CRC_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc_update_sse42(uint32_t crc, const uint8_t* p, size_t len) {
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0U - (crc & 1)));
+        }
+        crc_table[i] = crc;
+    }
+
+    crc_update = crc_update_table;
+#ifdef KV_CRC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_update = crc_update_sse42;
+    }
+#endif
+}
+
+// Extend a CRC32C over more data; chunks can be fed one after another
+uint32_t kv_crc32c(uint32_t crc, const void* data, size_t len) {
+    pthread_once(&crc_once, crc_init);
+    return ~crc_update(~crc, (const uint8_t*)data, len);
+}
@@ -0,0 +1,133 @@
+#include "kv_store.h"
+
+// Hot-key tracking with the space-saving algorithm
+//
+// The summary holds a fixed number of keys. A sampled key that is already
+// tracked has its count bumped; otherwise it replaces the key with the
+// lowest count and inherits that count as its possible overestimate.
+// Sampling keeps the lock off almost every request, and a sample that finds
+// the lock taken is skipped rather than waited for.
+
+typedef struct {
+    unsigned int hash;
+    char key[MAX_KEY_SIZE];
+    uint64_t count;            // Sampled requests, including the inherited error
+    uint64_t error;            // Upper bound on how much count overstates
+    uint64_t gets;             // Sampled GETs and PUTs since the key was tracked
+    uint64_t puts;
+} HotKey;
+
+static HotKey hot_keys[KV_HOTKEYS_CAPACITY];
+static int hot_count = 0;
+static pthread_mutex_t hot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Atomic unsigned int sample_rate = KV_HOTKEYS_SAMPLE;
+static __thread unsigned int sample_tick = 0;
+
+// Count one request in every rate; 0 turns tracking off
+void kv_hotkeys_set_sample_rate(unsigned int rate) {
+    atomic_store(&sample_rate, rate);
+}
+
+void kv_hotkeys_sample(OperationCode op, const char* key) {
+    if (op != OP_GET && op != OP_PUT) {
+        return;
+    }
+
+    unsigned int rate = atomic_load_explicit(&sample_rate, memory_order_relaxed);
+    if (rate == 0 || ++sample_tick < rate) {
+        return;
+    }
+    sample_tick = 0;
+
+    // The key has not been validated yet, so stay within the key field
+    unsigned int hash = (unsigned int)kv_hash(key, strnlen(key, MAX_KEY_SIZE - 1), kv_hash_get_seed());
+    if (pthread_mutex_trylock(&hot_lock) != 0) {
+        return;
+    }
+
+    HotKey* entry = NULL;
+    HotKey* lowest = NULL;
+    for (int i = 0; i < hot_count; i++) {
+        if (hot_keys[i].hash == hash && strncmp(hot_keys[i].key, key, MAX_KEY_SIZE) == 0) {
+            entry = &hot_keys[i];
+            break;
+        }
+        if (!lowest || hot_keys[i].count < lowest->count) {
+            lowest = &hot_keys[i];
+        }
+    }
+
+    if (!entry) {
+        if (hot_count < KV_HOTKEYS_CAPACITY) {
+            entry = &hot_keys[hot_count++];
+            entry->count = 0;
+            entry->error = 0;
+        } else {
+            // Evict the coldest key; the newcomer may have been it all along
+            entry = lowest;
+            entry->error = entry->count;
+        }
+        entry->hash = hash;
+        strncpy(entry->key, key, MAX_KEY_SIZE - 1);
+        entry->key[MAX_KEY_SIZE - 1] = '\0';
+        entry->gets = 0;
+        entry->puts = 0;
+    }
+
+    entry->count++;
+    if (op == OP_GET) {
+        entry->gets++;
+    } else {
+        entry->puts++;
+    }
+
+    pthread_mutex_unlock(&hot_lock);
+}
+
+static int compare_hot_keys(const void* a, const void* b) {
+    const HotKey* x = (const HotKey*)a;
+    const HotKey* y = (const HotKey*)b;
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return strcmp(x->key, y->key);
+}
+
+// Render the tracked keys, hottest first, with counts scaled back up by the
+// sample rate; the caller frees the result
+char* kv_hotkeys_render(void) {
+    HotKey* keys = (HotKey*)malloc(sizeof(HotKey) * KV_HOTKEYS_CAPACITY);
+    if (!keys) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&hot_lock);
+    int count = hot_count;
+    memcpy(keys, hot_keys, sizeof(HotKey) * count);
+    pthread_mutex_unlock(&hot_lock);
+
+    qsort(keys, count, sizeof(HotKey), compare_hot_keys);
+
+    size_t size = (size_t)count * (MAX_KEY_SIZE + 96) + 1;
+    char* text = (char*)malloc(size);
+    if (!text) {
+        free(keys);
+        return NULL;
+    }
+
+    unsigned long long rate = atomic_load(&sample_rate);
+    if (rate == 0) {
+        rate = 1;
+    }
+    size_t len = 0;
+    text[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        len += snprintf(text + len, size - len, "%s %llu %llu %llu %llu\n", keys[i].key,
+                        (unsigned long long)keys[i].count * rate, (unsigned long long)keys[i].error * rate,
+                        (unsigned long long)keys[i].gets * rate, (unsigned long long)keys[i].puts * rate);
+    }
+
+    free(keys);
+    return text;
+}
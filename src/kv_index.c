@@ -0,0 +1,175 @@
+#include "kv_store.h"
+
+// Pick a random level for a new node (p = 1/4 per level)
+static int random_level(KVIndex* index) {
+    int level = 1;
+
+    // xorshift keeps this cheap and avoids the global rand() state
+    while (level < KV_INDEX_MAX_LEVEL) {
+        index->seed ^= index->seed << 13;
+        index->seed ^= index->seed >> 17;
+        index->seed ^= index->seed << 5;
+        if ((index->seed & 3) != 0) {
+            break;
+        }
+        level++;
+    }
+
+    return level;
+}
+
+// Allocate a node with its tower of next pointers and a copy of the key
+static KVIndexNode* create_node(int level, const char* key) {
+    size_t key_len = key ? strlen(key) : 0;
+    KVIndexNode* node = (KVIndexNode*)malloc(sizeof(KVIndexNode) +
+                                             sizeof(KVIndexNode*) * level + key_len + 1);
+    if (!node) {
+        return NULL;
+    }
+
+    node->level = level;
+    for (int i = 0; i < level; i++) {
+        node->next[i] = NULL;
+    }
+
+    // The key lives right after the tower
+    node->key = (char*)&node->next[level];
+    if (key) {
+        memcpy(node->key, key, key_len + 1);
+    } else {
+        node->key[0] = '\0';
+    }
+
+    return node;
+}
+
+// Initialize an empty ordered index
+KVIndex* kv_index_init() {
+    KVIndex* index = (KVIndex*)malloc(sizeof(KVIndex));
+    if (!index) {
+        return NULL;
+    }
+
+    index->head = create_node(KV_INDEX_MAX_LEVEL, NULL);
+    if (!index->head) {
+        free(index);
+        return NULL;
+    }
+
+    index->level = 1;
+    index->count = 0;
+    index->seed = 0x9E3779B9u;
+
+    return index;
+}
+
+// Clean up the index and all of its nodes
+void kv_index_destroy(KVIndex* index) {
+    if (!index) {
+        return;
+    }
+
+    KVIndexNode* node = index->head;
+    while (node) {
+        KVIndexNode* next = node->next[0];
+        free(node);
+        node = next;
+    }
+
+    free(index);
+}
+
+// Find the rightmost node before key on every level
+static KVIndexNode* find_predecessors(KVIndex* index, const char* key, KVIndexNode** update) {
+    KVIndexNode* node = index->head;
+
+    for (int i = index->level - 1; i >= 0; i--) {
+        while (node->next[i] && strcmp(node->next[i]->key, key) < 0) {
+            node = node->next[i];
+        }
+        if (update) {
+            update[i] = node;
+        }
+    }
+
+    return node->next[0];
+}
+
+// Add a key; returns false if it is already present or allocation fails
+bool kv_index_insert(KVIndex* index, const char* key) {
+    if (!index || !key) {
+        return false;
+    }
+
+    KVIndexNode* update[KV_INDEX_MAX_LEVEL];
+    KVIndexNode* existing = find_predecessors(index, key, update);
+    if (existing && strcmp(existing->key, key) == 0) {
+        return false;
+    }
+
+    int level = random_level(index);
+    if (level > index->level) {
+        for (int i = index->level; i < level; i++) {
+            update[i] = index->head;
+        }
+        index->level = level;
+    }
+
+    KVIndexNode* node = create_node(level, key);
+    if (!node) {
+        return false;
+    }
+
+    for (int i = 0; i < level; i++) {
+        node->next[i] = update[i]->next[i];
+        update[i]->next[i] = node;
+    }
+
+    index->count++;
+    return true;
+}
+
+// Remove a key; returns false if it was not present
+bool kv_index_remove(KVIndex* index, const char* key) {
+    if (!index || !key) {
+        return false;
+    }
+
+    KVIndexNode* update[KV_INDEX_MAX_LEVEL];
+    KVIndexNode* node = find_predecessors(index, key, update);
+    if (!node || strcmp(node->key, key) != 0) {
+        return false;
+    }
+
+    for (int i = 0; i < node->level; i++) {
+        if (update[i]->next[i] == node) {
+            update[i]->next[i] = node->next[i];
+        }
+    }
+
+    while (index->level > 1 && !index->head->next[index->level - 1]) {
+        index->level--;
+    }
+
+    free(node);
+    index->count--;
+    return true;
+}
+
+// Find the first key >= start (or > start when exclusive); NULL start means the beginning
+KVIndexNode* kv_index_seek(KVIndex* index, const char* start, bool exclusive) {
+    if (!index) {
+        return NULL;
+    }
+
+    if (!start) {
+        return index->head->next[0];
+    }
+
+    KVIndexNode* node = find_predecessors(index, start, NULL);
+    if (exclusive && node && strcmp(node->key, start) == 0) {
+        node = node->next[0];
+    }
+
+    return node;
+}
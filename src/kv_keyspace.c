@@ -0,0 +1,285 @@
+#include "kv_store.h"
+#include <ctype.h>
+#include <limits.h>
+
+// Keyspaces
+//
+// A named keyspace is a store of its own, so its keys hash into its own
+// shards and tables, its writers never wait on another keyspace's locks,
+// its quota and evictions only ever touch its own records, and a scan walks
+// only its keys. Keyspaces are all created before the server starts serving
+// and never change afterwards, so requests find theirs by id without a
+// lock. Replication and rebalancing tag what they send with the keyspace it
+// came from.
+//
+// A keyspace is declared as NAME[:OPTION=VALUE,...]. The options are
+// capacity, quota (record bytes), eviction (none or clock), ttl (seconds),
+// engine (memory, lsm or mmap), persistence (on or off), durability
+// (buffered, fsync or async), compress-min (bytes) and rate (RATE[:BURST]
+// requests a second across all clients). Those left out take the server's
+// setting, except quota, ttl and rate, which default to none.
+
+static KVKeyspace* keyspaces[KV_MAX_KEYSPACES];  // By id; 0, the server's own store, stays NULL
+static int keyspace_count = 1;
+
+// A keyspace's settings, as its spec gives them
+typedef struct {
+    char name[KV_KEYSPACE_NAME_SIZE];
+    int capacity;
+    size_t quota;
+    KVEviction eviction;
+    uint64_t ttl_ms;
+    const char* engine;
+    bool persistence;
+    KVDurability durability;
+    size_t compress_min;
+    uint64_t rate;
+    uint64_t burst;
+} KeyspaceSpec;
+
+bool kv_parse_eviction(const char* name, KVEviction* eviction) {
+    if (strcmp(name, "none") == 0) {
+        *eviction = KV_EVICT_NONE;
+    } else if (strcmp(name, "clock") == 0) {
+        *eviction = KV_EVICT_CLOCK;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// A whole decimal number, with nothing after it
+static bool parse_number(const char* text, uint64_t* value) {
+    char* end;
+    errno = 0;
+    *value = strtoull(text, &end, 10);
+    return errno == 0 && end != text && *end == '\0' && text[0] != '-';
+}
+
+static bool parse_option(KeyspaceSpec* spec, const char* option, const char* value) {
+    uint64_t number;
+    if (strcmp(option, "capacity") == 0 && parse_number(value, &number) && number > 0 && number <= INT_MAX) {
+        spec->capacity = (int)number;
+    } else if (strcmp(option, "quota") == 0 && parse_number(value, &number)) {
+        spec->quota = (size_t)number;
+    } else if (strcmp(option, "eviction") == 0) {
+        return kv_parse_eviction(value, &spec->eviction);
+    } else if (strcmp(option, "ttl") == 0 && parse_number(value, &number)) {
+        spec->ttl_ms = number * 1000;
+    } else if (strcmp(option, "engine") == 0 &&
+               (strcmp(value, "memory") == 0 || strcmp(value, "lsm") == 0 || strcmp(value, "mmap") == 0)) {
+        spec->engine = strcmp(value, "memory") == 0 ? "memory" : (strcmp(value, "lsm") == 0 ? "lsm" : "mmap");
+    } else if (strcmp(option, "persistence") == 0 && (strcmp(value, "on") == 0 || strcmp(value, "off") == 0)) {
+        spec->persistence = strcmp(value, "on") == 0;
+    } else if (strcmp(option, "durability") == 0 && strcmp(value, "buffered") == 0) {
+        spec->durability = KV_DURABILITY_BUFFERED;
+    } else if (strcmp(option, "durability") == 0 && strcmp(value, "fsync") == 0) {
+        spec->durability = KV_DURABILITY_FSYNC;
+    } else if (strcmp(option, "durability") == 0 && strcmp(value, "async") == 0) {
+        spec->durability = KV_DURABILITY_ASYNC;
+    } else if (strcmp(option, "compress-min") == 0 && parse_number(value, &number)) {
+        spec->compress_min = (size_t)number;
+    } else if (strcmp(option, "rate") == 0) {
+        char* end;
+        spec->rate = strtoull(value, &end, 10);
+        spec->burst = *end == ':' ? strtoull(end + 1, &end, 10) : 0;
+        return end != value && *end == '\0';
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Read NAME[:OPTION=VALUE,...] over the defaults already in spec
+static bool parse_spec(const char* text, KeyspaceSpec* spec) {
+    size_t name_len = strcspn(text, ":");
+    if (name_len == 0 || name_len >= KV_KEYSPACE_NAME_SIZE) {
+        fprintf(stderr, "Keyspace names must be 1-%d characters: %s\n", KV_KEYSPACE_NAME_SIZE - 1, text);
+        return false;
+    }
+    for (size_t i = 0; i < name_len; i++) {
+        if (!isalnum((unsigned char)text[i]) && text[i] != '_' && text[i] != '-') {
+            fprintf(stderr, "Keyspace names may only hold letters, digits, '_' and '-': %s\n", text);
+            return false;
+        }
+    }
+    memcpy(spec->name, text, name_len);
+    spec->name[name_len] = '\0';
+    if (text[name_len] == '\0') {
+        return true;
+    }
+
+    char options[512];
+    snprintf(options, sizeof(options), "%s", text + name_len + 1);
+    char* saved;
+    for (char* option = strtok_r(options, ",", &saved); option; option = strtok_r(NULL, ",", &saved)) {
+        char* value = strchr(option, '=');
+        if (value) {
+            *value++ = '\0';
+        }
+        if (!value || !parse_option(spec, option, value)) {
+            fprintf(stderr, "Bad option for keyspace %s: %s%s%s\n", spec->name, option, value ? "=" : "",
+                    value ? value : "");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Open a keyspace's store the way the server opens its own
+static KVStore* open_store(const KeyspaceSpec* spec, const KVKeyspaceDefaults* defaults, uint32_t id) {
+    KVStore* store = kv_store_init(spec->capacity);
+    if (!store) {
+        return NULL;
+    }
+    store->keyspace = id;
+    kv_store_set_node_id(store, defaults->node_id);
+    kv_store_set_compression(store, spec->compress_min);
+    kv_store_set_durability(store, spec->durability);
+
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s/%s%s", defaults->data_dir, KV_KEYSPACE_DIR_PREFIX, spec->name);
+    bool memory_engine = strcmp(spec->engine, "memory") == 0;
+    if ((!memory_engine || spec->persistence) &&
+        (!ensure_directory_exists(defaults->data_dir) || !kv_store_check_placement(dir))) {
+        kv_store_destroy(store);
+        return NULL;
+    }
+    if (!memory_engine && !kv_store_set_engine(store, spec->engine, dir)) {
+        fprintf(stderr, "Failed to open the %s storage engine in %s\n", spec->engine, dir);
+        kv_store_destroy(store);
+        return NULL;
+    }
+    if (memory_engine && spec->persistence && !kv_store_enable_persistence(store, dir)) {
+        fprintf(stderr, "Warning: Failed to enable persistence for keyspace %s, continuing without it\n", spec->name);
+    }
+
+    if (!kv_store_set_limits(store, spec->quota, spec->eviction, spec->ttl_ms)) {
+        fprintf(stderr, "Failed to set the limits of keyspace %s (quotas need the memory engine)\n", spec->name);
+        kv_store_destroy(store);
+        return NULL;
+    }
+    return store;
+}
+
+// Declare a keyspace from its spec and open its store (call before serving)
+bool kv_keyspace_add(const char* text, const KVKeyspaceDefaults* defaults) {
+    if (keyspace_count == KV_MAX_KEYSPACES) {
+        fprintf(stderr, "Too many keyspaces; a server holds at most %d\n", KV_MAX_KEYSPACES - 1);
+        return false;
+    }
+
+    KeyspaceSpec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.capacity = defaults->capacity;
+    spec.eviction = KV_EVICT_NONE;
+    spec.engine = defaults->engine;
+    spec.persistence = defaults->persistence;
+    spec.durability = defaults->durability;
+    spec.compress_min = defaults->compress_min;
+    if (!parse_spec(text, &spec)) {
+        return false;
+    }
+    if (kv_keyspace_lookup(spec.name) >= 0) {
+        fprintf(stderr, "Keyspace %s is declared twice\n", spec.name);
+        return false;
+    }
+
+    KVKeyspace* keyspace = (KVKeyspace*)calloc(1, sizeof(KVKeyspace));
+    if (!keyspace) {
+        return false;
+    }
+    keyspace->id = (uint32_t)keyspace_count;
+    keyspace->store = open_store(&spec, defaults, keyspace->id);
+    if (!keyspace->store) {
+        free(keyspace);
+        return false;
+    }
+    memcpy(keyspace->name, spec.name, sizeof(keyspace->name));
+    pthread_mutex_init(&keyspace->lock, NULL);
+    kv_rate_bucket_init(&keyspace->bucket, spec.rate, spec.burst > 0 ? spec.burst : spec.rate);
+    atomic_init(&keyspace->shed, 0);
+    keyspaces[keyspace_count++] = keyspace;
+
+    printf("Keyspace %s (id %u): %s engine, capacity %d", keyspace->name, keyspace->id, spec.engine, spec.capacity);
+    if (spec.quota > 0) {
+        printf(", quota %zu bytes (%s eviction)", spec.quota, spec.eviction == KV_EVICT_CLOCK ? "clock" : "no");
+    }
+    if (spec.ttl_ms > 0) {
+        printf(", ttl %llu s", (unsigned long long)(spec.ttl_ms / 1000));
+    }
+    printf("\n");
+    return true;
+}
+
+void kv_keyspaces_destroy(void) {
+    for (int i = 1; i < keyspace_count; i++) {
+        kv_store_destroy(keyspaces[i]->store);
+        pthread_mutex_destroy(&keyspaces[i]->lock);
+        free(keyspaces[i]);
+        keyspaces[i] = NULL;
+    }
+    keyspace_count = 1;
+}
+
+// Keyspaces in use, the default one included
+int kv_keyspace_count(void) {
+    return keyspace_count;
+}
+
+// The id of a keyspace by name, -1 if there is none; "" and "default" name the default keyspace
+int kv_keyspace_lookup(const char* name) {
+    if (name[0] == '\0' || strcmp(name, "default") == 0) {
+        return 0;
+    }
+    for (int i = 1; i < keyspace_count; i++) {
+        if (strcmp(keyspaces[i]->name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// A named keyspace by id; NULL for the default keyspace and unused ids
+const KVKeyspace* kv_keyspace_get(uint32_t id) {
+    return id > 0 && id < (uint32_t)keyspace_count ? keyspaces[id] : NULL;
+}
+
+// The store a request is for, counting the request against its keyspace;
+// NULL if it names a keyspace this server does not hold
+KVStore* kv_keyspace_route(KVStore* store, const Message* msg) {
+    uint32_t id = KV_KEYSPACE_ID(msg->flags);
+    if (id > 0) {
+        const KVKeyspace* keyspace = kv_keyspace_get(id);
+        if (!keyspace) {
+            return NULL;
+        }
+        store = keyspace->store;
+    }
+    kv_stats_keyspace_request(id);
+    return store;
+}
+
+// Take a request from its keyspace's bucket, if it has one
+bool kv_keyspace_admit(const Message* msg) {
+    KVKeyspace* keyspace = (KVKeyspace*)kv_keyspace_get(KV_KEYSPACE_ID(msg->flags));
+    if (!keyspace || keyspace->bucket.rate == 0) {
+        return true;
+    }
+
+    pthread_mutex_lock(&keyspace->lock);
+    bool allowed = kv_rate_bucket_take(&keyspace->bucket);
+    pthread_mutex_unlock(&keyspace->lock);
+    if (!allowed) {
+        atomic_fetch_add_explicit(&keyspace->shed, 1, memory_order_relaxed);
+    }
+    return allowed;
+}
+
+// Push every keyspace's keys to their owners after a membership change
+void kv_keyspaces_distribute(KVStore* store, NodeList* list) {
+    distribute_data(store, list);
+    for (int i = 1; i < keyspace_count; i++) {
+        distribute_data(keyspaces[i]->store, list);
+    }
+}
@@ -0,0 +1,2025 @@
+#include "kv_store.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+
+// LSM-tree engine
+//
+// Writes are appended to a log and put in a skip-list memtable. A full
+// memtable is switched for an empty one and a background thread writes it
+// out as a level-0 SSTable, then merges tables down the levels: level 0 when
+// it holds KV_LSM_L0_COMPACT tables, a deeper level when it outgrows its
+// target. Tables below level 0 have disjoint key ranges, so a lookup reads
+// at most one block per level, and only after the table's Bloom filter says
+// the key may be there. Before any of that, a cuckoo filter per shard over
+// every live key turns away most lookups for keys the store does not hold.
+// Writes stay blind: a put adds the key's fingerprint unless the filter
+// already matches it, and a delete leaves it behind, since it may be
+// another key's too. When a filter fills up, or enough deleted keys linger
+// in them, the background thread rebuilds them all from the tree while
+// writers keep adding to both.
+//
+// Readers take no locks. The memtables and tables that make up the store
+// are an immutable version that is swapped whole and retired through the
+// epoch; a reader that loaded it may keep using it until it leaves its
+// epoch. Tables are reference counted by the versions holding them, and a
+// table a compaction replaced is deleted with its last reference. The
+// manifest names the live tables and the oldest log still needed; a log is
+// deleted once its memtable is in a table the manifest lists.
+//
+// An SSTable is a run of blocks, each a sequence of entries (header, key,
+// NUL, value as stored) that is LZ4-compressed when that makes it smaller,
+// followed by an index holding every block's last key, a blocked Bloom
+// filter and a fixed-size footer.
+
+#define LSM_TOMBSTONE 0x80         // Record flag: the key was deleted
+#define LSM_MAX_HEIGHT 12
+#define LSM_TABLE_MAGIC 0x3154534d534c564bULL   // "KVLSMST1"
+#define LSM_BLOCK_COMPRESSED 0x1
+#define LSM_FILTER_BLOCKED 1       // Footer filter kind: blocked Bloom filter
+#define LSM_BLOOM_SEED 0x6c736d626c6f6f6dULL
+#define LSM_FILTER_BATCH 1024      // Keys added per lock hold while rebuilding key filters
+#define LSM_ENTRY_MAX (sizeof(LsmEntry) + MAX_KEY_SIZE + MAX_VALUE_SIZE + 1)
+#define LSM_BLOCK_MAX (KV_LSM_BLOCK_SIZE + LSM_ENTRY_MAX)
+
+// Log record header, followed by the key and the value as stored
+typedef struct {
+    uint32_t crc;              // Of the header with crc 0, the key and the value
+    uint16_t key_len;
+    uint16_t value_len;
+    uint64_t version;
+    uint8_t flags;             // KV_RECORD_* and LSM_TOMBSTONE
+    uint8_t reserved[7];
+} LsmLogEntry;
+
+// Block entry header, followed by the key, a NUL and the value as stored
+typedef struct {
+    uint64_t version;
+    uint16_t key_len;
+    uint16_t value_len;
+    uint8_t flags;
+    uint8_t reserved[3];
+} LsmEntry;
+
+// Where a block is; the index stores each one followed by the block's last key
+typedef struct {
+    uint64_t offset;
+    uint32_t stored_len;
+    uint32_t raw_len;
+    uint32_t crc;              // Of the stored bytes
+    uint16_t flags;            // LSM_BLOCK_*
+    uint16_t key_len;
+} LsmBlockHandle;
+
+// Last bytes of a table. The index section is the smallest key followed by
+// the block handles; the Bloom filter comes right after it.
+typedef struct {
+    uint64_t magic;
+    uint64_t index_offset;
+    uint32_t index_len;
+    uint32_t bloom_len;
+    uint32_t block_count;
+    uint32_t bloom_probes;
+    uint64_t entries;
+    uint64_t max_version;
+    uint32_t crc;              // Of the index and the filter
+    uint16_t smallest_len;
+    uint16_t filter;           // LSM_FILTER_*; tables without a known one are read unfiltered
+} LsmFooter;
+
+typedef struct {
+    uint64_t number;
+    int fd;
+    uint64_t size;             // File bytes
+    uint64_t max_version;
+    uint64_t entries;
+    int block_count;
+    LsmBlockHandle* blocks;
+    char** last_keys;          // Last key of each block
+    char* smallest;
+    const char* largest;
+    uint8_t* bloom;
+    size_t bloom_bytes;        // 0 when the table has no usable filter
+    int bloom_probes;
+    _Atomic int refs;
+    _Atomic bool obsolete;     // Delete the file with the last reference
+    char path[300];
+} LsmTable;
+
+typedef struct LsmNode {
+    _Atomic(KVRecord*) rec;
+    _Atomic(struct LsmNode*) next[];
+} LsmNode;
+
+typedef struct {
+    LsmNode* head;
+    _Atomic int height;
+    size_t bytes;              // Approximate memory, for the flush threshold (writers only)
+    uint64_t entries;          // Keys, counting deletions (writers only)
+    uint64_t log_number;       // Log holding the memtable's writes
+    _Atomic int refs;
+    uint32_t rng;
+} LsmMemtable;
+
+typedef struct {
+    LsmMemtable* mem;
+    LsmMemtable* imm;          // Full memtable waiting to be flushed, or NULL
+    int counts[KV_LSM_LEVELS];
+    LsmTable** levels[KV_LSM_LEVELS];  // Level 0 newest first, the others by key
+} LsmVersion;
+
+typedef struct KVLsm KVLsm;
+
+struct KVLsm {
+    KVStore* store;
+    char dir[256];             // Holds the logs, tables and manifest
+    _Atomic(LsmVersion*) current;
+    pthread_mutex_t lock;      // Serializes writers and version changes
+    pthread_cond_t work;       // Wakes the background thread
+    pthread_cond_t room;       // Wakes writers waiting for a flush or compaction
+    pthread_t thread;
+    _Atomic bool running;
+    bool failed;               // A flush or compaction failed; writes needing room fail
+    int log_fd;
+    uint64_t next_number;      // Next log or table file number
+    char compact_pointer[KV_LSM_LEVELS][MAX_KEY_SIZE];  // Where each level's next compaction starts
+    _Atomic(struct KVCuckoo*) filters[KV_SHARD_COUNT];  // Live keys by the top bits of their hash; NULL until built
+    struct KVCuckoo* rebuilding[KV_SHARD_COUNT];        // Replacements being filled (lsm->lock)
+    bool filter_rebuild;       // A key filter is full, stale or missing
+    uint64_t filter_keys;      // Keys the filters held when last rebuilt
+    uint64_t filter_stale;     // Deletes since then
+};
+
+static bool write_full(int fd, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool read_at(int fd, void* data, size_t len, uint64_t offset) {
+    char* p = (char*)data;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return true;
+}
+
+static void sync_dir(const char* dir) {
+    int fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static void release_record(void* rec) {
+    kv_record_release((KVRecord*)rec);
+}
+
+// Take a file number (caller holds lsm->lock)
+static uint64_t new_number_locked(KVLsm* lsm) {
+    return lsm->next_number++;
+}
+
+static uint64_t new_number(KVLsm* lsm) {
+    pthread_mutex_lock(&lsm->lock);
+    uint64_t number = new_number_locked(lsm);
+    pthread_mutex_unlock(&lsm->lock);
+    return number;
+}
+
+static void file_path(KVLsm* lsm, uint64_t number, const char* suffix, char* path, size_t size) {
+    snprintf(path, size, "%s/lsm_%06llu.%s", lsm->dir, (unsigned long long)number, suffix);
+}
+
+// Memtable
+//
+// A skip list ordered by key. Writers are serialized by lsm->lock and
+// publish a node only once its forward pointers are set, so readers walk it
+// without locking. A key written again gets its node's record swapped.
+
+static LsmMemtable* memtable_create(uint64_t log_number) {
+    LsmMemtable* mem = (LsmMemtable*)calloc(1, sizeof(LsmMemtable));
+    if (!mem) {
+        return NULL;
+    }
+
+    mem->head = (LsmNode*)calloc(1, sizeof(LsmNode) + LSM_MAX_HEIGHT * sizeof(_Atomic(LsmNode*)));
+    if (!mem->head) {
+        free(mem);
+        return NULL;
+    }
+    atomic_init(&mem->height, 1);
+    atomic_init(&mem->refs, 1);
+    mem->log_number = log_number;
+    mem->rng = (uint32_t)(log_number * 2654435761U) | 1;
+    return mem;
+}
+
+static void memtable_ref(LsmMemtable* mem) {
+    atomic_fetch_add_explicit(&mem->refs, 1, memory_order_relaxed);
+}
+
+static void memtable_unref(LsmMemtable* mem) {
+    if (!mem || atomic_fetch_sub_explicit(&mem->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    LsmNode* node = atomic_load_explicit(&mem->head->next[0], memory_order_relaxed);
+    while (node) {
+        LsmNode* next = atomic_load_explicit(&node->next[0], memory_order_relaxed);
+        kv_record_release(atomic_load_explicit(&node->rec, memory_order_relaxed));
+        free(node);
+        node = next;
+    }
+    free(mem->head);
+    free(mem);
+}
+
+static bool memtable_empty(LsmMemtable* mem) {
+    return atomic_load_explicit(&mem->head->next[0], memory_order_acquire) == NULL;
+}
+
+static inline const char* node_key(LsmNode* node) {
+    return KV_RECORD_KEY(atomic_load_explicit(&node->rec, memory_order_acquire));
+}
+
+// First node at or after key (after it when exclusive; the first node when
+// key is NULL). Writers pass prev to learn each level's predecessor.
+static LsmNode* memtable_seek(LsmMemtable* mem, const char* key, bool exclusive, LsmNode** prev) {
+    LsmNode* node = mem->head;
+    for (int level = atomic_load_explicit(&mem->height, memory_order_acquire) - 1; level >= 0; level--) {
+        LsmNode* next;
+        while (key && (next = atomic_load_explicit(&node->next[level], memory_order_acquire)) != NULL) {
+            int cmp = strcmp(node_key(next), key);
+            if (cmp > 0 || (cmp == 0 && !exclusive)) {
+                break;
+            }
+            node = next;
+        }
+        if (prev) {
+            prev[level] = node;
+        }
+    }
+    return atomic_load_explicit(&node->next[0], memory_order_acquire);
+}
+
+static KVRecord* memtable_get(LsmMemtable* mem, const char* key) {
+    LsmNode* node = memtable_seek(mem, key, false, NULL);
+    if (!node) {
+        return NULL;
+    }
+    KVRecord* rec = atomic_load_explicit(&node->rec, memory_order_acquire);
+    return strcmp(KV_RECORD_KEY(rec), key) == 0 ? rec : NULL;
+}
+
+// Add or replace a key's record, taking over the reference (caller holds
+// lsm->lock)
+static bool memtable_put(LsmMemtable* mem, KVRecord* rec) {
+    LsmNode* prev[LSM_MAX_HEIGHT];
+    for (int i = 0; i < LSM_MAX_HEIGHT; i++) {
+        prev[i] = mem->head;
+    }
+
+    LsmNode* node = memtable_seek(mem, KV_RECORD_KEY(rec), false, prev);
+    size_t bytes = sizeof(KVRecord) + rec->key_len + rec->value_len + 2;
+    if (node && strcmp(node_key(node), KV_RECORD_KEY(rec)) == 0) {
+        KVRecord* old = atomic_load_explicit(&node->rec, memory_order_relaxed);
+        atomic_store_explicit(&node->rec, rec, memory_order_release);
+        kv_epoch_retire(old, release_record);
+        mem->bytes += bytes;
+        return true;
+    }
+
+    // Each level up holds a quarter of the nodes of the one below
+    int height = 1;
+    while (height < LSM_MAX_HEIGHT) {
+        mem->rng ^= mem->rng << 13;
+        mem->rng ^= mem->rng >> 17;
+        mem->rng ^= mem->rng << 5;
+        if ((mem->rng & 3) != 0) {
+            break;
+        }
+        height++;
+    }
+
+    node = (LsmNode*)malloc(sizeof(LsmNode) + height * sizeof(_Atomic(LsmNode*)));
+    if (!node) {
+        return false;
+    }
+    atomic_init(&node->rec, rec);
+    for (int i = 0; i < height; i++) {
+        atomic_init(&node->next[i], atomic_load_explicit(&prev[i]->next[i], memory_order_relaxed));
+    }
+    if (height > atomic_load_explicit(&mem->height, memory_order_relaxed)) {
+        atomic_store_explicit(&mem->height, height, memory_order_release);
+    }
+    for (int i = 0; i < height; i++) {
+        atomic_store_explicit(&prev[i]->next[i], node, memory_order_release);
+    }
+    mem->bytes += bytes + sizeof(LsmNode) + height * sizeof(LsmNode*);
+    mem->entries++;
+    return true;
+}
+
+// Write-ahead log
+
+static int log_create(KVLsm* lsm, uint64_t number) {
+    char path[300];
+    file_path(lsm, number, "log", path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error creating LSM log %s: %s\n", path, strerror(errno));
+    }
+    return fd;
+}
+
+// Append a record to the current log (caller holds lsm->lock). Fsync
+// durability syncs every append; the other modes leave it to the kernel.
+static bool log_append(KVLsm* lsm, const KVRecord* rec) {
+    char buffer[sizeof(LsmLogEntry) + MAX_KEY_SIZE + MAX_VALUE_SIZE];
+    LsmLogEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.key_len = rec->key_len;
+    entry.value_len = rec->value_len;
+    entry.version = rec->version;
+    entry.flags = rec->flags;
+
+    size_t len = sizeof(entry);
+    memcpy(buffer, &entry, sizeof(entry));
+    memcpy(buffer + len, KV_RECORD_KEY(rec), rec->key_len);
+    len += rec->key_len;
+    memcpy(buffer + len, KV_RECORD_VALUE(rec), rec->value_len);
+    len += rec->value_len;
+    entry.crc = kv_crc32c(0, buffer, len);
+    memcpy(buffer, &entry.crc, sizeof(entry.crc));
+
+    if (!write_full(lsm->log_fd, buffer, len)) {
+        fprintf(stderr, "Error writing LSM log: %s\n", strerror(errno));
+        return false;
+    }
+    kv_stats_add(KV_STAT_LOG_BYTES, (int64_t)len);
+    kv_stats_add(KV_STAT_LOG_RECORDS, 1);
+
+    if (lsm->store->durability == KV_DURABILITY_FSYNC) {
+        uint64_t sync_start = kv_stats_now();
+        bool synced = fdatasync(lsm->log_fd) == 0;
+        kv_stats_observe(KV_HIST_FSYNC, kv_stats_now() - sync_start);
+        return synced;
+    }
+    return true;
+}
+
+// Put a log's intact records into a memtable; replay stops at the first
+// torn or damaged one
+static bool log_replay(KVLsm* lsm, const char* path, LsmMemtable* mem) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 16);
+
+    char buffer[sizeof(LsmLogEntry) + MAX_KEY_SIZE + MAX_VALUE_SIZE];
+    char key[MAX_KEY_SIZE];
+    LsmLogEntry entry;
+    bool ok = true;
+    while (ok && fread(&entry, sizeof(entry), 1, file) == 1) {
+        if (entry.key_len >= MAX_KEY_SIZE || entry.value_len >= MAX_VALUE_SIZE) {
+            break;
+        }
+        size_t body = (size_t)entry.key_len + entry.value_len;
+        uint32_t crc = entry.crc;
+        entry.crc = 0;
+        memcpy(buffer, &entry, sizeof(entry));
+        if (fread(buffer + sizeof(entry), 1, body, file) != body ||
+            kv_crc32c(0, buffer, sizeof(entry) + body) != crc) {
+            break;
+        }
+
+        memcpy(key, buffer + sizeof(entry), entry.key_len);
+        key[entry.key_len] = '\0';
+        KVRecord* rec = kv_record_create(key, (unsigned int)kv_key_hash(key), buffer + sizeof(entry) + entry.key_len,
+                                         entry.value_len, entry.flags, entry.version);
+        ok = rec && memtable_put(mem, rec);
+        if (rec && !ok) {
+            kv_record_release(rec);
+        }
+        kv_store_observe_version(lsm->store, entry.version);
+    }
+
+    fclose(file);
+    return ok;
+}
+
+// SSTables
+
+static inline uint64_t filter_hash(const char* key, size_t len) {
+    return kv_hash(key, len, LSM_BLOOM_SEED);
+}
+
+static void table_free(LsmTable* table) {
+    if (table->fd >= 0) {
+        close(table->fd);
+    }
+    if (atomic_load(&table->obsolete)) {
+        unlink(table->path);
+    }
+    free(table->smallest);
+    free(table->last_keys);
+    free(table->blocks);
+    free(table->bloom);
+    kv_stats_add(KV_STAT_LSM_BLOOM_BYTES, -(int64_t)table->bloom_bytes);
+    free(table);
+}
+
+static void table_ref(LsmTable* table) {
+    atomic_fetch_add_explicit(&table->refs, 1, memory_order_relaxed);
+}
+
+static void table_unref(LsmTable* table) {
+    if (table && atomic_fetch_sub_explicit(&table->refs, 1, memory_order_acq_rel) == 1) {
+        table_free(table);
+    }
+}
+
+// Open a table and load its index and filter
+static LsmTable* table_open(KVLsm* lsm, uint64_t number) {
+    LsmTable* table = (LsmTable*)calloc(1, sizeof(LsmTable));
+    if (!table) {
+        return NULL;
+    }
+    table->number = number;
+    atomic_init(&table->refs, 1);
+    atomic_init(&table->obsolete, false);
+    file_path(lsm, number, "sst", table->path, sizeof(table->path));
+
+    table->fd = open(table->path, O_RDONLY);
+    struct stat st;
+    LsmFooter footer;
+    if (table->fd < 0 || fstat(table->fd, &st) != 0 || (size_t)st.st_size < sizeof(footer) ||
+        !read_at(table->fd, &footer, sizeof(footer), (uint64_t)st.st_size - sizeof(footer)) ||
+        footer.magic != LSM_TABLE_MAGIC || footer.block_count == 0 ||
+        footer.index_offset + footer.index_len + footer.bloom_len + sizeof(footer) != (uint64_t)st.st_size) {
+        fprintf(stderr, "Error opening LSM table %s: not a table\n", table->path);
+        table_free(table);
+        return NULL;
+    }
+    table->size = (uint64_t)st.st_size;
+    table->max_version = footer.max_version;
+    table->entries = footer.entries;
+
+    // The keys are copied out NUL-terminated into one allocation
+    size_t meta_len = (size_t)footer.index_len + footer.bloom_len;
+    char* meta = (char*)malloc(meta_len);
+    char* keys = (char*)malloc(footer.index_len + footer.block_count + 1);
+    table->smallest = keys;
+    table->blocks = (LsmBlockHandle*)malloc(sizeof(LsmBlockHandle) * footer.block_count);
+    table->last_keys = (char**)calloc(footer.block_count, sizeof(char*));
+    table->bloom = (uint8_t*)malloc(footer.bloom_len > 0 ? footer.bloom_len : 1);
+    bool ok = meta && keys && table->blocks && table->last_keys && table->bloom &&
+              read_at(table->fd, meta, meta_len, footer.index_offset) && kv_crc32c(0, meta, meta_len) == footer.crc &&
+              footer.smallest_len < MAX_KEY_SIZE && footer.smallest_len <= footer.index_len;
+
+    size_t pos = 0;
+    size_t key_pos = 0;
+    if (ok) {
+        memcpy(keys, meta, footer.smallest_len);
+        keys[footer.smallest_len] = '\0';
+        pos = footer.smallest_len;
+        key_pos = footer.smallest_len + 1;
+    }
+    for (uint32_t i = 0; ok && i < footer.block_count; i++) {
+        LsmBlockHandle* block = &table->blocks[i];
+        ok = pos + sizeof(LsmBlockHandle) <= footer.index_len;
+        if (ok) {
+            memcpy(block, meta + pos, sizeof(LsmBlockHandle));
+            pos += sizeof(LsmBlockHandle);
+            ok = block->key_len < MAX_KEY_SIZE && pos + block->key_len <= footer.index_len &&
+                 block->raw_len <= LSM_BLOCK_MAX && block->stored_len <= LSM_BLOCK_MAX;
+        }
+        if (ok) {
+            table->last_keys[i] = keys + key_pos;
+            memcpy(keys + key_pos, meta + pos, block->key_len);
+            keys[key_pos + block->key_len] = '\0';
+            pos += block->key_len;
+            key_pos += block->key_len + 1;
+        }
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Error opening LSM table %s: damaged index\n", table->path);
+        free(meta);
+        table_free(table);
+        return NULL;
+    }
+
+    table->block_count = (int)footer.block_count;
+    table->largest = table->last_keys[table->block_count - 1];
+    if (footer.filter == LSM_FILTER_BLOCKED && footer.bloom_len >= KV_BLOOM_BLOCK &&
+        footer.bloom_len % KV_BLOOM_BLOCK == 0) {
+        memcpy(table->bloom, meta + footer.index_len, footer.bloom_len);
+        table->bloom_bytes = footer.bloom_len;
+        table->bloom_probes = (int)footer.bloom_probes;
+        kv_stats_add(KV_STAT_LSM_BLOOM_BYTES, (int64_t)table->bloom_bytes);
+    }
+    free(meta);
+    return table;
+}
+
+// Read and check a block into raw (LSM_BLOCK_MAX bytes), using stored for
+// a compressed one; returns its length, or -1
+static int table_read_block(LsmTable* table, int index, char* raw, char* stored) {
+    const LsmBlockHandle* block = &table->blocks[index];
+    bool compressed = block->flags & LSM_BLOCK_COMPRESSED;
+    char* into = compressed ? stored : raw;
+
+    kv_stats_add(KV_STAT_LSM_BLOCK_READS, 1);
+    if (!read_at(table->fd, into, block->stored_len, block->offset) ||
+        kv_crc32c(0, into, block->stored_len) != block->crc) {
+        fprintf(stderr, "Error reading LSM table %s: damaged block %d\n", table->path, index);
+        return -1;
+    }
+    if (!compressed) {
+        return (int)block->stored_len;
+    }
+    int len = kv_lz4_decompress(stored, (int)block->stored_len, raw, LSM_BLOCK_MAX);
+    return len == (int)block->raw_len ? len : -1;
+}
+
+// Decode the entry at pos; false at the end of the block
+static bool block_entry(const char* raw, size_t len, size_t pos, LsmEntry* entry) {
+    if (pos + sizeof(LsmEntry) > len) {
+        return false;
+    }
+    memcpy(entry, raw + pos, sizeof(LsmEntry));
+    return entry->key_len < MAX_KEY_SIZE && entry->value_len < MAX_VALUE_SIZE &&
+           pos + sizeof(LsmEntry) + entry->key_len + 1 + entry->value_len <= len;
+}
+
+static inline size_t entry_size(const LsmEntry* entry) {
+    return sizeof(LsmEntry) + entry->key_len + 1 + entry->value_len;
+}
+
+// First block whose last key is at or after key; block_count if none
+static int table_find_block(const LsmTable* table, const char* key) {
+    int low = 0;
+    int high = table->block_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (strcmp(table->last_keys[mid], key) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Look a key up in one table. Returns false if the table does not hold it;
+// otherwise *rec is its record, or NULL if the table holds its deletion.
+// A record read from disk is retired at once, so it lasts until the caller
+// leaves its epoch.
+static bool table_get(LsmTable* table, const char* key, unsigned int hash, uint64_t bloom_hash, KVRecord** rec) {
+    if (strcmp(key, table->smallest) < 0 || strcmp(key, table->largest) > 0) {
+        return false;
+    }
+    bool filtered = table->bloom_bytes > 0;
+    if (filtered && !kv_bloom_may_contain(table->bloom, table->bloom_bytes, table->bloom_probes, bloom_hash)) {
+        kv_stats_add(KV_STAT_LSM_BLOOM_SKIPS, 1);
+        return false;
+    }
+
+    int index = table_find_block(table, key);
+    if (index >= table->block_count) {
+        return false;
+    }
+    char raw[LSM_BLOCK_MAX];
+    char stored[LSM_BLOCK_MAX];
+    int len = table_read_block(table, index, raw, stored);
+
+    LsmEntry entry;
+    for (size_t pos = 0; len > 0 && block_entry(raw, (size_t)len, pos, &entry); pos += entry_size(&entry)) {
+        const char* entry_key = raw + pos + sizeof(LsmEntry);
+        int cmp = strcmp(entry_key, key);
+        if (cmp > 0) {
+            break;
+        }
+        if (cmp < 0) {
+            continue;
+        }
+
+        *rec = NULL;
+        if (!(entry.flags & LSM_TOMBSTONE)) {
+            *rec = kv_record_create(entry_key, hash, entry_key + entry.key_len + 1, entry.value_len, entry.flags,
+                                    entry.version);
+            kv_epoch_retire(*rec, release_record);
+        }
+        return true;
+    }
+    if (filtered) {
+        kv_stats_add(KV_STAT_LSM_BLOOM_FALSE_POSITIVES, 1);
+    }
+    return false;
+}
+
+// Table builder: entries are added in key order and the file is opened as a
+// table once finished
+
+typedef struct {
+    KVLsm* lsm;
+    uint64_t number;
+    int fd;
+    char path[300];
+    char* block;               // Entries of the block being filled
+    size_t block_len;
+    char* packed;              // Compressed form of a block
+    uint64_t offset;           // Bytes written
+    char* index;               // Smallest key, then block handles and last keys
+    size_t index_len;
+    size_t index_cap;
+    uint64_t* hashes;          // Bloom hash of every key
+    uint64_t hash_cap;
+    uint64_t entries;
+    uint64_t max_version;
+    uint32_t block_count;
+    uint16_t smallest_len;
+    char last_key[MAX_KEY_SIZE];
+    uint16_t last_len;
+    bool ok;
+} LsmBuilder;
+
+static bool builder_start(LsmBuilder* b, KVLsm* lsm) {
+    memset(b, 0, sizeof(LsmBuilder));
+    b->lsm = lsm;
+    b->number = new_number(lsm);
+    file_path(lsm, b->number, "sst", b->path, sizeof(b->path));
+    b->fd = open(b->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    b->block = (char*)malloc(LSM_BLOCK_MAX);
+    b->packed = (char*)malloc(LSM_BLOCK_MAX);
+    b->index_cap = 4096;
+    b->index = (char*)malloc(b->index_cap);
+    b->ok = b->fd >= 0 && b->block && b->packed && b->index;
+    if (!b->ok) {
+        fprintf(stderr, "Error creating LSM table %s: %s\n", b->path, strerror(errno));
+    }
+    return b->ok;
+}
+
+static void builder_free(LsmBuilder* b) {
+    if (b->fd >= 0) {
+        close(b->fd);
+    }
+    free(b->block);
+    free(b->packed);
+    free(b->index);
+    free(b->hashes);
+}
+
+static void builder_abandon(LsmBuilder* b) {
+    builder_free(b);
+    unlink(b->path);
+}
+
+static bool index_append(LsmBuilder* b, const void* data, size_t len) {
+    if (b->index_len + len > b->index_cap) {
+        size_t cap = b->index_cap * 2 + len;
+        char* grown = (char*)realloc(b->index, cap);
+        if (!grown) {
+            return false;
+        }
+        b->index = grown;
+        b->index_cap = cap;
+    }
+    memcpy(b->index + b->index_len, data, len);
+    b->index_len += len;
+    return true;
+}
+
+// Write out the block being filled
+static bool builder_flush_block(LsmBuilder* b) {
+    if (b->block_len == 0) {
+        return b->ok;
+    }
+
+    LsmBlockHandle handle;
+    memset(&handle, 0, sizeof(handle));
+    handle.offset = b->offset;
+    handle.raw_len = (uint32_t)b->block_len;
+    handle.key_len = b->last_len;
+
+    const char* data = b->block;
+    int packed_len = kv_lz4_compress(b->block, (int)b->block_len, b->packed, (int)b->block_len - 1);
+    if (packed_len > 0) {
+        data = b->packed;
+        handle.flags = LSM_BLOCK_COMPRESSED;
+    }
+    handle.stored_len = packed_len > 0 ? (uint32_t)packed_len : handle.raw_len;
+    handle.crc = kv_crc32c(0, data, handle.stored_len);
+
+    b->ok = b->ok && write_full(b->fd, data, handle.stored_len) && index_append(b, &handle, sizeof(handle)) &&
+            index_append(b, b->last_key, b->last_len);
+    b->offset += handle.stored_len;
+    b->block_count++;
+    b->block_len = 0;
+    return b->ok;
+}
+
+static bool builder_add(LsmBuilder* b, const char* key, uint16_t key_len, uint64_t version, uint8_t flags,
+                        const char* value, uint16_t value_len) {
+    if (b->entries == 0) {
+        b->smallest_len = key_len;
+        b->ok = b->ok && index_append(b, key, key_len);
+    }
+    if (b->ok && b->entries == b->hash_cap) {
+        uint64_t cap = b->hash_cap ? b->hash_cap * 2 : 1024;
+        uint64_t* grown = (uint64_t*)realloc(b->hashes, sizeof(uint64_t) * cap);
+        b->ok = grown != NULL;
+        b->hashes = grown ? grown : b->hashes;
+        b->hash_cap = cap;
+    }
+    if (!b->ok) {
+        return false;
+    }
+
+    LsmEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.version = version;
+    entry.key_len = key_len;
+    entry.value_len = value_len;
+    entry.flags = flags;
+    char* p = b->block + b->block_len;
+    memcpy(p, &entry, sizeof(entry));
+    memcpy(p + sizeof(entry), key, key_len);
+    p[sizeof(entry) + key_len] = '\0';
+    memcpy(p + sizeof(entry) + key_len + 1, value, value_len);
+    b->block_len += entry_size(&entry);
+
+    b->hashes[b->entries++] = filter_hash(key, key_len);
+    if (version > b->max_version) {
+        b->max_version = version;
+    }
+    memcpy(b->last_key, key, key_len);
+    b->last_len = key_len;
+
+    return b->block_len < KV_LSM_BLOCK_SIZE || builder_flush_block(b);
+}
+
+static uint64_t builder_size(const LsmBuilder* b) {
+    return b->offset + b->block_len;
+}
+
+// Write the index, filter and footer, sync the file and open it as a table
+static LsmTable* builder_finish(LsmBuilder* b) {
+    builder_flush_block(b);
+
+    uint32_t bloom_len = (uint32_t)kv_bloom_bytes(b->entries, KV_LSM_BLOOM_BITS);
+    int probes = kv_bloom_probes(KV_LSM_BLOOM_BITS);
+    uint8_t* bloom = (uint8_t*)calloc(1, bloom_len);
+    if (!bloom) {
+        b->ok = false;
+    }
+    for (uint64_t i = 0; b->ok && i < b->entries; i++) {
+        kv_bloom_add(bloom, bloom_len, probes, b->hashes[i]);
+    }
+
+    LsmFooter footer;
+    memset(&footer, 0, sizeof(footer));
+    footer.magic = LSM_TABLE_MAGIC;
+    footer.index_offset = b->offset;
+    footer.index_len = (uint32_t)b->index_len;
+    footer.bloom_len = bloom_len;
+    footer.block_count = b->block_count;
+    footer.bloom_probes = (uint32_t)probes;
+    footer.entries = b->entries;
+    footer.max_version = b->max_version;
+    footer.smallest_len = b->smallest_len;
+    footer.filter = LSM_FILTER_BLOCKED;
+    if (b->ok) {
+        footer.crc = kv_crc32c(kv_crc32c(0, b->index, b->index_len), bloom, bloom_len);
+    }
+
+    b->ok = b->ok && b->entries > 0 && write_full(b->fd, b->index, b->index_len) &&
+            write_full(b->fd, bloom, bloom_len) && write_full(b->fd, &footer, sizeof(footer)) && fdatasync(b->fd) == 0;
+    free(bloom);
+    if (!b->ok) {
+        fprintf(stderr, "Error writing LSM table %s: %s\n", b->path, strerror(errno));
+        builder_abandon(b);
+        return NULL;
+    }
+
+    builder_free(b);
+    LsmTable* table = table_open(b->lsm, b->number);
+    if (!table) {
+        unlink(b->path);
+    }
+    return table;
+}
+
+// Versions
+
+static uint64_t level_bytes(const LsmVersion* v, int level) {
+    uint64_t bytes = 0;
+    for (int i = 0; i < v->counts[level]; i++) {
+        bytes += v->levels[level][i]->size;
+    }
+    return bytes;
+}
+
+static void version_free(LsmVersion* v) {
+    memtable_unref(v->mem);
+    memtable_unref(v->imm);
+    for (int level = 0; level < KV_LSM_LEVELS; level++) {
+        for (int i = 0; i < v->counts[level]; i++) {
+            table_unref(v->levels[level][i]);
+        }
+        free(v->levels[level]);
+    }
+    free(v);
+}
+
+static void version_retire(void* v) {
+    version_free((LsmVersion*)v);
+}
+
+// A copy of a version holding its own references
+static LsmVersion* version_copy(const LsmVersion* v) {
+    LsmVersion* copy = (LsmVersion*)calloc(1, sizeof(LsmVersion));
+    if (!copy) {
+        return NULL;
+    }
+
+    copy->mem = v->mem;
+    memtable_ref(copy->mem);
+    copy->imm = v->imm;
+    if (copy->imm) {
+        memtable_ref(copy->imm);
+    }
+    for (int level = 0; level < KV_LSM_LEVELS; level++) {
+        if (v->counts[level] == 0) {
+            continue;
+        }
+        copy->levels[level] = (LsmTable**)malloc(sizeof(LsmTable*) * v->counts[level]);
+        if (!copy->levels[level]) {
+            version_free(copy);
+            return NULL;
+        }
+        for (int i = 0; i < v->counts[level]; i++) {
+            copy->levels[level][i] = v->levels[level][i];
+            table_ref(copy->levels[level][i]);
+            copy->counts[level]++;
+        }
+    }
+    return copy;
+}
+
+// Add a table to a level: level 0 stays newest (highest number) first, the
+// others in key order
+static bool version_add(LsmVersion* v, int level, LsmTable* table) {
+    LsmTable** grown = (LsmTable**)realloc(v->levels[level], sizeof(LsmTable*) * (v->counts[level] + 1));
+    if (!grown) {
+        return false;
+    }
+    v->levels[level] = grown;
+
+    int pos = v->counts[level];
+    while (pos > 0 && (level == 0 ? grown[pos - 1]->number < table->number
+                                  : strcmp(grown[pos - 1]->smallest, table->smallest) > 0)) {
+        grown[pos] = grown[pos - 1];
+        pos--;
+    }
+    grown[pos] = table;
+    v->counts[level]++;
+    table_ref(table);
+    return true;
+}
+
+static void version_remove(LsmVersion* v, int level, LsmTable* table) {
+    for (int i = 0; i < v->counts[level]; i++) {
+        if (v->levels[level][i] == table) {
+            memmove(&v->levels[level][i], &v->levels[level][i + 1],
+                    sizeof(LsmTable*) * (v->counts[level] - i - 1));
+            v->counts[level]--;
+            table_unref(table);
+            return;
+        }
+    }
+}
+
+// Record a version's tables and oldest needed log (caller holds lsm->lock)
+static bool manifest_write_locked(KVLsm* lsm, const LsmVersion* v) {
+    char path[300];
+    char tmp_path[310];
+    snprintf(path, sizeof(path), "%s/lsm_manifest", lsm->dir);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE* file = fopen(tmp_path, "w");
+    if (!file) {
+        fprintf(stderr, "Error writing LSM manifest: %s\n", strerror(errno));
+        return false;
+    }
+    fprintf(file, "next %llu\n", (unsigned long long)lsm->next_number);
+    fprintf(file, "log %llu\n", (unsigned long long)(v->imm ? v->imm : v->mem)->log_number);
+    for (int level = 0; level < KV_LSM_LEVELS; level++) {
+        for (int i = 0; i < v->counts[level]; i++) {
+            fprintf(file, "table %d %llu\n", level, (unsigned long long)v->levels[level][i]->number);
+        }
+    }
+
+    bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Error writing LSM manifest: %s\n", strerror(errno));
+        unlink(tmp_path);
+        return false;
+    }
+    sync_dir(lsm->dir);
+    return true;
+}
+
+// Make a version current and wake any writer waiting for room (caller holds
+// lsm->lock)
+static void version_install_locked(KVLsm* lsm, LsmVersion* v) {
+    LsmVersion* old = atomic_load_explicit(&lsm->current, memory_order_relaxed);
+    atomic_store_explicit(&lsm->current, v, memory_order_release);
+    kv_epoch_retire(old, version_retire);
+    pthread_cond_broadcast(&lsm->room);
+}
+
+// Write a memtable out as a table; *table is NULL if it was empty
+static bool write_memtable(KVLsm* lsm, LsmMemtable* mem, LsmTable** table) {
+    *table = NULL;
+    if (memtable_empty(mem)) {
+        return true;
+    }
+
+    LsmBuilder b;
+    if (!builder_start(&b, lsm)) {
+        builder_abandon(&b);
+        return false;
+    }
+    for (LsmNode* node = atomic_load(&mem->head->next[0]); node; node = atomic_load(&node->next[0])) {
+        const KVRecord* rec = atomic_load(&node->rec);
+        builder_add(&b, KV_RECORD_KEY(rec), rec->key_len, rec->version, rec->flags, KV_RECORD_VALUE(rec),
+                    rec->value_len);
+    }
+    *table = builder_finish(&b);
+    return *table != NULL;
+}
+
+// Write the full memtable out as a level-0 table, if there is one
+static bool flush_imm(KVLsm* lsm) {
+    pthread_mutex_lock(&lsm->lock);
+    LsmMemtable* imm = atomic_load_explicit(&lsm->current, memory_order_relaxed)->imm;
+    if (imm) {
+        memtable_ref(imm);
+    }
+    pthread_mutex_unlock(&lsm->lock);
+    if (!imm) {
+        return true;
+    }
+
+    LsmTable* table;
+    uint64_t log_number = imm->log_number;
+    bool ok = write_memtable(lsm, imm, &table);
+    memtable_unref(imm);
+    if (!ok) {
+        return false;
+    }
+
+    pthread_mutex_lock(&lsm->lock);
+    LsmVersion* next = version_copy(atomic_load_explicit(&lsm->current, memory_order_relaxed));
+    if (next) {
+        memtable_unref(next->imm);
+        next->imm = NULL;
+    }
+    ok = next && (!table || version_add(next, 0, table)) && manifest_write_locked(lsm, next);
+    if (ok) {
+        version_install_locked(lsm, next);
+    } else if (next) {
+        version_free(next);
+    }
+    pthread_mutex_unlock(&lsm->lock);
+
+    if (ok) {
+        char path[300];
+        file_path(lsm, log_number, "log", path, sizeof(path));
+        unlink(path);
+        kv_stats_add(KV_STAT_LSM_FLUSHES, 1);
+    } else if (table) {
+        atomic_store(&table->obsolete, true);
+    }
+    table_unref(table);
+    return ok;
+}
+
+// Merging
+//
+// A source is a memtable or a run of tables with disjoint key ranges in key
+// order. The merge returns each key once, from the newest source holding it.
+
+typedef struct {
+    LsmNode* node;             // Memtable position
+    const KVRecord* rec;       // Its record
+    LsmTable** tables;         // Table run
+    int table_count;
+    int table;
+    int block;
+    char* raw;                 // The block being read, decoded
+    char* stored;
+    size_t raw_len;
+    size_t pos;
+    LsmEntry entry;
+    bool valid;
+    const char* key;           // Current entry
+    const char* value;
+    bool failed;               // A block could not be read
+} LsmSource;
+
+static void source_memtable(LsmSource* s, LsmMemtable* mem) {
+    memset(s, 0, sizeof(LsmSource));
+    s->node = mem->head;
+}
+
+static bool source_tables(LsmSource* s, LsmTable** tables, int count) {
+    memset(s, 0, sizeof(LsmSource));
+    s->tables = tables;
+    s->table_count = count;
+    s->raw = (char*)malloc(LSM_BLOCK_MAX);
+    s->stored = (char*)malloc(LSM_BLOCK_MAX);
+    return s->raw && s->stored;
+}
+
+static void source_free(LsmSource* s) {
+    free(s->raw);
+    free(s->stored);
+}
+
+static void source_set_node(LsmSource* s, LsmNode* node) {
+    s->node = node;
+    s->valid = node != NULL;
+    if (node) {
+        s->rec = atomic_load_explicit(&node->rec, memory_order_acquire);
+        s->key = KV_RECORD_KEY(s->rec);
+        s->value = KV_RECORD_VALUE(s->rec);
+        s->entry.version = s->rec->version;
+        s->entry.key_len = s->rec->key_len;
+        s->entry.value_len = s->rec->value_len;
+        s->entry.flags = s->rec->flags;
+    }
+}
+
+// Decode the entry at pos, reading on into later blocks and tables
+static void source_fill(LsmSource* s) {
+    while (!block_entry(s->raw, s->raw_len, s->pos, &s->entry)) {
+        s->block++;
+        s->pos = 0;
+        s->raw_len = 0;
+        if (s->table < s->table_count && s->block >= s->tables[s->table]->block_count) {
+            s->table++;
+            s->block = 0;
+        }
+        if (s->table >= s->table_count) {
+            s->valid = false;
+            return;
+        }
+        int len = table_read_block(s->tables[s->table], s->block, s->raw, s->stored);
+        if (len < 0) {
+            s->failed = true;
+            s->valid = false;
+            return;
+        }
+        s->raw_len = (size_t)len;
+    }
+    s->valid = true;
+    s->key = s->raw + s->pos + sizeof(LsmEntry);
+    s->value = s->key + s->entry.key_len + 1;
+}
+
+static void source_next(LsmSource* s) {
+    if (!s->valid) {
+        return;
+    }
+    if (s->raw) {
+        s->pos += entry_size(&s->entry);
+        source_fill(s);
+    } else {
+        source_set_node(s, atomic_load_explicit(&s->node->next[0], memory_order_acquire));
+    }
+}
+
+// Position a source at start (after it when exclusive; the first key when
+// start is NULL)
+static void source_seek(LsmSource* s, LsmMemtable* mem, const char* start, bool exclusive) {
+    if (!s->raw) {
+        source_set_node(s, memtable_seek(mem, start, exclusive, NULL));
+        return;
+    }
+
+    s->table = 0;
+    if (start) {
+        // The first table whose range reaches start
+        int high = s->table_count;
+        while (s->table < high) {
+            int mid = (s->table + high) / 2;
+            if (strcmp(s->tables[mid]->largest, start) < 0) {
+                s->table = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+    }
+    s->block = s->table < s->table_count && start ? table_find_block(s->tables[s->table], start) : 0;
+
+    // Step back so that source_fill reads the block in
+    s->block--;
+    s->raw_len = 0;
+    s->pos = 0;
+    source_fill(s);
+    while (start && s->valid) {
+        int cmp = strcmp(s->key, start);
+        if (cmp > 0 || (cmp == 0 && !exclusive)) {
+            break;
+        }
+        source_next(s);
+    }
+}
+
+// The source holding the smallest key; on ties the newest, which comes first
+static LsmSource* merge_pick(LsmSource* sources, int count) {
+    LsmSource* best = NULL;
+    for (int i = 0; i < count; i++) {
+        if (sources[i].valid && (!best || strcmp(sources[i].key, best->key) < 0)) {
+            best = &sources[i];
+        }
+    }
+    return best;
+}
+
+// Move past the current key in every source holding it
+static LsmSource* merge_next(LsmSource* sources, int count, LsmSource* current) {
+    for (int i = 0; i < count; i++) {
+        if (&sources[i] != current && sources[i].valid && strcmp(sources[i].key, current->key) == 0) {
+            source_next(&sources[i]);
+        }
+    }
+    source_next(current);
+    return merge_pick(sources, count);
+}
+
+// Compaction
+
+typedef struct {
+    int level;                 // Inputs come from level and level + 1
+    LsmTable** inputs[2];
+    int counts[2];
+    bool bottom;               // No deeper level holds data; deletions can go
+} LsmCompaction;
+
+static uint64_t level_target(int level) {
+    uint64_t target = KV_LSM_L1_SIZE;
+    for (int i = 1; i < level; i++) {
+        target *= KV_LSM_LEVEL_RATIO;
+    }
+    return target;
+}
+
+static bool overlaps(const LsmTable* table, const char* smallest, const char* largest) {
+    return strcmp(table->largest, smallest) >= 0 && strcmp(table->smallest, largest) <= 0;
+}
+
+static void compaction_free(LsmCompaction* c) {
+    for (int which = 0; which < 2; which++) {
+        for (int i = 0; i < c->counts[which]; i++) {
+            table_unref(c->inputs[which][i]);
+        }
+        free(c->inputs[which]);
+    }
+}
+
+// Choose the level most over its target and the tables to merge, taking a
+// reference on each (caller holds lsm->lock). Level 0 is merged whole; a
+// deeper level gives up one table at a time, going round its key range.
+static bool pick_compaction_locked(KVLsm* lsm, const LsmVersion* v, LsmCompaction* c) {
+    memset(c, 0, sizeof(LsmCompaction));
+    double best_score = (double)v->counts[0] / KV_LSM_L0_COMPACT;
+    int best = 0;
+    for (int level = 1; level < KV_LSM_LEVELS - 1; level++) {
+        double score = (double)level_bytes(v, level) / (double)level_target(level);
+        if (score > best_score) {
+            best_score = score;
+            best = level;
+        }
+    }
+    if (best_score < 1.0) {
+        return false;
+    }
+
+    c->level = best;
+    int first = 0;
+    int count = v->counts[best];
+    if (best > 0) {
+        while (first < count && strcmp(v->levels[best][first]->smallest, lsm->compact_pointer[best]) <= 0) {
+            first++;
+        }
+        first = first < count ? first : 0;
+        count = 1;
+    }
+
+    c->inputs[0] = (LsmTable**)malloc(sizeof(LsmTable*) * count);
+    c->inputs[1] = (LsmTable**)malloc(sizeof(LsmTable*) * (v->counts[best + 1] + 1));
+    if (!c->inputs[0] || !c->inputs[1]) {
+        compaction_free(c);
+        return false;
+    }
+
+    const char* smallest = v->levels[best][first]->smallest;
+    const char* largest = v->levels[best][first]->largest;
+    for (int i = 0; i < count; i++) {
+        LsmTable* table = v->levels[best][first + i];
+        smallest = strcmp(table->smallest, smallest) < 0 ? table->smallest : smallest;
+        largest = strcmp(table->largest, largest) > 0 ? table->largest : largest;
+        table_ref(table);
+        c->inputs[0][c->counts[0]++] = table;
+    }
+    for (int i = 0; i < v->counts[best + 1]; i++) {
+        LsmTable* table = v->levels[best + 1][i];
+        if (overlaps(table, smallest, largest)) {
+            table_ref(table);
+            c->inputs[1][c->counts[1]++] = table;
+        }
+    }
+
+    c->bottom = true;
+    for (int level = best + 2; level < KV_LSM_LEVELS; level++) {
+        c->bottom = c->bottom && v->counts[level] == 0;
+    }
+    if (best > 0) {
+        strncpy(lsm->compact_pointer[best], largest, MAX_KEY_SIZE - 1);
+    }
+    return true;
+}
+
+// Swap a compaction's inputs for its outputs (caller holds lsm->lock)
+static bool install_compaction_locked(KVLsm* lsm, const LsmCompaction* c, LsmTable** outputs, int output_count) {
+    LsmVersion* next = version_copy(atomic_load_explicit(&lsm->current, memory_order_relaxed));
+    if (!next) {
+        return false;
+    }
+    for (int which = 0; which < 2; which++) {
+        for (int i = 0; i < c->counts[which]; i++) {
+            version_remove(next, c->level + which, c->inputs[which][i]);
+        }
+    }
+    bool ok = true;
+    for (int i = 0; ok && i < output_count; i++) {
+        ok = version_add(next, c->level + 1, outputs[i]);
+    }
+    if (!ok || !manifest_write_locked(lsm, next)) {
+        version_free(next);
+        return false;
+    }
+
+    version_install_locked(lsm, next);
+    return true;
+}
+
+// Merge the inputs into new tables at the next level. The merge gives way
+// to a waiting memtable between output tables, so writers are not held up
+// behind a long compaction. Returns false on an I/O error; a compaction cut
+// short by shutdown leaves the tables as they were.
+static bool run_compaction(KVLsm* lsm, LsmCompaction* c) {
+    if (c->counts[0] == 1 && c->counts[1] == 0) {
+        // Nothing to merge with: the table moves down as it is
+        pthread_mutex_lock(&lsm->lock);
+        bool moved = install_compaction_locked(lsm, c, c->inputs[0], 1);
+        pthread_mutex_unlock(&lsm->lock);
+        if (moved) {
+            kv_stats_add(KV_STAT_LSM_COMPACTIONS, 1);
+        }
+        return moved;
+    }
+
+    // Level-0 tables are separate sources, newest first; the rest are runs
+    int source_count = 0;
+    LsmSource* sources = (LsmSource*)calloc(c->counts[0] + 1, sizeof(LsmSource));
+    LsmTable** outputs = NULL;
+    int output_count = 0;
+    bool ok = sources != NULL;
+    if (ok && c->level == 0) {
+        for (int i = 0; ok && i < c->counts[0]; i++) {
+            ok = source_tables(&sources[source_count++], &c->inputs[0][i], 1);
+        }
+    } else if (ok) {
+        ok = source_tables(&sources[source_count++], c->inputs[0], c->counts[0]);
+    }
+    if (ok && c->counts[1] > 0) {
+        ok = source_tables(&sources[source_count++], c->inputs[1], c->counts[1]);
+    }
+    for (int i = 0; ok && i < source_count; i++) {
+        source_seek(&sources[i], NULL, NULL, false);
+    }
+
+    LsmBuilder b;
+    bool building = false;
+    uint64_t written = 0;
+    LsmSource* current = ok ? merge_pick(sources, source_count) : NULL;
+    for (; ok && current; current = merge_next(sources, source_count, current)) {
+        if ((current->entry.flags & LSM_TOMBSTONE) && c->bottom) {
+            continue;
+        }
+        if (!building) {
+            LsmTable** grown = (LsmTable**)realloc(outputs, sizeof(LsmTable*) * (output_count + 1));
+            ok = grown && builder_start(&b, lsm);
+            outputs = grown ? grown : outputs;
+            if (!ok) {
+                if (grown) {
+                    builder_abandon(&b);
+                }
+                break;
+            }
+            building = true;
+        }
+
+        ok = builder_add(&b, current->key, current->entry.key_len, current->entry.version, current->entry.flags,
+                         current->value, current->entry.value_len);
+        if (ok && builder_size(&b) >= KV_LSM_TABLE_SIZE) {
+            building = false;
+            outputs[output_count] = builder_finish(&b);
+            ok = outputs[output_count] != NULL;
+            if (ok) {
+                written += outputs[output_count++]->size;
+                ok = flush_imm(lsm) && atomic_load(&lsm->running);
+            }
+        } else if (!ok) {
+            building = false;
+            builder_abandon(&b);
+        }
+    }
+    for (int i = 0; i < source_count; i++) {
+        ok = ok && !sources[i].failed;
+        source_free(&sources[i]);
+    }
+    free(sources);
+
+    if (building) {
+        if (ok) {
+            outputs[output_count] = builder_finish(&b);
+            ok = outputs[output_count] != NULL;
+            if (ok) {
+                written += outputs[output_count++]->size;
+            }
+        } else {
+            builder_abandon(&b);
+        }
+    }
+
+    bool stopping = !atomic_load(&lsm->running);
+    if (ok) {
+        pthread_mutex_lock(&lsm->lock);
+        ok = install_compaction_locked(lsm, c, outputs, output_count);
+        pthread_mutex_unlock(&lsm->lock);
+    }
+    if (ok) {
+        for (int which = 0; which < 2; which++) {
+            for (int i = 0; i < c->counts[which]; i++) {
+                atomic_store(&c->inputs[which][i]->obsolete, true);
+            }
+        }
+        kv_stats_add(KV_STAT_LSM_COMPACTIONS, 1);
+        kv_stats_add(KV_STAT_LSM_COMPACTION_BYTES, (int64_t)written);
+    }
+    for (int i = 0; i < output_count; i++) {
+        if (!ok) {
+            atomic_store(&outputs[i]->obsolete, true);
+        }
+        table_unref(outputs[i]);
+    }
+    free(outputs);
+    return ok || stopping;
+}
+
+// Writes
+
+// Start a new memtable and log, handing the full one to the background
+// thread (caller holds lsm->lock)
+static bool switch_memtable_locked(KVLsm* lsm, LsmVersion* v) {
+    uint64_t number = new_number_locked(lsm);
+    int fd = log_create(lsm, number);
+    if (fd < 0) {
+        return false;
+    }
+
+    LsmMemtable* mem = memtable_create(number);
+    LsmVersion* next = mem ? version_copy(v) : NULL;
+    if (!next) {
+        memtable_unref(mem);
+        close(fd);
+        return false;
+    }
+    next->imm = next->mem;
+    next->mem = mem;
+
+    close(lsm->log_fd);
+    lsm->log_fd = fd;
+    version_install_locked(lsm, next);
+    pthread_cond_signal(&lsm->work);
+    return true;
+}
+
+// Make sure the memtable can take a write, waiting while level 0 is too
+// deep or a full memtable is still being flushed (caller holds lsm->lock)
+static bool make_room_locked(KVLsm* lsm) {
+    bool stalled = false;
+    while (true) {
+        LsmVersion* v = atomic_load_explicit(&lsm->current, memory_order_relaxed);
+        bool full = v->mem->bytes >= KV_LSM_MEMTABLE_SIZE;
+        if (lsm->failed && full) {
+            return false;
+        }
+        if (v->counts[0] >= KV_LSM_L0_STALL || (full && v->imm)) {
+            if (!stalled) {
+                kv_stats_add(KV_STAT_LSM_STALLS, 1);
+                stalled = true;
+            }
+            pthread_cond_wait(&lsm->room, &lsm->lock);
+            continue;
+        }
+        return !full || switch_memtable_locked(lsm, v);
+    }
+}
+
+// Key filters
+
+static inline int filter_shard(uint64_t hash) {
+    return (int)(hash >> (64 - KV_SHARD_BITS));
+}
+
+// Epoch callback for a replaced key filter
+static void filter_retire(void* ptr) {
+    struct KVCuckoo* filter = (struct KVCuckoo*)ptr;
+    kv_stats_add(KV_STAT_LSM_FILTER_BYTES, -(int64_t)kv_cuckoo_bytes(filter));
+    kv_cuckoo_free(filter);
+}
+
+static void request_rebuild_locked(KVLsm* lsm) {
+    if (!lsm->filter_rebuild && !lsm->rebuilding[0]) {
+        lsm->filter_rebuild = true;
+        pthread_cond_signal(&lsm->work);
+    }
+}
+
+// Add a key to a filter unless a fingerprint already matches it; false if
+// the filter is full
+static bool filter_add(struct KVCuckoo* filter, uint64_t hash) {
+    return kv_cuckoo_may_contain(filter, hash) ? !kv_cuckoo_full(filter) : kv_cuckoo_add(filter, hash);
+}
+
+// Keep the key filters in step with a write (caller holds lsm->lock)
+static void filter_update_locked(KVLsm* lsm, uint64_t hash, bool deleted) {
+    if (deleted) {
+        if (++lsm->filter_stale > lsm->filter_keys / 4 + KV_LSM_FILTER_MIN_KEYS) {
+            request_rebuild_locked(lsm);
+        }
+        return;
+    }
+
+    int shard = filter_shard(hash);
+    struct KVCuckoo* filter = atomic_load_explicit(&lsm->filters[shard], memory_order_relaxed);
+    if (lsm->rebuilding[shard]) {
+        filter_add(lsm->rebuilding[shard], hash);
+    }
+    if (filter && !filter_add(filter, hash)) {
+        request_rebuild_locked(lsm);
+    }
+}
+
+// Engine operations
+
+static KVRecord* lsm_lookup(KVStore* store, unsigned int hash, const char* key) {
+    KVLsm* lsm = store->lsm;
+    uint64_t bloom_hash = filter_hash(key, strnlen(key, MAX_KEY_SIZE - 1));
+    struct KVCuckoo* filter = atomic_load_explicit(&lsm->filters[filter_shard(bloom_hash)], memory_order_acquire);
+    bool filtered = filter && !kv_cuckoo_full(filter);
+    if (filtered && !kv_cuckoo_may_contain(filter, bloom_hash)) {
+        kv_stats_add(KV_STAT_LSM_FILTER_NEGATIVES, 1);
+        return NULL;
+    }
+
+    LsmVersion* v = atomic_load_explicit(&lsm->current, memory_order_acquire);
+    KVRecord* rec = memtable_get(v->mem, key);
+    if (!rec && v->imm) {
+        rec = memtable_get(v->imm, key);
+    }
+    bool found = rec != NULL;
+    if (rec && (rec->flags & LSM_TOMBSTONE)) {
+        rec = NULL;
+    }
+
+    for (int i = 0; !found && i < v->counts[0]; i++) {
+        found = table_get(v->levels[0][i], key, hash, bloom_hash, &rec);
+    }
+    for (int level = 1; !found && level < KV_LSM_LEVELS; level++) {
+        // The one table whose range could hold the key
+        int low = 0;
+        int high = v->counts[level];
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (strcmp(v->levels[level][mid]->largest, key) < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        found = low < v->counts[level] && table_get(v->levels[level][low], key, hash, bloom_hash, &rec);
+    }
+    if (!rec && filtered) {
+        kv_stats_add(KV_STAT_LSM_FILTER_FALSE_POSITIVES, 1);
+    }
+    return rec;
+}
+
+static bool lsm_insert(KVStore* store, KVShard* shard, KVRecord* rec) {
+    (void)shard;
+    KVLsm* lsm = store->lsm;
+    uint64_t hash = filter_hash(KV_RECORD_KEY(rec), rec->key_len);
+    pthread_mutex_lock(&lsm->lock);
+    bool ok = make_room_locked(lsm) && log_append(lsm, rec) &&
+              memtable_put(atomic_load_explicit(&lsm->current, memory_order_relaxed)->mem, rec);
+    if (ok) {
+        filter_update_locked(lsm, hash, rec->flags & LSM_TOMBSTONE);
+    }
+    pthread_mutex_unlock(&lsm->lock);
+    return ok;
+}
+
+// A delete is written as a tombstone, which hides older copies until a
+// compaction into the last level holding data drops them together
+static bool lsm_remove(KVStore* store, KVShard* shard, unsigned int hash, const char* key) {
+    KVRecord* current = lsm_lookup(store, hash, key);
+    if (!current) {
+        return false;
+    }
+
+    KVRecord* tombstone = kv_record_create(key, hash, "", 0, LSM_TOMBSTONE, current->version);
+    if (!tombstone || !lsm_insert(store, shard, tombstone)) {
+        kv_record_release(tombstone);
+        return false;
+    }
+    return true;
+}
+
+static void lsm_each(KVStore* store, const char* start, bool exclusive, bool values,
+                     bool (*fn)(void* arg, const char* key, const KVRecord* rec), void* arg) {
+    kv_epoch_enter();
+    LsmVersion* v = atomic_load_explicit(&store->lsm->current, memory_order_acquire);
+
+    // Newest first: memtables, level-0 tables, then one run per level
+    LsmSource* sources = (LsmSource*)calloc(2 + v->counts[0] + KV_LSM_LEVELS, sizeof(LsmSource));
+    KVRecord* scratch = values ? (KVRecord*)malloc(sizeof(KVRecord) + MAX_KEY_SIZE + MAX_VALUE_SIZE + 2) : NULL;
+    int count = 0;
+    bool ok = sources && (!values || scratch);
+    if (ok) {
+        source_memtable(&sources[count], v->mem);
+        source_seek(&sources[count++], v->mem, start, exclusive);
+        if (v->imm) {
+            source_memtable(&sources[count], v->imm);
+            source_seek(&sources[count++], v->imm, start, exclusive);
+        }
+    }
+    for (int i = 0; ok && i < v->counts[0]; i++) {
+        ok = source_tables(&sources[count++], &v->levels[0][i], 1);
+    }
+    for (int level = 1; ok && level < KV_LSM_LEVELS; level++) {
+        if (v->counts[level] > 0) {
+            ok = source_tables(&sources[count++], v->levels[level], v->counts[level]);
+        }
+    }
+    for (int i = 0; ok && i < count; i++) {
+        if (sources[i].raw) {
+            source_seek(&sources[i], NULL, start, exclusive);
+        }
+    }
+
+    LsmSource* current = ok ? merge_pick(sources, count) : NULL;
+    for (; current; current = merge_next(sources, count, current)) {
+        if (current->entry.flags & LSM_TOMBSTONE) {
+            continue;
+        }
+
+        const KVRecord* rec = NULL;
+        if (values && current->raw) {
+            // Table entries are copied into a record that lasts for the call
+            scratch->version = current->entry.version;
+            scratch->hash = 0;
+            scratch->key_len = current->entry.key_len;
+            scratch->value_len = current->entry.value_len;
+            scratch->flags = current->entry.flags;
+            memcpy(KV_RECORD_KEY(scratch), current->key, current->entry.key_len + 1);
+            memcpy(KV_RECORD_VALUE(scratch), current->value, current->entry.value_len);
+            KV_RECORD_VALUE(scratch)[current->entry.value_len] = '\0';
+            rec = scratch;
+        } else if (values) {
+            rec = current->rec;
+        }
+        if (!fn(arg, current->key, rec)) {
+            break;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        source_free(&sources[i]);
+    }
+    free(sources);
+    free(scratch);
+    kv_epoch_exit();
+}
+
+// Background work
+
+typedef struct {
+    KVLsm* lsm;
+    uint64_t hashes[LSM_FILTER_BATCH];
+    int count;
+    bool ok;                   // No flush failed
+} FilterBuild;
+
+// Add a batch of keys to the filters being built, then let a full memtable
+// be flushed so writers are not held up behind the rebuild
+static bool filter_add_batch(FilterBuild* fb) {
+    KVLsm* lsm = fb->lsm;
+    pthread_mutex_lock(&lsm->lock);
+    for (int i = 0; i < fb->count; i++) {
+        filter_add(lsm->rebuilding[filter_shard(fb->hashes[i])], fb->hashes[i]);
+    }
+    pthread_mutex_unlock(&lsm->lock);
+    fb->count = 0;
+    fb->ok = flush_imm(lsm);
+    return fb->ok && atomic_load(&lsm->running);
+}
+
+static bool filter_key(void* arg, const char* key, const KVRecord* rec) {
+    (void)rec;
+    FilterBuild* fb = (FilterBuild*)arg;
+    fb->hashes[fb->count++] = filter_hash(key, strlen(key));
+    return fb->count < LSM_FILTER_BATCH || filter_add_batch(fb);
+}
+
+// Replace every key filter with one sized for the keys the tree holds, or
+// twice what a full one held, dropping deleted keys. Writes made meanwhile
+// go into both, so the new filters miss no key. Returns false if a flush
+// failed.
+static bool rebuild_filters(KVLsm* lsm) {
+    pthread_mutex_lock(&lsm->lock);
+    LsmVersion* v = atomic_load_explicit(&lsm->current, memory_order_relaxed);
+    uint64_t keys = v->mem->entries + (v->imm ? v->imm->entries : 0);
+    for (int level = 0; level < KV_LSM_LEVELS; level++) {
+        for (int i = 0; i < v->counts[level]; i++) {
+            keys += v->levels[level][i]->entries;
+        }
+    }
+
+    bool ok = true;
+    for (int shard = 0; shard < KV_SHARD_COUNT; shard++) {
+        struct KVCuckoo* filter = atomic_load_explicit(&lsm->filters[shard], memory_order_relaxed);
+        uint64_t want = keys / KV_SHARD_COUNT + keys / KV_SHARD_COUNT / 4;
+        if (filter && kv_cuckoo_full(filter) && kv_cuckoo_count(filter) * 2 > want) {
+            want = kv_cuckoo_count(filter) * 2;
+        }
+        lsm->rebuilding[shard] = kv_cuckoo_create(want > KV_LSM_FILTER_MIN_KEYS ? want : KV_LSM_FILTER_MIN_KEYS);
+        ok = ok && lsm->rebuilding[shard];
+    }
+    lsm->filter_rebuild = false;
+    lsm->filter_stale = 0;
+    pthread_mutex_unlock(&lsm->lock);
+
+    FilterBuild* fb = ok ? (FilterBuild*)malloc(sizeof(FilterBuild)) : NULL;
+    bool built = false;
+    if (fb) {
+        fb->lsm = lsm;
+        fb->count = 0;
+        fb->ok = true;
+        lsm_each(lsm->store, NULL, false, false, filter_key, fb);
+        built = fb->ok && atomic_load(&lsm->running) && filter_add_batch(fb);
+    }
+
+    pthread_mutex_lock(&lsm->lock);
+    lsm->filter_keys = 0;
+    for (int shard = 0; shard < KV_SHARD_COUNT; shard++) {
+        struct KVCuckoo* filter = lsm->rebuilding[shard];
+        lsm->rebuilding[shard] = NULL;
+        if (!built) {
+            kv_cuckoo_free(filter);
+            continue;
+        }
+        lsm->filter_keys += kv_cuckoo_count(filter);
+        kv_stats_add(KV_STAT_LSM_FILTER_BYTES, (int64_t)kv_cuckoo_bytes(filter));
+        kv_epoch_retire(atomic_exchange_explicit(&lsm->filters[shard], filter, memory_order_acq_rel), filter_retire);
+        if (kv_cuckoo_full(filter)) {
+            lsm->filter_rebuild = true;
+        }
+    }
+    pthread_mutex_unlock(&lsm->lock);
+
+    if (built) {
+        kv_stats_add(KV_STAT_LSM_FILTER_REBUILDS, 1);
+    }
+    bool flushed = !fb || fb->ok;
+    free(fb);
+    return flushed;
+}
+
+static void* lsm_main(void* arg) {
+    KVLsm* lsm = (KVLsm*)arg;
+    pthread_mutex_lock(&lsm->lock);
+    while (atomic_load(&lsm->running)) {
+        LsmVersion* v = atomic_load_explicit(&lsm->current, memory_order_relaxed);
+        LsmCompaction c;
+        bool ok = true;
+        if (lsm->failed) {
+            pthread_cond_wait(&lsm->work, &lsm->lock);
+            continue;
+        } else if (v->imm) {
+            pthread_mutex_unlock(&lsm->lock);
+            ok = flush_imm(lsm);
+            pthread_mutex_lock(&lsm->lock);
+        } else if (lsm->filter_rebuild) {
+            pthread_mutex_unlock(&lsm->lock);
+            ok = rebuild_filters(lsm);
+            pthread_mutex_lock(&lsm->lock);
+        } else if (pick_compaction_locked(lsm, v, &c)) {
+            pthread_mutex_unlock(&lsm->lock);
+            ok = run_compaction(lsm, &c);
+            compaction_free(&c);
+            pthread_mutex_lock(&lsm->lock);
+        } else {
+            pthread_cond_wait(&lsm->work, &lsm->lock);
+            continue;
+        }
+
+        if (!ok) {
+            // Writes that need room fail from now on rather than wait forever
+            fprintf(stderr, "Error: LSM background work failed; writes will be refused once the memtable fills\n");
+            lsm->failed = true;
+            pthread_cond_broadcast(&lsm->room);
+        }
+    }
+    pthread_mutex_unlock(&lsm->lock);
+    return NULL;
+}
+
+// Number of a file named lsm_<number>.<suffix>, or 0
+static uint64_t parse_number(const char* name, const char* suffix) {
+    char* end;
+    if (strncmp(name, "lsm_", 4) != 0) {
+        return 0;
+    }
+    unsigned long long number = strtoull(name + 4, &end, 10);
+    return end != name + 4 && *end == '.' && strcmp(end + 1, suffix) == 0 ? (uint64_t)number : 0;
+}
+
+static int compare_numbers(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Load the tables the manifest lists; a missing manifest is an empty store
+static bool manifest_read(KVLsm* lsm, LsmVersion* v, uint64_t* log_number) {
+    char path[300];
+    snprintf(path, sizeof(path), "%s/lsm_manifest", lsm->dir);
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return errno == ENOENT;
+    }
+
+    bool ok = true;
+    char line[128];
+    while (ok && fgets(line, sizeof(line), file)) {
+        unsigned long long number;
+        int level;
+        if (sscanf(line, "next %llu", &number) == 1) {
+            lsm->next_number = number > lsm->next_number ? number : lsm->next_number;
+        } else if (sscanf(line, "log %llu", &number) == 1) {
+            *log_number = number;
+        } else if (sscanf(line, "table %d %llu", &level, &number) == 2) {
+            LsmTable* table = level >= 0 && level < KV_LSM_LEVELS ? table_open(lsm, number) : NULL;
+            ok = table && version_add(v, level, table);
+            table_unref(table);
+            if (ok) {
+                kv_store_observe_version(lsm->store, table->max_version);
+            }
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+// Logs from number on, oldest first; sets *count
+static uint64_t* find_logs(KVLsm* lsm, uint64_t from, int* count) {
+    *count = 0;
+    DIR* dir = opendir(lsm->dir);
+    if (!dir) {
+        return NULL;
+    }
+
+    int allocated = 8;
+    uint64_t* numbers = (uint64_t*)malloc(sizeof(uint64_t) * allocated);
+    struct dirent* entry;
+    while (numbers && (entry = readdir(dir)) != NULL) {
+        uint64_t number = parse_number(entry->d_name, "log");
+        if (number == 0 || number < from) {
+            continue;
+        }
+        if (*count == allocated) {
+            uint64_t* grown = (uint64_t*)realloc(numbers, sizeof(uint64_t) * allocated * 2);
+            if (!grown) {
+                break;
+            }
+            numbers = grown;
+            allocated *= 2;
+        }
+        numbers[(*count)++] = number;
+    }
+    closedir(dir);
+
+    if (numbers) {
+        qsort(numbers, *count, sizeof(uint64_t), compare_numbers);
+    }
+    return numbers;
+}
+
+static bool version_has_table(const LsmVersion* v, uint64_t number) {
+    for (int level = 0; level < KV_LSM_LEVELS; level++) {
+        for (int i = 0; i < v->counts[level]; i++) {
+            if (v->levels[level][i]->number == number) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Find the highest file number, or delete the files the manifest no longer
+// needs once it has been written
+static void scan_files(KVLsm* lsm, const LsmVersion* v) {
+    DIR* dir = opendir(lsm->dir);
+    if (!dir) {
+        return;
+    }
+
+    struct dirent* entry;
+    char path[600];
+    while ((entry = readdir(dir)) != NULL) {
+        uint64_t table = parse_number(entry->d_name, "sst");
+        uint64_t log = parse_number(entry->d_name, "log");
+        uint64_t number = table > log ? table : log;
+        if (!v && number >= lsm->next_number) {
+            lsm->next_number = number + 1;
+        }
+        if (v && ((table && !version_has_table(v, table)) || (log && log != v->mem->log_number))) {
+            snprintf(path, sizeof(path), "%s/%s", lsm->dir, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+// Open the tables in dir and replay the logs the last run left behind
+static bool lsm_open(KVStore* store, const char* dir) {
+    if (!dir || strlen(dir) >= 256 || !ensure_directory_exists(dir)) {
+        return false;
+    }
+
+    KVLsm* lsm = (KVLsm*)calloc(1, sizeof(KVLsm));
+    LsmVersion* v = (LsmVersion*)calloc(1, sizeof(LsmVersion));
+    if (!lsm || !v) {
+        free(lsm);
+        free(v);
+        return false;
+    }
+    lsm->store = store;
+    strcpy(lsm->dir, dir);
+    lsm->next_number = 1;
+    lsm->log_fd = -1;
+    pthread_mutex_init(&lsm->lock, NULL);
+    pthread_cond_init(&lsm->work, NULL);
+    pthread_cond_init(&lsm->room, NULL);
+    atomic_init(&lsm->current, v);
+    atomic_init(&lsm->running, false);
+
+    scan_files(lsm, NULL);
+    uint64_t log_number = 0;
+    bool ok = manifest_read(lsm, v, &log_number);
+    if (!ok) {
+        fprintf(stderr, "Error opening LSM store in %s: manifest names a missing or damaged table\n", dir);
+    }
+
+    // Writes still only in logs go into a level-0 table before anything else
+    int log_count = 0;
+    uint64_t* logs = ok ? find_logs(lsm, log_number, &log_count) : NULL;
+    LsmMemtable* replay = ok ? memtable_create(0) : NULL;
+    ok = ok && replay;
+    for (int i = 0; ok && i < log_count; i++) {
+        char path[300];
+        file_path(lsm, logs[i], "log", path, sizeof(path));
+        ok = log_replay(lsm, path, replay);
+    }
+    free(logs);
+
+    LsmTable* table = NULL;
+    ok = ok && write_memtable(lsm, replay, &table) && (!table || version_add(v, 0, table));
+    table_unref(table);
+    memtable_unref(replay);
+
+    uint64_t number = lsm->next_number++;
+    v->mem = ok ? memtable_create(number) : NULL;
+    lsm->log_fd = v->mem ? log_create(lsm, number) : -1;
+    ok = lsm->log_fd >= 0 && manifest_write_locked(lsm, v);
+    if (ok) {
+        // Lookups go unfiltered until the background thread has built the
+        // key filters from the tree
+        scan_files(lsm, v);
+        lsm->filter_rebuild = true;
+        store->lsm = lsm;
+        atomic_store(&lsm->running, true);
+        ok = pthread_create(&lsm->thread, NULL, lsm_main, lsm) == 0;
+    }
+
+    if (!ok) {
+        store->lsm = NULL;
+        if (lsm->log_fd >= 0) {
+            close(lsm->log_fd);
+        }
+        version_free(v);
+        pthread_mutex_destroy(&lsm->lock);
+        pthread_cond_destroy(&lsm->work);
+        pthread_cond_destroy(&lsm->room);
+        free(lsm);
+        return false;
+    }
+    return true;
+}
+
+// Stop the background thread; the memtable stays in its log for the next open
+static void lsm_close(KVStore* store) {
+    KVLsm* lsm = store->lsm;
+    pthread_mutex_lock(&lsm->lock);
+    atomic_store(&lsm->running, false);
+    pthread_cond_signal(&lsm->work);
+    pthread_mutex_unlock(&lsm->lock);
+    pthread_join(lsm->thread, NULL);
+
+    close(lsm->log_fd);
+    kv_epoch_drain();
+    for (int shard = 0; shard < KV_SHARD_COUNT; shard++) {
+        struct KVCuckoo* filter = atomic_load(&lsm->filters[shard]);
+        if (filter) {
+            filter_retire(filter);
+        }
+    }
+    version_free(atomic_load(&lsm->current));
+    pthread_mutex_destroy(&lsm->lock);
+    pthread_cond_destroy(&lsm->work);
+    pthread_cond_destroy(&lsm->room);
+    free(lsm);
+    store->lsm = NULL;
+}
+
+const KVEngineOps kv_engine_lsm = {
+    "lsm", lsm_open, lsm_close, lsm_lookup, lsm_insert, lsm_remove, lsm_each, NULL,
+};
+
+// Tables in a level and their total size, for metrics
+int kv_lsm_level_tables(KVStore* store, int level, uint64_t* bytes) {
+    *bytes = 0;
+    if (!store || !store->lsm || level < 0 || level >= KV_LSM_LEVELS) {
+        return 0;
+    }
+
+    kv_epoch_enter();
+    LsmVersion* v = atomic_load_explicit(&store->lsm->current, memory_order_acquire);
+    int count = v->counts[level];
+    *bytes = level_bytes(v, level);
+    kv_epoch_exit();
+    return count;
+}
@@ -0,0 +1,498 @@
+#include "kv_store.h"
+
+// Storage engine microbenchmarks
+//
+// Links the store directly and times its entry points without the network:
+// put/get/delete at several fill levels and thread counts, kv_key_hash, log
+// appends under each durability mode, snapshot/recovery against the number
+// of keys, and the memory, LSM and mmap storage engines side by side. Every case runs KV_MICROBENCH_RUNS times and the median
+// is reported together with the spread, so runs can be compared over time.
+
+#define KV_MICROBENCH_RUNS 5
+#define KV_MICROBENCH_CAPACITY 100000
+#define KV_MICROBENCH_MAX_THREADS 8
+#define KV_MICROBENCH_MISSING 1000000000  // Key numbers from here on are never stored
+
+typedef struct {
+    char name[64];
+    double ns_per_op;          // Median over the runs
+    double spread;             // (max - min) / median
+    double ops_per_sec;        // Aggregate throughput at the median
+} BenchResult;
+
+typedef enum {
+    MB_PUT,
+    MB_GET,
+    MB_DELETE,
+    MB_GET_MISSING
+} StoreOp;
+
+typedef struct {
+    KVStore* store;
+    StoreOp op;
+    int first_key;             // This thread's slice of the key space
+    int key_count;
+    long ops;
+    uint64_t seed;
+    pthread_barrier_t* barrier;
+} StoreWorker;
+
+static bool json_output = false;
+static bool quick = false;
+static char data_dir[256];
+static BenchResult results[256];
+static int result_count = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static void make_key(char* key, int i) {
+    snprintf(key, MAX_KEY_SIZE, "key%010d", i);
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Record the median of per-run ns/op figures
+static void add_result(const char* name, double* ns_per_op, int runs, int threads) {
+    qsort(ns_per_op, runs, sizeof(double), compare_doubles);
+
+    BenchResult* result = &results[result_count++];
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->ns_per_op = ns_per_op[runs / 2];
+    result->spread = result->ns_per_op > 0 ? (ns_per_op[runs - 1] - ns_per_op[0]) / result->ns_per_op : 0;
+    result->ops_per_sec = result->ns_per_op > 0 ? 1e9 / result->ns_per_op * threads : 0;
+
+    if (!json_output) {
+        printf("%-40s %12.1f %14.0f %9.1f%%\n", result->name, result->ns_per_op,
+               result->ops_per_sec, result->spread * 100.0);
+        fflush(stdout);
+    }
+}
+
+// Store operations
+
+static void fill_store(KVStore* store, int count) {
+    char key[MAX_KEY_SIZE];
+    char value[MAX_VALUE_SIZE];
+    memset(value, 'v', 100);
+    value[100] = '\0';
+
+    for (int i = 0; i < count; i++) {
+        make_key(key, i);
+        kv_store_put(store, key, kv_key_hash(key), value, NULL);
+    }
+}
+
+static void* store_worker(void* arg) {
+    StoreWorker* w = (StoreWorker*)arg;
+    char key[MAX_KEY_SIZE];
+    char value[MAX_VALUE_SIZE];
+    memset(value, 'w', 100);
+    value[100] = '\0';
+
+    pthread_barrier_wait(w->barrier);
+
+    for (long i = 0; i < w->ops; i++) {
+        switch (w->op) {
+            case MB_PUT:
+                // Overwrite keys in this thread's slice
+                make_key(key, w->first_key + (int)(next_random(&w->seed) % (uint64_t)w->key_count));
+                kv_store_put(w->store, key, kv_key_hash(key), value, NULL);
+                break;
+
+            case MB_GET:
+                make_key(key, w->first_key + (int)(next_random(&w->seed) % (uint64_t)w->key_count));
+                kv_store_get(w->store, key, kv_key_hash(key), value, NULL);
+                break;
+
+            case MB_DELETE:
+                // Each key in the slice is deleted once
+                make_key(key, w->first_key + (int)i);
+                kv_store_delete(w->store, key, kv_key_hash(key), NULL);
+                break;
+
+            case MB_GET_MISSING:
+                // Keys numbered past any the store was filled with
+                make_key(key, KV_MICROBENCH_MISSING + (int)(next_random(&w->seed) % (uint64_t)w->key_count));
+                kv_store_get(w->store, key, kv_key_hash(key), value, NULL);
+                break;
+        }
+    }
+
+    return NULL;
+}
+
+// Time one run of op over `threads` threads; returns ns per operation per thread
+static double time_store_op(KVStore* store, StoreOp op, int fill, int threads, long ops_per_thread) {
+    pthread_t tids[KV_MICROBENCH_MAX_THREADS];
+    StoreWorker workers[KV_MICROBENCH_MAX_THREADS];
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, (unsigned int)threads + 1);
+
+    for (int t = 0; t < threads; t++) {
+        workers[t].store = store;
+        workers[t].op = op;
+        workers[t].first_key = fill / threads * t;
+        workers[t].key_count = fill / threads;
+        workers[t].ops = op == MB_DELETE ? fill / threads : ops_per_thread;
+        workers[t].seed = 0x9E3779B97F4A7C15ULL * (uint64_t)(t + 1);
+        workers[t].barrier = &barrier;
+        pthread_create(&tids[t], NULL, store_worker, &workers[t]);
+    }
+
+    pthread_barrier_wait(&barrier);
+    uint64_t start = now_ns();
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    uint64_t elapsed = now_ns() - start;
+    pthread_barrier_destroy(&barrier);
+
+    return (double)elapsed / (double)workers[0].ops;
+}
+
+static void bench_store_ops(void) {
+    static const int fill_percents[] = { 10, 50, 90 };
+    static const int thread_counts[] = { 1, 2, 4 };
+    static const char* op_names[] = { "put", "get", "delete" };
+    long ops_per_thread = quick ? 20000 : 200000;
+
+    for (size_t f = 0; f < sizeof(fill_percents) / sizeof(fill_percents[0]); f++) {
+        int fill = KV_MICROBENCH_CAPACITY / 100 * fill_percents[f];
+
+        for (size_t th = 0; th < sizeof(thread_counts) / sizeof(thread_counts[0]); th++) {
+            int threads = thread_counts[th];
+
+            for (int op = MB_PUT; op <= MB_DELETE; op++) {
+                double runs[KV_MICROBENCH_RUNS];
+                for (int r = 0; r < KV_MICROBENCH_RUNS; r++) {
+                    // A fresh store per run keeps deletes from emptying it
+                    KVStore* store = kv_store_init(KV_MICROBENCH_CAPACITY);
+                    fill_store(store, fill);
+                    runs[r] = time_store_op(store, (StoreOp)op, fill, threads, ops_per_thread);
+                    kv_store_destroy(store);
+                }
+
+                char name[64];
+                snprintf(name, sizeof(name), "%s fill=%d%% threads=%d", op_names[op], fill_percents[f], threads);
+                add_result(name, runs, KV_MICROBENCH_RUNS, threads);
+            }
+        }
+    }
+}
+
+// kv_key_hash
+
+static void bench_hash(void) {
+    static const int key_lengths[] = { 8, 32, 127 };
+    long iterations = quick ? 200000 : 2000000;
+
+    for (size_t l = 0; l < sizeof(key_lengths) / sizeof(key_lengths[0]); l++) {
+        int len = key_lengths[l];
+
+        // A small rotating set of keys so the loop is not a single constant input
+        char keys[64][MAX_KEY_SIZE];
+        uint64_t seed = 42;
+        for (int k = 0; k < 64; k++) {
+            for (int c = 0; c < len; c++) {
+                keys[k][c] = (char)('a' + next_random(&seed) % 26);
+            }
+            keys[k][len] = '\0';
+        }
+
+        double runs[KV_MICROBENCH_RUNS];
+        for (int r = 0; r < KV_MICROBENCH_RUNS; r++) {
+            volatile uint64_t sink = 0;
+            uint64_t start = now_ns();
+            for (long i = 0; i < iterations; i++) {
+                sink += kv_key_hash(keys[i & 63]);
+            }
+            runs[r] = (double)(now_ns() - start) / (double)iterations;
+            (void)sink;
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "kv_key_hash len=%d", len);
+        add_result(name, runs, KV_MICROBENCH_RUNS, 1);
+    }
+}
+
+// Persistence
+
+// Remove the files a persistent store left in the data directory
+static void clear_data_dir(void) {
+    DIR* dir = opendir(data_dir);
+    if (!dir) {
+        return;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", data_dir, entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+static void bench_log(void) {
+    static const KVDurability modes[] = { KV_DURABILITY_BUFFERED, KV_DURABILITY_FSYNC, KV_DURABILITY_ASYNC };
+    static const char* mode_names[] = { "buffered", "fsync", "async" };
+
+    char value[MAX_VALUE_SIZE];
+    memset(value, 'l', 100);
+    value[100] = '\0';
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        long records = modes[m] == KV_DURABILITY_FSYNC ? (quick ? 200 : 1000) : (quick ? 2000 : 20000);
+
+        double runs[KV_MICROBENCH_RUNS];
+        for (int r = 0; r < KV_MICROBENCH_RUNS; r++) {
+            clear_data_dir();
+            KVStore* store = kv_store_init(KV_MICROBENCH_CAPACITY);
+            kv_store_set_durability(store, modes[m]);
+            kv_store_enable_persistence(store, data_dir);
+
+            char key[MAX_KEY_SIZE];
+            uint64_t start = now_ns();
+            for (long i = 0; i < records; i++) {
+                make_key(key, (int)i);
+                kv_store_log_operation(store, OP_PUT, key, value, (uint64_t)i + 1);
+            }
+            runs[r] = (double)(now_ns() - start) / (double)records;
+
+            kv_store_destroy(store);
+        }
+
+        // Includes the snapshot and log rotation every SNAPSHOT_THRESHOLD records
+        char name[64];
+        snprintf(name, sizeof(name), "log_operation durability=%s", mode_names[m]);
+        add_result(name, runs, KV_MICROBENCH_RUNS, 1);
+    }
+}
+
+static void bench_snapshot_recovery(void) {
+    static const int sizes[] = { 1000, 10000, 50000 };
+    int size_count = quick ? 2 : 3;
+
+    for (int s = 0; s < size_count; s++) {
+        double snapshot_runs[KV_MICROBENCH_RUNS];
+        double recovery_runs[KV_MICROBENCH_RUNS];
+
+        for (int r = 0; r < KV_MICROBENCH_RUNS; r++) {
+            clear_data_dir();
+
+            // Fill in memory first, then persist everything with one snapshot
+            KVStore* store = kv_store_init(sizes[s]);
+            fill_store(store, sizes[s]);
+            kv_store_enable_persistence(store, data_dir);
+
+            uint64_t start = now_ns();
+            kv_store_create_snapshot(store);
+            snapshot_runs[r] = (double)(now_ns() - start) / sizes[s];
+            kv_store_destroy(store);
+
+            store = kv_store_init(sizes[s]);
+            start = now_ns();
+            kv_store_enable_persistence(store, data_dir);
+            recovery_runs[r] = (double)(now_ns() - start) / sizes[s];
+            kv_store_destroy(store);
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "snapshot keys=%d", sizes[s]);
+        add_result(name, snapshot_runs, KV_MICROBENCH_RUNS, 1);
+        snprintf(name, sizeof(name), "recovery keys=%d", sizes[s]);
+        add_result(name, recovery_runs, KV_MICROBENCH_RUNS, 1);
+    }
+}
+
+// Storage engines
+
+// A store on the named engine; an on-disk engine starts from an empty data
+// directory
+static KVStore* open_engine(const char* engine, int capacity) {
+    clear_data_dir();
+    KVStore* store = kv_store_init(capacity);
+    if (store && !kv_store_set_engine(store, engine, data_dir)) {
+        fprintf(stderr, "Cannot open the %s engine in %s\n", engine, data_dir);
+        kv_store_destroy(store);
+        return NULL;
+    }
+    return store;
+}
+
+// Time pages of about 100 keys from random start keys; returns ns per page
+static double time_scan(KVStore* store, int fill, long pages) {
+    char buffer[100 * 14 + 1];
+    char cursor[MAX_KEY_SIZE];
+    char key[MAX_KEY_SIZE];
+    bool done;
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+
+    uint64_t start = now_ns();
+    for (long i = 0; i < pages; i++) {
+        make_key(key, (int)(next_random(&seed) % (uint64_t)fill));
+        kv_store_scan(store, key, false, NULL, NULL, buffer, sizeof(buffer), cursor, &done);
+    }
+    return (double)(now_ns() - start) / (double)pages;
+}
+
+// Time reopening an engine's files through to the first GET; ns per reopen
+static double time_reopen(const char* engine, int capacity) {
+    char value[MAX_VALUE_SIZE];
+    char key[MAX_KEY_SIZE];
+    make_key(key, 0);
+
+    uint64_t start = now_ns();
+    KVStore* store = kv_store_init(capacity);
+    if (!store || !kv_store_set_engine(store, engine, data_dir)) {
+        fprintf(stderr, "Cannot reopen the %s engine in %s\n", engine, data_dir);
+        kv_store_destroy(store);
+        return 0;
+    }
+    kv_store_get(store, key, kv_key_hash(key), value, NULL);
+    double elapsed = (double)(now_ns() - start);
+    kv_store_destroy(store);
+    return elapsed;
+}
+
+// The same workload on each engine: loading the keys in order, random
+// overwrites, random gets on one and four threads, gets for missing keys,
+// and short scans, then for engines that keep files, reopening them. LSM
+// tables and the mmap files are read through the page cache, so gets
+// measure decoding and probing rather than the disk.
+static void bench_engines(void) {
+    static const char* engines[] = { "memory", "lsm", "mmap" };
+    int fill = quick ? 50000 : 500000;
+    long ops_per_thread = quick ? 20000 : 200000;
+    long pages = quick ? 2000 : 20000;
+
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+        double load_runs[KV_MICROBENCH_RUNS];
+        double put_runs[KV_MICROBENCH_RUNS];
+        double get_runs[KV_MICROBENCH_RUNS];
+        double get4_runs[KV_MICROBENCH_RUNS];
+        double missing_runs[KV_MICROBENCH_RUNS];
+        double scan_runs[KV_MICROBENCH_RUNS];
+        double reopen_runs[KV_MICROBENCH_RUNS];
+        bool reopens = strcmp(engines[e], "memory") != 0;
+
+        for (int r = 0; r < KV_MICROBENCH_RUNS; r++) {
+            KVStore* store = open_engine(engines[e], fill);
+            if (!store) {
+                return;
+            }
+
+            uint64_t start = now_ns();
+            fill_store(store, fill);
+            load_runs[r] = (double)(now_ns() - start) / fill;
+            put_runs[r] = time_store_op(store, MB_PUT, fill, 1, ops_per_thread);
+            get_runs[r] = time_store_op(store, MB_GET, fill, 1, ops_per_thread);
+            get4_runs[r] = time_store_op(store, MB_GET, fill, 4, ops_per_thread);
+            missing_runs[r] = time_store_op(store, MB_GET_MISSING, fill, 1, ops_per_thread);
+            scan_runs[r] = time_scan(store, fill, pages);
+            kv_store_destroy(store);
+            if (reopens) {
+                reopen_runs[r] = time_reopen(engines[e], fill);
+            }
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "engine=%s load keys=%d", engines[e], fill);
+        add_result(name, load_runs, KV_MICROBENCH_RUNS, 1);
+        snprintf(name, sizeof(name), "engine=%s put threads=1", engines[e]);
+        add_result(name, put_runs, KV_MICROBENCH_RUNS, 1);
+        snprintf(name, sizeof(name), "engine=%s get threads=1", engines[e]);
+        add_result(name, get_runs, KV_MICROBENCH_RUNS, 1);
+        snprintf(name, sizeof(name), "engine=%s get threads=4", engines[e]);
+        add_result(name, get4_runs, KV_MICROBENCH_RUNS, 4);
+        snprintf(name, sizeof(name), "engine=%s get missing threads=1", engines[e]);
+        add_result(name, missing_runs, KV_MICROBENCH_RUNS, 1);
+        snprintf(name, sizeof(name), "engine=%s scan 100 keys", engines[e]);
+        add_result(name, scan_runs, KV_MICROBENCH_RUNS, 1);
+        if (reopens) {
+            snprintf(name, sizeof(name), "engine=%s reopen keys=%d", engines[e], fill);
+            add_result(name, reopen_runs, KV_MICROBENCH_RUNS, 1);
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const char* filter = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json_output = true;
+        } else if (strcmp(argv[i], "--quick") == 0) {
+            quick = true;
+        } else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc) {
+            filter = argv[i + 1];
+            i++;
+        } else {
+            fprintf(stderr, "Usage: %s [--quick] [--json] [--only store|hash|log|snapshot|engine]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Persistence cases write into a private scratch directory
+    snprintf(data_dir, sizeof(data_dir), "/tmp/kv_microbench.XXXXXX");
+    if (!mkdtemp(data_dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    if (!json_output) {
+        printf("Index probe: %s\n", kv_group_ops()->name);
+        printf("%-40s %12s %14s %10s\n", "Benchmark", "ns/op", "ops/s", "spread");
+    }
+
+    if (!filter || strcmp(filter, "store") == 0) {
+        bench_store_ops();
+    }
+    if (!filter || strcmp(filter, "hash") == 0) {
+        bench_hash();
+    }
+    if (!filter || strcmp(filter, "log") == 0) {
+        bench_log();
+    }
+    if (!filter || strcmp(filter, "snapshot") == 0) {
+        bench_snapshot_recovery();
+    }
+    if (!filter || strcmp(filter, "engine") == 0) {
+        bench_engines();
+    }
+
+    clear_data_dir();
+    rmdir(data_dir);
+
+    if (json_output) {
+        printf("[");
+        for (int i = 0; i < result_count; i++) {
+            printf("%s{\"name\":\"%s\",\"ns_per_op\":%.2f,\"ops_per_sec\":%.1f,\"spread\":%.4f}",
+                   i ? "," : "", results[i].name, results[i].ns_per_op, results[i].ops_per_sec, results[i].spread);
+        }
+        printf("]\n");
+    }
+
+    return 0;
+}
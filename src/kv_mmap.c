@@ -0,0 +1,1205 @@
+#include "kv_store.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+// Memory-mapped engine
+//
+// Records live in a slab heap inside one data file, and each shard's hash
+// index in a file of its own; all of them are mapped shared, so the page
+// cache is the only copy and a restart maps the files and serves at once,
+// faulting pages in as they are read. Index entries hold the file offset of
+// a record's slot, never a pointer, so the files work wherever they are
+// mapped. Readers take no locks: a lookup probes the mapped index and
+// returns the record in place. Writers copy a new record into a free slot
+// and swap the index entry; the old slot goes back on its class's free list
+// after an epoch grace period.
+//
+// Every write is also appended to a write-ahead log with a log sequence
+// number (LSN). A checkpoint switches to a new log, syncs the heap and then
+// records the last LSN it covers in the file header, after which older logs
+// are deleted. A clean close checkpoints, syncs the index files and marks
+// the header clean; opening a clean file replays nothing. After a crash the
+// index files and free lists cannot be trusted, so open rebuilds them from
+// the heap's checksummed slots, keeping the higher version of a key found
+// twice, and replays the log records past the checkpoint.
+//
+// Scans need the keys in order. The ordered index is loaded into memory by
+// a background thread after open; point reads and writes do not wait for it,
+// scans do.
+
+#define MMAP_MAGIC 0x3150414d4d564bULL   // "KVMMAP1"
+#define MMAP_INDEX_MAGIC 0x3158444e494d4bULL  // "KMINDX1"
+#define MMAP_FORMAT 1
+#define MMAP_HEADER_SIZE 4096      // File header page; slabs follow it
+#define MMAP_SLAB_HEADER 64        // Slab header bytes before its first slot
+#define MMAP_SLAB_MAGIC 0x42414c53U
+#define MMAP_MIN_SLOT 64
+#define MMAP_CLASSES 6             // Slot sizes 64 << class, up to 2048 bytes
+#define MMAP_SLOT_FREE 0
+#define MMAP_SLOT_LIVE 1
+#define MMAP_EMPTY 0               // Index entry never used
+#define MMAP_DELETED 1             // Index entry whose key was deleted; probing continues past it
+#define MMAP_TAG_BITS 16
+#define MMAP_SCAN_WIDTH 8          // Index entries per group of a hash-order walk
+#define MMAP_DELETE 0x80           // Log record flag: the key was deleted
+#define MMAP_ORDER_BATCH 1024      // Index entries added to the ordered index per shard lock hold
+
+// First page of the heap file. The free lists are only current after a
+// clean close; the checkpoint fields are written by every checkpoint.
+typedef struct {
+    uint64_t magic;
+    uint32_t format;
+    uint32_t slab_size;
+    uint64_t hash_seed;        // Key hash seed the index files were built with
+    uint64_t slabs;            // Slabs carved from the file
+    uint64_t checkpoint_lsn;   // Every logged write up to here is in the heap
+    uint64_t max_version;      // Highest version written as of the checkpoint
+    uint64_t free_heads[MMAP_CLASSES];  // Free slots by class, linked through MmapSlot.next
+    uint32_t clean;            // Closed cleanly: the index files and free lists are current
+    uint32_t reserved;
+} MmapHeader;
+
+// Start of a slab; slots of one class follow
+typedef struct {
+    uint32_t magic;
+    uint32_t size_class;
+} MmapSlab;
+
+// Slot header, followed by a KVRecord
+typedef struct {
+    uint32_t crc;              // Of the record's fields other than refs, referenced and hash, and its data
+    uint16_t state;            // MMAP_SLOT_*
+    uint16_t size_class;
+    uint64_t next;             // Next free slot of the class (free slots only)
+} MmapSlot;
+
+// Index file header, followed by the entries: a slot offset shifted left by
+// MMAP_TAG_BITS with hash bits below it, or MMAP_EMPTY or MMAP_DELETED
+typedef struct {
+    uint64_t magic;
+    uint32_t mask;             // Entries - 1
+    uint32_t reserved;
+    uint64_t used;             // Live entries plus deleted ones (shard lock)
+    uint64_t live;
+    uint8_t pad[KV_CACHE_LINE - 32];
+} MmapIndexHeader;
+
+typedef struct {
+    MmapIndexHeader* header;   // Start of the mapping
+    _Atomic uint64_t* entries;
+    uint32_t mask;
+    size_t bytes;              // Mapping length
+} MmapIndex;
+
+// Log record header, followed by the key and the value as stored
+typedef struct {
+    uint32_t crc;              // Of the header with crc 0, the key and the value
+    uint16_t key_len;
+    uint16_t value_len;
+    uint64_t lsn;
+    uint64_t version;
+    uint8_t flags;             // KV_RECORD_* and MMAP_DELETE
+    uint8_t reserved[7];
+} MmapLogEntry;
+
+struct KVMmap {
+    KVStore* store;
+    char dir[256];
+    int fd;                    // Heap file
+    char* base;                // KV_MMAP_MAX_BYTES of address space; the file fills the start of it
+    MmapHeader* header;
+    _Atomic(MmapIndex*) indexes[KV_SHARD_COUNT];  // Replaced under the shard lock
+    pthread_mutex_t lock;      // Serializes the log, the slot allocator and the header
+    pthread_cond_t work;       // Wakes the background thread
+    pthread_cond_t ordered_cond; // Wakes scans waiting for the ordered index
+    pthread_t thread;
+    _Atomic bool running;
+    uint64_t file_bytes;       // Heap file size
+    int log_fd;
+    uint64_t log_number;
+    uint64_t log_bytes;        // Appended since the last checkpoint
+    uint64_t next_lsn;
+    uint64_t max_version;
+    bool checkpoint_due;
+    bool ordered;              // Every key is in store->index
+    uint32_t ordered_pos[KV_SHARD_COUNT];  // Index entries below this are in store->index (shard lock)
+    bool ordered_done[KV_SHARD_COUNT];
+};
+
+typedef struct KVMmap KVMmap;
+
+// A slot waiting out its grace period before it is reused
+typedef struct {
+    KVMmap* mm;
+    uint64_t offset;
+} MmapFreed;
+
+static bool write_full(int fd, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static void sync_dir(const char* dir) {
+    int fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static inline int shard_of(unsigned int hash) {
+    return (int)(hash >> (32 - KV_SHARD_BITS));
+}
+
+static inline MmapSlot* slot_at(KVMmap* mm, uint64_t offset) {
+    return (MmapSlot*)(mm->base + offset);
+}
+
+static inline KVRecord* slot_record(MmapSlot* slot) {
+    return (KVRecord*)(slot + 1);
+}
+
+static inline uint64_t entry_make(uint64_t offset, unsigned int hash) {
+    return (offset << MMAP_TAG_BITS) | ((hash >> 12) & ((1U << MMAP_TAG_BITS) - 1));
+}
+
+static inline uint64_t entry_offset(uint64_t entry) {
+    return entry >> MMAP_TAG_BITS;
+}
+
+static inline bool entry_live(uint64_t entry) {
+    return entry > MMAP_DELETED;
+}
+
+static inline size_t slot_size(int size_class) {
+    return (size_t)MMAP_MIN_SLOT << size_class;
+}
+
+// Smallest class whose slots hold this many bytes, or -1
+static int size_class_for(size_t bytes) {
+    for (int c = 0; c < MMAP_CLASSES; c++) {
+        if (slot_size(c) >= bytes) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+static size_t record_size(const KVRecord* rec) {
+    return sizeof(KVRecord) + rec->key_len + rec->value_len + 2;
+}
+
+// The hash is left out: it depends on the seed and is rewritten when that changes
+static uint32_t slot_crc(const KVRecord* rec) {
+    uint32_t crc = kv_crc32c(0, &rec->version, sizeof(rec->version));
+    crc = kv_crc32c(crc, &rec->key_len, sizeof(rec->key_len));
+    crc = kv_crc32c(crc, &rec->value_len, sizeof(rec->value_len));
+    crc = kv_crc32c(crc, &rec->flags, sizeof(rec->flags));
+    return kv_crc32c(crc, rec->data, (size_t)rec->key_len + rec->value_len + 2);
+}
+
+static void file_path(KVMmap* mm, const char* name, char* path, size_t size) {
+    snprintf(path, size, "%s/%s", mm->dir, name);
+}
+
+static void log_path(KVMmap* mm, uint64_t number, char* path, size_t size) {
+    snprintf(path, size, "%s/mmap_%06llu.log", mm->dir, (unsigned long long)number);
+}
+
+static void index_path(KVMmap* mm, int shard, const char* suffix, char* path, size_t size) {
+    snprintf(path, size, "%s/mmap_index_%02d.%s", mm->dir, shard, suffix);
+}
+
+// Slab heap
+
+// Take a free slot, carving a new slab when the class has none (caller
+// holds mm->lock); 0 if the file cannot grow
+static uint64_t slot_alloc_locked(KVMmap* mm, int size_class) {
+    MmapHeader* header = mm->header;
+    uint64_t offset = header->free_heads[size_class];
+    if (offset) {
+        header->free_heads[size_class] = slot_at(mm, offset)->next;
+        return offset;
+    }
+
+    uint64_t slab = MMAP_HEADER_SIZE + header->slabs * KV_MMAP_SLAB_SIZE;
+    if (slab + KV_MMAP_SLAB_SIZE > mm->file_bytes) {
+        uint64_t grown = mm->file_bytes + KV_MMAP_GROW;
+        if (grown > KV_MMAP_MAX_BYTES || ftruncate(mm->fd, (off_t)grown) != 0) {
+            fprintf(stderr, "Error growing mmap data file: %s\n", strerror(errno));
+            return 0;
+        }
+        kv_stats_add(KV_STAT_MMAP_FILE_BYTES, (int64_t)(grown - mm->file_bytes));
+        mm->file_bytes = grown;
+    }
+
+    MmapSlab* header_of_slab = (MmapSlab*)(mm->base + slab);
+    header_of_slab->magic = MMAP_SLAB_MAGIC;
+    header_of_slab->size_class = (uint32_t)size_class;
+    header->slabs++;
+
+    // Hand out the first slot and list the rest in address order
+    size_t size = slot_size(size_class);
+    uint64_t count = (KV_MMAP_SLAB_SIZE - MMAP_SLAB_HEADER) / size;
+    uint64_t first = slab + MMAP_SLAB_HEADER;
+    for (uint64_t i = count - 1; i >= 1; i--) {
+        MmapSlot* slot = slot_at(mm, first + i * size);
+        slot->size_class = (uint16_t)size_class;
+        slot->next = header->free_heads[size_class];
+        header->free_heads[size_class] = first + i * size;
+    }
+    return first;
+}
+
+// Epoch callback: no reader can still hold the slot's record
+static void slot_reclaim(void* arg) {
+    MmapFreed* freed = (MmapFreed*)arg;
+    KVMmap* mm = freed->mm;
+    MmapSlot* slot = slot_at(mm, freed->offset);
+    pthread_mutex_lock(&mm->lock);
+    slot->next = mm->header->free_heads[slot->size_class];
+    mm->header->free_heads[slot->size_class] = freed->offset;
+    pthread_mutex_unlock(&mm->lock);
+    free(freed);
+}
+
+// Reuse a slot once readers are done with it; the caller must not hold
+// mm->lock, which the callback may take. A slot whose retirement cannot be
+// recorded is left unused until the next crash recovery finds it free.
+static void slot_retire(KVMmap* mm, uint64_t offset) {
+    MmapFreed* freed = (MmapFreed*)malloc(sizeof(MmapFreed));
+    if (freed) {
+        freed->mm = mm;
+        freed->offset = offset;
+        kv_epoch_retire(freed, slot_reclaim);
+    }
+}
+
+// Index files
+
+static void index_unmap(MmapIndex* idx) {
+    if (idx) {
+        munmap(idx->header, idx->bytes);
+        free(idx);
+    }
+}
+
+static void index_retire(void* idx) {
+    index_unmap((MmapIndex*)idx);
+}
+
+static MmapIndex* index_map(int fd, size_t bytes) {
+    MmapIndex* idx = (MmapIndex*)calloc(1, sizeof(MmapIndex));
+    void* map = idx ? mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED) {
+        free(idx);
+        return NULL;
+    }
+    idx->header = (MmapIndexHeader*)map;
+    idx->entries = (_Atomic uint64_t*)(idx->header + 1);
+    idx->bytes = bytes;
+    return idx;
+}
+
+// Create an empty index file under a temporary name; index_install puts it
+// in place
+static MmapIndex* index_create(KVMmap* mm, int shard, uint32_t mask) {
+    char path[320];
+    index_path(mm, shard, "tmp", path, sizeof(path));
+    size_t bytes = sizeof(MmapIndexHeader) + ((size_t)mask + 1) * sizeof(uint64_t);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)bytes) != 0) {
+        fprintf(stderr, "Error creating mmap index %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    MmapIndex* idx = index_map(fd, bytes);
+    close(fd);
+    if (idx) {
+        idx->header->magic = MMAP_INDEX_MAGIC;
+        idx->header->mask = mask;
+        idx->mask = mask;
+    }
+    return idx;
+}
+
+// Publish a new index for a shard (caller holds the shard lock); readers
+// of the old one keep it until they leave their epoch
+static void index_install(KVMmap* mm, int shard, MmapIndex* idx) {
+    char tmp[320];
+    char path[320];
+    index_path(mm, shard, "tmp", tmp, sizeof(tmp));
+    index_path(mm, shard, "dat", path, sizeof(path));
+    rename(tmp, path);
+
+    MmapIndex* old = atomic_load_explicit(&mm->indexes[shard], memory_order_relaxed);
+    atomic_store_explicit(&mm->indexes[shard], idx, memory_order_release);
+    if (old) {
+        kv_epoch_retire(old, index_retire);
+    }
+}
+
+// Map a shard's index as the last clean close left it
+static MmapIndex* index_open(KVMmap* mm, int shard) {
+    char path[320];
+    index_path(mm, shard, "dat", path, sizeof(path));
+    int fd = open(path, O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(MmapIndexHeader)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    MmapIndex* idx = index_map(fd, (size_t)st.st_size);
+    close(fd);
+    if (idx && (idx->header->magic != MMAP_INDEX_MAGIC ||
+                sizeof(MmapIndexHeader) + ((size_t)idx->header->mask + 1) * sizeof(uint64_t) != idx->bytes)) {
+        index_unmap(idx);
+        return NULL;
+    }
+    if (idx) {
+        idx->mask = idx->header->mask;
+    }
+    return idx;
+}
+
+// Position of a key's entry, or -1; *free_pos gets the first reusable
+// entry on the probe path
+static int64_t index_find(KVMmap* mm, const MmapIndex* idx, unsigned int hash, const char* key, size_t key_len,
+                          int64_t* free_pos, KVRecord** found) {
+    uint64_t tag = entry_make(0, hash);
+    if (free_pos) {
+        *free_pos = -1;
+    }
+    for (uint32_t i = 0, pos = hash & idx->mask; i <= idx->mask; i++, pos = (pos + 1) & idx->mask) {
+        uint64_t entry = atomic_load_explicit(&idx->entries[pos], memory_order_acquire);
+        if (entry == MMAP_EMPTY) {
+            if (free_pos && *free_pos < 0) {
+                *free_pos = pos;
+            }
+            return -1;
+        }
+        if (entry == MMAP_DELETED) {
+            if (free_pos && *free_pos < 0) {
+                *free_pos = pos;
+            }
+            continue;
+        }
+        if ((entry & ((1U << MMAP_TAG_BITS) - 1)) != tag) {
+            continue;
+        }
+        KVRecord* rec = slot_record(slot_at(mm, entry_offset(entry)));
+        if (rec->hash == hash && rec->key_len == key_len && memcmp(KV_RECORD_KEY(rec), key, key_len) == 0) {
+            if (found) {
+                *found = rec;
+            }
+            return pos;
+        }
+    }
+    return -1;
+}
+
+// Rebuild a shard's index, doubling it unless deleted entries were what
+// filled it (caller holds the shard lock, or is opening the store)
+static bool index_grow(KVMmap* mm, int shard) {
+    MmapIndex* old = atomic_load_explicit(&mm->indexes[shard], memory_order_relaxed);
+    uint32_t mask = old->mask;
+    if ((old->header->live + 1) * 2 > (uint64_t)mask + 1) {
+        mask = mask * 2 + 1;
+    }
+
+    MmapIndex* idx = index_create(mm, shard, mask);
+    if (!idx) {
+        return false;
+    }
+    for (uint32_t i = 0; i <= old->mask; i++) {
+        uint64_t entry = atomic_load_explicit(&old->entries[i], memory_order_relaxed);
+        if (!entry_live(entry)) {
+            continue;
+        }
+        unsigned int hash = slot_record(slot_at(mm, entry_offset(entry)))->hash;
+        uint32_t pos = hash & mask;
+        while (atomic_load_explicit(&idx->entries[pos], memory_order_relaxed) != MMAP_EMPTY) {
+            pos = (pos + 1) & mask;
+        }
+        atomic_store_explicit(&idx->entries[pos], entry, memory_order_relaxed);
+    }
+    idx->header->used = old->header->live;
+    idx->header->live = old->header->live;
+
+    // Entries moved, so the ordered index load restarts on this shard
+    if (!mm->ordered_done[shard]) {
+        mm->ordered_pos[shard] = 0;
+    }
+    index_install(mm, shard, idx);
+    return true;
+}
+
+// Write-ahead log
+
+static int log_create(KVMmap* mm, uint64_t number) {
+    char path[320];
+    log_path(mm, number, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error creating mmap log %s: %s\n", path, strerror(errno));
+    } else {
+        sync_dir(mm->dir);
+    }
+    return fd;
+}
+
+// Append a write to the log under the next LSN (caller holds mm->lock)
+static bool log_append_locked(KVMmap* mm, const KVRecord* rec, uint8_t flags) {
+    char buffer[sizeof(MmapLogEntry) + MAX_KEY_SIZE + MAX_VALUE_SIZE];
+    MmapLogEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.key_len = rec->key_len;
+    entry.value_len = (flags & MMAP_DELETE) ? 0 : rec->value_len;
+    entry.lsn = mm->next_lsn;
+    entry.version = rec->version;
+    entry.flags = flags;
+
+    size_t len = sizeof(entry);
+    memcpy(buffer, &entry, sizeof(entry));
+    memcpy(buffer + len, KV_RECORD_KEY(rec), entry.key_len);
+    len += entry.key_len;
+    memcpy(buffer + len, KV_RECORD_VALUE(rec), entry.value_len);
+    len += entry.value_len;
+    entry.crc = kv_crc32c(0, buffer, len);
+    memcpy(buffer, &entry.crc, sizeof(entry.crc));
+
+    if (!write_full(mm->log_fd, buffer, len)) {
+        fprintf(stderr, "Error writing mmap log: %s\n", strerror(errno));
+        return false;
+    }
+    mm->next_lsn++;
+    mm->log_bytes += len;
+    kv_stats_add(KV_STAT_LOG_BYTES, (int64_t)len);
+    kv_stats_add(KV_STAT_LOG_RECORDS, 1);
+    if (mm->log_bytes >= KV_MMAP_CHECKPOINT_BYTES && !mm->checkpoint_due) {
+        mm->checkpoint_due = true;
+        pthread_cond_signal(&mm->work);
+    }
+
+    if (mm->store->durability == KV_DURABILITY_FSYNC) {
+        uint64_t sync_start = kv_stats_now();
+        bool synced = fdatasync(mm->log_fd) == 0;
+        kv_stats_observe(KV_HIST_FSYNC, kv_stats_now() - sync_start);
+        return synced;
+    }
+    return true;
+}
+
+// Writes
+
+// Add a new key to the ordered index if the background load has already
+// passed its entry (caller holds the shard lock)
+static void order_insert(KVMmap* mm, int shard, int64_t pos, const char* key) {
+    if (mm->ordered_done[shard] || pos < (int64_t)mm->ordered_pos[shard]) {
+        pthread_mutex_lock(&mm->store->index_lock);
+        kv_index_insert(mm->store->index, key);
+        pthread_mutex_unlock(&mm->store->index_lock);
+    }
+}
+
+// Copy a record into a slot and point its key's index entry at it, logging
+// the write first when log is set (caller holds the shard lock)
+static bool mmap_put(KVMmap* mm, const KVRecord* rec, bool log) {
+    int shard = shard_of(rec->hash);
+    MmapIndex* idx = atomic_load_explicit(&mm->indexes[shard], memory_order_relaxed);
+    int64_t free_pos;
+    int64_t pos = index_find(mm, idx, rec->hash, KV_RECORD_KEY(rec), rec->key_len, &free_pos, NULL);
+    if (pos < 0 && (free_pos < 0 || (idx->header->used + 1) * 4 > ((uint64_t)idx->mask + 1) * 3)) {
+        if (!index_grow(mm, shard)) {
+            return false;
+        }
+        idx = atomic_load_explicit(&mm->indexes[shard], memory_order_relaxed);
+        index_find(mm, idx, rec->hash, KV_RECORD_KEY(rec), rec->key_len, &free_pos, NULL);
+    }
+    int size_class = size_class_for(sizeof(MmapSlot) + record_size(rec));
+    if (size_class < 0) {
+        return false;
+    }
+
+    uint64_t old = pos >= 0 ? entry_offset(atomic_load_explicit(&idx->entries[pos], memory_order_relaxed)) : 0;
+    pthread_mutex_lock(&mm->lock);
+    uint64_t offset = 0;
+    if (!log || log_append_locked(mm, rec, rec->flags)) {
+        offset = slot_alloc_locked(mm, size_class);
+    }
+    if (offset) {
+        MmapSlot* slot = slot_at(mm, offset);
+        KVRecord* copy = slot_record(slot);
+        memcpy(copy, rec, record_size(rec));
+        atomic_init(&copy->refs, 1);
+        atomic_init(&copy->referenced, 1);
+        copy->flags |= KV_RECORD_MAPPED;
+        slot->crc = slot_crc(copy);
+        slot->size_class = (uint16_t)size_class;
+        slot->state = MMAP_SLOT_LIVE;
+        if (old) {
+            slot_at(mm, old)->state = MMAP_SLOT_FREE;
+        }
+        if (rec->version > mm->max_version) {
+            mm->max_version = rec->version;
+        }
+    }
+    pthread_mutex_unlock(&mm->lock);
+    if (!offset) {
+        return false;
+    }
+
+    if (pos >= 0) {
+        atomic_store_explicit(&idx->entries[pos], entry_make(offset, rec->hash), memory_order_release);
+        slot_retire(mm, old);
+        return true;
+    }
+
+    if (atomic_load_explicit(&idx->entries[free_pos], memory_order_relaxed) == MMAP_EMPTY) {
+        idx->header->used++;
+    }
+    idx->header->live++;
+    atomic_store_explicit(&idx->entries[free_pos], entry_make(offset, rec->hash), memory_order_release);
+    atomic_fetch_add(&mm->store->size, 1);
+    order_insert(mm, shard, free_pos, KV_RECORD_KEY(rec));
+    return true;
+}
+
+// Delete a key, logging it first when log is set (caller holds the shard lock)
+static bool mmap_delete(KVMmap* mm, unsigned int hash, const char* key, bool log) {
+    int shard = shard_of(hash);
+    MmapIndex* idx = atomic_load_explicit(&mm->indexes[shard], memory_order_relaxed);
+    int64_t pos = index_find(mm, idx, hash, key, strnlen(key, MAX_KEY_SIZE - 1), NULL, NULL);
+    if (pos < 0) {
+        return false;
+    }
+
+    uint64_t offset = entry_offset(atomic_load_explicit(&idx->entries[pos], memory_order_relaxed));
+    MmapSlot* slot = slot_at(mm, offset);
+    pthread_mutex_lock(&mm->lock);
+    bool ok = !log || log_append_locked(mm, slot_record(slot), MMAP_DELETE);
+    if (ok) {
+        slot->state = MMAP_SLOT_FREE;
+    }
+    pthread_mutex_unlock(&mm->lock);
+    if (!ok) {
+        return false;
+    }
+
+    atomic_store_explicit(&idx->entries[pos], MMAP_DELETED, memory_order_release);
+    idx->header->live--;
+    atomic_fetch_sub(&mm->store->size, 1);
+
+    // The key may be in the ordered index whether or not the load has passed it
+    pthread_mutex_lock(&mm->store->index_lock);
+    kv_index_remove(mm->store->index, KV_RECORD_KEY(slot_record(slot)));
+    pthread_mutex_unlock(&mm->store->index_lock);
+    slot_retire(mm, offset);
+    return true;
+}
+
+// Checkpoints
+
+static uint64_t parse_number(const char* name) {
+    unsigned long long number = 0;
+    char tail[8];
+    if (sscanf(name, "mmap_%llu.%7s", &number, tail) != 2 || strcmp(tail, "log") != 0) {
+        return 0;
+    }
+    return number;
+}
+
+static int compare_numbers(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : (x > y);
+}
+
+// Log numbers in the directory, in order
+static uint64_t* find_logs(KVMmap* mm, int* count) {
+    *count = 0;
+    DIR* dir = opendir(mm->dir);
+    if (!dir) {
+        return NULL;
+    }
+
+    int allocated = 8;
+    uint64_t* numbers = (uint64_t*)malloc(sizeof(uint64_t) * allocated);
+    struct dirent* entry;
+    while (numbers && (entry = readdir(dir)) != NULL) {
+        uint64_t number = parse_number(entry->d_name);
+        if (number == 0) {
+            continue;
+        }
+        if (*count == allocated) {
+            uint64_t* grown = (uint64_t*)realloc(numbers, sizeof(uint64_t) * allocated * 2);
+            if (!grown) {
+                break;
+            }
+            numbers = grown;
+            allocated *= 2;
+        }
+        numbers[(*count)++] = number;
+    }
+    closedir(dir);
+
+    if (numbers) {
+        qsort(numbers, *count, sizeof(uint64_t), compare_numbers);
+    }
+    return numbers;
+}
+
+// Delete the logs before number, whose writes a checkpoint covers
+static void drop_logs(KVMmap* mm, uint64_t number) {
+    int count = 0;
+    uint64_t* logs = find_logs(mm, &count);
+    for (int i = 0; logs && i < count && logs[i] < number; i++) {
+        char path[320];
+        log_path(mm, logs[i], path, sizeof(path));
+        unlink(path);
+    }
+    free(logs);
+}
+
+// Make every write logged so far durable in the heap and drop the logs that
+// held them. Writes go on during the sync into a new log: they land after
+// the checkpoint LSN, so recovery replays them whether or not the sync
+// caught them.
+static bool checkpoint(KVMmap* mm) {
+    pthread_mutex_lock(&mm->lock);
+    uint64_t lsn = mm->next_lsn - 1;
+    uint64_t version = mm->max_version;
+    uint64_t number = mm->log_number + 1;
+    int fd = log_create(mm, number);
+    if (fd < 0) {
+        pthread_mutex_unlock(&mm->lock);
+        return false;
+    }
+    close(mm->log_fd);
+    mm->log_fd = fd;
+    mm->log_number = number;
+    mm->log_bytes = 0;
+    uint64_t file_bytes = mm->file_bytes;
+    pthread_mutex_unlock(&mm->lock);
+
+    if (msync(mm->base, file_bytes, MS_SYNC) != 0) {
+        fprintf(stderr, "Error syncing mmap data file: %s\n", strerror(errno));
+        return false;
+    }
+    pthread_mutex_lock(&mm->lock);
+    mm->header->checkpoint_lsn = lsn;
+    mm->header->max_version = version;
+    pthread_mutex_unlock(&mm->lock);
+    if (msync(mm->base, MMAP_HEADER_SIZE, MS_SYNC) != 0) {
+        return false;
+    }
+
+    drop_logs(mm, number);
+    kv_stats_add(KV_STAT_MMAP_CHECKPOINTS, 1);
+    return true;
+}
+
+// Engine operations
+
+static KVRecord* mmap_lookup(KVStore* store, unsigned int hash, const char* key) {
+    KVMmap* mm = store->mmap;
+    MmapIndex* idx = atomic_load_explicit(&mm->indexes[shard_of(hash)], memory_order_acquire);
+    KVRecord* rec = NULL;
+    index_find(mm, idx, hash, key, strnlen(key, MAX_KEY_SIZE - 1), NULL, &rec);
+    return rec;
+}
+
+// The file takes a copy, so the store's reference is dropped here
+static bool mmap_insert(KVStore* store, KVShard* shard, KVRecord* rec) {
+    (void)shard;
+    if (!mmap_put(store->mmap, rec, true)) {
+        return false;
+    }
+    kv_record_release(rec);
+    return true;
+}
+
+static bool mmap_remove(KVStore* store, KVShard* shard, unsigned int hash, const char* key) {
+    (void)shard;
+    return mmap_delete(store->mmap, hash, key, true);
+}
+
+// Walk the ordered index once the background thread has loaded it
+static void mmap_each(KVStore* store, const char* start, bool exclusive, bool values,
+                      bool (*fn)(void* arg, const char* key, const KVRecord* rec), void* arg) {
+    KVMmap* mm = store->mmap;
+    pthread_mutex_lock(&mm->lock);
+    while (!mm->ordered && atomic_load(&mm->running)) {
+        pthread_cond_wait(&mm->ordered_cond, &mm->lock);
+    }
+    pthread_mutex_unlock(&mm->lock);
+
+    pthread_mutex_lock(&store->index_lock);
+    kv_epoch_enter();
+    for (KVIndexNode* node = kv_index_seek(store->index, start, exclusive); node; node = node->next[0]) {
+        const KVRecord* rec = NULL;
+        if (values) {
+            rec = mmap_lookup(store, (unsigned int)kv_key_hash(node->key), node->key);
+            if (!rec) {
+                continue;
+            }
+        }
+        if (!fn(arg, node->key, rec)) {
+            break;
+        }
+    }
+    kv_epoch_exit();
+    pthread_mutex_unlock(&store->index_lock);
+}
+
+// Walk one group of index entries in hash order. It needs neither the
+// index lock nor the ordered index, so it serves as soon as the file is
+// open. A key sits between its home entry and the next empty one, so the
+// walk ends at the first empty entry past the group.
+static uint64_t mmap_scan(KVStore* store, uint64_t cursor, KVScanFn fn, void* arg) {
+    KVMmap* mm = store->mmap;
+    KVScanGroup found;
+    kv_scan_group_init(&found);
+    kv_epoch_enter();
+
+    MmapIndex* idx = atomic_load_explicit(&mm->indexes[kv_cursor_shard(cursor)], memory_order_acquire);
+    uint32_t groups_mask = (idx->mask + 1) / MMAP_SCAN_WIDTH - 1;
+    uint32_t home = (kv_cursor_group(cursor) & groups_mask) * MMAP_SCAN_WIDTH;
+
+    for (uint32_t i = 0, pos = home; i <= idx->mask; i++, pos = (pos + 1) & idx->mask) {
+        uint64_t entry = atomic_load_explicit(&idx->entries[pos], memory_order_acquire);
+        if (entry == MMAP_EMPTY && i >= MMAP_SCAN_WIDTH - 1) {
+            break;
+        }
+        if (!entry_live(entry)) {
+            continue;
+        }
+        KVRecord* rec = slot_record(slot_at(mm, entry_offset(entry)));
+        if ((rec->hash & idx->mask & ~(MMAP_SCAN_WIDTH - 1)) == home) {
+            kv_scan_group_add(&found, rec->hash & (MMAP_SCAN_WIDTH - 1), KV_RECORD_KEY(rec));
+        }
+    }
+
+    uint64_t next = kv_scan_group_finish(&found, cursor, groups_mask, fn, arg);
+    kv_epoch_exit();
+    return next;
+}
+
+// Background work
+
+// Add every key to the ordered index, a batch of index entries per shard
+// lock hold; writers add the keys the load has already passed
+static void load_order(KVMmap* mm) {
+    KVStore* store = mm->store;
+    for (int shard = 0; shard < KV_SHARD_COUNT && atomic_load(&mm->running); shard++) {
+        while (!mm->ordered_done[shard] && atomic_load(&mm->running)) {
+            pthread_mutex_lock(&store->shards[shard].lock);
+            MmapIndex* idx = atomic_load_explicit(&mm->indexes[shard], memory_order_relaxed);
+            uint64_t end = (uint64_t)mm->ordered_pos[shard] + MMAP_ORDER_BATCH;
+            if (end > (uint64_t)idx->mask + 1) {
+                end = (uint64_t)idx->mask + 1;
+            }
+
+            pthread_mutex_lock(&store->index_lock);
+            for (uint64_t pos = mm->ordered_pos[shard]; pos < end; pos++) {
+                uint64_t entry = atomic_load_explicit(&idx->entries[pos], memory_order_relaxed);
+                if (entry_live(entry)) {
+                    kv_index_insert(store->index, KV_RECORD_KEY(slot_record(slot_at(mm, entry_offset(entry)))));
+                }
+            }
+            pthread_mutex_unlock(&store->index_lock);
+
+            mm->ordered_pos[shard] = (uint32_t)end;
+            mm->ordered_done[shard] = end > idx->mask;
+            pthread_mutex_unlock(&store->shards[shard].lock);
+        }
+    }
+
+    pthread_mutex_lock(&mm->lock);
+    mm->ordered = atomic_load(&mm->running);
+    pthread_cond_broadcast(&mm->ordered_cond);
+    pthread_mutex_unlock(&mm->lock);
+}
+
+static void* mmap_main(void* arg) {
+    KVMmap* mm = (KVMmap*)arg;
+    load_order(mm);
+
+    pthread_mutex_lock(&mm->lock);
+    while (atomic_load(&mm->running)) {
+        if (!mm->checkpoint_due) {
+            pthread_cond_wait(&mm->work, &mm->lock);
+            continue;
+        }
+        mm->checkpoint_due = false;
+        pthread_mutex_unlock(&mm->lock);
+        checkpoint(mm);
+        pthread_mutex_lock(&mm->lock);
+    }
+    pthread_mutex_unlock(&mm->lock);
+    return NULL;
+}
+
+// Opening
+
+// Whether a slot holds an intact record of a size its class can hold
+static bool slot_valid(const MmapSlot* slot, int size_class) {
+    const KVRecord* rec = slot_record((MmapSlot*)slot);
+    return slot->state == MMAP_SLOT_LIVE && slot->size_class == size_class && rec->key_len < MAX_KEY_SIZE &&
+           rec->value_len < MAX_VALUE_SIZE && sizeof(MmapSlot) + record_size(rec) <= slot_size(size_class) &&
+           KV_RECORD_KEY(rec)[rec->key_len] == '\0' && slot_crc(rec) == slot->crc;
+}
+
+// Put a slot found live by the heap scan in its shard's index, keeping the
+// higher version when the key is already there; the loser is freed
+static bool recover_slot(KVMmap* mm, uint64_t offset, uint64_t* freed) {
+    MmapSlot* slot = slot_at(mm, offset);
+    KVRecord* rec = slot_record(slot);
+    rec->hash = (unsigned int)kv_key_hash(KV_RECORD_KEY(rec));
+    kv_store_observe_version(mm->store, rec->version);
+    if (rec->version > mm->max_version) {
+        mm->max_version = rec->version;
+    }
+    int shard = shard_of(rec->hash);
+    MmapIndex* idx = atomic_load_explicit(&mm->indexes[shard], memory_order_relaxed);
+    int64_t free_pos;
+    int64_t pos = index_find(mm, idx, rec->hash, KV_RECORD_KEY(rec), rec->key_len, &free_pos, NULL);
+    if (pos >= 0) {
+        uint64_t other = entry_offset(atomic_load_explicit(&idx->entries[pos], memory_order_relaxed));
+        if (slot_record(slot_at(mm, other))->version >= rec->version) {
+            *freed = offset;
+            return true;
+        }
+        atomic_store_explicit(&idx->entries[pos], entry_make(offset, rec->hash), memory_order_relaxed);
+        *freed = other;
+        return true;
+    }
+
+    if ((idx->header->used + 1) * 4 > ((uint64_t)idx->mask + 1) * 3) {
+        if (!index_grow(mm, shard)) {
+            return false;
+        }
+        idx = atomic_load_explicit(&mm->indexes[shard], memory_order_relaxed);
+        index_find(mm, idx, rec->hash, KV_RECORD_KEY(rec), rec->key_len, &free_pos, NULL);
+    }
+    atomic_store_explicit(&idx->entries[free_pos], entry_make(offset, rec->hash), memory_order_relaxed);
+    idx->header->used++;
+    idx->header->live++;
+    *freed = 0;
+    return true;
+}
+
+// Rebuild the index files and free lists from the heap, after a crash or a
+// change of hash seed
+static bool rebuild_index(KVMmap* mm) {
+    MmapHeader* header = mm->header;
+    memset(header->free_heads, 0, sizeof(header->free_heads));
+    for (int shard = 0; shard < KV_SHARD_COUNT; shard++) {
+        MmapIndex* idx = index_create(mm, shard, KV_MMAP_INDEX_MIN - 1);
+        if (!idx) {
+            return false;
+        }
+        index_install(mm, shard, idx);
+    }
+
+    uint64_t slabs = 0;
+    for (uint64_t s = 0; MMAP_HEADER_SIZE + (s + 1) * KV_MMAP_SLAB_SIZE <= mm->file_bytes; s++) {
+        uint64_t slab = MMAP_HEADER_SIZE + s * KV_MMAP_SLAB_SIZE;
+        const MmapSlab* slab_header = (const MmapSlab*)(mm->base + slab);
+        if (slab_header->magic != MMAP_SLAB_MAGIC || slab_header->size_class >= MMAP_CLASSES) {
+            continue;
+        }
+        slabs = s + 1;
+
+        // Backwards, so each free list comes out in address order
+        int size_class = (int)slab_header->size_class;
+        size_t size = slot_size(size_class);
+        for (uint64_t i = (KV_MMAP_SLAB_SIZE - MMAP_SLAB_HEADER) / size; i-- > 0;) {
+            uint64_t offset = slab + MMAP_SLAB_HEADER + i * size;
+            uint64_t freed = offset;
+            if (slot_valid(slot_at(mm, offset), size_class) && !recover_slot(mm, offset, &freed)) {
+                return false;
+            }
+            if (freed) {
+                MmapSlot* slot = slot_at(mm, freed);
+                if (freed == offset) {
+                    slot->size_class = (uint16_t)size_class;
+                }
+                slot->state = MMAP_SLOT_FREE;
+                slot->next = header->free_heads[slot->size_class];
+                header->free_heads[slot->size_class] = freed;
+            }
+        }
+    }
+    header->slabs = slabs;
+    return true;
+}
+
+// Redo the logged writes past the checkpoint, in LSN order; each log stops
+// at its first torn or damaged record. *last gets the highest log number.
+static bool replay_logs(KVMmap* mm, uint64_t* last) {
+    int count = 0;
+    uint64_t* logs = find_logs(mm, &count);
+    char* buffer = (char*)malloc(sizeof(MmapLogEntry) + MAX_KEY_SIZE + MAX_VALUE_SIZE);
+    KVRecord* rec = (KVRecord*)malloc(sizeof(KVRecord) + MAX_KEY_SIZE + MAX_VALUE_SIZE + 2);
+    bool ok = buffer && rec;
+    uint64_t replayed = 0;
+    *last = 0;
+
+    for (int i = 0; ok && i < count; i++) {
+        char path[320];
+        log_path(mm, logs[i], path, sizeof(path));
+        FILE* file = fopen(path, "rb");
+        if (!file) {
+            ok = false;
+            break;
+        }
+        setvbuf(file, NULL, _IOFBF, 1 << 16);
+        *last = logs[i];
+
+        MmapLogEntry entry;
+        while (ok && fread(&entry, sizeof(entry), 1, file) == 1) {
+            if (entry.key_len >= MAX_KEY_SIZE || entry.value_len >= MAX_VALUE_SIZE) {
+                break;
+            }
+            size_t body = (size_t)entry.key_len + entry.value_len;
+            uint32_t crc = entry.crc;
+            entry.crc = 0;
+            memcpy(buffer, &entry, sizeof(entry));
+            if (fread(buffer + sizeof(entry), 1, body, file) != body ||
+                kv_crc32c(0, buffer, sizeof(entry) + body) != crc) {
+                break;
+            }
+            if (entry.lsn <= mm->header->checkpoint_lsn) {
+                continue;
+            }
+
+            memset(rec, 0, sizeof(KVRecord));
+            rec->version = entry.version;
+            rec->key_len = entry.key_len;
+            rec->value_len = entry.value_len;
+            rec->flags = entry.flags & ~MMAP_DELETE;
+            memcpy(KV_RECORD_KEY(rec), buffer + sizeof(entry), entry.key_len);
+            KV_RECORD_KEY(rec)[entry.key_len] = '\0';
+            memcpy(KV_RECORD_VALUE(rec), buffer + sizeof(entry) + entry.key_len, entry.value_len);
+            KV_RECORD_VALUE(rec)[entry.value_len] = '\0';
+            rec->hash = (unsigned int)kv_key_hash(KV_RECORD_KEY(rec));
+            if (entry.flags & MMAP_DELETE) {
+                mmap_delete(mm, rec->hash, KV_RECORD_KEY(rec), false);
+            } else {
+                ok = mmap_put(mm, rec, false);
+            }
+
+            kv_store_observe_version(mm->store, entry.version);
+            if (entry.lsn >= mm->next_lsn) {
+                mm->next_lsn = entry.lsn + 1;
+            }
+            replayed++;
+        }
+        fclose(file);
+    }
+
+    // The replayed writes are only in the logs until the next checkpoint
+    mm->checkpoint_due = replayed > 0;
+    free(logs);
+    free(buffer);
+    free(rec);
+    return ok;
+}
+
+static void mmap_free(KVMmap* mm) {
+    for (int shard = 0; shard < KV_SHARD_COUNT; shard++) {
+        index_unmap(atomic_load(&mm->indexes[shard]));
+    }
+    if (mm->log_fd >= 0) {
+        close(mm->log_fd);
+    }
+    if (mm->base) {
+        munmap(mm->base, KV_MMAP_MAX_BYTES);
+    }
+    if (mm->fd >= 0) {
+        close(mm->fd);
+    }
+    pthread_mutex_destroy(&mm->lock);
+    pthread_cond_destroy(&mm->work);
+    pthread_cond_destroy(&mm->ordered_cond);
+    free(mm);
+}
+
+// Map the data file in dir, creating it if needed. A cleanly closed file is
+// served as it is; otherwise its index is rebuilt first. Either way the log
+// records past the checkpoint are replayed before open returns.
+static bool mmap_open(KVStore* store, const char* dir) {
+    if (!dir || strlen(dir) >= 256 || !ensure_directory_exists(dir)) {
+        return false;
+    }
+
+    KVMmap* mm = (KVMmap*)calloc(1, sizeof(KVMmap));
+    if (!mm) {
+        return false;
+    }
+    mm->store = store;
+    strcpy(mm->dir, dir);
+    mm->log_fd = -1;
+    pthread_mutex_init(&mm->lock, NULL);
+    pthread_cond_init(&mm->work, NULL);
+    pthread_cond_init(&mm->ordered_cond, NULL);
+    atomic_init(&mm->running, false);
+
+    char path[320];
+    file_path(mm, "mmap_heap.dat", path, sizeof(path));
+    mm->fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    bool ok = mm->fd >= 0 && fstat(mm->fd, &st) == 0;
+    bool fresh = ok && st.st_size == 0;
+    if (fresh) {
+        ok = ftruncate(mm->fd, MMAP_HEADER_SIZE + KV_MMAP_GROW) == 0;
+    }
+    mm->file_bytes = fresh ? MMAP_HEADER_SIZE + KV_MMAP_GROW : (ok ? (uint64_t)st.st_size : 0);
+
+    // The whole address range is reserved now, so the heap grows in place
+    // and records never move
+    void* map = ok ? mmap(NULL, KV_MMAP_MAX_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, mm->fd, 0)
+                   : MAP_FAILED;
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error mapping %s: %s\n", path, strerror(errno));
+        mm->base = NULL;
+        mmap_free(mm);
+        return false;
+    }
+    mm->base = (char*)map;
+    mm->header = (MmapHeader*)map;
+
+    MmapHeader* header = mm->header;
+    if (fresh) {
+        header->magic = MMAP_MAGIC;
+        header->format = MMAP_FORMAT;
+        header->slab_size = KV_MMAP_SLAB_SIZE;
+        header->hash_seed = kv_hash_get_seed();
+    }
+    if (header->magic != MMAP_MAGIC || header->format != MMAP_FORMAT || header->slab_size != KV_MMAP_SLAB_SIZE ||
+        mm->file_bytes < MMAP_HEADER_SIZE || mm->file_bytes > KV_MMAP_MAX_BYTES) {
+        fprintf(stderr, "Error opening %s: not a data file of this format\n", path);
+        mmap_free(mm);
+        return false;
+    }
+
+    bool clean = header->clean && header->hash_seed == kv_hash_get_seed();
+    for (int shard = 0; clean && shard < KV_SHARD_COUNT; shard++) {
+        MmapIndex* idx = index_open(mm, shard);
+        atomic_store(&mm->indexes[shard], idx);
+        clean = idx != NULL;
+    }
+
+    // From here until the next clean close, a crash leaves the file marked
+    // for recovery
+    header->clean = 0;
+    ok = msync(mm->base, MMAP_HEADER_SIZE, MS_SYNC) == 0;
+    if (ok && !clean) {
+        if (!fresh) {
+            fprintf(stderr, "Warning: %s was not closed cleanly; rebuilding its index\n", path);
+        }
+        for (int shard = 0; shard < KV_SHARD_COUNT; shard++) {
+            index_unmap(atomic_load(&mm->indexes[shard]));
+            atomic_store(&mm->indexes[shard], NULL);
+        }
+        header->hash_seed = kv_hash_get_seed();
+        ok = rebuild_index(mm);
+    }
+
+    int live = 0;
+    for (int shard = 0; ok && shard < KV_SHARD_COUNT; shard++) {
+        live += (int)atomic_load(&mm->indexes[shard])->header->live;
+    }
+    atomic_store(&store->size, live);
+    if (header->max_version > mm->max_version) {
+        mm->max_version = header->max_version;
+    }
+    kv_store_observe_version(store, mm->max_version);
+    mm->next_lsn = header->checkpoint_lsn + 1;
+
+    uint64_t last_log = 0;
+    ok = ok && replay_logs(mm, &last_log);
+    if (ok) {
+        mm->log_number = last_log + 1;
+        mm->log_fd = log_create(mm, mm->log_number);
+        ok = mm->log_fd >= 0;
+    }
+    if (ok) {
+        kv_stats_add(KV_STAT_MMAP_FILE_BYTES, (int64_t)mm->file_bytes);
+        store->mmap = mm;
+        atomic_store(&mm->running, true);
+        ok = pthread_create(&mm->thread, NULL, mmap_main, mm) == 0;
+        if (!ok) {
+            kv_stats_add(KV_STAT_MMAP_FILE_BYTES, -(int64_t)mm->file_bytes);
+        }
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Error opening mmap store in %s\n", dir);
+        store->mmap = NULL;
+        atomic_store(&store->size, 0);
+        kv_epoch_drain();
+        mmap_free(mm);
+        return false;
+    }
+    return true;
+}
+
+// Checkpoint, sync the index files and mark the file clean, so the next
+// open maps it and serves at once
+static void mmap_close(KVStore* store) {
+    KVMmap* mm = store->mmap;
+    pthread_mutex_lock(&mm->lock);
+    atomic_store(&mm->running, false);
+    pthread_cond_signal(&mm->work);
+    pthread_cond_broadcast(&mm->ordered_cond);
+    pthread_mutex_unlock(&mm->lock);
+    pthread_join(mm->thread, NULL);
+
+    // Retired slots go back on the free lists before they are saved
+    kv_epoch_drain();
+    bool clean = checkpoint(mm);
+    for (int shard = 0; shard < KV_SHARD_COUNT; shard++) {
+        MmapIndex* idx = atomic_load(&mm->indexes[shard]);
+        clean = clean && msync(idx->header, idx->bytes, MS_SYNC) == 0;
+    }
+    if (clean) {
+        mm->header->clean = 1;
+        clean = msync(mm->base, MMAP_HEADER_SIZE, MS_SYNC) == 0;
+    }
+    if (clean) {
+        // Nothing has been logged since the checkpoint
+        close(mm->log_fd);
+        mm->log_fd = -1;
+        drop_logs(mm, UINT64_MAX);
+    }
+
+    kv_stats_add(KV_STAT_MMAP_FILE_BYTES, -(int64_t)mm->file_bytes);
+    mmap_free(mm);
+    store->mmap = NULL;
+}
+
+const KVEngineOps kv_engine_mmap = {
+    "mmap", mmap_open, mmap_close, mmap_lookup, mmap_insert, mmap_remove, mmap_each, mmap_scan,
+};
@@ -0,0 +1,51 @@
+#include "kv_store.h"
+#include <netinet/tcp.h> // For TCP_NODELAY
+
+// Connect to a server
+int connect_to_server(const char* ip, int port) {
+    int sockfd;
+    struct sockaddr_in server_addr;
+    
+    // Create socket
+    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    
+    // Configure server address
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    
+    // Convert IP address
+    if (inet_pton(AF_INET, ip, &server_addr.sin_addr) <= 0) {
+        close(sockfd);
+        return -1;
+    }
+    
+    // Connect to server
+    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    
+    // Requests are small and latency-bound; do not let Nagle hold them back
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    return sockfd;
+}
+
+// Receive exactly one Message; returns false on error or end of stream
+bool recv_message(int sockfd, Message* msg) {
+    size_t received = 0;
+    while (received < sizeof(Message)) {
+        ssize_t n = recv(sockfd, (char*)msg + received, sizeof(Message) - received, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        received += (size_t)n;
+    }
+    return true;
+}
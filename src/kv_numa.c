@@ -0,0 +1,157 @@
+#define _GNU_SOURCE  // For CPU sets and thread affinity
+#include "kv_store.h"
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+// NUMA placement and thread pinning
+//
+// The topology is read from sysfs, so there is no libnuma dependency. Only
+// nodes with CPUs are counted; they are numbered 0..count-1 here and mapped
+// to kernel node ids where memory policy needs them. On a single-node
+// machine memory comes from calloc and pinning only sets CPU affinity.
+
+#define KV_NUMA_MAX_NODES 64
+
+static int node_count = 0;
+static int node_ids[KV_NUMA_MAX_NODES];           // Kernel id of each node with CPUs
+static cpu_set_t node_cpus[KV_NUMA_MAX_NODES];
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+
+// Parse a sysfs CPU list such as "0-3,8-11"
+static bool read_cpulist(const char* path, cpu_set_t* set) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+
+    char text[4096];
+    bool ok = fgets(text, sizeof(text), file) != NULL;
+    fclose(file);
+    if (!ok) {
+        return false;
+    }
+
+    CPU_ZERO(set);
+    char* p = text;
+    while (*p && *p != '\n') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET((int)cpu, set);
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return true;
+}
+
+static void numa_init(void) {
+    for (int id = 0; id < KV_NUMA_MAX_NODES && node_count < KV_NUMA_MAX_NODES; id++) {
+        char path[96];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+        if (read_cpulist(path, &node_cpus[node_count]) && CPU_COUNT(&node_cpus[node_count]) > 0) {
+            node_ids[node_count++] = id;
+        }
+    }
+
+    // No NUMA information: one node holding every CPU we may run on
+    if (node_count == 0) {
+        node_ids[0] = -1;
+        if (sched_getaffinity(0, sizeof(cpu_set_t), &node_cpus[0]) != 0) {
+            CPU_ZERO(&node_cpus[0]);
+            CPU_SET(0, &node_cpus[0]);
+        }
+        node_count = 1;
+    }
+}
+
+// Number of nodes with CPUs; 1 on machines without NUMA
+int kv_numa_node_count(void) {
+    pthread_once(&numa_once, numa_init);
+    return node_count;
+}
+
+// Node a CPU belongs to, or -1
+int kv_numa_node_of_cpu(int cpu) {
+    pthread_once(&numa_once, numa_init);
+    for (int node = 0; node < node_count; node++) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &node_cpus[node])) {
+            return node;
+        }
+    }
+    return -1;
+}
+
+// The i-th CPU when CPUs are handed out one node after another, so that
+// consecutive threads land on different nodes
+int kv_numa_cpu(int i) {
+    pthread_once(&numa_once, numa_init);
+    int node = i % node_count;
+    int nth = (i / node_count) % CPU_COUNT(&node_cpus[node]);
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &node_cpus[node]) && nth-- == 0) {
+            return cpu;
+        }
+    }
+    return 0;
+}
+
+// Zeroed memory preferring a node (node < 0 for no preference); free it
+// with kv_numa_free
+void* kv_numa_alloc(size_t size, int node) {
+    pthread_once(&numa_once, numa_init);
+    if (node_count < 2) {
+        return calloc(1, size);
+    }
+
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+
+    // A preference rather than a binding: a full node falls back to the others
+    if (node >= 0) {
+        unsigned long mask = 1UL << node_ids[node % node_count];
+        syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+    }
+    return ptr;
+}
+
+void kv_numa_free(void* ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    if (node_count < 2) {
+        free(ptr);
+    } else {
+        munmap(ptr, size);
+    }
+}
+
+// Pin the calling thread to one CPU
+bool kv_numa_pin_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// Let the calling thread run on any CPU of a node
+bool kv_numa_pin_node(int node) {
+    pthread_once(&numa_once, numa_init);
+    if (node < 0 || node >= node_count) {
+        return false;
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &node_cpus[node]) == 0;
+}
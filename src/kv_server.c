@@ -1,185 +1,762 @@
 #include "kv_store.h"
 #include <ctype.h>  // For isdigit function
+#include <limits.h> // For LLONG_MIN
+#include <sys/uio.h> // For scatter/gather sends
+#include <netinet/tcp.h> // For TCP_NODELAY
+
+// Serve clients from io_uring event loops instead of a thread per connection
+static bool use_io_uring = false;
+static int io_threads = 1;
+
+// Pin serving threads to CPUs and keep each connection on the NUMA node
+// that receives its packets
+static bool pin_threads = false;
+
+// Serve Prometheus metrics over HTTP on this port (0 disables)
+static int metrics_port = 0;
+
+// Log requests slower than this many microseconds (0 disables); NULL path is stderr
+static uint64_t slow_log_us = 0;
+static const char* slow_log_path = NULL;
 
 // Thread data structure
 typedef struct {
     int client_fd;
     KVStore* store;
     NodeList* nodes;
+    int node;                  // NUMA node to run on, or -1
 } ThreadData;
 
 // Thread function to handle client connections
 void* client_thread(void* arg) {
     ThreadData* data = (ThreadData*)arg;
     
+    if (data->node >= 0) {
+        kv_numa_pin_node(data->node);
+    }
     handle_client(data->client_fd, data->store, data->nodes);
     
     close(data->client_fd);
+    kv_stats_add(KV_STAT_CONNECTIONS_ACTIVE, -1);
+    kv_admit_connection_closed();
     free(data);
     
     return NULL;
 }
 
-// Function to handle a client connection
+// Turn the request into a redirect reply if this node does not own the key
+static bool redirect_if_not_owner(NodeList* list, Message* msg, uint64_t key_hash) {
+    // Check if this node should handle the key
+    int node_idx = node_for_hash(list, key_hash);
+    if (node_idx != list->current_node_idx && node_idx >= 0) {
+        // Forward to correct node
+        msg->status = -1; // Indicate redirection
+        kv_stats_add(KV_STAT_REDIRECTS, 1);
+        return true;
+    }
+    return false;
+}
+
+// Send a whole iovec array, resuming after short writes
+static bool send_iov_all(int fd, struct iovec* iov, int iov_count) {
+    while (iov_count > 0) {
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = iov_count;
+        
+        ssize_t sent = sendmsg(fd, &mh, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        
+        // Skip past what went out
+        while (iov_count > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = (char*)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return true;
+}
+
+// Send a GET reply as a small header plus the value straight from the
+// stored record, which the caller keeps referenced until this returns
+static bool send_record_reply(int client_fd, ResponseHeader* header, KVRecord* rec) {
+    struct iovec iov[2];
+    int iov_count = 1;
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(ResponseHeader);
+    if (rec && rec->value_len > 0) {
+        iov[1].iov_base = KV_RECORD_VALUE(rec);
+        iov[1].iov_len = rec->value_len;
+        iov_count = 2;
+    }
+    
+    return send_iov_all(client_fd, iov, iov_count);
+}
+
+// Build the header of a variable-length GET reply and pin the record to send
+// after it (NULL if there is no value to send)
+KVRecord* prepare_get_reply(KVStore* store, NodeList* list, Message* msg, ResponseHeader* header) {
+    memset(header, 0, sizeof(ResponseHeader));
+    header->op_code = OP_GET;
+    
+    // Check if this node should handle the key
+    uint64_t key_hash = kv_key_hash(msg->key);
+    int node_idx = node_for_hash(list, key_hash);
+    if (node_idx != list->current_node_idx && node_idx >= 0) {
+        header->status = -1; // Indicate redirection
+        kv_stats_add(KV_STAT_REDIRECTS, 1);
+        return NULL;
+    }
+    
+    KVRecord* rec = kv_store_get_record(store, msg->key, key_hash);
+    if (rec && !(msg->flags & KV_FLAG_ACCEPT_COMPRESSED)) {
+        rec = kv_record_unpack(rec);
+    }
+    if (rec) {
+        header->status = 1; // Success
+        header->value_len = rec->value_len;
+        header->version = rec->version;
+        header->flags = (rec->flags & KV_RECORD_COMPRESSED) ? KV_FLAG_COMPRESSED : 0;
+    } else {
+        header->status = 0; // Key not found
+    }
+    
+    return rec;
+}
+
+// Replicate the result of an atomic operation, left in msg, as a plain
+// versioned PUT to the same keyspace
+static void replicate_write(NodeList* list, const Message* msg) {
+    Message put_msg;
+    memset(&put_msg, 0, sizeof(Message));
+    put_msg.op_code = OP_PUT;
+    put_msg.flags = msg->flags & KV_FLAG_KEYSPACE_MASK;
+    put_msg.version = msg->version;
+    snprintf(put_msg.key, MAX_KEY_SIZE, "%.*s", MAX_KEY_SIZE - 1, msg->key);
+    snprintf(put_msg.value, MAX_VALUE_SIZE, "%.*s", MAX_VALUE_SIZE - 1, msg->value);
+    replicate_to_nodes(list, &put_msg);
+}
+
+// Start a streaming SCAN from its request
+void scan_begin(ScanState* scan, const Message* msg) {
+    strncpy(scan->start, msg->key, MAX_KEY_SIZE - 1);
+    scan->start[MAX_KEY_SIZE - 1] = '\0';
+    strncpy(scan->bound, msg->value, MAX_VALUE_SIZE - 1);
+    scan->bound[MAX_VALUE_SIZE - 1] = '\0';
+    scan->by_prefix = (msg->flags & KV_SCAN_PREFIX) != 0;
+    scan->exclusive = (msg->flags & KV_SCAN_AFTER) != 0;
+    scan->by_hash = (msg->flags & KV_SCAN_HASH) != 0;
+    scan->hash_cursor = strtoull(msg->key, NULL, 10);
+}
+
+// Fill msg with the next hash-order page; returns true if it is the final frame
+static bool scan_next_hash_frame(KVStore* store, ScanState* scan, Message* msg) {
+    uint64_t next;
+    int count = kv_store_scan_cursor(store, scan->hash_cursor, scan->bound, msg->value, MAX_VALUE_SIZE, &next);
+    
+    msg->op_code = OP_SCAN;
+    snprintf(msg->key, MAX_KEY_SIZE, "%llu", (unsigned long long)next);
+    msg->status = count < 0 ? 0 : (next == 0 ? 1 : KV_SCAN_MORE);
+    scan->hash_cursor = next;
+    
+    return msg->status != KV_SCAN_MORE;
+}
+
+// Fill msg with the next SCAN page; returns true if it is the final frame
+bool scan_next_frame(KVStore* store, ScanState* scan, Message* msg) {
+    if (scan->by_hash) {
+        return scan_next_hash_frame(store, scan, msg);
+    }
+    
+    const char* start_key = (scan->start[0] || scan->exclusive) ? scan->start : NULL;
+    
+    bool done;
+    char cursor[MAX_KEY_SIZE];
+    int count = kv_store_scan(store, start_key, scan->exclusive, scan->by_prefix ? NULL : scan->bound,
+                              scan->by_prefix ? scan->bound : NULL, msg->value, MAX_VALUE_SIZE, cursor, &done);
+    if (count == 0) {
+        // Nothing fit or nothing left; either way this is the last frame
+        done = true;
+        strncpy(cursor, scan->start, MAX_KEY_SIZE);
+    }
+    
+    msg->op_code = OP_SCAN;
+    strncpy(msg->key, cursor, MAX_KEY_SIZE);
+    msg->status = done ? 1 : KV_SCAN_MORE;
+    
+    // Resume just after the last key of this page
+    strncpy(scan->start, cursor, MAX_KEY_SIZE);
+    scan->exclusive = true;
+    
+    return done;
+}
+
+// Fill msg with the next chunk of a STATS or HOTKEYS reply; returns true if
+// it is the final frame
+bool stats_next_frame(const char* text, size_t* offset, Message* msg) {
+    size_t remaining = strlen(text + *offset);
+    size_t chunk = remaining < MAX_VALUE_SIZE - 1 ? remaining : MAX_VALUE_SIZE - 1;
+    
+    memcpy(msg->value, text + *offset, chunk);
+    msg->value[chunk] = '\0';
+    *offset += chunk;
+    
+    bool done = text[*offset] == '\0';
+    msg->status = done ? 1 : KV_SCAN_MORE;
+    return done;
+}
+
+// Function to handle a client connection; requests are served in order
+// until the client closes it, so clients may pipeline
 void handle_client(int client_fd, KVStore* store, NodeList* list) {
     Message msg;
-    char buffer[MAX_VALUE_SIZE];
+    KVSlowRequest slow;
     
-    // Read message from client
-    ssize_t bytes_read = recv(client_fd, &msg, sizeof(Message), 0);
-    if (bytes_read <= 0) {
-        return;
+    // Rate limits apply to the client's address and to this connection
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    uint32_t addr = getpeername(client_fd, (struct sockaddr*)&peer, &peer_len) == 0 ? peer.sin_addr.s_addr : 0;
+    KVTokenBucket bucket;
+    kv_rate_conn_init(&bucket);
+    
+    // Read messages from client; the recv span includes waiting for the
+    // client to send the next request
+    while (1) {
+        KV_TRACE_BEGIN(recv_start);
+        if (!recv_message(client_fd, &msg)) {
+            break;
+        }
+        KV_TRACE_END(KV_TRACE_RECV, recv_start);
+        
+        KV_TRACE_BEGIN(parse_start);
+        uint64_t started = kv_stats_now();
+        OperationCode op = msg.op_code;
+        kv_stats_add(KV_STAT_BYTES_IN, sizeof(Message));
+        
+        // Answer busy rather than queue without bound behind the store
+        if (!kv_admit_request(&msg, addr, &bucket, true)) {
+            KV_TRACE_END(KV_TRACE_PARSE, parse_start);
+            if (!kv_send_busy(client_fd, &msg)) {
+                return;
+            }
+            continue;
+        }
+        
+        // Serve the request from the store of the keyspace it names
+        KVStore* target = kv_keyspace_route(store, &msg);
+        if (!target) {
+            kv_admit_exit();
+            KV_TRACE_END(KV_TRACE_PARSE, parse_start);
+            if (!kv_send_status(client_fd, &msg, KV_STATUS_NO_KEYSPACE)) {
+                return;
+            }
+            continue;
+        }
+        kv_slowlog_begin(&slow, &msg, started);
+        kv_hotkeys_sample(op, msg.key);
+        KV_TRACE_END(KV_TRACE_PARSE, parse_start);
+        
+        if (op == OP_SCAN || op == OP_STATS || op == OP_HOTKEYS) {
+            // Stream frames until the reply is complete or the client goes away
+            ScanState scan;
+            char* text = NULL;
+            size_t offset = 0;
+            if (op == OP_SCAN) {
+                scan_begin(&scan, &msg);
+            } else if (op == OP_STATS) {
+                text = kv_stats_render(store, list);
+            } else {
+                text = kv_hotkeys_render();
+            }
+            
+            bool done;
+            do {
+                if (op == OP_SCAN) {
+                    done = scan_next_frame(target, &scan, &msg);
+                } else {
+                    done = stats_next_frame(text ? text : "", &offset, &msg);
+                }
+                kv_slowlog_processed(&slow, strlen(msg.value));
+                KV_TRACE_BEGIN(send_start);
+                if (send(client_fd, &msg, sizeof(Message), MSG_NOSIGNAL) <= 0) {
+                    kv_admit_exit();
+                    free(text);
+                    return;
+                }
+                KV_TRACE_END(KV_TRACE_SEND, send_start);
+                kv_stats_add(KV_STAT_BYTES_OUT, sizeof(Message));
+            } while (!done);
+            
+            kv_admit_exit();
+            free(text);
+            kv_slowlog_end(&slow, client_fd);
+            kv_stats_record_op(op, kv_stats_now() - started);
+            continue;
+        }
+        
+        if (op == OP_GET && (msg.flags & KV_FLAG_VARLEN_REPLY)) {
+            msg.key[MAX_KEY_SIZE - 1] = '\0';
+            ResponseHeader header;
+            KVRecord* rec = prepare_get_reply(target, list, &msg, &header);
+            kv_admit_exit();
+            kv_slowlog_processed(&slow, header.value_len);
+            KV_TRACE_BEGIN(send_start);
+            bool sent = send_record_reply(client_fd, &header, rec);
+            KV_TRACE_END(KV_TRACE_SEND, send_start);
+            kv_record_release(rec);
+            if (!sent) {
+                return;
+            }
+            kv_stats_add(KV_STAT_BYTES_OUT, sizeof(ResponseHeader) + header.value_len);
+            kv_slowlog_end(&slow, client_fd);
+            kv_stats_record_op(op, kv_stats_now() - started);
+            continue;
+        }
+        
+        process_request(&msg, target, list);
+        kv_admit_exit();
+        kv_slowlog_processed(&slow, strnlen(msg.value, MAX_VALUE_SIZE));
+        KV_TRACE_BEGIN(send_start);
+        if (send(client_fd, &msg, sizeof(Message), MSG_NOSIGNAL) <= 0) {
+            return;
+        }
+        KV_TRACE_END(KV_TRACE_SEND, send_start);
+        kv_stats_add(KV_STAT_BYTES_OUT, sizeof(Message));
+        kv_slowlog_end(&slow, client_fd);
+        kv_stats_record_op(op, kv_stats_now() - started);
+        
+        // Membership changes redistribute data after the reply has gone out
+        if (op == OP_NODE_JOIN || op == OP_NODE_LEAVE) {
+            kv_keyspaces_distribute(store, list);
+        }
     }
+}
+
+// Execute a single-reply request, turning msg into the reply in place. SCAN
+// and variable-length GET replies are produced by their own helpers.
+void process_request(Message* msg, KVStore* store, NodeList* list) {
+    msg->key[MAX_KEY_SIZE - 1] = '\0';
+    uint64_t key_hash = kv_key_hash(msg->key);
     
     // Process message based on operation code
-    switch (msg.op_code) {
+    switch (msg->op_code) {
         case OP_GET: {
-            // Check if this node should handle the key
-            int node_idx = node_for_key(list, msg.key);
-            if (node_idx != list->current_node_idx && node_idx >= 0) {
-                // Forward to correct node
-                msg.status = -1; // Indicate redirection
-                send(client_fd, &msg, sizeof(Message), 0);
+            if (redirect_if_not_owner(list, msg, key_hash)) {
                 break;
             }
             
-            if (kv_store_get(store, msg.key, msg.value)) {
-                msg.status = 1; // Success
+            if (kv_store_get(store, msg->key, key_hash, msg->value, &msg->version)) {
+                msg->status = 1; // Success
             } else {
-                msg.status = 0; // Key not found
+                msg->status = 0; // Key not found
             }
-            send(client_fd, &msg, sizeof(Message), 0);
             break;
         }
             
         case OP_PUT: {
-            // Check if this node should handle the key
-            int node_idx = node_for_key(list, msg.key);
-            if (node_idx != list->current_node_idx && node_idx >= 0) {
-                // Forward to correct node
-                msg.status = -1; // Indicate redirection
-                send(client_fd, &msg, sizeof(Message), 0);
+            if (redirect_if_not_owner(list, msg, key_hash)) {
                 break;
             }
             
-            if (kv_store_put(store, msg.key, msg.value)) {
-                msg.status = 1; // Success
+            if (kv_store_put(store, msg->key, key_hash, msg->value, &msg->version)) {
+                msg->status = 1; // Success
                 
                 // Replicate to other nodes
-                replicate_to_nodes(list, &msg);
+                replicate_to_nodes(list, msg);
             } else {
-                msg.status = 0; // Failure
+                msg->status = 0; // Failure
             }
-            send(client_fd, &msg, sizeof(Message), 0);
             break;
         }
             
         case OP_DELETE: {
-            // Check if this node should handle the key
-            int node_idx = node_for_key(list, msg.key);
-            if (node_idx != list->current_node_idx && node_idx >= 0) {
-                // Forward to correct node
-                msg.status = -1; // Indicate redirection
-                send(client_fd, &msg, sizeof(Message), 0);
+            if (redirect_if_not_owner(list, msg, key_hash)) {
                 break;
             }
             
-            if (kv_store_delete(store, msg.key)) {
-                msg.status = 1; // Success
+            if (kv_store_delete(store, msg->key, key_hash, &msg->version)) {
+                msg->status = 1; // Success
                 
                 // Replicate to other nodes
-                replicate_to_nodes(list, &msg);
+                replicate_to_nodes(list, msg);
             } else {
-                msg.status = 0; // Key not found
+                msg->status = 0; // Key not found
             }
-            send(client_fd, &msg, sizeof(Message), 0);
             break;
         }
             
         case OP_REPLICATE: {
-            // This is a replication message from another node
-            if (msg.op_code == OP_PUT) {
-                kv_store_put(store, msg.key, msg.value);
-            } else if (msg.op_code == OP_DELETE) {
-                kv_store_delete(store, msg.key);
+            // This is a replication message from another node; the wrapped
+            // operation only wins if its version is newer than ours
+            if (msg->repl_op == OP_PUT || msg->repl_op == OP_DELETE) {
+                msg->value[MAX_VALUE_SIZE - 1] = '\0';
+                kv_store_apply(store, msg->repl_op, msg->key, key_hash, msg->value, msg->version);
             }
-            msg.status = 1;
-            send(client_fd, &msg, sizeof(Message), 0);
+            msg->status = 1;
             break;
         }
             
         case OP_NODE_JOIN: {
             // Add the new node to the list
-            node_list_add(list, msg.key, atoi(msg.value));
-            msg.status = 1;
-            send(client_fd, &msg, sizeof(Message), 0);
-            
-            // Redistribute data
-            distribute_data(store, list);
+            node_list_add(list, msg->key, atoi(msg->value));
+            msg->status = 1;
             break;
         }
             
         case OP_NODE_LEAVE: {
             // Remove the node from the list
-            node_list_remove(list, msg.key, atoi(msg.value));
-            msg.status = 1;
-            send(client_fd, &msg, sizeof(Message), 0);
-            
-            // Redistribute data
-            distribute_data(store, list);
+            node_list_remove(list, msg->key, atoi(msg->value));
+            msg->status = 1;
             break;
         }
             
         case OP_LIST_KEYS: {
             // Get list of keys
-            kv_store_list_keys(store, buffer, MAX_VALUE_SIZE);
-            strncpy(msg.value, buffer, MAX_VALUE_SIZE - 1);
-            msg.value[MAX_VALUE_SIZE - 1] = '\0';
-            msg.status = 1;
-            send(client_fd, &msg, sizeof(Message), 0);
+            kv_store_list_keys(store, msg->value, MAX_VALUE_SIZE);
+            msg->status = 1;
+            break;
+        }
+            
+        case OP_CAS: {
+            if (redirect_if_not_owner(list, msg, key_hash)) {
+                break;
+            }
+            
+            // With KV_CAS_VALUE the value field carries "expected\0new"
+            msg->value[MAX_VALUE_SIZE - 1] = '\0';
+            const char* expected = NULL;
+            char value[MAX_VALUE_SIZE];
+            if (msg->flags & KV_CAS_VALUE) {
+                size_t expected_len = strlen(msg->value);
+                if (expected_len + 1 >= MAX_VALUE_SIZE) {
+                    msg->status = 0; // Malformed request
+                    break;
+                }
+                expected = msg->value;
+                strncpy(value, msg->value + expected_len + 1, MAX_VALUE_SIZE - expected_len - 1);
+                value[MAX_VALUE_SIZE - expected_len - 2] = '\0';
+            } else {
+                strncpy(value, msg->value, MAX_VALUE_SIZE);
+            }
+            
+            // On a mismatch the current value and version come back in msg
+            char current[MAX_VALUE_SIZE];
+            if (kv_store_cas(store, msg->key, key_hash, msg->flags, expected, msg->version, value, current, &msg->version)) {
+                msg->status = 1; // Swapped
+                strncpy(msg->value, value, MAX_VALUE_SIZE);
+                replicate_write(list, msg);
+            } else {
+                msg->status = 0; // Mismatch
+                strncpy(msg->value, current, MAX_VALUE_SIZE);
+            }
+            break;
+        }
+            
+        case OP_INCR:
+        case OP_DECR: {
+            if (redirect_if_not_owner(list, msg, key_hash)) {
+                break;
+            }
+            
+            // The value field holds the delta; an empty value means 1
+            msg->value[MAX_VALUE_SIZE - 1] = '\0';
+            long long delta = 1;
+            if (msg->value[0]) {
+                char* end;
+                errno = 0;
+                delta = strtoll(msg->value, &end, 10);
+                if (errno != 0 || end == msg->value || *end != '\0' ||
+                    (msg->op_code == OP_DECR && delta == LLONG_MIN)) {
+                    msg->status = 0; // Not an integer, or out of range
+                    break;
+                }
+            }
+            if (msg->op_code == OP_DECR) {
+                delta = -delta;
+            }
+            
+            long long result;
+            if (kv_store_incr(store, msg->key, key_hash, delta, &result, &msg->version)) {
+                msg->status = 1; // Success
+                snprintf(msg->value, MAX_VALUE_SIZE, "%lld", result);
+                replicate_write(list, msg);
+            } else {
+                msg->status = 0; // Not an integer or overflow
+            }
+            break;
+        }
+            
+        case OP_APPEND: {
+            if (redirect_if_not_owner(list, msg, key_hash)) {
+                break;
+            }
+            
+            msg->value[MAX_VALUE_SIZE - 1] = '\0';
+            char result[MAX_VALUE_SIZE];
+            if (kv_store_append(store, msg->key, key_hash, msg->value, result, &msg->version)) {
+                msg->status = 1; // Success
+                strncpy(msg->value, result, MAX_VALUE_SIZE);
+                replicate_write(list, msg);
+            } else {
+                msg->status = 0; // Value would be too long
+            }
+            break;
+        }
+            
+        case OP_GETSET: {
+            if (redirect_if_not_owner(list, msg, key_hash)) {
+                break;
+            }
+            
+            msg->value[MAX_VALUE_SIZE - 1] = '\0';
+            char old_value[MAX_VALUE_SIZE];
+            if (kv_store_getset(store, msg->key, key_hash, msg->value, old_value, &msg->version)) {
+                msg->status = 1; // Success
+                replicate_write(list, msg);
+                strncpy(msg->value, old_value, MAX_VALUE_SIZE);
+            } else {
+                msg->status = 0; // Failure
+            }
+            break;
+        }
+            
+        case OP_KEYSPACE: {
+            // Resolve a keyspace name to the id clients tag requests with
+            msg->key[MAX_KEY_SIZE - 1] = '\0';
+            int id = kv_keyspace_lookup(msg->key);
+            msg->status = id >= 0 ? 1 : 0;
+            snprintf(msg->value, MAX_VALUE_SIZE, "%d", id >= 0 ? id : 0);
+            break;
+        }
+            
+        case OP_TRACE: {
+            // Dump the trace rings next to the data, or in the working directory
+            static _Atomic int dump_count = 0;
+            char path[MAX_VALUE_SIZE];
+            snprintf(path, sizeof(path), "%s/kv_trace-%d-%d.json",
+                     store->persistence_enabled ? store->data_dir : ".", (int)getpid(),
+                     atomic_fetch_add(&dump_count, 1));
+            if (kv_trace_dump(path)) {
+                msg->status = 1; // Success
+                snprintf(msg->value, MAX_VALUE_SIZE, "%s", path);
+            } else {
+                msg->status = 0; // Tracing not built in, or the file could not be written
+                msg->value[0] = '\0';
+            }
             break;
         }
             
         default:
             // Unknown operation
-            msg.status = -2;
-            send(client_fd, &msg, sizeof(Message), 0);
+            msg->status = -2;
             break;
     }
 }
 
+
 // Replicate operation to other nodes
 void replicate_to_nodes(NodeList* list, Message* msg) {
     if (!list || !msg) {
         return;
     }
     
-    pthread_mutex_lock(&list->lock);
-    
     Message repl_msg;
+    memset(&repl_msg, 0, sizeof(Message));
     repl_msg.op_code = OP_REPLICATE;
+    repl_msg.repl_op = msg->op_code;
+    repl_msg.flags = msg->flags & KV_FLAG_KEYSPACE_MASK;
+    repl_msg.version = msg->version;
     strncpy(repl_msg.key, msg->key, MAX_KEY_SIZE);
     strncpy(repl_msg.value, msg->value, MAX_VALUE_SIZE);
     
-    // Send to all active nodes except current
+    // Peers are sent to one at a time, so one message is in flight; wait
+    // while rebalancing has the peer byte budget in use, before any lock
+    kv_peer_budget_acquire(sizeof(Message));
+    
+    // Copy the active peers so no network I/O happens under the list lock
+    Node peers[MAX_NODES];
+    int peer_idx[MAX_NODES];
+    int peer_count = 0;
+    pthread_mutex_lock(&list->lock);
     for (int i = 0; i < list->count; i++) {
         if (i != list->current_node_idx && list->nodes[i].active) {
-            int sockfd = connect_to_server(list->nodes[i].ip, list->nodes[i].port);
-            if (sockfd >= 0) {
-                send(sockfd, &repl_msg, sizeof(Message), 0);
-                
-                // Receive acknowledgment
-                recv(sockfd, &repl_msg, sizeof(Message), 0);
-                
-                close(sockfd);
-            } else {
-                // Connection failed, mark node as inactive
+            peers[peer_count] = list->nodes[i];
+            peer_idx[peer_count++] = i;
+        }
+    }
+    pthread_mutex_unlock(&list->lock);
+    
+    for (int p = 0; p < peer_count; p++) {
+        int i = peer_idx[p];
+        uint64_t started = kv_stats_now();
+        KV_TRACE_BEGIN(trace_start);
+        int sockfd = connect_to_server(peers[p].ip, peers[p].port);
+        if (sockfd >= 0) {
+            send(sockfd, &repl_msg, sizeof(Message), MSG_NOSIGNAL);
+            
+            // Receive acknowledgment
+            Message ack;
+            bool acked = recv_message(sockfd, &ack);
+            kv_stats_replication(i, acked, kv_stats_now() - started);
+            
+            close(sockfd);
+            KV_TRACE_END(KV_TRACE_REPLICATE, trace_start);
+        } else {
+            // Connection failed, mark node as inactive if membership has
+            // not moved it in the meantime
+            kv_stats_replication(i, false, 0);
+            pthread_mutex_lock(&list->lock);
+            if (i < list->count && list->nodes[i].port == peers[p].port &&
+                strcmp(list->nodes[i].ip, peers[p].ip) == 0) {
                 list->nodes[i].active = false;
             }
+            pthread_mutex_unlock(&list->lock);
         }
     }
     
-    pthread_mutex_unlock(&list->lock);
+    kv_peer_budget_release(sizeof(Message));
+}
+
+// Metrics endpoint state
+typedef struct {
+    int server_fd;
+    KVStore* store;
+    NodeList* nodes;
+} MetricsServer;
+
+// Write a complete buffer to a socket
+static bool send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        len -= (size_t)sent;
+    }
+    return true;
+}
+
+// Answer one HTTP request on the metrics port: GET /metrics, and GET /trace
+// in tracing builds
+static void serve_metrics_request(int client_fd, KVStore* store, NodeList* list) {
+    char request[1024];
+    size_t len = 0;
+    
+    // Read until the end of the request headers; the body is never needed
+    while (len < sizeof(request) - 1) {
+        ssize_t n = recv(client_fd, request + len, sizeof(request) - 1 - len, 0);
+        if (n <= 0) {
+            return;
+        }
+        len += (size_t)n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+            break;
+        }
+    }
+    request[len] = '\0';
+    
+    char header[256];
+    bool is_metrics = strncmp(request, "GET /metrics ", 13) == 0 ||
+                      strncmp(request, "GET /metrics?", 13) == 0;
+    bool is_trace = strncmp(request, "GET /trace ", 11) == 0;
+    char* text = NULL;
+    if (is_metrics) {
+        text = kv_stats_render(store, list);
+    } else if (is_trace) {
+        text = kv_trace_render();
+    }
+    if (!text) {
+        const char* not_found = "HTTP/1.0 404 Not Found\r\n"
+                                "Content-Type: text/plain\r\n"
+                                "Content-Length: 10\r\n\r\nNot Found\n";
+        send_all(client_fd, not_found, strlen(not_found));
+        return;
+    }
+    
+    size_t text_len = strlen(text);
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\n"
+                              "Content-Type: %s\r\n"
+                              "Content-Length: %zu\r\n\r\n",
+                              is_trace ? "application/json" : "text/plain; version=0.0.4; charset=utf-8", text_len);
+    if (send_all(client_fd, header, (size_t)header_len)) {
+        send_all(client_fd, text, text_len);
+    }
+    free(text);
+}
+
+// Metrics endpoint loop; scrapes are rare, so they are served one at a time
+static void* metrics_thread(void* arg) {
+    MetricsServer* metrics = (MetricsServer*)arg;
+    
+    while (1) {
+        int client_fd = accept(metrics->server_fd, NULL, NULL);
+        if (client_fd < 0) {
+            continue;
+        }
+        serve_metrics_request(client_fd, metrics->store, metrics->nodes);
+        close(client_fd);
+    }
+    
+    return NULL;
+}
+
+// Start the Prometheus metrics endpoint on its own listening socket
+static bool start_metrics_server(KVStore* store, NodeList* list, int port) {
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        perror("metrics socket");
+        return false;
+    }
+    
+    int opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(server_fd, 10) < 0) {
+        perror("metrics bind");
+        close(server_fd);
+        return false;
+    }
+    
+    MetricsServer* metrics = (MetricsServer*)malloc(sizeof(MetricsServer));
+    if (!metrics) {
+        close(server_fd);
+        return false;
+    }
+    metrics->server_fd = server_fd;
+    metrics->store = store;
+    metrics->nodes = list;
+    
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, metrics_thread, metrics) != 0) {
+        perror("pthread_create");
+        free(metrics);
+        close(server_fd);
+        return false;
+    }
+    pthread_detach(tid);
+    
+    printf("Metrics available at http://0.0.0.0:%d/metrics\n", port);
+    return true;
 }
 
 // Start the server
@@ -201,6 +778,13 @@ int start_server(KVStore* store, NodeList* list, int port) {
         return -1;
     }
     
+    // Pinned io_uring threads each add a listener on the same port
+    if (pin_threads && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("setsockopt");
+        close(server_fd);
+        return -1;
+    }
+    
     // Configure address
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
@@ -214,7 +798,7 @@ int start_server(KVStore* store, NodeList* list, int port) {
     }
     
     // Start listening for connections
-    if (listen(server_fd, 10) < 0) {
+    if (listen(server_fd, KV_LISTEN_BACKLOG) < 0) {
         perror("listen");
         close(server_fd);
         return -1;
@@ -232,6 +816,21 @@ int start_server(KVStore* store, NodeList* list, int port) {
     node_list_add(list, ip, port);
     list->current_node_idx = 0;
     
+    if (metrics_port > 0 && !start_metrics_server(store, list, metrics_port)) {
+        fprintf(stderr, "Warning: Failed to start metrics endpoint\n");
+    }
+    if (slow_log_us > 0 && !kv_slowlog_start(slow_log_us, slow_log_path)) {
+        fprintf(stderr, "Warning: Failed to start slow-request log\n");
+    }
+    
+    if (use_io_uring) {
+        if (kv_uring_serve(server_fd, store, list, io_threads, pin_threads)) {
+            close(server_fd);
+            return 0;
+        }
+        fprintf(stderr, "Warning: io_uring unavailable, falling back to threads\n");
+    }
+    
     // Accept connections
     while (1) {
         struct sockaddr_in client_addr;
@@ -243,17 +842,35 @@ int start_server(KVStore* store, NodeList* list, int port) {
             perror("accept");
             continue;
         }
+        KV_TRACE_BEGIN(accept_start);
+        if (!kv_admit_connection()) {
+            kv_admit_shed_connection(client_fd);
+            continue;
+        }
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        kv_stats_add(KV_STAT_CONNECTIONS, 1);
+        kv_stats_add(KV_STAT_CONNECTIONS_ACTIVE, 1);
         
         // Create thread data
         ThreadData* data = (ThreadData*)malloc(sizeof(ThreadData));
         if (!data) {
             close(client_fd);
+            kv_stats_add(KV_STAT_CONNECTIONS_ACTIVE, -1);
+            kv_admit_connection_closed();
             continue;
         }
         
         data->client_fd = client_fd;
         data->store = store;
         data->nodes = list;
+        data->node = -1;
+        
+        // Serve the connection on the node whose CPU took its packets
+        int cpu;
+        socklen_t cpu_len = sizeof(cpu);
+        if (pin_threads && getsockopt(client_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &cpu_len) == 0) {
+            data->node = kv_numa_node_of_cpu(cpu);
+        }
         
         // Create thread to handle client
         pthread_t tid;
@@ -261,43 +878,24 @@ int start_server(KVStore* store, NodeList* list, int port) {
             perror("pthread_create");
             free(data);
             close(client_fd);
+            kv_stats_add(KV_STAT_CONNECTIONS_ACTIVE, -1);
+            kv_admit_connection_closed();
             continue;
         }
         
         // Detach thread
         pthread_detach(tid);
+        KV_TRACE_END(KV_TRACE_ACCEPT, accept_start);
     }
     
     return 0;
 }
 
-// Connect to a server
-int connect_to_server(const char* ip, int port) {
-    int sockfd;
-    struct sockaddr_in server_addr;
-    
-    // Create socket
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        return -1;
-    }
-    
-    // Configure server address
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    
-    // Convert IP address
-    if (inet_pton(AF_INET, ip, &server_addr.sin_addr) <= 0) {
-        close(sockfd);
-        return -1;
-    }
-    
-    // Connect to server
-    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        close(sockfd);
-        return -1;
-    }
-    
-    return sockfd;
+// Parse a "RATE[:BURST]" token-bucket limit
+static void parse_rate(const char* arg, uint64_t* rate, uint64_t* burst) {
+    char* end;
+    *rate = strtoull(arg, &end, 10);
+    *burst = *end == ':' ? strtoull(end + 1, NULL, 10) : 0;
 }
 
 // Main function for the server
@@ -305,6 +903,22 @@ int main(int argc, char* argv[]) {
     int port = DEFAULT_PORT;
     const char* data_dir = DATA_DIR;
     bool enable_persistence = true;
+    int node_id = -1;
+    int capacity = 1000;
+    size_t compress_min = 0;
+    const char* spill_dir = NULL;
+    size_t memory_limit = 0;
+    const char* engine = "memory";
+    KVDurability durability = KV_DURABILITY_BUFFERED;
+    int max_inflight = KV_ADMIT_INFLIGHT;
+    int admit_queue = KV_ADMIT_QUEUE;
+    uint64_t admit_wait_us = KV_ADMIT_WAIT_US;
+    uint64_t addr_rate = 0, addr_burst = 0, conn_rate = 0, conn_burst = 0;
+    size_t quota = 0;
+    KVEviction eviction = KV_EVICT_NONE;
+    uint64_t ttl_ms = 0;
+    const char* keyspace_specs[KV_MAX_KEYSPACES];
+    int keyspace_spec_count = 0;
     
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
@@ -314,39 +928,209 @@ int main(int argc, char* argv[]) {
         } else if (strcmp(argv[i], "--data-dir") == 0 && i + 1 < argc) {
             data_dir = argv[i + 1];
             i++;
+        } else if (strcmp(argv[i], "--node-id") == 0 && i + 1 < argc) {
+            node_id = atoi(argv[i + 1]);
+            if (node_id < 0 || node_id > (int)KV_VERSION_NODE_MASK) {
+                fprintf(stderr, "Node ids run from 0 to %d\n", (int)KV_VERSION_NODE_MASK);
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--hash-seed") == 0 && i + 1 < argc) {
+            kv_hash_set_seed(strtoull(argv[i + 1], NULL, 0));
+            i++;
+        } else if (strcmp(argv[i], "--capacity") == 0 && i + 1 < argc) {
+            capacity = atoi(argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--io-backend") == 0 && i + 1 < argc) {
+            if (strcmp(argv[i + 1], "io_uring") != 0 && strcmp(argv[i + 1], "threads") != 0) {
+                fprintf(stderr, "Unknown I/O backend %s (threads or io_uring)\n", argv[i + 1]);
+                return 1;
+            }
+            use_io_uring = strcmp(argv[i + 1], "io_uring") == 0;
+            i++;
+        } else if (strcmp(argv[i], "--io-threads") == 0 && i + 1 < argc) {
+            io_threads = atoi(argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--durability") == 0 && i + 1 < argc) {
+            if (strcmp(argv[i + 1], "buffered") == 0) {
+                durability = KV_DURABILITY_BUFFERED;
+            } else if (strcmp(argv[i + 1], "fsync") == 0) {
+                durability = KV_DURABILITY_FSYNC;
+            } else if (strcmp(argv[i + 1], "async") == 0) {
+                durability = KV_DURABILITY_ASYNC;
+            } else {
+                fprintf(stderr, "Unknown durability %s (buffered, fsync or async)\n", argv[i + 1]);
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+            metrics_port = atoi(argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--slow-log-us") == 0 && i + 1 < argc) {
+            slow_log_us = strtoull(argv[i + 1], NULL, 10);
+            i++;
+        } else if (strcmp(argv[i], "--slow-log") == 0 && i + 1 < argc) {
+            slow_log_path = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "--hot-key-sample") == 0 && i + 1 < argc) {
+            kv_hotkeys_set_sample_rate((unsigned int)atoi(argv[i + 1]));
+            i++;
+        } else if (strcmp(argv[i], "--compress-min") == 0 && i + 1 < argc) {
+            compress_min = (size_t)atol(argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--spill-dir") == 0 && i + 1 < argc) {
+            spill_dir = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "--memory-limit") == 0 && i + 1 < argc) {
+            memory_limit = (size_t)strtoull(argv[i + 1], NULL, 10);
+            i++;
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            engine = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "--max-inflight") == 0 && i + 1 < argc) {
+            max_inflight = atoi(argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--admit-queue") == 0 && i + 1 < argc) {
+            admit_queue = atoi(argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--admit-wait-us") == 0 && i + 1 < argc) {
+            admit_wait_us = strtoull(argv[i + 1], NULL, 10);
+            i++;
+        } else if (strcmp(argv[i], "--max-connections") == 0 && i + 1 < argc) {
+            kv_admit_set_max_connections(atoi(argv[i + 1]));
+            i++;
+        } else if (strcmp(argv[i], "--rate-limit-ip") == 0 && i + 1 < argc) {
+            parse_rate(argv[i + 1], &addr_rate, &addr_burst);
+            i++;
+        } else if (strcmp(argv[i], "--rate-limit-conn") == 0 && i + 1 < argc) {
+            parse_rate(argv[i + 1], &conn_rate, &conn_burst);
+            i++;
+        } else if (strcmp(argv[i], "--peer-inflight-bytes") == 0 && i + 1 < argc) {
+            kv_peer_budget_configure((size_t)strtoull(argv[i + 1], NULL, 10));
+            i++;
+        } else if (strcmp(argv[i], "--quota") == 0 && i + 1 < argc) {
+            quota = (size_t)strtoull(argv[i + 1], NULL, 10);
+            i++;
+        } else if (strcmp(argv[i], "--eviction") == 0 && i + 1 < argc) {
+            if (!kv_parse_eviction(argv[i + 1], &eviction)) {
+                fprintf(stderr, "Unknown eviction policy %s (none or clock)\n", argv[i + 1]);
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--ttl") == 0 && i + 1 < argc) {
+            ttl_ms = strtoull(argv[i + 1], NULL, 10) * 1000;
+            i++;
+        } else if (strcmp(argv[i], "--keyspace") == 0 && i + 1 < argc) {
+            if (keyspace_spec_count == KV_MAX_KEYSPACES - 1) {
+                fprintf(stderr, "Too many keyspaces; a server holds at most %d\n", KV_MAX_KEYSPACES - 1);
+                return 1;
+            }
+            keyspace_specs[keyspace_spec_count++] = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "--pin-threads") == 0) {
+            pin_threads = true;
         } else if (strcmp(argv[i], "--no-persistence") == 0) {
             enable_persistence = false;
+        } else if (strcmp(argv[i], "--migrate-placement") == 0) {
+            kv_store_allow_placement_migration(true);
         } else if (isdigit(argv[i][0])) {
             // For backward compatibility: if first arg is a number, it's the port
             port = atoi(argv[i]);
         }
     }
     
+    kv_admit_configure(max_inflight, admit_queue, admit_wait_us);
+    kv_rate_configure(addr_rate, addr_burst, conn_rate, conn_burst);
+    
     printf("Starting key-value store server on port %d\n", port);
-    if (enable_persistence) {
+    if (enable_persistence || strcmp(engine, "memory") != 0) {
         printf("Persistence enabled, data directory: %s\n", data_dir);
     } else {
         printf("Persistence disabled, data will be lost on shutdown\n");
     }
     
     // Initialize key-value store
-    KVStore* store = kv_store_init(1000);
+    KVStore* store = kv_store_init(capacity);
     if (!store) {
         fprintf(stderr, "Failed to initialize key-value store\n");
         return 1;
     }
     
+    // Compression applies to values recovered from disk as well
+    kv_store_set_compression(store, compress_min);
+    kv_store_set_durability(store, durability);
+    
+    // Settle the hash seed before any keys are loaded
+    bool memory_engine = strcmp(engine, "memory") == 0;
+    if ((!memory_engine || enable_persistence) && !kv_store_check_placement(data_dir)) {
+        kv_store_destroy(store);
+        return 1;
+    }
+    
+    // Pick a node id for version tie-breaking. One derived from host and port
+    // is hashed with the built-in seed, so it does not change with the data
+    // directory, but it is only 8 bits and two nodes may share it; their
+    // equal-version writes would then tie and replicas diverge
+    if (node_id < 0) {
+        char node_name[192];
+        gethostname(node_name, 128);
+        node_name[127] = '\0';
+        snprintf(node_name + strlen(node_name), 64, ":%d", port);
+        node_id = (int)(kv_hash(node_name, strlen(node_name), KV_HASH_DEFAULT_SEED) & KV_VERSION_NODE_MASK);
+        fprintf(stderr, "Warning: node id %d derived from host and port; give each node of a cluster "
+                "a distinct --node-id\n", node_id);
+    }
+    kv_store_set_node_id(store, (unsigned int)node_id);
+    
+    // The LSM and mmap engines keep their own logs and files in the data
+    // directory, in place of the operation log, snapshots and value log
+    if (!memory_engine) {
+        if (!kv_store_set_engine(store, engine, data_dir)) {
+            fprintf(stderr, "Failed to open the %s storage engine in %s\n", engine, data_dir);
+            kv_store_destroy(store);
+            return 1;
+        }
+        printf("Storage engine: %s\n", engine);
+    }
+    
+    // Spill cold values to disk once resident data passes the memory limit
+    if (memory_engine && spill_dir && memory_limit > 0) {
+        if (!kv_store_enable_tiering(store, spill_dir, memory_limit)) {
+            fprintf(stderr, "Warning: Failed to enable tiered storage, keeping every value in memory\n");
+        }
+    }
+    
     // Enable persistence if requested
-    if (enable_persistence) {
+    if (memory_engine && enable_persistence) {
         if (!kv_store_enable_persistence(store, data_dir)) {
             fprintf(stderr, "Warning: Failed to enable persistence, continuing without it\n");
         }
     }
     
+    // Limits on the default keyspace; once recovered, so expired keys are swept
+    if (!kv_store_set_limits(store, quota, eviction, ttl_ms)) {
+        fprintf(stderr, "Quotas need the memory engine\n");
+        kv_store_destroy(store);
+        return 1;
+    }
+    
+    // Named keyspaces get their ids in the order they are declared, which
+    // must be the same on every node
+    KVKeyspaceDefaults defaults = {capacity, engine, enable_persistence, durability, compress_min,
+                                   (unsigned int)node_id, data_dir};
+    for (int i = 0; i < keyspace_spec_count; i++) {
+        if (!kv_keyspace_add(keyspace_specs[i], &defaults)) {
+            kv_keyspaces_destroy();
+            kv_store_destroy(store);
+            return 1;
+        }
+    }
+    
     // Initialize node list
     NodeList* nodes = node_list_init();
     if (!nodes) {
         fprintf(stderr, "Failed to initialize node list\n");
+        kv_keyspaces_destroy();
         kv_store_destroy(store);
         return 1;
     }
@@ -356,6 +1140,7 @@ int main(int argc, char* argv[]) {
     
     // Clean up
     node_list_destroy(nodes);
+    kv_keyspaces_destroy();
     kv_store_destroy(store);
     
     return result == 0 ? 0 : 1;
@@ -0,0 +1,243 @@
+#include "kv_store.h"
+
+// Slow-request log
+//
+// Request threads claim a cell of a bounded ring with one compare-and-swap
+// on the tail and publish it by bumping the cell's sequence number (the
+// classic bounded MPMC queue layout, with a single consumer). A writer
+// thread drains the ring to the log file. When the ring is full the entry
+// is dropped and counted rather than making the request wait.
+
+typedef struct {
+    _Atomic uint64_t seq;      // Ring position the cell is ready for
+    struct timespec when;      // Wall-clock time the request finished
+    OperationCode op;
+    char key[MAX_KEY_SIZE];
+    char client[64];
+    uint32_t request_bytes;
+    uint32_t reply_bytes;
+    uint64_t total_ns;
+    uint64_t lock_ns;
+    uint64_t store_ns;
+    uint64_t log_ns;
+    uint64_t network_ns;
+} SlowEntry;
+
+static SlowEntry slow_ring[KV_SLOWLOG_RING_SIZE];
+static _Atomic uint64_t slow_tail = 0;     // Next position to claim
+static uint64_t slow_head = 0;             // Next position to write out (writer thread only)
+
+static uint64_t slow_threshold_ns = 0;     // 0 while the slow log is off
+static FILE* slow_file = NULL;
+
+// Request being processed on this thread; the store charges phases to it
+static __thread KVSlowRequest* current_request = NULL;
+
+static const char* op_name(OperationCode op) {
+    static const char* names[] = {
+        "?", "GET", "PUT", "DELETE", "REPLICATE", "NODE_JOIN", "NODE_LEAVE", "LIST_KEYS",
+        "CAS", "INCR", "DECR", "APPEND", "GETSET", "SCAN", "STATS", "HOTKEYS", "TRACE"
+    };
+    if ((int)op < 0 || (size_t)op >= sizeof(names) / sizeof(names[0])) {
+        return "?";
+    }
+    return names[op];
+}
+
+// Copy a key for the log, replacing anything that would break the line format
+static void copy_printable(char* dst, const char* src, size_t size) {
+    size_t i;
+    for (i = 0; i + 1 < size && src[i]; i++) {
+        unsigned char c = (unsigned char)src[i];
+        dst[i] = (c < 0x20 || c >= 0x7f || c == '"') ? '?' : (char)c;
+    }
+    dst[i] = '\0';
+}
+
+static void write_entry(const SlowEntry* entry) {
+    struct tm tm;
+    char when[32];
+    gmtime_r(&entry->when.tv_sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    fprintf(slow_file,
+            "%s.%03ldZ op=%s key=\"%s\" client=%s request_bytes=%u reply_bytes=%u "
+            "total_us=%llu lock_us=%llu store_us=%llu log_us=%llu network_us=%llu\n",
+            when, entry->when.tv_nsec / 1000000, op_name(entry->op), entry->key, entry->client,
+            entry->request_bytes, entry->reply_bytes,
+            (unsigned long long)(entry->total_ns / 1000), (unsigned long long)(entry->lock_ns / 1000),
+            (unsigned long long)(entry->store_ns / 1000), (unsigned long long)(entry->log_ns / 1000),
+            (unsigned long long)(entry->network_ns / 1000));
+}
+
+// Writer thread: drain published entries, then nap while the ring is empty
+static void* slowlog_writer(void* arg) {
+    (void)arg;
+
+    while (1) {
+        bool wrote = false;
+        while (1) {
+            SlowEntry* entry = &slow_ring[slow_head & (KV_SLOWLOG_RING_SIZE - 1)];
+            if (atomic_load_explicit(&entry->seq, memory_order_acquire) != slow_head + 1) {
+                break;
+            }
+
+            write_entry(entry);
+
+            // Hand the cell back for the next lap of the ring
+            atomic_store_explicit(&entry->seq, slow_head + KV_SLOWLOG_RING_SIZE, memory_order_release);
+            slow_head++;
+            wrote = true;
+        }
+
+        if (wrote) {
+            fflush(slow_file);
+        } else {
+            usleep(20000);
+        }
+    }
+
+    return NULL;
+}
+
+// Turn on the slow log for requests over threshold_us; path NULL means stderr
+bool kv_slowlog_start(uint64_t threshold_us, const char* path) {
+    if (threshold_us == 0 || slow_threshold_ns != 0) {
+        return false;
+    }
+
+    slow_file = path ? fopen(path, "a") : stderr;
+    if (!slow_file) {
+        perror("slow log");
+        return false;
+    }
+
+    for (uint64_t i = 0; i < KV_SLOWLOG_RING_SIZE; i++) {
+        atomic_store_explicit(&slow_ring[i].seq, i, memory_order_relaxed);
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, slowlog_writer, NULL) != 0) {
+        perror("pthread_create");
+        if (path) {
+            fclose(slow_file);
+        }
+        slow_file = NULL;
+        return false;
+    }
+    pthread_detach(tid);
+
+    slow_threshold_ns = threshold_us * 1000;
+    return true;
+}
+
+// Start tracking a request that has just been read
+void kv_slowlog_begin(KVSlowRequest* req, const Message* msg, uint64_t started) {
+    req->active = slow_threshold_ns != 0;
+    if (!req->active) {
+        return;
+    }
+
+    req->op = msg->op_code;
+    size_t key_len = strnlen(msg->key, MAX_KEY_SIZE - 1);
+    memcpy(req->key, msg->key, key_len);
+    req->key[key_len] = '\0';
+    req->request_bytes = (uint32_t)(key_len + strnlen(msg->value, MAX_VALUE_SIZE));
+    req->reply_bytes = 0;
+    req->started = started;
+    req->replied = 0;
+    memset(req->phases, 0, sizeof(req->phases));
+    current_request = req;
+}
+
+// A reply (or one frame of a streamed reply) is ready to send
+void kv_slowlog_processed(KVSlowRequest* req, size_t reply_bytes) {
+    if (!req->active) {
+        return;
+    }
+
+    req->reply_bytes += (uint32_t)reply_bytes;
+    if (req->replied == 0) {
+        req->replied = kv_stats_now();
+        current_request = NULL;
+    }
+}
+
+// The last reply byte has been handed to the socket
+void kv_slowlog_end(KVSlowRequest* req, int client_fd) {
+    if (!req->active) {
+        return;
+    }
+    req->active = false;
+    if (current_request == req) {
+        current_request = NULL;
+    }
+
+    uint64_t now = kv_stats_now();
+    uint64_t total = now - req->started;
+    if (total < slow_threshold_ns) {
+        return;
+    }
+    kv_stats_add(KV_STAT_SLOW_REQUESTS, 1);
+
+    // Claim a cell; a cell whose sequence lags our position is still unread
+    uint64_t pos = atomic_load_explicit(&slow_tail, memory_order_relaxed);
+    SlowEntry* entry;
+    while (1) {
+        entry = &slow_ring[pos & (KV_SLOWLOG_RING_SIZE - 1)];
+        uint64_t seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&slow_tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            kv_stats_add(KV_STAT_SLOW_DROPPED, 1);
+            return;
+        } else {
+            pos = atomic_load_explicit(&slow_tail, memory_order_relaxed);
+        }
+    }
+
+    uint64_t replied = req->replied ? req->replied : now;
+    uint64_t processing = replied - req->started;
+    uint64_t charged = req->phases[KV_PHASE_LOCK_WAIT] + req->phases[KV_PHASE_LOG];
+
+    clock_gettime(CLOCK_REALTIME, &entry->when);
+    entry->op = req->op;
+    copy_printable(entry->key, req->key, sizeof(entry->key));
+    entry->request_bytes = req->request_bytes;
+    entry->reply_bytes = req->reply_bytes;
+    entry->total_ns = total;
+    entry->lock_ns = req->phases[KV_PHASE_LOCK_WAIT];
+    entry->log_ns = req->phases[KV_PHASE_LOG];
+    entry->store_ns = processing > charged ? processing - charged : 0;
+    entry->network_ns = now - replied;
+
+    // The client address is only looked up for requests that get logged
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(client_fd, (struct sockaddr*)&addr, &addr_len) == 0 && addr.sin_family == AF_INET) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+        snprintf(entry->client, sizeof(entry->client), "%s:%d", ip, ntohs(addr.sin_port));
+    } else {
+        snprintf(entry->client, sizeof(entry->client), "-");
+    }
+
+    atomic_store_explicit(&entry->seq, pos + 1, memory_order_release);
+}
+
+// Charge this thread's phases to req from now on (NULL for none), for a
+// request handed from one thread to another
+void kv_slowlog_attach(KVSlowRequest* req) {
+    current_request = req && req->active && req->replied == 0 ? req : NULL;
+}
+
+// Charge time spent in a phase to the request running on this thread
+void kv_slowlog_phase(KVRequestPhase phase, uint64_t ns) {
+    if (current_request) {
+        current_request->phases[phase] += ns;
+    }
+}
@@ -0,0 +1,462 @@
+#include "kv_store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Snapshot files
+//
+// Version 2 layout:
+//
+//   SnapshotHeader
+//   block 0 .. block n-1      records, each LZ4-compressed if that shrank it
+//   SnapshotBlock[n]          where each block is, its size and its CRC32C
+//   SnapshotTrailer           where the index is, and the index's CRC32C
+//
+// A block holds SnapshotRecords back to back, each followed by its key and
+// value bytes. Values are written as the store holds them, so a value kept
+// compressed in memory goes to disk and back without being recompressed.
+// The writer streams blocks out as they fill and only keeps the index in
+// memory. The loader reads the trailer and index first, then hands blocks
+// out to threads that read, check and apply them independently; records
+// carry their versions, so the order blocks are applied in does not matter.
+//
+// Version 1 files, a count and raw KeyValuePairs, are still loaded, and so
+// are files from before versioning, a count and pairs without a version.
+
+#define SNAPSHOT_BLOCK_LZ4 0x1
+
+typedef struct {
+    uint32_t magic;            // KV_SNAPSHOT_MAGIC
+    uint32_t version;          // KV_SNAPSHOT_VERSION
+    uint32_t block_size;       // KV_SNAPSHOT_BLOCK_SIZE when written
+    uint32_t reserved;
+} SnapshotHeader;
+
+typedef struct {
+    uint64_t version;          // HLC version of the last write
+    uint16_t key_len;
+    uint16_t value_len;        // Bytes as stored
+    uint8_t flags;             // KV_RECORD_*
+    uint8_t reserved[3];
+} SnapshotRecord;
+
+typedef struct {
+    uint64_t offset;           // File offset of the stored bytes
+    uint32_t stored_len;       // Bytes on disk
+    uint32_t raw_len;          // Record bytes once decompressed
+    uint32_t count;            // Records in the block
+    uint32_t flags;            // SNAPSHOT_BLOCK_*
+    uint32_t crc;              // CRC32C of the stored bytes
+    uint32_t reserved;
+} SnapshotBlock;
+
+typedef struct {
+    uint64_t index_offset;
+    uint64_t records;
+    uint32_t block_count;
+    uint32_t index_crc;        // CRC32C of the block index
+    uint32_t reserved;
+    uint32_t magic;            // KV_SNAPSHOT_MAGIC; a file without it was never finished
+} SnapshotTrailer;
+
+typedef struct {
+    FILE* file;
+    uint64_t offset;
+    SnapshotBlock* blocks;
+    uint32_t block_count;
+    uint32_t block_capacity;
+    uint64_t records;
+    uint32_t raw_len;
+    uint32_t count;
+    char raw[KV_SNAPSHOT_BLOCK_SIZE];
+    char packed[KV_SNAPSHOT_BLOCK_SIZE];
+} SnapshotWriter;
+
+static bool write_bytes(SnapshotWriter* w, const void* data, size_t len) {
+    if (len > 0 && fwrite(data, len, 1, w->file) != 1) {
+        return false;
+    }
+    w->offset += len;
+    return true;
+}
+
+// Write out the pending block and add it to the index
+static bool flush_block(SnapshotWriter* w) {
+    if (w->count == 0) {
+        return true;
+    }
+
+    if (w->block_count == w->block_capacity) {
+        uint32_t capacity = w->block_capacity ? w->block_capacity * 2 : 64;
+        SnapshotBlock* blocks = (SnapshotBlock*)realloc(w->blocks, sizeof(SnapshotBlock) * capacity);
+        if (!blocks) {
+            return false;
+        }
+        w->blocks = blocks;
+        w->block_capacity = capacity;
+    }
+
+    SnapshotBlock* block = &w->blocks[w->block_count];
+    memset(block, 0, sizeof(SnapshotBlock));
+    block->offset = w->offset;
+    block->raw_len = w->raw_len;
+    block->count = w->count;
+
+    const char* data = w->raw;
+    int packed_len = kv_lz4_compress(w->raw, (int)w->raw_len, w->packed, (int)w->raw_len - 1);
+    if (packed_len > 0) {
+        data = w->packed;
+        block->stored_len = (uint32_t)packed_len;
+        block->flags = SNAPSHOT_BLOCK_LZ4;
+    } else {
+        block->stored_len = w->raw_len;
+    }
+    block->crc = kv_crc32c(0, data, block->stored_len);
+
+    if (!write_bytes(w, data, block->stored_len)) {
+        return false;
+    }
+    w->block_count++;
+    w->raw_len = 0;
+    w->count = 0;
+    return true;
+}
+
+// Spilled values are read back from the value log and written as if resident
+static bool add_record(SnapshotWriter* w, KVStore* store, const KVRecord* rec) {
+    size_t size = sizeof(SnapshotRecord) + rec->key_len + rec->value_len;
+    if (w->raw_len + size > KV_SNAPSHOT_BLOCK_SIZE && !flush_block(w)) {
+        return false;
+    }
+
+    SnapshotRecord header;
+    memset(&header, 0, sizeof(SnapshotRecord));
+    header.version = rec->version;
+    header.key_len = rec->key_len;
+    header.value_len = rec->value_len;
+    header.flags = rec->flags & ~KV_RECORD_SPILLED;
+
+    char* p = w->raw + w->raw_len;
+    memcpy(p, &header, sizeof(SnapshotRecord));
+    memcpy(p + sizeof(SnapshotRecord), KV_RECORD_KEY(rec), rec->key_len);
+    char* value = p + sizeof(SnapshotRecord) + rec->key_len;
+    if (rec->flags & KV_RECORD_SPILLED) {
+        KVValuePointer ptr;
+        memcpy(&ptr, KV_RECORD_VALUE(rec), sizeof(KVValuePointer));
+        if (!kv_vlog_read(store->vlog, ptr, rec->value_len, value)) {
+            return false;
+        }
+    } else {
+        memcpy(value, KV_RECORD_VALUE(rec), rec->value_len);
+    }
+    w->raw_len += (uint32_t)size;
+    w->count++;
+    w->records++;
+    return true;
+}
+
+// fsync the directory holding path so a rename into it is durable
+static bool sync_parent_dir(const char* path) {
+    char dir[512];
+    const char* slash = strrchr(path, '/');
+    if (!slash) {
+        snprintf(dir, sizeof(dir), ".");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    }
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+static bool write_records(SnapshotWriter* w, KVStore* store) {
+    bool ok = true;
+    kv_epoch_enter();
+    for (int i = 0; i < KV_SHARD_COUNT && ok; i++) {
+        KVTable* table = atomic_load_explicit(&store->shards[i].table, memory_order_acquire);
+        for (unsigned int j = 0; j <= table->mask && ok; j++) {
+            KVRecord* rec = atomic_load_explicit(&table->slots[j], memory_order_acquire);
+            if (rec != NULL && rec != KV_TOMBSTONE) {
+                ok = add_record(w, store, rec);
+            }
+        }
+    }
+    kv_epoch_exit();
+    return ok && flush_block(w);
+}
+
+// Write every record in the store to path. The file only appears under its
+// name once it is complete and on disk; until then it is path.tmp.
+bool kv_snapshot_write(KVStore* store, const char* path) {
+    char temp_path[520];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    SnapshotWriter* w = (SnapshotWriter*)calloc(1, sizeof(SnapshotWriter));
+    if (!w) {
+        return false;
+    }
+    w->file = fopen(temp_path, "wb");
+    if (!w->file) {
+        fprintf(stderr, "Error creating snapshot file: %s\n", strerror(errno));
+        free(w);
+        return false;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(SnapshotHeader));
+    header.magic = KV_SNAPSHOT_MAGIC;
+    header.version = KV_SNAPSHOT_VERSION;
+    header.block_size = KV_SNAPSHOT_BLOCK_SIZE;
+
+    bool ok = write_bytes(w, &header, sizeof(SnapshotHeader)) && write_records(w, store);
+
+    if (ok) {
+        SnapshotTrailer trailer;
+        memset(&trailer, 0, sizeof(SnapshotTrailer));
+        trailer.index_offset = w->offset;
+        trailer.records = w->records;
+        trailer.block_count = w->block_count;
+        trailer.index_crc = kv_crc32c(0, w->blocks, sizeof(SnapshotBlock) * w->block_count);
+        trailer.magic = KV_SNAPSHOT_MAGIC;
+        ok = write_bytes(w, w->blocks, sizeof(SnapshotBlock) * w->block_count) &&
+             write_bytes(w, &trailer, sizeof(SnapshotTrailer));
+    }
+
+    // Data first, then the name: a crash leaves either the old snapshot set
+    // or the new one, never a partial file under a snapshot name
+    ok = ok && fflush(w->file) == 0 && fsync(fileno(w->file)) == 0;
+    ok = fclose(w->file) == 0 && ok;
+    ok = ok && rename(temp_path, path) == 0;
+    if (!ok) {
+        fprintf(stderr, "Error writing snapshot %s: %s\n", path, strerror(errno));
+        unlink(temp_path);
+    } else {
+        sync_parent_dir(path);
+    }
+
+    free(w->blocks);
+    free(w);
+    return ok;
+}
+
+// Read exactly len bytes at offset
+static bool read_at(int fd, void* buf, size_t len, off_t offset) {
+    char* p = (char*)buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return true;
+}
+
+typedef struct {
+    KVStore* store;
+    int fd;
+    const SnapshotBlock* blocks;
+    uint32_t block_count;
+    _Atomic uint32_t next;     // Next block to hand out
+    _Atomic bool failed;
+} SnapshotLoad;
+
+// Check and apply one block; raw and packed are KV_SNAPSHOT_BLOCK_SIZE bytes
+static bool load_block(SnapshotLoad* load, const SnapshotBlock* block, char* raw, char* packed) {
+    if (block->stored_len > KV_SNAPSHOT_BLOCK_SIZE || block->raw_len > KV_SNAPSHOT_BLOCK_SIZE) {
+        return false;
+    }
+
+    char* stored = (block->flags & SNAPSHOT_BLOCK_LZ4) ? packed : raw;
+    if (!read_at(load->fd, stored, block->stored_len, (off_t)block->offset) ||
+        kv_crc32c(0, stored, block->stored_len) != block->crc) {
+        return false;
+    }
+    if ((block->flags & SNAPSHOT_BLOCK_LZ4) &&
+        kv_lz4_decompress(packed, (int)block->stored_len, raw, KV_SNAPSHOT_BLOCK_SIZE) != (int)block->raw_len) {
+        return false;
+    }
+
+    char key[MAX_KEY_SIZE];
+    char value[MAX_VALUE_SIZE];
+    uint32_t pos = 0;
+    for (uint32_t i = 0; i < block->count; i++) {
+        SnapshotRecord header;
+        if (block->raw_len - pos < sizeof(SnapshotRecord)) {
+            return false;
+        }
+        memcpy(&header, raw + pos, sizeof(SnapshotRecord));
+        pos += sizeof(SnapshotRecord);
+
+        if (header.key_len >= MAX_KEY_SIZE || header.value_len >= MAX_VALUE_SIZE ||
+            block->raw_len - pos < (uint32_t)header.key_len + header.value_len) {
+            return false;
+        }
+        memcpy(key, raw + pos, header.key_len);
+        key[header.key_len] = '\0';
+        pos += header.key_len;
+        memcpy(value, raw + pos, header.value_len);
+        value[header.value_len] = '\0';
+        pos += header.value_len;
+
+        kv_store_restore(load->store, key, value, header.value_len, header.flags, header.version);
+    }
+    return pos == block->raw_len;
+}
+
+static void* load_thread(void* arg) {
+    SnapshotLoad* load = (SnapshotLoad*)arg;
+    char* raw = (char*)malloc(KV_SNAPSHOT_BLOCK_SIZE);
+    char* packed = (char*)malloc(KV_SNAPSHOT_BLOCK_SIZE);
+    if (!raw || !packed) {
+        atomic_store(&load->failed, true);
+    }
+
+    while (!atomic_load(&load->failed)) {
+        uint32_t i = atomic_fetch_add(&load->next, 1);
+        if (i >= load->block_count) {
+            break;
+        }
+        if (!load_block(load, &load->blocks[i], raw, packed)) {
+            atomic_store(&load->failed, true);
+        }
+    }
+
+    free(raw);
+    free(packed);
+    return NULL;
+}
+
+static bool load_v2(KVStore* store, int fd, off_t size) {
+    SnapshotTrailer trailer;
+    if (size < (off_t)(sizeof(SnapshotHeader) + sizeof(SnapshotTrailer)) ||
+        !read_at(fd, &trailer, sizeof(SnapshotTrailer), size - (off_t)sizeof(SnapshotTrailer)) ||
+        trailer.magic != KV_SNAPSHOT_MAGIC ||
+        trailer.index_offset + (uint64_t)trailer.block_count * sizeof(SnapshotBlock) + sizeof(SnapshotTrailer) !=
+            (uint64_t)size) {
+        return false;
+    }
+
+    SnapshotBlock* blocks = (SnapshotBlock*)malloc(sizeof(SnapshotBlock) * (trailer.block_count + 1));
+    if (!blocks) {
+        return false;
+    }
+    if (!read_at(fd, blocks, sizeof(SnapshotBlock) * trailer.block_count, (off_t)trailer.index_offset) ||
+        kv_crc32c(0, blocks, sizeof(SnapshotBlock) * trailer.block_count) != trailer.index_crc) {
+        free(blocks);
+        return false;
+    }
+
+    SnapshotLoad load;
+    load.store = store;
+    load.fd = fd;
+    load.blocks = blocks;
+    load.block_count = trailer.block_count;
+    atomic_init(&load.next, 0);
+    atomic_init(&load.failed, false);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = cpus > 0 && cpus < KV_SNAPSHOT_MAX_THREADS ? (int)cpus : KV_SNAPSHOT_MAX_THREADS;
+    if ((uint32_t)thread_count > trailer.block_count) {
+        thread_count = (int)trailer.block_count;
+    }
+
+    // The calling thread loads too, and alone if no thread can be started
+    pthread_t threads[KV_SNAPSHOT_MAX_THREADS];
+    int started = 0;
+    while (started < thread_count - 1 && pthread_create(&threads[started], NULL, load_thread, &load) == 0) {
+        started++;
+    }
+    load_thread(&load);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(blocks);
+    return !atomic_load(&load.failed);
+}
+
+// Pair as written before versioning
+typedef struct {
+    char key[MAX_KEY_SIZE];
+    char value[MAX_VALUE_SIZE];
+    bool valid;
+} LegacyKeyValuePair;
+
+// Before versioning: an int count followed by exactly that many
+// LegacyKeyValuePairs. They get versions in file order, as of when the
+// file was written.
+static bool load_legacy(KVStore* store, int fd, int count, time_t written) {
+    LegacyKeyValuePair pair;
+    for (int i = 0; i < count; i++) {
+        if (!read_at(fd, &pair, sizeof(LegacyKeyValuePair),
+                     (off_t)sizeof(int) + (off_t)i * (off_t)sizeof(LegacyKeyValuePair))) {
+            return false;
+        }
+        pair.key[MAX_KEY_SIZE - 1] = '\0';
+        pair.value[MAX_VALUE_SIZE - 1] = '\0';
+        kv_store_restore(store, pair.key, pair.value, (uint16_t)strlen(pair.value), 0,
+                         kv_store_legacy_version(store, written));
+    }
+    return true;
+}
+
+// Version 1: an int count followed by raw KeyValuePairs. The writer patched
+// the count in last, so a file it never finished reads as empty. A file
+// whose size fits the count in pairs without versions is from before them.
+static bool load_v1(KVStore* store, int fd, off_t size, time_t written) {
+    int count;
+    if (!read_at(fd, &count, sizeof(int), 0) || count < 0) {
+        return false;
+    }
+    if (count > 0 && size == (off_t)sizeof(int) + (off_t)count * (off_t)sizeof(LegacyKeyValuePair)) {
+        return load_legacy(store, fd, count, written);
+    }
+    if ((off_t)sizeof(int) + (off_t)count * (off_t)sizeof(KeyValuePair) > size) {
+        return false;
+    }
+
+    KeyValuePair pair;
+    for (int i = 0; i < count; i++) {
+        if (!read_at(fd, &pair, sizeof(KeyValuePair), (off_t)sizeof(int) + (off_t)i * (off_t)sizeof(KeyValuePair))) {
+            return false;
+        }
+        pair.key[MAX_KEY_SIZE - 1] = '\0';
+        pair.value[MAX_VALUE_SIZE - 1] = '\0';
+        kv_store_restore(store, pair.key, pair.value, (uint16_t)strlen(pair.value), 0, pair.version);
+    }
+    return true;
+}
+
+// Load a snapshot into the store; false if it is damaged or unreadable, in
+// which case some of its records may already have been applied
+bool kv_snapshot_load(KVStore* store, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    SnapshotHeader header;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok && st.st_size >= (off_t)sizeof(SnapshotHeader) &&
+        read_at(fd, &header, sizeof(SnapshotHeader), 0) && header.magic == KV_SNAPSHOT_MAGIC) {
+        ok = header.version == KV_SNAPSHOT_VERSION && load_v2(store, fd, st.st_size);
+    } else {
+        ok = ok && load_v1(store, fd, st.st_size, st.st_mtime);
+    }
+
+    close(fd);
+    return ok;
+}
@@ -0,0 +1,510 @@
+#include "kv_store.h"
+#include <stdarg.h>
+
+// Per-thread metrics
+//
+// Each thread owns a slot and is the only writer of its counters, so an
+// update is a relaxed load and store with no locked instruction, and slots
+// are cache-line aligned so threads never write to a shared line. Readers
+// add every slot up; a slot released by an exiting thread keeps its counts
+// and the next thread to claim it carries on from them.
+
+typedef struct {
+    _Atomic uint64_t counters[KV_STAT_COUNTER_COUNT];
+    _Atomic uint64_t buckets[KV_HIST_COUNT][KV_STATS_BUCKETS];
+    _Atomic uint64_t sums[KV_HIST_COUNT];            // Nanoseconds
+    _Atomic uint64_t repl_ok[MAX_NODES];
+    _Atomic uint64_t repl_failed[MAX_NODES];
+    _Atomic uint64_t repl_ns[MAX_NODES];
+    _Atomic uint64_t keyspace_requests[KV_MAX_KEYSPACES];
+    _Atomic bool in_use;
+} __attribute__((aligned(64))) StatsSlot;
+
+// Totals over every slot
+typedef struct {
+    uint64_t counters[KV_STAT_COUNTER_COUNT];
+    uint64_t buckets[KV_HIST_COUNT][KV_STATS_BUCKETS];
+    uint64_t sums[KV_HIST_COUNT];
+    uint64_t repl_ok[MAX_NODES];
+    uint64_t repl_failed[MAX_NODES];
+    uint64_t repl_ns[MAX_NODES];
+    uint64_t keyspace_requests[KV_MAX_KEYSPACES];
+} StatsTotals;
+
+static StatsSlot stats_slots[KV_STATS_MAX_THREADS];
+static _Atomic int stats_slot_high = 0;         // Slots below this may hold counts
+
+// Round-trip time of the last replication to each peer
+static _Atomic uint64_t repl_last_ns[MAX_NODES];
+
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+static __thread StatsSlot* thread_stats = NULL;
+
+static const char* op_names[KV_STATS_MAX_OPS] = {
+    NULL, "GET", "PUT", "DELETE", "REPLICATE", "NODE_JOIN", "NODE_LEAVE", "LIST_KEYS",
+    "CAS", "INCR", "DECR", "APPEND", "GETSET", "SCAN", "STATS", "HOTKEYS", "TRACE", "KEYSPACE"
+};
+
+static void release_slot(void* arg) {
+    atomic_store(&((StatsSlot*)arg)->in_use, false);
+}
+
+static void create_stats_key(void) {
+    pthread_key_create(&stats_key, release_slot);
+}
+
+// Claim a slot for the calling thread; threads beyond the limit share the last one
+static StatsSlot* acquire_slot(void) {
+    pthread_once(&stats_key_once, create_stats_key);
+
+    int i;
+    for (i = 0; i < KV_STATS_MAX_THREADS - 1; i++) {
+        bool expected = false;
+        if (!atomic_load_explicit(&stats_slots[i].in_use, memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&stats_slots[i].in_use, &expected, true)) {
+            pthread_setspecific(stats_key, &stats_slots[i]);
+            break;
+        }
+    }
+
+    int high = atomic_load(&stats_slot_high);
+    while (high < i + 1 && !atomic_compare_exchange_weak(&stats_slot_high, &high, i + 1)) {
+    }
+
+    return &stats_slots[i];
+}
+
+static inline StatsSlot* my_slot(void) {
+    if (!thread_stats) {
+        thread_stats = acquire_slot();
+    }
+    return thread_stats;
+}
+
+// Single-writer increment; threads sharing the overflow slot may lose updates
+static inline void bump(_Atomic uint64_t* value, uint64_t delta) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + delta, memory_order_relaxed);
+}
+
+uint64_t kv_stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Current value of one counter, summed over the thread slots
+int64_t kv_stats_counter(KVStatCounter counter) {
+    uint64_t total = 0;
+    int high = atomic_load(&stats_slot_high);
+    for (int i = 0; i < high; i++) {
+        total += atomic_load_explicit(&stats_slots[i].counters[counter], memory_order_relaxed);
+    }
+    return (int64_t)total;
+}
+
+// Add to a counter; negative deltas move gauges down
+void kv_stats_add(KVStatCounter counter, int64_t delta) {
+    bump(&my_slot()->counters[counter], (uint64_t)delta);
+}
+
+// Record a duration in a histogram
+void kv_stats_observe(int histogram, uint64_t ns) {
+    if (histogram < 0 || histogram >= KV_HIST_COUNT) {
+        return;
+    }
+
+    // Bucket i holds durations up to 2^i microseconds
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+    while (bucket < KV_STATS_BUCKETS - 1 && us > (1ULL << bucket)) {
+        bucket++;
+    }
+
+    StatsSlot* slot = my_slot();
+    bump(&slot->buckets[histogram][bucket], 1);
+    bump(&slot->sums[histogram], ns);
+}
+
+// Record a served request
+void kv_stats_record_op(OperationCode op, uint64_t ns) {
+    if ((int)op > 0 && (int)op < KV_STATS_MAX_OPS) {
+        kv_stats_observe((int)op, ns);
+    }
+}
+
+// Record a replication round trip to the peer at index peer of the node list
+void kv_stats_replication(int peer, bool ok, uint64_t ns) {
+    if (peer < 0 || peer >= MAX_NODES) {
+        return;
+    }
+
+    StatsSlot* slot = my_slot();
+    if (ok) {
+        bump(&slot->repl_ok[peer], 1);
+        bump(&slot->repl_ns[peer], ns);
+        atomic_store_explicit(&repl_last_ns[peer], ns, memory_order_relaxed);
+    } else {
+        bump(&slot->repl_failed[peer], 1);
+    }
+}
+
+// Record a request routed to the keyspace with this id
+void kv_stats_keyspace_request(uint32_t id) {
+    if (id < KV_MAX_KEYSPACES) {
+        bump(&my_slot()->keyspace_requests[id], 1);
+    }
+}
+
+static void collect(StatsTotals* totals) {
+    memset(totals, 0, sizeof(StatsTotals));
+    int high = atomic_load(&stats_slot_high);
+
+    for (int i = 0; i < high; i++) {
+        StatsSlot* slot = &stats_slots[i];
+        for (int c = 0; c < KV_STAT_COUNTER_COUNT; c++) {
+            totals->counters[c] += atomic_load_explicit(&slot->counters[c], memory_order_relaxed);
+        }
+        for (int h = 0; h < KV_HIST_COUNT; h++) {
+            for (int b = 0; b < KV_STATS_BUCKETS; b++) {
+                totals->buckets[h][b] += atomic_load_explicit(&slot->buckets[h][b], memory_order_relaxed);
+            }
+            totals->sums[h] += atomic_load_explicit(&slot->sums[h], memory_order_relaxed);
+        }
+        for (int p = 0; p < MAX_NODES; p++) {
+            totals->repl_ok[p] += atomic_load_explicit(&slot->repl_ok[p], memory_order_relaxed);
+            totals->repl_failed[p] += atomic_load_explicit(&slot->repl_failed[p], memory_order_relaxed);
+            totals->repl_ns[p] += atomic_load_explicit(&slot->repl_ns[p], memory_order_relaxed);
+        }
+        for (int k = 0; k < KV_MAX_KEYSPACES; k++) {
+            totals->keyspace_requests[k] += atomic_load_explicit(&slot->keyspace_requests[k], memory_order_relaxed);
+        }
+    }
+}
+
+// Growable text buffer for rendering
+typedef struct {
+    char* data;
+    size_t len;
+    size_t size;
+} TextBuffer;
+
+static void append(TextBuffer* buf, const char* format, ...) {
+    if (!buf->data) {
+        return;
+    }
+
+    while (1) {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(buf->data + buf->len, buf->size - buf->len, format, args);
+        va_end(args);
+
+        if (n < 0) {
+            return;
+        }
+        if ((size_t)n < buf->size - buf->len) {
+            buf->len += (size_t)n;
+            return;
+        }
+
+        char* grown = (char*)realloc(buf->data, buf->size * 2);
+        if (!grown) {
+            free(buf->data);
+            buf->data = NULL;
+            return;
+        }
+        buf->data = grown;
+        buf->size *= 2;
+    }
+}
+
+static void append_header(TextBuffer* buf, const char* name, const char* type, const char* help) {
+    append(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// One histogram series; labels is empty or "key=\"value\","
+static void append_histogram(TextBuffer* buf, const char* name, const char* labels,
+                             const uint64_t* buckets, uint64_t sum_ns) {
+    uint64_t cumulative = 0;
+    for (int b = 0; b < KV_STATS_BUCKETS - 1; b++) {
+        cumulative += buckets[b];
+        append(buf, "%s_bucket{%sle=\"%g\"} %llu\n", name, labels, (double)(1ULL << b) / 1e6,
+               (unsigned long long)cumulative);
+    }
+    cumulative += buckets[KV_STATS_BUCKETS - 1];
+    append(buf, "%s_bucket{%sle=\"+Inf\"} %llu\n", name, labels, (unsigned long long)cumulative);
+
+    // Drop the trailing comma for the plain series
+    char plain[128];
+    snprintf(plain, sizeof(plain), "%s", labels);
+    size_t len = strlen(plain);
+    if (len > 0) {
+        plain[len - 1] = '\0';
+    }
+    const char* open = len > 0 ? "{" : "";
+    const char* close = len > 0 ? "}" : "";
+    append(buf, "%s_sum%s%s%s %.9f\n", name, open, plain, close, (double)sum_ns / 1e9);
+    append(buf, "%s_count%s%s%s %llu\n", name, open, plain, close, (unsigned long long)cumulative);
+}
+
+// Render every metric in Prometheus text format; the caller frees the result
+char* kv_stats_render(KVStore* store, NodeList* list) {
+    StatsTotals totals;
+    collect(&totals);
+
+    TextBuffer buf;
+    buf.size = 32768;
+    buf.len = 0;
+    buf.data = (char*)malloc(buf.size);
+    if (!buf.data) {
+        return NULL;
+    }
+    buf.data[0] = '\0';
+
+    append_header(&buf, "kv_requests_total", "counter", "Requests served by opcode");
+    for (int op = 1; op < KV_STATS_MAX_OPS; op++) {
+        if (!op_names[op]) {
+            continue;
+        }
+        uint64_t count = 0;
+        for (int b = 0; b < KV_STATS_BUCKETS; b++) {
+            count += totals.buckets[op][b];
+        }
+        append(&buf, "kv_requests_total{op=\"%s\"} %llu\n", op_names[op], (unsigned long long)count);
+    }
+
+    append_header(&buf, "kv_request_duration_seconds", "histogram", "Time from receiving a request to sending its reply");
+    for (int op = 1; op < KV_STATS_MAX_OPS; op++) {
+        if (!op_names[op]) {
+            continue;
+        }
+        char labels[64];
+        snprintf(labels, sizeof(labels), "op=\"%s\",", op_names[op]);
+        append_histogram(&buf, "kv_request_duration_seconds", labels, totals.buckets[op], totals.sums[op]);
+    }
+
+    append_header(&buf, "kv_received_bytes_total", "counter", "Request bytes received");
+    append(&buf, "kv_received_bytes_total %llu\n", (unsigned long long)totals.counters[KV_STAT_BYTES_IN]);
+    append_header(&buf, "kv_sent_bytes_total", "counter", "Reply bytes sent");
+    append(&buf, "kv_sent_bytes_total %llu\n", (unsigned long long)totals.counters[KV_STAT_BYTES_OUT]);
+
+    append_header(&buf, "kv_connections_total", "counter", "Client connections accepted");
+    append(&buf, "kv_connections_total %llu\n", (unsigned long long)totals.counters[KV_STAT_CONNECTIONS]);
+    append_header(&buf, "kv_connections_active", "gauge", "Client connections currently open");
+    append(&buf, "kv_connections_active %lld\n", (long long)totals.counters[KV_STAT_CONNECTIONS_ACTIVE]);
+
+    append_header(&buf, "kv_requests_inflight", "gauge", "Requests holding an admission slot");
+    append(&buf, "kv_requests_inflight %d\n", kv_admit_inflight());
+    append_header(&buf, "kv_admission_waits_total", "counter", "Requests that queued for an admission slot");
+    append(&buf, "kv_admission_waits_total %llu\n", (unsigned long long)totals.counters[KV_STAT_ADMIT_WAITS]);
+    append_header(&buf, "kv_shed_total", "counter", "Requests and connections answered busy");
+    append(&buf, "kv_shed_total{reason=\"overload\"} %llu\n", (unsigned long long)totals.counters[KV_STAT_SHED_BUSY]);
+    append(&buf, "kv_shed_total{reason=\"rate_limit\"} %llu\n", (unsigned long long)totals.counters[KV_STAT_SHED_RATE]);
+    append(&buf, "kv_shed_total{reason=\"connections\"} %llu\n",
+           (unsigned long long)totals.counters[KV_STAT_SHED_CONNECTIONS]);
+    append_header(&buf, "kv_peer_inflight_bytes", "gauge", "Replication and rebalancing bytes sent and not yet acknowledged");
+    append(&buf, "kv_peer_inflight_bytes %zu\n", kv_peer_budget_used());
+    append_header(&buf, "kv_peer_budget_waits_total", "counter", "Peer sends that waited for the in-flight byte budget");
+    append(&buf, "kv_peer_budget_waits_total %llu\n", (unsigned long long)totals.counters[KV_STAT_PEER_BUDGET_WAITS]);
+
+    append_header(&buf, "kv_redirects_total", "counter", "Requests redirected to the owning node");
+    append(&buf, "kv_redirects_total %llu\n", (unsigned long long)totals.counters[KV_STAT_REDIRECTS]);
+
+    append_header(&buf, "kv_slow_requests_total", "counter", "Requests slower than the slow-log threshold");
+    append(&buf, "kv_slow_requests_total %llu\n", (unsigned long long)totals.counters[KV_STAT_SLOW_REQUESTS]);
+    append_header(&buf, "kv_slow_log_dropped_total", "counter", "Slow-log entries dropped because the ring was full");
+    append(&buf, "kv_slow_log_dropped_total %llu\n", (unsigned long long)totals.counters[KV_STAT_SLOW_DROPPED]);
+
+    append_header(&buf, "kv_keys", "gauge", "Keys in the store");
+    append(&buf, "kv_keys %d\n", store ? atomic_load(&store->size) : 0);
+    append_header(&buf, "kv_memory_bytes", "gauge", "Memory held by value records and hash tables");
+    append(&buf, "kv_memory_bytes %lld\n", (long long)totals.counters[KV_STAT_STORE_BYTES]);
+
+    // Keyspaces are labelled by name, the server's own store being "default"
+    int keyspace_count = kv_keyspace_count();
+    const char* keyspace_names[KV_MAX_KEYSPACES];
+    KVStore* keyspace_stores[KV_MAX_KEYSPACES];
+    uint64_t keyspace_shed[KV_MAX_KEYSPACES];
+    keyspace_names[0] = "default";
+    keyspace_stores[0] = store;
+    keyspace_shed[0] = 0;
+    for (int k = 1; k < keyspace_count; k++) {
+        const KVKeyspace* keyspace = kv_keyspace_get((uint32_t)k);
+        keyspace_names[k] = keyspace->name;
+        keyspace_stores[k] = keyspace->store;
+        keyspace_shed[k] = atomic_load_explicit(&keyspace->shed, memory_order_relaxed);
+    }
+    append_header(&buf, "kv_keyspace_requests_total", "counter", "Requests routed to each keyspace");
+    for (int k = 0; k < keyspace_count; k++) {
+        append(&buf, "kv_keyspace_requests_total{keyspace=\"%s\"} %llu\n", keyspace_names[k],
+               (unsigned long long)totals.keyspace_requests[k]);
+    }
+    append_header(&buf, "kv_keyspace_keys", "gauge", "Keys in each keyspace");
+    for (int k = 0; k < keyspace_count; k++) {
+        append(&buf, "kv_keyspace_keys{keyspace=\"%s\"} %d\n", keyspace_names[k],
+               keyspace_stores[k] ? atomic_load(&keyspace_stores[k]->size) : 0);
+    }
+    append_header(&buf, "kv_keyspace_bytes", "gauge", "Key and value bytes held in memory by each keyspace");
+    for (int k = 0; k < keyspace_count; k++) {
+        append(&buf, "kv_keyspace_bytes{keyspace=\"%s\"} %lld\n", keyspace_names[k],
+               keyspace_stores[k] ? (long long)atomic_load(&keyspace_stores[k]->bytes) : 0LL);
+    }
+    append_header(&buf, "kv_keyspace_quota_bytes", "gauge", "Byte quota of each keyspace (0 for none)");
+    for (int k = 0; k < keyspace_count; k++) {
+        append(&buf, "kv_keyspace_quota_bytes{keyspace=\"%s\"} %zu\n", keyspace_names[k],
+               keyspace_stores[k] ? keyspace_stores[k]->quota : 0);
+    }
+    append_header(&buf, "kv_keyspace_evictions_total", "counter", "Keys evicted to bring each keyspace under its quota");
+    for (int k = 0; k < keyspace_count; k++) {
+        append(&buf, "kv_keyspace_evictions_total{keyspace=\"%s\"} %llu\n", keyspace_names[k],
+               keyspace_stores[k] ? (unsigned long long)atomic_load(&keyspace_stores[k]->evicted) : 0ULL);
+    }
+    append_header(&buf, "kv_keyspace_expirations_total", "counter", "Keys removed from each keyspace when their TTL ran out");
+    for (int k = 0; k < keyspace_count; k++) {
+        append(&buf, "kv_keyspace_expirations_total{keyspace=\"%s\"} %llu\n", keyspace_names[k],
+               keyspace_stores[k] ? (unsigned long long)atomic_load(&keyspace_stores[k]->expired) : 0ULL);
+    }
+    append_header(&buf, "kv_keyspace_rejected_writes_total", "counter", "Writes refused because their keyspace was over quota");
+    for (int k = 0; k < keyspace_count; k++) {
+        append(&buf, "kv_keyspace_rejected_writes_total{keyspace=\"%s\"} %llu\n", keyspace_names[k],
+               keyspace_stores[k] ? (unsigned long long)atomic_load(&keyspace_stores[k]->rejected) : 0ULL);
+    }
+    append_header(&buf, "kv_keyspace_shed_total", "counter", "Requests answered busy by each keyspace's rate limit");
+    for (int k = 0; k < keyspace_count; k++) {
+        append(&buf, "kv_keyspace_shed_total{keyspace=\"%s\"} %llu\n", keyspace_names[k],
+               (unsigned long long)keyspace_shed[k]);
+    }
+
+    append_header(&buf, "kv_compressed_input_bytes_total", "counter", "Value bytes stored compressed, before compression");
+    append(&buf, "kv_compressed_input_bytes_total %llu\n", (unsigned long long)totals.counters[KV_STAT_COMPRESS_RAW_BYTES]);
+    append_header(&buf, "kv_compressed_output_bytes_total", "counter", "Value bytes stored compressed, after compression");
+    append(&buf, "kv_compressed_output_bytes_total %llu\n",
+           (unsigned long long)totals.counters[KV_STAT_COMPRESS_PACKED_BYTES]);
+    append_header(&buf, "kv_compression_skipped_total", "counter", "Values over the threshold stored raw because compression did not shrink them");
+    append(&buf, "kv_compression_skipped_total %llu\n", (unsigned long long)totals.counters[KV_STAT_COMPRESS_SKIPPED]);
+    append_header(&buf, "kv_decompressions_total", "counter", "Values decompressed for readers");
+    append(&buf, "kv_decompressions_total %llu\n", (unsigned long long)totals.counters[KV_STAT_DECOMPRESSIONS]);
+    append_header(&buf, "kv_compression_seconds_total", "counter", "Time spent compressing and decompressing values");
+    append(&buf, "kv_compression_seconds_total{op=\"compress\"} %g\n", (double)totals.counters[KV_STAT_COMPRESS_NS] / 1e9);
+    append(&buf, "kv_compression_seconds_total{op=\"decompress\"} %g\n",
+           (double)totals.counters[KV_STAT_DECOMPRESS_NS] / 1e9);
+
+    append_header(&buf, "kv_spills_total", "counter", "Cold values moved from memory to the value log");
+    append(&buf, "kv_spills_total %llu\n", (unsigned long long)totals.counters[KV_STAT_SPILLS]);
+    append_header(&buf, "kv_spill_reads_total", "counter", "Values read back from the value log");
+    append(&buf, "kv_spill_reads_total %llu\n", (unsigned long long)totals.counters[KV_STAT_SPILL_READS]);
+    append_header(&buf, "kv_value_log_bytes", "gauge", "Bytes in value log segments");
+    append(&buf, "kv_value_log_bytes %lld\n", (long long)totals.counters[KV_STAT_VLOG_BYTES]);
+    append_header(&buf, "kv_value_log_dead_bytes", "gauge", "Value log bytes no record points at any more");
+    append(&buf, "kv_value_log_dead_bytes %lld\n", (long long)totals.counters[KV_STAT_VLOG_DEAD_BYTES]);
+    append_header(&buf, "kv_value_log_gc_bytes_total", "counter", "Live value bytes rewritten by value log garbage collection");
+    append(&buf, "kv_value_log_gc_bytes_total %llu\n", (unsigned long long)totals.counters[KV_STAT_VLOG_GC_BYTES]);
+
+    if (store && store->lsm) {
+        int tables[KV_LSM_LEVELS];
+        uint64_t table_bytes[KV_LSM_LEVELS];
+        for (int level = 0; level < KV_LSM_LEVELS; level++) {
+            tables[level] = kv_lsm_level_tables(store, level, &table_bytes[level]);
+        }
+        append_header(&buf, "kv_lsm_tables", "gauge", "SSTables in each LSM level");
+        for (int level = 0; level < KV_LSM_LEVELS; level++) {
+            append(&buf, "kv_lsm_tables{level=\"%d\"} %d\n", level, tables[level]);
+        }
+        append_header(&buf, "kv_lsm_table_bytes", "gauge", "SSTable bytes in each LSM level");
+        for (int level = 0; level < KV_LSM_LEVELS; level++) {
+            append(&buf, "kv_lsm_table_bytes{level=\"%d\"} %llu\n", level, (unsigned long long)table_bytes[level]);
+        }
+    }
+    append_header(&buf, "kv_lsm_flushes_total", "counter", "Memtables written out as level-0 SSTables");
+    append(&buf, "kv_lsm_flushes_total %llu\n", (unsigned long long)totals.counters[KV_STAT_LSM_FLUSHES]);
+    append_header(&buf, "kv_lsm_compactions_total", "counter", "LSM compactions, including tables moved down a level unchanged");
+    append(&buf, "kv_lsm_compactions_total %llu\n", (unsigned long long)totals.counters[KV_STAT_LSM_COMPACTIONS]);
+    append_header(&buf, "kv_lsm_compaction_bytes_total", "counter", "SSTable bytes written by LSM compactions");
+    append(&buf, "kv_lsm_compaction_bytes_total %llu\n", (unsigned long long)totals.counters[KV_STAT_LSM_COMPACTION_BYTES]);
+    append_header(&buf, "kv_lsm_block_reads_total", "counter", "SSTable blocks read from disk");
+    append(&buf, "kv_lsm_block_reads_total %llu\n", (unsigned long long)totals.counters[KV_STAT_LSM_BLOCK_READS]);
+    append_header(&buf, "kv_lsm_bloom_skips_total", "counter", "SSTable lookups answered by the Bloom filter");
+    append(&buf, "kv_lsm_bloom_skips_total %llu\n", (unsigned long long)totals.counters[KV_STAT_LSM_BLOOM_SKIPS]);
+    append_header(&buf, "kv_lsm_bloom_false_positives_total", "counter", "SSTable lookups the Bloom filter let through for an absent key");
+    append(&buf, "kv_lsm_bloom_false_positives_total %llu\n",
+           (unsigned long long)totals.counters[KV_STAT_LSM_BLOOM_FALSE_POSITIVES]);
+    append_header(&buf, "kv_lsm_key_filter_negatives_total", "counter", "LSM lookups the per-shard key filter answered");
+    append(&buf, "kv_lsm_key_filter_negatives_total %llu\n", (unsigned long long)totals.counters[KV_STAT_LSM_FILTER_NEGATIVES]);
+    append_header(&buf, "kv_lsm_key_filter_false_positives_total", "counter", "LSM lookups the key filter let through for an absent key");
+    append(&buf, "kv_lsm_key_filter_false_positives_total %llu\n",
+           (unsigned long long)totals.counters[KV_STAT_LSM_FILTER_FALSE_POSITIVES]);
+    append_header(&buf, "kv_lsm_key_filter_rebuilds_total", "counter", "Key filter rebuilds, at startup and after one fills up");
+    append(&buf, "kv_lsm_key_filter_rebuilds_total %llu\n", (unsigned long long)totals.counters[KV_STAT_LSM_FILTER_REBUILDS]);
+
+    // False positives as a share of the lookups for keys a filter does not hold
+    uint64_t bloom_negatives = totals.counters[KV_STAT_LSM_BLOOM_SKIPS] + totals.counters[KV_STAT_LSM_BLOOM_FALSE_POSITIVES];
+    uint64_t key_negatives = totals.counters[KV_STAT_LSM_FILTER_NEGATIVES] + totals.counters[KV_STAT_LSM_FILTER_FALSE_POSITIVES];
+    append_header(&buf, "kv_lsm_filter_bytes", "gauge", "Memory held by LSM filters");
+    append(&buf, "kv_lsm_filter_bytes{filter=\"table\"} %lld\n", (long long)totals.counters[KV_STAT_LSM_BLOOM_BYTES]);
+    append(&buf, "kv_lsm_filter_bytes{filter=\"key\"} %lld\n", (long long)totals.counters[KV_STAT_LSM_FILTER_BYTES]);
+    append_header(&buf, "kv_lsm_filter_false_positive_ratio", "gauge", "Share of absent-key lookups each LSM filter let through");
+    append(&buf, "kv_lsm_filter_false_positive_ratio{filter=\"table\"} %g\n",
+           bloom_negatives > 0 ? (double)totals.counters[KV_STAT_LSM_BLOOM_FALSE_POSITIVES] / bloom_negatives : 0.0);
+    append(&buf, "kv_lsm_filter_false_positive_ratio{filter=\"key\"} %g\n",
+           key_negatives > 0 ? (double)totals.counters[KV_STAT_LSM_FILTER_FALSE_POSITIVES] / key_negatives : 0.0);
+    append_header(&buf, "kv_lsm_write_stalls_total", "counter", "Writes that waited for an LSM flush or compaction");
+    append(&buf, "kv_lsm_write_stalls_total %llu\n", (unsigned long long)totals.counters[KV_STAT_LSM_STALLS]);
+    append_header(&buf, "kv_mmap_file_bytes", "gauge", "Size of the mmap engine's data file");
+    append(&buf, "kv_mmap_file_bytes %lld\n", (long long)totals.counters[KV_STAT_MMAP_FILE_BYTES]);
+    append_header(&buf, "kv_mmap_checkpoints_total", "counter", "Checkpoints of the mmap engine's data file");
+    append(&buf, "kv_mmap_checkpoints_total %llu\n", (unsigned long long)totals.counters[KV_STAT_MMAP_CHECKPOINTS]);
+
+    append_header(&buf, "kv_log_bytes_total", "counter", "Bytes appended to the operation log");
+    append(&buf, "kv_log_bytes_total %llu\n", (unsigned long long)totals.counters[KV_STAT_LOG_BYTES]);
+    append_header(&buf, "kv_log_records_total", "counter", "Records appended to the operation log");
+    append(&buf, "kv_log_records_total %llu\n", (unsigned long long)totals.counters[KV_STAT_LOG_RECORDS]);
+    append_header(&buf, "kv_log_fsync_duration_seconds", "histogram", "Time taken by log fsyncs");
+    append_histogram(&buf, "kv_log_fsync_duration_seconds", "", totals.buckets[KV_HIST_FSYNC],
+                     totals.sums[KV_HIST_FSYNC]);
+    append_header(&buf, "kv_snapshot_duration_seconds", "histogram", "Time taken to write a snapshot and rotate the log");
+    append_histogram(&buf, "kv_snapshot_duration_seconds", "", totals.buckets[KV_HIST_SNAPSHOT],
+                     totals.sums[KV_HIST_SNAPSHOT]);
+
+    if (list) {
+        // Peers are labelled by address; each family's samples must follow its header
+        pthread_mutex_lock(&list->lock);
+        char peers[MAX_NODES][64];
+        int peer_count = list->count < MAX_NODES ? list->count : MAX_NODES;
+        for (int p = 0; p < peer_count; p++) {
+            snprintf(peers[p], sizeof(peers[p]), "%s:%d", list->nodes[p].ip, list->nodes[p].port);
+        }
+        int self = list->current_node_idx;
+        pthread_mutex_unlock(&list->lock);
+
+        append_header(&buf, "kv_replication_requests_total", "counter", "Replication messages sent to each peer");
+        for (int p = 0; p < peer_count; p++) {
+            if (p == self) {
+                continue;
+            }
+            append(&buf, "kv_replication_requests_total{peer=\"%s\",result=\"ok\"} %llu\n", peers[p],
+                   (unsigned long long)totals.repl_ok[p]);
+            append(&buf, "kv_replication_requests_total{peer=\"%s\",result=\"failed\"} %llu\n", peers[p],
+                   (unsigned long long)totals.repl_failed[p]);
+        }
+
+        append_header(&buf, "kv_replication_seconds_total", "counter", "Total replication round-trip time per peer");
+        for (int p = 0; p < peer_count; p++) {
+            if (p != self) {
+                append(&buf, "kv_replication_seconds_total{peer=\"%s\"} %.9f\n", peers[p],
+                       (double)totals.repl_ns[p] / 1e9);
+            }
+        }
+
+        append_header(&buf, "kv_replication_lag_seconds", "gauge", "Round-trip time of the last replication to each peer");
+        for (int p = 0; p < peer_count; p++) {
+            if (p != self) {
+                append(&buf, "kv_replication_lag_seconds{peer=\"%s\"} %.9f\n", peers[p],
+                       (double)atomic_load_explicit(&repl_last_ns[p], memory_order_relaxed) / 1e9);
+            }
+        }
+    }
+
+    return buf.data;
+}
@@ -1,14 +1,5 @@
 #include "kv_store.h"
 
-// Simple hash function for distributing keys
-unsigned int hash_key(const char* key) {
-    unsigned int hash = 0;
-    while (*key) {
-        hash = (hash * 31) + (*key++);
-    }
-    return hash;
-}
-
 // Create directory if it doesn't exist
 bool ensure_directory_exists(const char* path) {
     struct stat st = {0};
@@ -26,41 +17,1490 @@ bool ensure_directory_exists(const char* path) {
     return true;
 }
 
+#define KV_TABLE_MIN_SLOTS 32   // At least one group of the widest probe
+
+// The store uses the low half of a key's hash; routing uses the high half,
+// so the keys a node owns still spread over every shard
+static inline unsigned int table_hash(uint64_t key_hash) {
+    return (unsigned int)key_hash;
+}
+
+// Take a writer lock, charging any time spent blocked to the request being
+// served on this thread; the uncontended case costs one trylock. Returns
+// the trace timestamp at which the lock was taken.
+static uint64_t lock_timed(pthread_mutex_t* lock) {
+    KV_TRACE_BEGIN(trace_start);
+    if (pthread_mutex_trylock(lock) != 0) {
+        uint64_t wait_start = kv_stats_now();
+        pthread_mutex_lock(lock);
+        kv_slowlog_phase(KV_PHASE_LOCK_WAIT, kv_stats_now() - wait_start);
+    }
+    KV_TRACE_END(KV_TRACE_LOCK, trace_start);
+    return KV_TRACE_NOW();
+}
+
+// Release a shard lock; with tracing the time it was held is the store span
+static void unlock_traced(pthread_mutex_t* lock, uint64_t held_since) {
+    pthread_mutex_unlock(lock);
+#ifdef KV_TRACING
+    kv_trace_record(KV_TRACE_STORE, held_since);
+#else
+    (void)held_since;
+#endif
+}
+
+// Take a shard's writer lock. The holder is also inside an epoch, so a
+// record the engine hands back stays valid until the lock is released.
+static uint64_t lock_shard(KVShard* shard) {
+    kv_epoch_enter();
+    return lock_timed(&shard->lock);
+}
+
+static void unlock_shard(KVShard* shard, uint64_t held_since) {
+    unlock_traced(&shard->lock, held_since);
+    kv_epoch_exit();
+}
+
+// Shards use the top bits of the hash, table probing the low bits
+static KVShard* shard_for(KVStore* store, unsigned int hash) {
+    return &store->shards[hash >> (32 - KV_SHARD_BITS)];
+}
+
+// Bytes taken by a table with this mask: slots, then cache-line aligned
+// control bytes
+static size_t table_bytes(unsigned int mask) {
+    return sizeof(KVTable) + (sizeof(_Atomic(KVRecord*)) + 1) * ((size_t)mask + 1) + 63;
+}
+
+// Tag kept in a full slot's control byte. It comes from hash bits that
+// neither the shard nor, in tables under 2^21 slots, the probe start use.
+static inline uint8_t ctrl_tag(unsigned int hash) {
+    return (uint8_t)((hash >> 21) & 0x7f);
+}
+
+// Control bytes of the group starting at pos
+static inline const uint8_t* table_group(const KVTable* table, unsigned int pos) {
+    return (const uint8_t*)&table->ctrl[pos];
+}
+
+// Set a control byte after its slot, so a reader that sees the byte also
+// sees the slot (caller holds the shard lock)
+static inline void set_ctrl(KVTable* table, unsigned int pos, uint8_t value) {
+    atomic_store_explicit(&table->ctrl[pos], value, memory_order_release);
+}
+
+// Allocate an empty table with a power-of-two slot count on a NUMA node
+static KVTable* table_create(unsigned int slot_count, int node) {
+    KVTable* table = (KVTable*)kv_numa_alloc(table_bytes(slot_count - 1), node);
+    if (!table) {
+        return NULL;
+    }
+    kv_stats_add(KV_STAT_STORE_BYTES, (int64_t)table_bytes(slot_count - 1));
+    
+    table->mask = slot_count - 1;
+    table->used = 0;
+    table->ctrl = (_Atomic uint8_t*)(((uintptr_t)(table->slots + slot_count) + 63) & ~(uintptr_t)63);
+    for (unsigned int i = 0; i < slot_count; i++) {
+        atomic_init(&table->slots[i], NULL);
+        atomic_init(&table->ctrl[i], KV_CTRL_EMPTY);
+    }
+    
+    return table;
+}
+
+// Free a table that no reader can still see
+static void table_free(void* ptr) {
+    KVTable* table = (KVTable*)ptr;
+    kv_stats_add(KV_STAT_STORE_BYTES, -(int64_t)table_bytes(table->mask));
+    kv_numa_free(table, table_bytes(table->mask));
+}
+
+// Bytes of a value kept in its record; a spilled one leaves only its pointer
+static inline size_t resident_len(uint8_t flags, uint16_t value_len) {
+    return (flags & KV_RECORD_SPILLED) ? sizeof(KVValuePointer) : value_len;
+}
+
+// Bytes taken by a record
+static size_t record_bytes(const KVRecord* rec) {
+    return sizeof(KVRecord) + rec->key_len + resident_len(rec->flags, rec->value_len) + 2;
+}
+
+// A value as it will be stored: the caller's string, or an LZ4 block when
+// that is smaller. Writers pack values before taking the shard lock where
+// they can, so compression stays off the critical section. For a spilled
+// value data points at its KVValuePointer and len is the stored length.
+typedef struct {
+    const char* data;
+    uint16_t len;
+    uint8_t flags;             // KV_RECORD_*
+    char packed[MAX_VALUE_SIZE];
+} PackedValue;
+
+// Pack a value, compressing it if it is over the threshold and shrinks
+static void pack_value(KVStore* store, const char* value, PackedValue* out) {
+    size_t len = strnlen(value, MAX_VALUE_SIZE - 1);
+    out->data = value;
+    out->len = (uint16_t)len;
+    out->flags = 0;
+    if (store->compress_min == 0 || len < store->compress_min) {
+        return;
+    }
+    
+    uint64_t started = kv_stats_now();
+    int packed_len = kv_lz4_compress(value, (int)len, out->packed, (int)len - 1);
+    kv_stats_add(KV_STAT_COMPRESS_NS, (int64_t)(kv_stats_now() - started));
+    if (packed_len <= 0) {
+        kv_stats_add(KV_STAT_COMPRESS_SKIPPED, 1);
+        return;
+    }
+    
+    kv_stats_add(KV_STAT_COMPRESS_RAW_BYTES, (int64_t)len);
+    kv_stats_add(KV_STAT_COMPRESS_PACKED_BYTES, packed_len);
+    out->data = out->packed;
+    out->len = (uint16_t)packed_len;
+    out->flags = KV_RECORD_COMPRESSED;
+}
+
+// Read a spilled record's stored bytes from the value log into dst
+static bool read_spilled(KVStore* store, const KVRecord* rec, char* dst) {
+    KVValuePointer ptr;
+    memcpy(&ptr, KV_RECORD_VALUE(rec), sizeof(KVValuePointer));
+    return kv_vlog_read(store->vlog, ptr, rec->value_len, dst);
+}
+
+// Copy a record's value out as a string into dst (MAX_VALUE_SIZE bytes);
+// returns its length, or -1 if it cannot be read back. The store is only
+// used for spilled records.
+static int unpack_value(KVStore* store, const KVRecord* rec, char* dst) {
+    char spilled[MAX_VALUE_SIZE];
+    const char* stored = KV_RECORD_VALUE(rec);
+    if (rec->flags & KV_RECORD_SPILLED) {
+        // A plain value is read straight into dst
+        char* into = (rec->flags & KV_RECORD_COMPRESSED) ? spilled : dst;
+        if (!read_spilled(store, rec, into)) {
+            dst[0] = '\0';
+            return -1;
+        }
+        stored = into;
+    }
+    
+    if (!(rec->flags & KV_RECORD_COMPRESSED)) {
+        if (stored != dst) {
+            memcpy(dst, stored, rec->value_len);
+        }
+        dst[rec->value_len] = '\0';
+        return rec->value_len;
+    }
+    
+    uint64_t started = kv_stats_now();
+    int len = kv_lz4_decompress(stored, rec->value_len, dst, MAX_VALUE_SIZE - 1);
+    kv_stats_add(KV_STAT_DECOMPRESS_NS, (int64_t)(kv_stats_now() - started));
+    kv_stats_add(KV_STAT_DECOMPRESSIONS, 1);
+    dst[len > 0 ? len : 0] = '\0';
+    return len;
+}
+
+// A record's value as a string, copied into scratch (MAX_VALUE_SIZE bytes)
+// only if it is stored compressed or spilled
+static const char* record_value(KVStore* store, const KVRecord* rec, char* scratch) {
+    if (!(rec->flags & (KV_RECORD_COMPRESSED | KV_RECORD_SPILLED))) {
+        return KV_RECORD_VALUE(rec);
+    }
+    unpack_value(store, rec, scratch);
+    return scratch;
+}
+
+static bool log_value(KVStore* store, OperationCode op, const char* key, const PackedValue* value,
+                      uint64_t version);
+
+// Build an immutable record for a key and a value as stored (value_len
+// stored bytes; a spilled value is its KVValuePointer)
+KVRecord* kv_record_create(const char* key, unsigned int hash, const char* value, uint16_t value_len, uint8_t flags,
+                           uint64_t version) {
+    size_t key_len = strnlen(key, MAX_KEY_SIZE - 1);
+    size_t resident = resident_len(flags, value_len);
+    
+    KVRecord* rec = (KVRecord*)malloc(sizeof(KVRecord) + key_len + resident + 2);
+    if (!rec) {
+        return NULL;
+    }
+    
+    rec->version = version;
+    atomic_init(&rec->refs, 1);
+    rec->hash = hash;
+    rec->key_len = (uint16_t)key_len;
+    rec->value_len = value_len;
+    rec->flags = flags;
+    atomic_init(&rec->referenced, 1);
+    memcpy(KV_RECORD_KEY(rec), key, key_len);
+    KV_RECORD_KEY(rec)[key_len] = '\0';
+    memcpy(KV_RECORD_VALUE(rec), value, resident);
+    KV_RECORD_VALUE(rec)[resident] = '\0';
+    
+    kv_stats_add(KV_STAT_STORE_BYTES, (int64_t)record_bytes(rec));
+    return rec;
+}
+
+static KVRecord* record_create(const char* key, unsigned int hash, const PackedValue* value, uint64_t version) {
+    return kv_record_create(key, hash, value->data, value->len, value->flags, version);
+}
+
+// Drop a reference to a record, freeing it with the last one
+void kv_record_release(KVRecord* rec) {
+    if (rec && atomic_fetch_sub_explicit(&rec->refs, 1, memory_order_acq_rel) == 1) {
+        kv_stats_add(KV_STAT_STORE_BYTES, -(int64_t)record_bytes(rec));
+        free(rec);
+    }
+}
+
+// A record holding the plain value, for senders whose client cannot take a
+// compressed one. A compressed record is copied out decompressed and the
+// reference to it dropped; the copy belongs to the caller alone.
+KVRecord* kv_record_unpack(KVRecord* rec) {
+    if (!rec || !(rec->flags & KV_RECORD_COMPRESSED)) {
+        return rec;
+    }
+    
+    // Records handed out by kv_store_get_record are never spilled
+    char value[MAX_VALUE_SIZE];
+    KVRecord* plain = NULL;
+    if (unpack_value(NULL, rec, value) >= 0) {
+        PackedValue unpacked;
+        unpacked.data = value;
+        unpacked.len = (uint16_t)strlen(value);
+        unpacked.flags = 0;
+        plain = record_create(KV_RECORD_KEY(rec), rec->hash, &unpacked, rec->version);
+    }
+    kv_record_release(rec);
+    return plain;
+}
+
+// Epoch callback: the store's reference goes away after the grace period
+static void record_retire(void* rec) {
+    kv_record_release((KVRecord*)rec);
+}
+
+// A private copy of a spilled record with its value read back in, for
+// senders that need the bytes in memory; NULL if the read fails
+static KVRecord* record_load(KVStore* store, const KVRecord* rec) {
+    char stored[MAX_VALUE_SIZE];
+    if (!read_spilled(store, rec, stored)) {
+        return NULL;
+    }
+    
+    PackedValue loaded;
+    loaded.data = stored;
+    loaded.len = rec->value_len;
+    loaded.flags = rec->flags & ~KV_RECORD_SPILLED;
+    return record_create(KV_RECORD_KEY(rec), rec->hash, &loaded, rec->version);
+}
+
+// A private copy of a record in the mmap engine's file, whose reference
+// count cannot keep its slot alive
+static KVRecord* record_copy(const KVRecord* rec) {
+    PackedValue value;
+    value.data = KV_RECORD_VALUE(rec);
+    value.len = rec->value_len;
+    value.flags = rec->flags & ~KV_RECORD_MAPPED;
+    return record_create(KV_RECORD_KEY(rec), rec->hash, &value, rec->version);
+}
+
+// Mark a record as read, for the tier thread's CLOCK sweep. The line is
+// only written when the bit is clear, so hot records stay shared.
+static inline void touch(KVRecord* rec) {
+    if (!atomic_load_explicit(&rec->referenced, memory_order_relaxed)) {
+        atomic_store_explicit(&rec->referenced, 1, memory_order_relaxed);
+    }
+}
+
+// A record leaving the store no longer needs its value log entry
+static void forget_spilled(KVStore* store, const KVRecord* rec) {
+    if (rec->flags & KV_RECORD_SPILLED) {
+        KVValuePointer ptr;
+        memcpy(&ptr, KV_RECORD_VALUE(rec), sizeof(KVValuePointer));
+        kv_vlog_discard(store->vlog, ptr, rec->key_len, rec->value_len);
+    }
+}
+
+// Does a record hold this key? Lengths are compared before any key bytes.
+static bool record_matches(const KVRecord* rec, unsigned int hash, const char* key, size_t key_len) {
+    return rec != NULL && rec != KV_TOMBSTONE && rec->hash == hash && rec->key_len == key_len &&
+           memcmp(KV_RECORD_KEY(rec), key, key_len) == 0;
+}
+
+// First group on a hash's probe path; groups are aligned so a group's
+// control bytes never straddle a cache line
+static inline unsigned int probe_start(const KVTable* table, const KVGroupOps* group, unsigned int hash) {
+    return hash & table->mask & ~(group->width - 1);
+}
+
+// Look up a key without locking (caller is inside an epoch). A group with an
+// empty slot ends the probe, so a miss usually reads one line of control
+// bytes and no records.
+static KVRecord* memory_lookup(KVStore* store, unsigned int hash, const char* key) {
+    KVTable* table = atomic_load_explicit(&shard_for(store, hash)->table, memory_order_acquire);
+    const KVGroupOps* group = store->group;
+    size_t key_len = strnlen(key, MAX_KEY_SIZE - 1);
+    uint8_t tag = ctrl_tag(hash);
+    
+    unsigned int pos = probe_start(table, group, hash);
+    for (unsigned int i = 0; i <= table->mask; i += group->width, pos = (pos + group->width) & table->mask) {
+        uint32_t empty;
+        uint32_t match = group->match(table_group(table, pos), tag, &empty);
+        atomic_thread_fence(memory_order_acquire);
+        
+        for (; match; match &= match - 1) {
+            KVRecord* rec = atomic_load_explicit(&table->slots[pos + __builtin_ctz(match)], memory_order_acquire);
+            if (record_matches(rec, hash, key, key_len)) {
+                return rec;
+            }
+        }
+        if (empty) {
+            return NULL;
+        }
+    }
+    
+    return NULL;
+}
+
+// Find the slot holding a key, or -1; also reports the first reusable slot
+// seen on the probe path (caller holds the shard lock)
+static int table_find(KVTable* table, const KVGroupOps* group, unsigned int hash, const char* key,
+                      int* free_slot) {
+    if (free_slot) {
+        *free_slot = -1;
+    }
+    size_t key_len = strnlen(key, MAX_KEY_SIZE - 1);
+    uint8_t tag = ctrl_tag(hash);
+    
+    unsigned int pos = probe_start(table, group, hash);
+    for (unsigned int i = 0; i <= table->mask; i += group->width, pos = (pos + group->width) & table->mask) {
+        const uint8_t* ctrl = table_group(table, pos);
+        uint32_t empty;
+        uint32_t match = group->match(ctrl, tag, &empty);
+        
+        for (; match; match &= match - 1) {
+            unsigned int slot = pos + __builtin_ctz(match);
+            KVRecord* rec = atomic_load_explicit(&table->slots[slot], memory_order_relaxed);
+            if (record_matches(rec, hash, key, key_len)) {
+                return (int)slot;
+            }
+        }
+        
+        uint32_t reusable = group->free(ctrl);
+        if (free_slot && *free_slot < 0 && reusable) {
+            *free_slot = (int)(pos + __builtin_ctz(reusable));
+        }
+        if (empty) {
+            return -1;
+        }
+    }
+    
+    return -1;
+}
+
+// Replace a shard's table with a fresh one sized for its live keys, dropping
+// tombstones. Readers still probing the old table see a consistent, slightly
+// stale view until they leave their epoch. (caller holds the shard lock)
+static KVTable* table_rebuild(KVStore* store, KVShard* shard) {
+    KVTable* old_table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    
+    // Keep the load factor at or below 1/2 after the rebuild
+    unsigned int slot_count = KV_TABLE_MIN_SLOTS;
+    while (slot_count < (unsigned int)(shard->size + 1) * 2) {
+        slot_count <<= 1;
+    }
+    
+    KVTable* table = table_create(slot_count, shard->node);
+    if (!table) {
+        return NULL;
+    }
+    
+    for (unsigned int i = 0; i <= old_table->mask; i++) {
+        KVRecord* rec = atomic_load_explicit(&old_table->slots[i], memory_order_relaxed);
+        if (rec == NULL || rec == KV_TOMBSTONE) {
+            continue;
+        }
+        
+        // The new table has no tombstones, so the first free slot is empty
+        unsigned int pos = probe_start(table, store->group, rec->hash);
+        uint32_t reusable;
+        while ((reusable = store->group->free(table_group(table, pos))) == 0) {
+            pos = (pos + store->group->width) & table->mask;
+        }
+        pos += __builtin_ctz(reusable);
+        atomic_store_explicit(&table->slots[pos], rec, memory_order_relaxed);
+        atomic_store_explicit(&table->ctrl[pos], ctrl_tag(rec->hash), memory_order_relaxed);
+        table->used++;
+    }
+    
+    atomic_store_explicit(&shard->table, table, memory_order_release);
+    kv_epoch_retire(old_table, table_free);
+    return table;
+}
+
 // Initialize key-value store
 KVStore* kv_store_init(int capacity) {
-    KVStore* store = (KVStore*)malloc(sizeof(KVStore));
+    KVStore* store = (KVStore*)aligned_alloc(KV_CACHE_LINE, sizeof(KVStore));
     if (!store) {
         return NULL;
     }
     
-    store->data = (KeyValuePair*)malloc(sizeof(KeyValuePair) * capacity);
-    if (!store->data) {
+    store->index = kv_index_init();
+    if (!store->index) {
         free(store);
         return NULL;
     }
+    store->group = kv_group_ops();
+    store->engine = &kv_engine_memory;
+    store->lsm = NULL;
+    store->compress_min = 0;
+    store->vlog = NULL;
+    store->memory_limit = 0;
+    store->quota = 0;
+    store->eviction = KV_EVICT_NONE;
+    store->ttl_ms = 0;
+    store->keyspace = 0;
+    atomic_init(&store->tier_running, false);
+    store->tier_shard = 0;
+    store->tier_slot = 0;
+    atomic_init(&store->sweep_running, false);
+    store->sweep_shard = 0;
+    store->sweep_slot = 0;
+    atomic_init(&store->expired, 0);
+    atomic_init(&store->evicted, 0);
+    atomic_init(&store->rejected, 0);
+    
+    // Each shard starts with room for its share of the capacity. Shards are
+    // spread over the NUMA nodes so no one node serves all of the memory
+    // traffic.
+    unsigned int slot_count = KV_TABLE_MIN_SLOTS;
+    while (slot_count < (unsigned int)(capacity / KV_SHARD_COUNT + 1) * 2) {
+        slot_count <<= 1;
+    }
+    
+    for (int i = 0; i < KV_SHARD_COUNT; i++) {
+        store->shards[i].node = i % kv_numa_node_count();
+        KVTable* table = table_create(slot_count, store->shards[i].node);
+        if (!table) {
+            while (--i >= 0) {
+                table_free(atomic_load(&store->shards[i].table));
+                pthread_mutex_destroy(&store->shards[i].lock);
+            }
+            kv_index_destroy(store->index);
+            free(store);
+            return NULL;
+        }
+        
+        pthread_mutex_init(&store->shards[i].lock, NULL);
+        atomic_init(&store->shards[i].table, table);
+        store->shards[i].deletions = NULL;
+        store->shards[i].size = 0;
+    }
+    
+    store->capacity = capacity;
+    atomic_init(&store->size, 0);
+    atomic_init(&store->bytes, 0);
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_mutex_init(&store->index_lock, NULL);
+    
+    // Initialize persistence-related fields
+    store->persistence_enabled = false;
+    store->op_count = 0;
+    store->log_file = NULL;
+    store->durability = KV_DURABILITY_BUFFERED;
+    store->log_ring = NULL;
+    strncpy(store->data_dir, DATA_DIR, sizeof(store->data_dir) - 1);
+    store->data_dir[sizeof(store->data_dir) - 1] = '\0';
+    
+    // Initialize versioning state
+    atomic_init(&store->hlc, 0);
+    store->node_id = 0;
+    
+    return store;
+}
+
+// Set the node id stamped into locally issued versions
+void kv_store_set_node_id(KVStore* store, unsigned int node_id) {
+    if (!store) {
+        return;
+    }
+    
+    store->node_id = node_id & KV_VERSION_NODE_MASK;
+}
+
+// Store values of at least min_bytes compressed when that makes them
+// smaller; 0 turns compression off. Values already stored keep their form.
+void kv_store_set_compression(KVStore* store, size_t min_bytes) {
+    if (!store) {
+        return;
+    }
+    
+    store->compress_min = min_bytes;
+}
+
+// Current wall-clock time in milliseconds
+static uint64_t wall_clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Whether a record has outlived the store's TTL; a version's top bits are
+// the wall-clock time of the write that made it
+static inline bool expired(const KVStore* store, const KVRecord* rec) {
+    return store->ttl_ms > 0 &&
+           (rec->version >> (KV_VERSION_LOGICAL_BITS + KV_VERSION_NODE_BITS)) + store->ttl_ms <= wall_clock_ms();
+}
+
+// Issue a new version for a local write
+static uint64_t hlc_next(KVStore* store) {
+    uint64_t physical = wall_clock_ms() << (KV_VERSION_LOGICAL_BITS + KV_VERSION_NODE_BITS);
+    uint64_t current = atomic_load(&store->hlc);
+    uint64_t next;
+    
+    do {
+        // Fall back to the logical counter when the wall clock has not moved past
+        // the last version; an overflowing counter simply carries into the clock bits
+        uint64_t last = current & ~KV_VERSION_NODE_MASK;
+        next = (physical > last ? physical : last + (1ULL << KV_VERSION_NODE_BITS)) | store->node_id;
+    } while (!atomic_compare_exchange_weak(&store->hlc, &current, next));
+    
+    return next;
+}
+
+// Merge a version seen from a peer or the log
+static void hlc_observe(KVStore* store, uint64_t version) {
+    uint64_t current = atomic_load(&store->hlc);
+    while (version > current && !atomic_compare_exchange_weak(&store->hlc, &current, version)) {
+    }
+}
+
+// Merge a version an engine found in its own files
+void kv_store_observe_version(KVStore* store, uint64_t version) {
+    hlc_observe(store, version);
+}
+
+// Current record for a key (caller holds the shard lock)
+static KVRecord* find_locked(KVStore* store, KVShard* shard, unsigned int hash, const char* key) {
+    (void)shard;
+    KVRecord* rec = store->engine->lookup(store, hash, key);
+    return rec && !expired(store, rec) ? rec : NULL;
+}
+
+// Store a value at a given version (caller holds the shard lock)
+static bool write_locked(KVStore* store, KVShard* shard, unsigned int hash, const char* key,
+                         const PackedValue* value, uint64_t version) {
+    KVRecord* rec = record_create(key, hash, value, version);
+    if (!rec) {
+        return false;
+    }
+    
+    if (!store->engine->insert(store, shard, rec)) {
+        kv_record_release(rec);
+        return false;
+    }
+    return true;
+}
+
+// Memory engine
+//
+// Records live in the shards' hash tables, and an ordered index of the keys
+// serves scans.
+
+// Put a record in its shard's table (caller holds the shard lock)
+static bool memory_insert(KVStore* store, KVShard* shard, KVRecord* rec) {
+    KVTable* table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    unsigned int hash = rec->hash;
+    const char* key = KV_RECORD_KEY(rec);
+    int free_slot;
+    int pos = table_find(table, store->group, hash, key, &free_slot);
+    
+    if (pos >= 0) {
+        // Swap in the new record; readers holding the old one keep it until they leave
+        KVRecord* old = atomic_load_explicit(&table->slots[pos], memory_order_relaxed);
+        atomic_store_explicit(&table->slots[pos], rec, memory_order_release);
+        atomic_fetch_add_explicit(&store->bytes, (int64_t)record_bytes(rec) - (int64_t)record_bytes(old),
+                                  memory_order_relaxed);
+        forget_spilled(store, old);
+        kv_epoch_retire(old, record_retire);
+        return true;
+    }
+    
+    // Key doesn't exist; reserve room in the store
+    if (atomic_fetch_add(&store->size, 1) >= store->capacity) {
+        // Store is full
+        atomic_fetch_sub(&store->size, 1);
+        return false;
+    }
+    
+    // Grow (or clear out tombstones) before the table gets more than 3/4 used
+    if (free_slot < 0 || (table->used + 1) * 4 > (int)(table->mask + 1) * 3) {
+        KVTable* rebuilt = table_rebuild(store, shard);
+        if (rebuilt) {
+            table = rebuilt;
+            table_find(table, store->group, hash, key, &free_slot);
+        }
+        if (free_slot < 0) {
+            atomic_fetch_sub(&store->size, 1);
+            return false;
+        }
+    }
+    
+    // New keys also go into the ordered index
+    lock_timed(&store->index_lock);
+    bool indexed = kv_index_insert(store->index, KV_RECORD_KEY(rec));
+    pthread_mutex_unlock(&store->index_lock);
+    if (!indexed) {
+        atomic_fetch_sub(&store->size, 1);
+        return false;
+    }
+    
+    if (atomic_load_explicit(&table->slots[free_slot], memory_order_relaxed) == NULL) {
+        table->used++;
+    }
+    atomic_store_explicit(&table->slots[free_slot], rec, memory_order_release);
+    set_ctrl(table, free_slot, ctrl_tag(hash));
+    shard->size++;
+    atomic_fetch_add_explicit(&store->bytes, (int64_t)record_bytes(rec), memory_order_relaxed);
+    return true;
+}
+
+// Remove a key (caller holds the shard lock); returns false if it is missing
+static bool memory_remove(KVStore* store, KVShard* shard, unsigned int hash, const char* key) {
+    KVTable* table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    int pos = table_find(table, store->group, hash, key, NULL);
+    if (pos < 0) {
+        return false;
+    }
+    
+    KVRecord* old = atomic_load_explicit(&table->slots[pos], memory_order_relaxed);
+    atomic_store_explicit(&table->slots[pos], KV_TOMBSTONE, memory_order_release);
+    set_ctrl(table, pos, KV_CTRL_DELETED);
+    
+    lock_timed(&store->index_lock);
+    kv_index_remove(store->index, KV_RECORD_KEY(old));
+    pthread_mutex_unlock(&store->index_lock);
+    
+    atomic_fetch_sub_explicit(&store->bytes, (int64_t)record_bytes(old), memory_order_relaxed);
+    forget_spilled(store, old);
+    kv_epoch_retire(old, record_retire);
+    shard->size--;
+    atomic_fetch_sub(&store->size, 1);
+    return true;
+}
+
+// Walk the ordered index; values are looked up only when asked for. New
+// keys wait on the index lock for the length of the walk.
+static void memory_each(KVStore* store, const char* start, bool exclusive, bool values,
+                        bool (*fn)(void* arg, const char* key, const KVRecord* rec), void* arg) {
+    lock_timed(&store->index_lock);
+    kv_epoch_enter();
+    
+    for (KVIndexNode* node = kv_index_seek(store->index, start, exclusive); node; node = node->next[0]) {
+        const KVRecord* rec = NULL;
+        if (values) {
+            rec = memory_lookup(store, table_hash(kv_key_hash(node->key)), node->key);
+            if (!rec) {
+                continue;
+            }
+        }
+        if (!fn(arg, node->key, rec)) {
+            break;
+        }
+    }
+    
+    kv_epoch_exit();
+    pthread_mutex_unlock(&store->index_lock);
+}
+
+// Walk one group in hash order without the index lock. Keys whose home is
+// the group sit on its probe chain, which ends at the first group with an
+// empty slot, just as a lookup's does.
+static uint64_t memory_scan(KVStore* store, uint64_t cursor, KVScanFn fn, void* arg) {
+    KVShard* shard = &store->shards[kv_cursor_shard(cursor)];
+    unsigned int width = store->group->width;
+    KVScanGroup found;
+    kv_scan_group_init(&found);
+    kv_epoch_enter();
+    
+    KVTable* table = atomic_load_explicit(&shard->table, memory_order_acquire);
+    uint32_t groups_mask = (table->mask + 1) / width - 1;
+    unsigned int home = (kv_cursor_group(cursor) & groups_mask) * width;
+    
+    unsigned int pos = home;
+    for (unsigned int i = 0; i <= table->mask; i += width, pos = (pos + width) & table->mask) {
+        bool empty = false;
+        for (unsigned int j = 0; j < width; j++) {
+            uint8_t ctrl = atomic_load_explicit(&table->ctrl[pos + j], memory_order_acquire);
+            if (ctrl == KV_CTRL_EMPTY) {
+                empty = true;
+                continue;
+            }
+            if (ctrl == KV_CTRL_DELETED) {
+                continue;
+            }
+            KVRecord* rec = atomic_load_explicit(&table->slots[pos + j], memory_order_acquire);
+            if (rec && rec != KV_TOMBSTONE && (rec->hash & table->mask & ~(width - 1)) == home) {
+                kv_scan_group_add(&found, rec->hash & (width - 1), KV_RECORD_KEY(rec));
+            }
+        }
+        if (empty) {
+            break;
+        }
+    }
+    
+    uint64_t next = kv_scan_group_finish(&found, cursor, groups_mask, fn, arg);
+    kv_epoch_exit();
+    return next;
+}
+
+const KVEngineOps kv_engine_memory = {
+    "memory", NULL, NULL, memory_lookup, memory_insert, memory_remove, memory_each, memory_scan,
+};
+
+void kv_scan_group_init(KVScanGroup* group) {
+    group->keys = group->local;
+    group->count = 0;
+    group->cap = KV_SCAN_GROUP_KEYS;
+}
+
+void kv_scan_group_add(KVScanGroup* group, unsigned int slot, const char* key) {
+    if (group->count == group->cap) {
+        KVScanKey* keys = (KVScanKey*)malloc(sizeof(KVScanKey) * group->cap * 2);
+        if (!keys) {
+            return;
+        }
+        memcpy(keys, group->keys, sizeof(KVScanKey) * group->count);
+        if (group->keys != group->local) {
+            free(group->keys);
+        }
+        group->keys = keys;
+        group->cap *= 2;
+    }
+    group->keys[group->count++] = (KVScanKey){ slot, (uint16_t)(kv_key_hash(key) >> 32), key };
+}
+
+// Reverse the bits of a group counter
+static inline uint32_t reverse_bits(uint32_t v) {
+    v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+    v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+    v = ((v >> 4) & 0x0f0f0f0f) | ((v & 0x0f0f0f0f) << 4);
+    return __builtin_bswap32(v);
+}
+
+// Order gathered keys by home slot, then tag, then key
+static bool scan_key_before(const KVScanKey* a, const KVScanKey* b) {
+    if (a->slot != b->slot) {
+        return a->slot < b->slot;
+    }
+    if (a->tag != b->tag) {
+        return a->tag < b->tag;
+    }
+    return strcmp(a->key, b->key) < 0;
+}
+
+// Hand a gathered group to fn a home slot and tag at a time, from the
+// cursor's slot and tag on, and return the cursor that follows: the slot and
+// tag fn stopped before, else the next group, else the start of the next
+// shard, else 0. Frees the group.
+uint64_t kv_scan_group_finish(KVScanGroup* group, uint64_t cursor, uint32_t groups_mask, KVScanFn fn, void* arg) {
+    int shard = kv_cursor_shard(cursor);
+    uint32_t counter = kv_cursor_group(cursor);
+    KVScanKey* keys = group->keys;
+    uint64_t next = 0;
+    
+    // Insertion sort; a group holds a handful of keys
+    for (int i = 1; i < group->count; i++) {
+        KVScanKey key = keys[i];
+        int j = i;
+        for (; j > 0 && scan_key_before(&key, &keys[j - 1]); j--) {
+            keys[j] = keys[j - 1];
+        }
+        keys[j] = key;
+    }
+    
+    bool stopped = false;
+    for (int i = 0, end; i < group->count && !stopped; i = end) {
+        end = i + 1;
+        while (end < group->count && keys[end].slot == keys[i].slot && keys[end].tag == keys[i].tag) {
+            end++;
+        }
+        bool passed = keys[i].slot < kv_cursor_slot(cursor) ||
+                      (keys[i].slot == kv_cursor_slot(cursor) && keys[i].tag < kv_cursor_tag(cursor));
+        if (!passed && !fn(arg, keys + i, end - i)) {
+            next = kv_cursor_make(shard, keys[i].slot, counter, keys[i].tag);
+            stopped = true;
+        }
+    }
+    
+    // Otherwise increment the counter from its top bit down
+    if (!stopped) {
+        counter = reverse_bits(reverse_bits(counter | ~groups_mask) + 1);
+        if (counter != 0) {
+            next = kv_cursor_make(shard, 0, counter, 0);
+        } else if (shard + 1 < KV_SHARD_COUNT) {
+            next = kv_cursor_make(shard + 1, 0, 0, 0);
+        }
+    }
+    
+    if (group->keys != group->local) {
+        free(group->keys);
+    }
+    return next;
+}
+
+// Choose the storage engine by name, before any data is loaded; dir is
+// where an engine that keeps its records on disk puts its files
+bool kv_store_set_engine(KVStore* store, const char* name, const char* dir) {
+    static const KVEngineOps* const engines[] = { &kv_engine_memory, &kv_engine_lsm, &kv_engine_mmap };
+    if (!store || !name || store->engine != &kv_engine_memory || store->persistence_enabled || store->vlog ||
+        atomic_load(&store->size) > 0) {
+        return false;
+    }
+    
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        if (strcmp(engines[i]->name, name) != 0) {
+            continue;
+        }
+        if (engines[i]->open && !engines[i]->open(store, dir)) {
+            return false;
+        }
+        store->engine = engines[i];
+        return true;
+    }
+    return false;
+}
+
+// Deletions
+//
+// A deleted key leaves its version behind in a small per-shard hash so that
+// a write older than the delete, arriving late from a peer, is dropped
+// instead of recreating the key. Entries are dropped lazily once they pass
+// KV_DELETION_HORIZON_MS, whenever their bucket is walked.
+
+// Find a key's deletion, unlinking expired entries on the way (caller holds
+// the shard lock). Returns the link that points at it, or NULL.
+static KVDeletion** deletion_find_locked(KVShard* shard, unsigned int hash, const char* key) {
+    if (!shard->deletions) {
+        return NULL;
+    }
+    
+    uint64_t horizon = wall_clock_ms();
+    horizon = horizon > KV_DELETION_HORIZON_MS ? horizon - KV_DELETION_HORIZON_MS : 0;
+    
+    KVDeletion** link = &shard->deletions[hash % KV_DELETION_BUCKETS];
+    while (*link) {
+        KVDeletion* del = *link;
+        if ((del->version >> (KV_VERSION_LOGICAL_BITS + KV_VERSION_NODE_BITS)) < horizon) {
+            *link = del->next;
+            free(del);
+            continue;
+        }
+        if (del->hash == hash && strcmp(del->key, key) == 0) {
+            return link;
+        }
+        link = &del->next;
+    }
+    return NULL;
+}
+
+// Version of a key's last deletion, or 0 if none is remembered
+static uint64_t deletion_version_locked(KVShard* shard, unsigned int hash, const char* key) {
+    KVDeletion** link = deletion_find_locked(shard, hash, key);
+    return link ? (*link)->version : 0;
+}
+
+// Remember that a key was deleted at version (caller holds the shard lock)
+static void deletion_record_locked(KVShard* shard, unsigned int hash, const char* key, uint64_t version) {
+    KVDeletion** link = deletion_find_locked(shard, hash, key);
+    if (link) {
+        if ((*link)->version < version) {
+            (*link)->version = version;
+        }
+        return;
+    }
+    
+    if (!shard->deletions) {
+        shard->deletions = (KVDeletion**)calloc(KV_DELETION_BUCKETS, sizeof(KVDeletion*));
+        if (!shard->deletions) {
+            return;
+        }
+    }
+    
+    size_t key_len = strlen(key);
+    KVDeletion* del = (KVDeletion*)malloc(sizeof(KVDeletion) + key_len + 1);
+    if (!del) {
+        return;
+    }
+    del->version = version;
+    del->hash = hash;
+    memcpy(del->key, key, key_len + 1);
+    
+    KVDeletion** bucket = &shard->deletions[hash % KV_DELETION_BUCKETS];
+    del->next = *bucket;
+    *bucket = del;
+}
+
+// Forget a key's deletion once a newer write has recreated it
+static void deletion_clear_locked(KVShard* shard, unsigned int hash, const char* key) {
+    KVDeletion** link = deletion_find_locked(shard, hash, key);
+    if (link) {
+        KVDeletion* del = *link;
+        *link = del->next;
+        free(del);
+    }
+}
+
+// Free every remembered deletion of a shard
+static void deletion_free(KVShard* shard) {
+    if (!shard->deletions) {
+        return;
+    }
+    for (int i = 0; i < KV_DELETION_BUCKETS; i++) {
+        while (shard->deletions[i]) {
+            KVDeletion* del = shard->deletions[i];
+            shard->deletions[i] = del->next;
+            free(del);
+        }
+    }
+    free(shard->deletions);
+    shard->deletions = NULL;
+}
+
+// Write a value under a new local version and log it (caller holds the shard lock)
+static bool commit_write_locked(KVStore* store, KVShard* shard, unsigned int hash, const char* key,
+                                const PackedValue* value, uint64_t* version) {
+    // Over the quota only deletes get through, until eviction makes room
+    if (store->quota > 0) {
+        size_t limit = store->eviction == KV_EVICT_NONE ? store->quota : store->quota + store->quota / KV_QUOTA_SLACK;
+        if ((size_t)atomic_load_explicit(&store->bytes, memory_order_relaxed) >= limit) {
+            atomic_fetch_add_explicit(&store->rejected, 1, memory_order_relaxed);
+            return false;
+        }
+    }
+    
+    uint64_t new_version = hlc_next(store);
+    if (!write_locked(store, shard, hash, key, value, new_version)) {
+        return false;
+    }
+    deletion_clear_locked(shard, hash, key);
+    
+    // Log the operation if persistence is enabled
+    if (store->persistence_enabled) {
+        log_value(store, OP_PUT, key, value, new_version);
+    }
+    
+    if (version) {
+        *version = new_version;
+    }
+    return true;
+}
+
+// Apply a versioned operation with last-writer-wins semantics
+static bool apply_versioned(KVStore* store, OperationCode op, const char* key, uint64_t key_hash,
+                            const PackedValue* value, uint64_t version, bool log) {
+    hlc_observe(store, version);
+    
+    unsigned int hash = table_hash(key_hash);
+    KVShard* shard = shard_for(store, hash);
+    uint64_t held_since = lock_shard(shard);
+    
+    // Drop operations that are not newer than what we already hold. A
+    // missing key is compared against its deletion, if one is remembered.
+    KVRecord* current = find_locked(store, shard, hash, key);
+    uint64_t held = current ? current->version : deletion_version_locked(shard, hash, key);
+    if (held >= version) {
+        unlock_shard(shard, held_since);
+        return false;
+    }
+    
+    bool applied = false;
+    if (op == OP_PUT && value) {
+        applied = write_locked(store, shard, hash, key, value, version);
+        if (applied) {
+            deletion_clear_locked(shard, hash, key);
+        }
+    } else if (op == OP_DELETE) {
+        // Deleting a key we never saw still records the delete, so the
+        // write it overtook cannot land afterwards
+        applied = !current || store->engine->remove(store, shard, hash, key);
+        if (applied) {
+            deletion_record_locked(shard, hash, key, version);
+        }
+    }
+    
+    if (applied && log && store->persistence_enabled) {
+        log_value(store, op, key, value, version);
+    }
+    
+    unlock_shard(shard, held_since);
+    return applied;
+}
+
+// Tiering
+//
+// The tier thread keeps the memory held by records and tables under
+// memory_limit by moving cold values to the value log. Coldness is tracked
+// with CLOCK: readers set a record's referenced bit, and the thread sweeps
+// the shards a batch of slots at a time, clearing set bits and spilling the
+// values whose bit was already clear. Values are written out without the
+// shard lock and swapped in under it only if the record is still current;
+// a record replaced in the meantime leaves its new entry as garbage.
+
+// Replace rec with a copy whose value is at ptr, if rec is still its key's
+// record (caller holds the shard lock). The old record's own entry, if it
+// had one, becomes garbage.
+static bool tier_swap_locked(KVStore* store, KVShard* shard, KVRecord* rec, KVValuePointer ptr) {
+    KVTable* table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    int pos = table_find(table, store->group, rec->hash, KV_RECORD_KEY(rec), NULL);
+    KVRecord* spilled = NULL;
+    if (pos >= 0 && atomic_load_explicit(&table->slots[pos], memory_order_relaxed) == rec) {
+        PackedValue value;
+        value.data = (const char*)&ptr;
+        value.len = rec->value_len;
+        value.flags = rec->flags | KV_RECORD_SPILLED;
+        spilled = record_create(KV_RECORD_KEY(rec), rec->hash, &value, rec->version);
+    }
+    if (!spilled) {
+        kv_vlog_discard(store->vlog, ptr, rec->key_len, rec->value_len);
+        return false;
+    }
+    
+    // It was cold when it was picked; it stays cold until it is read
+    atomic_store_explicit(&spilled->referenced, 0, memory_order_relaxed);
+    atomic_store_explicit(&table->slots[pos], spilled, memory_order_release);
+    atomic_fetch_add_explicit(&store->bytes, (int64_t)record_bytes(spilled) - (int64_t)record_bytes(rec),
+                              memory_order_relaxed);
+    forget_spilled(store, rec);
+    kv_epoch_retire(rec, record_retire);
+    return true;
+}
+
+// Publish a batch: flush the staged entries, then swap spilled copies in
+// for the records (each pinned by a reference) that are still current. Only
+// the first staged records got an entry; nothing is published if the
+// entries could not be written.
+static void tier_publish(KVStore* store, KVRecord** recs, KVValuePointer* ptrs, int count, int staged,
+                         bool compacting) {
+    if (kv_vlog_flush(store->vlog)) {
+        for (int i = 0; i < staged; i++) {
+            KVShard* shard = shard_for(store, recs[i]->hash);
+            uint64_t held_since = lock_shard(shard);
+            if (tier_swap_locked(store, shard, recs[i], ptrs[i])) {
+                kv_stats_add(compacting ? KV_STAT_VLOG_GC_BYTES : KV_STAT_SPILLS, compacting ? recs[i]->value_len : 1);
+            }
+            unlock_shard(shard, held_since);
+        }
+    }
+    
+    for (int i = 0; i < count; i++) {
+        kv_record_release(recs[i]);
+    }
+}
+
+// Advance the CLOCK hand over one batch of slots, spilling cold values;
+// returns true when the hand moved on to the next shard
+static bool tier_sweep(KVStore* store) {
+    KVShard* shard = &store->shards[store->tier_shard];
+    KVRecord* cold[KV_TIER_BATCH];
+    int count = 0;
+    
+    uint64_t held_since = lock_shard(shard);
+    KVTable* table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    unsigned int slot = store->tier_slot;
+    for (unsigned int end = slot + KV_TIER_BATCH; slot <= table->mask && slot < end; slot++) {
+        KVRecord* rec = atomic_load_explicit(&table->slots[slot], memory_order_relaxed);
+        if (rec == NULL || rec == KV_TOMBSTONE) {
+            continue;
+        }
+        if (atomic_load_explicit(&rec->referenced, memory_order_relaxed)) {
+            atomic_store_explicit(&rec->referenced, 0, memory_order_relaxed);
+        } else if (!(rec->flags & KV_RECORD_SPILLED) && rec->value_len >= KV_TIER_MIN_VALUE) {
+            atomic_fetch_add_explicit(&rec->refs, 1, memory_order_relaxed);
+            cold[count++] = rec;
+        }
+    }
+    bool wrapped = slot > table->mask;
+    unlock_shard(shard, held_since);
+    
+    store->tier_slot = wrapped ? 0 : slot;
+    if (wrapped) {
+        store->tier_shard = (store->tier_shard + 1) % KV_SHARD_COUNT;
+    }
+    
+    // Values of in-memory records cannot change, so they are staged unlocked
+    KVValuePointer ptrs[KV_TIER_BATCH];
+    int staged = 0;
+    while (staged < count && kv_vlog_append(store->vlog, KV_RECORD_KEY(cold[staged]), cold[staged]->key_len,
+                                            KV_RECORD_VALUE(cold[staged]), cold[staged]->value_len, &ptrs[staged])) {
+        staged++;
+    }
+    if (count > 0) {
+        tier_publish(store, cold, ptrs, count, staged, false);
+    }
+    return wrapped;
+}
+
+// Record and table bytes of this store alone, which is what its memory
+// limit covers; other keyspaces' stores count against their own
+static size_t resident_bytes(KVStore* store) {
+    size_t bytes = (size_t)atomic_load_explicit(&store->bytes, memory_order_relaxed);
+    kv_epoch_enter();
+    for (int i = 0; i < KV_SHARD_COUNT; i++) {
+        KVTable* table = atomic_load_explicit(&store->shards[i].table, memory_order_acquire);
+        bytes += table_bytes(table->mask);
+    }
+    kv_epoch_exit();
+    return bytes;
+}
+
+// Spill until memory is a little under the limit, giving up after two
+// turns of the clock: the first may only clear referenced bits
+static void tier_spill(KVStore* store) {
+    size_t target = store->memory_limit - store->memory_limit / 16;
+    int shards_passed = 0;
+    while (atomic_load(&store->tier_running) && shards_passed < 2 * KV_SHARD_COUNT &&
+           resident_bytes(store) > target) {
+        if (tier_sweep(store)) {
+            shards_passed++;
+        }
+    }
+}
+
+typedef struct {
+    KVStore* store;
+    KVRecord* live[KV_TIER_BATCH];
+    KVValuePointer ptrs[KV_TIER_BATCH];
+    int count;
+} TierCollect;
+
+// kv_vlog_scan callback: copy entries whose record still points at them to
+// the head of the log
+static bool tier_collect_entry(void* arg, const char* key, uint16_t key_len, const char* value, uint16_t value_len,
+                               KVValuePointer ptr) {
+    TierCollect* collect = (TierCollect*)arg;
+    KVStore* store = collect->store;
+    if (key_len >= MAX_KEY_SIZE) {
+        return false;
+    }
+    
+    char key_str[MAX_KEY_SIZE];
+    memcpy(key_str, key, key_len);
+    key_str[key_len] = '\0';
+    unsigned int hash = table_hash(kv_key_hash(key_str));
+    KVShard* shard = shard_for(store, hash);
+    
+    uint64_t held_since = lock_shard(shard);
+    KVRecord* rec = find_locked(store, shard, hash, key_str);
+    bool live = false;
+    if (rec && (rec->flags & KV_RECORD_SPILLED) && rec->value_len == value_len) {
+        KVValuePointer current;
+        memcpy(&current, KV_RECORD_VALUE(rec), sizeof(KVValuePointer));
+        live = current.segment == ptr.segment && current.offset == ptr.offset;
+    }
+    if (live) {
+        atomic_fetch_add_explicit(&rec->refs, 1, memory_order_relaxed);
+    }
+    unlock_shard(shard, held_since);
+    if (!live) {
+        return atomic_load(&store->tier_running);
+    }
+    
+    // The record is pinned; if it changes before the swap, the copy is garbage
+    if (!kv_vlog_append(store->vlog, key, key_len, value, value_len, &collect->ptrs[collect->count])) {
+        kv_record_release(rec);
+        return false;
+    }
+    collect->live[collect->count++] = rec;
+    if (collect->count == KV_TIER_BATCH) {
+        tier_publish(store, collect->live, collect->ptrs, collect->count, collect->count, true);
+        collect->count = 0;
+    }
+    return atomic_load(&store->tier_running);
+}
+
+// Move a segment's live entries to the head of the log and drop it
+static void tier_compact(KVStore* store, uint32_t segment) {
+    TierCollect collect;
+    collect.store = store;
+    collect.count = 0;
+    kv_vlog_scan(store->vlog, segment, tier_collect_entry, &collect);
+    if (collect.count > 0) {
+        tier_publish(store, collect.live, collect.ptrs, collect.count, collect.count, true);
+    }
+    kv_vlog_drop(store->vlog, segment);
+}
+
+static void* tier_main(void* arg) {
+    KVStore* store = (KVStore*)arg;
+    while (atomic_load(&store->tier_running)) {
+        if (resident_bytes(store) > store->memory_limit) {
+            tier_spill(store);
+        }
+        
+        int64_t victim = kv_vlog_gc_victim(store->vlog);
+        if (victim >= 0) {
+            tier_compact(store, (uint32_t)victim);
+        }
+        
+        usleep(KV_TIER_INTERVAL_MS * 1000);
+    }
+    return NULL;
+}
+
+// Keep record and table memory under memory_limit bytes by spilling cold
+// values to a value log in dir. Call before persistence is enabled so that
+// recovery can spill too.
+bool kv_store_enable_tiering(KVStore* store, const char* dir, size_t memory_limit) {
+    if (!store || !dir || memory_limit == 0 || store->vlog || store->engine != &kv_engine_memory) {
+        return false;
+    }
+    
+    store->vlog = kv_vlog_open(dir);
+    if (!store->vlog) {
+        return false;
+    }
+    store->memory_limit = memory_limit;
+    
+    atomic_store(&store->tier_running, true);
+    if (pthread_create(&store->tier_thread, NULL, tier_main, store) != 0) {
+        atomic_store(&store->tier_running, false);
+        kv_vlog_close(store->vlog);
+        store->vlog = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Expiry and eviction
+//
+// A sweeper thread walks the shards a batch of slots at a time, on a CLOCK
+// hand of its own, removing keys that have outlived the TTL and, while the
+// store is over its quota with CLOCK eviction, keys whose referenced bit is
+// already clear. The removals are logged as deletes, so a restart does not
+// bring the keys back; they are not replicated, since each node evicts by
+// its own reads. Between passes an expired key is hidden from reads but may
+// still show up in key listings.
+
+// Sweep one batch of slots; returns true when the hand moved on to the next shard
+static bool sweep_batch(KVStore* store, bool evict) {
+    KVShard* shard = &store->shards[store->sweep_shard];
+    size_t target = store->quota - store->quota / 16;
+    
+    uint64_t held_since = lock_shard(shard);
+    KVTable* table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    unsigned int slot = store->sweep_slot;
+    for (unsigned int end = slot + KV_TIER_BATCH; slot <= table->mask && slot < end; slot++) {
+        KVRecord* rec = atomic_load_explicit(&table->slots[slot], memory_order_relaxed);
+        if (rec == NULL || rec == KV_TOMBSTONE) {
+            continue;
+        }
+        
+        _Atomic uint64_t* counter = NULL;
+        if (expired(store, rec)) {
+            counter = &store->expired;
+        } else if (evict && (size_t)atomic_load_explicit(&store->bytes, memory_order_relaxed) > target) {
+            if (atomic_load_explicit(&rec->referenced, memory_order_relaxed)) {
+                atomic_store_explicit(&rec->referenced, 0, memory_order_relaxed);
+            } else {
+                counter = &store->evicted;
+            }
+        }
+        if (!counter) {
+            continue;
+        }
+        
+        // Removal only marks the slot, so the walk can go on over the same table
+        char key[MAX_KEY_SIZE];
+        memcpy(key, KV_RECORD_KEY(rec), rec->key_len + 1);
+        if (memory_remove(store, shard, rec->hash, key)) {
+            atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+            if (store->persistence_enabled) {
+                kv_store_log_operation(store, OP_DELETE, key, NULL, hlc_next(store));
+            }
+        }
+    }
+    bool wrapped = slot > table->mask;
+    unlock_shard(shard, held_since);
+    
+    store->sweep_slot = wrapped ? 0 : slot;
+    if (wrapped) {
+        store->sweep_shard = (store->sweep_shard + 1) % KV_SHARD_COUNT;
+    }
+    return wrapped;
+}
+
+static void* sweep_main(void* arg) {
+    KVStore* store = (KVStore*)arg;
+    while (atomic_load(&store->sweep_running)) {
+        if (store->eviction == KV_EVICT_CLOCK && store->quota > 0 &&
+            (size_t)atomic_load(&store->bytes) > store->quota) {
+            // Evict to a little under the quota, giving up after two turns
+            // of the clock: the first may only clear referenced bits
+            size_t target = store->quota - store->quota / 16;
+            int shards_passed = 0;
+            while (atomic_load(&store->sweep_running) && shards_passed < 2 * KV_SHARD_COUNT &&
+                   (size_t)atomic_load(&store->bytes) > target) {
+                if (sweep_batch(store, true)) {
+                    shards_passed++;
+                }
+            }
+        } else if (store->ttl_ms > 0) {
+            for (int i = 0; i < KV_SWEEP_BATCHES && atomic_load(&store->sweep_running); i++) {
+                sweep_batch(store, false);
+            }
+        }
+        
+        usleep(KV_TIER_INTERVAL_MS * 1000);
+    }
+    return NULL;
+}
+
+// Limit the records to quota bytes, eviction saying what happens past it,
+// and expire keys ttl_ms after their last write (0 for no limit and no
+// expiry). A TTL hides expired keys under any engine, but a quota and the
+// sweeper that removes keys need the memory engine. Call once the store is
+// loaded, so recovery is never refused or swept.
+bool kv_store_set_limits(KVStore* store, size_t quota, KVEviction eviction, uint64_t ttl_ms) {
+    if (!store || atomic_load(&store->sweep_running) || (quota > 0 && store->engine != &kv_engine_memory)) {
+        return false;
+    }
+    
+    store->quota = quota;
+    store->eviction = eviction;
+    store->ttl_ms = ttl_ms;
+    
+    bool sweeps = ttl_ms > 0 || (quota > 0 && eviction != KV_EVICT_NONE);
+    if (!sweeps || store->engine != &kv_engine_memory) {
+        return true;
+    }
+    atomic_store(&store->sweep_running, true);
+    if (pthread_create(&store->sweep_thread, NULL, sweep_main, store) != 0) {
+        atomic_store(&store->sweep_running, false);
+        return false;
+    }
+    return true;
+}
+
+// Choose how log appends are flushed; takes effect for the next log file
+void kv_store_set_durability(KVStore* store, KVDurability durability) {
+    pthread_mutex_lock(&store->lock);
+    store->durability = durability;
+    pthread_mutex_unlock(&store->lock);
+}
+
+// Open a new log file and its async writer (caller holds store->lock)
+static bool open_log_locked(KVStore* store, const char* log_path) {
+    store->log_file = fopen(log_path, "a+");
+    if (!store->log_file) {
+        return false;
+    }
+    
+    if (store->durability == KV_DURABILITY_ASYNC) {
+        // Async appends bypass stdio and write at offsets through io_uring
+        store->log_ring = kv_log_ring_create(fileno(store->log_file));
+        if (!store->log_ring) {
+            fprintf(stderr, "Warning: io_uring unavailable, falling back to fsync durability\n");
+            store->durability = KV_DURABILITY_FSYNC;
+        }
+    }
+    
+    return true;
+}
+
+// Flush and close the current log file (caller holds store->lock)
+static void close_log_locked(KVStore* store) {
+    if (store->log_ring) {
+        kv_log_ring_destroy(store->log_ring);
+        store->log_ring = NULL;
+    }
+    
+    if (store->log_file) {
+        fclose(store->log_file);
+        store->log_file = NULL;
+    }
+}
+
+// Whether a data directory already holds logs or snapshots
+static bool has_persisted_data(const char* data_dir) {
+    DIR* dir = opendir(data_dir);
+    if (!dir) {
+        return false;
+    }
+    
+    bool found = false;
+    struct dirent* entry;
+    while (!found && (entry = readdir(dir)) != NULL) {
+        found = strncmp(entry->d_name, "operations_", 11) == 0 || strncmp(entry->d_name, "snapshot_", 9) == 0 ||
+                strcmp(entry->d_name, "operations.log") == 0;
+    }
+    closedir(dir);
+    return found;
+}
+
+static bool placement_migration = false;  // Whether a data directory may change hash seeds
+
+// Let kv_store_check_placement accept a data directory placed with another
+// seed, or with the legacy hash
+void kv_store_allow_placement_migration(bool allow) {
+    placement_migration = allow;
+}
+
+// Keys are placed on nodes by their hash, so a node keeps the hash seed its
+// data was written under unless it is given a new one. A new seed, or data
+// from before seeded hashing, gives keys new owners, so the node refuses to
+// start unless migration was allowed; distribute_data then moves the keys
+// once the node has peers to move them to. Call before the directory's data
+// is loaded.
+bool kv_store_check_placement(const char* data_dir) {
+    if (!ensure_directory_exists(data_dir)) {
+        return false;
+    }
     
-    // Initialize all entries as invalid
-    for (int i = 0; i < capacity; i++) {
-        store->data[i].valid = false;
-    }
+    char path[512];
+    snprintf(path, sizeof(path), "%s/placement", data_dir);
     
-    store->capacity = capacity;
-    store->size = 0;
-    pthread_mutex_init(&store->lock, NULL);
+    unsigned long long stored_seed = 0;
+    FILE* file = fopen(path, "r");
+    bool have_seed = file && fscanf(file, "wyhash %llx", &stored_seed) == 1;
+    if (file) {
+        fclose(file);
+    }
     
-    // Initialize persistence-related fields
-    store->persistence_enabled = false;
-    store->op_count = 0;
-    store->log_file = NULL;
-    strncpy(store->data_dir, DATA_DIR, sizeof(store->data_dir) - 1);
-    store->data_dir[sizeof(store->data_dir) - 1] = '\0';
+    if (have_seed && !kv_hash_seed_is_set()) {
+        kv_hash_set_seed(stored_seed);
+    } else if (have_seed && stored_seed != kv_hash_get_seed()) {
+        if (!placement_migration) {
+            fprintf(stderr, "Keys in %s were placed with hash seed %llx; start with --hash-seed 0x%llx to keep "
+                    "them where they are, or with --migrate-placement to move them to their new owners\n",
+                    data_dir, stored_seed, stored_seed);
+            return false;
+        }
+        fprintf(stderr, "Warning: hash seed changed from %llx; keys in %s move to their new owners when this "
+                "node joins the cluster\n", stored_seed, data_dir);
+    } else if (!have_seed && has_persisted_data(data_dir)) {
+        if (!placement_migration) {
+            fprintf(stderr, "Keys in %s were placed with the legacy key hash; start with --migrate-placement "
+                    "to move them to their new owners\n", data_dir);
+            return false;
+        }
+        fprintf(stderr, "Warning: keys in %s were placed with the legacy key hash; they move to their new "
+                "owners when this node joins the cluster\n", data_dir);
+    }
     
-    return store;
+    file = fopen(path, "w");
+    if (file) {
+        fprintf(file, "wyhash %llx\n", (unsigned long long)kv_hash_get_seed());
+        fclose(file);
+    }
+    return true;
 }
 
 // Enable persistence for the key-value store
 bool kv_store_enable_persistence(KVStore* store, const char* data_dir) {
-    if (!store || !data_dir) {
+    // Other engines keep their own files
+    if (!store || !data_dir || store->engine != &kv_engine_memory) {
         return false;
     }
     
@@ -76,13 +1516,12 @@ bool kv_store_enable_persistence(KVStore* store, const char* data_dir) {
         return false;
     }
     
-    // Create a log file path
+    // Create a log file path; the timestamped name lets recovery find it again
     char log_path[512];
-    snprintf(log_path, sizeof(log_path), "%s/operations.log", store->data_dir);
+    snprintf(log_path, sizeof(log_path), "%s/operations_%ld.log", store->data_dir, (long)time(NULL));
     
     // Open the log file for append
-    store->log_file = fopen(log_path, "a+");
-    if (!store->log_file) {
+    if (!open_log_locked(store, log_path)) {
         fprintf(stderr, "Error opening log file: %s\n", strerror(errno));
         pthread_mutex_unlock(&store->lock);
         return false;
@@ -91,47 +1530,96 @@ bool kv_store_enable_persistence(KVStore* store, const char* data_dir) {
     // Set persistence as enabled
     store->persistence_enabled = true;
     
-    // Recover data from existing logs if they exist
+    pthread_mutex_unlock(&store->lock);
+    
+    // Recover data from existing logs if they exist; this takes shard locks,
+    // which must never be acquired while holding store->lock
     if (!kv_store_recover_from_logs(store)) {
         fprintf(stderr, "Warning: Failed to recover data from logs\n");
         // We continue anyway since we might be starting fresh
     }
     
-    pthread_mutex_unlock(&store->lock);
     return true;
 }
 
+static bool create_snapshot_locked(KVStore* store);
+static bool write_snapshot_locked(KVStore* store);
+
 // Log an operation to the append-only log
-bool kv_store_log_operation(KVStore* store, OperationCode op, const char* key, const char* value) {
-    if (!store || !store->persistence_enabled || !store->log_file) {
+bool kv_store_log_operation(KVStore* store, OperationCode op, const char* key, const char* value, uint64_t version) {
+    if (!store || !store->persistence_enabled) {
+        return false;
+    }
+    
+    if (!value) {
+        return log_value(store, op, key, NULL, version);
+    }
+    PackedValue packed;
+    pack_value(store, value, &packed);
+    return log_value(store, op, key, &packed, version);
+}
+
+// Append a record with a value as stored (NULL for deletes) to the log
+static bool log_value(KVStore* store, OperationCode op, const char* key, const PackedValue* value,
+                      uint64_t version) {
+    if (!store->persistence_enabled) {
         return false;
     }
     
+    uint64_t log_start = kv_stats_now();
+    KV_TRACE_BEGIN(trace_start);
     LogEntry entry;
-    entry.op_code = op;
+    memset(&entry, 0, sizeof(LogEntry));
+    entry.op_code = op | (value && (value->flags & KV_RECORD_COMPRESSED) ? KV_LOG_COMPRESSED : 0);
     entry.timestamp = time(NULL);
-    strncpy(entry.key, key, MAX_KEY_SIZE - 1);
-    entry.key[MAX_KEY_SIZE - 1] = '\0';
+    entry.version = version;
+    entry.key_len = (uint16_t)strnlen(key, MAX_KEY_SIZE - 1);
+    entry.value_len = value ? value->len : 0;
+    
+    // Write the header followed by the key and value bytes only
+    char record[sizeof(LogEntry) + MAX_KEY_SIZE + MAX_VALUE_SIZE];
+    size_t record_len = sizeof(LogEntry);
+    memcpy(record, &entry, sizeof(LogEntry));
+    memcpy(record + record_len, key, entry.key_len);
+    record_len += entry.key_len;
+    if (entry.value_len > 0) {
+        memcpy(record + record_len, value->data, entry.value_len);
+        record_len += entry.value_len;
+    }
     
-    if (value) {
-        strncpy(entry.value, value, MAX_VALUE_SIZE - 1);
-        entry.value[MAX_VALUE_SIZE - 1] = '\0';
-    } else {
-        entry.value[0] = '\0';
+    pthread_mutex_lock(&store->lock);
+    
+    if (!store->log_file) {
+        pthread_mutex_unlock(&store->lock);
+        return false;
     }
     
-    // Write the entry to the log file
-    size_t items_written = fwrite(&entry, sizeof(LogEntry), 1, store->log_file);
-    fflush(store->log_file); // Ensure it's written to disk
+    bool written;
+    if (store->log_ring) {
+        written = kv_log_ring_append(store->log_ring, record, record_len);
+    } else {
+        written = fwrite(record, record_len, 1, store->log_file) == 1;
+        fflush(store->log_file); // Ensure it's written to disk
+        if (store->durability == KV_DURABILITY_FSYNC) {
+            uint64_t sync_start = kv_stats_now();
+            written = fdatasync(fileno(store->log_file)) == 0 && written;
+            kv_stats_observe(KV_HIST_FSYNC, kv_stats_now() - sync_start);
+        }
+    }
+    kv_stats_add(KV_STAT_LOG_BYTES, (int64_t)record_len);
+    kv_stats_add(KV_STAT_LOG_RECORDS, 1);
     
     // Check if we need to create a snapshot
     store->op_count++;
     if (store->op_count >= SNAPSHOT_THRESHOLD) {
-        kv_store_create_snapshot(store);
+        create_snapshot_locked(store);
         store->op_count = 0;
     }
     
-    return items_written == 1;
+    pthread_mutex_unlock(&store->lock);
+    kv_slowlog_phase(KV_PHASE_LOG, kv_stats_now() - log_start);
+    KV_TRACE_END(KV_TRACE_LOG, trace_start);
+    return written;
 }
 
 // Create a snapshot of the current state
@@ -141,58 +1629,65 @@ bool kv_store_create_snapshot(KVStore* store) {
     }
     
     pthread_mutex_lock(&store->lock);
-    
+    bool result = create_snapshot_locked(store);
+    pthread_mutex_unlock(&store->lock);
+    return result;
+}
+
+// Write a snapshot and rotate the log, timing both (caller holds store->lock)
+static bool create_snapshot_locked(KVStore* store) {
+    uint64_t started = kv_stats_now();
+    bool result = write_snapshot_locked(store);
+    kv_stats_observe(KV_HIST_SNAPSHOT, kv_stats_now() - started);
+    return result;
+}
+
+// Write a snapshot and rotate the log (caller holds store->lock)
+//
+// Shards are read without their locks. Holding store->lock stops every
+// writer at its log append, so any write the snapshot misses is logged to
+// the new file, and any it catches early is replayed as a same-version no-op.
+static bool write_snapshot_locked(KVStore* store) {
     // Create a snapshot file path with timestamp
     char snapshot_path[512];
     time_t now = time(NULL);
     snprintf(snapshot_path, sizeof(snapshot_path), "%s/snapshot_%ld.dat", 
              store->data_dir, (long)now);
     
-    // Open the snapshot file
-    FILE* snapshot_file = fopen(snapshot_path, "wb");
-    if (!snapshot_file) {
-        fprintf(stderr, "Error creating snapshot file: %s\n", strerror(errno));
-        pthread_mutex_unlock(&store->lock);
+    // Keep appending to the current log if the snapshot could not be written
+    if (!kv_snapshot_write(store, snapshot_path)) {
         return false;
     }
     
-    // Write the number of valid entries
-    fwrite(&store->size, sizeof(int), 1, snapshot_file);
-    
-    // Write all valid key-value pairs
-    for (int i = 0; i < store->capacity; i++) {
-        if (store->data[i].valid) {
-            fwrite(&store->data[i], sizeof(KeyValuePair), 1, snapshot_file);
-        }
-    }
-    
-    fclose(snapshot_file);
-    
     // After creating a snapshot, start a new log file
-    if (store->log_file) {
-        fclose(store->log_file);
-    }
+    close_log_locked(store);
     
     // Create a new log file path
     char log_path[512];
     snprintf(log_path, sizeof(log_path), "%s/operations_%ld.log", store->data_dir, (long)now);
     
     // Open the new log file
-    store->log_file = fopen(log_path, "a+");
-    if (!store->log_file) {
+    if (!open_log_locked(store, log_path)) {
         fprintf(stderr, "Error opening new log file: %s\n", strerror(errno));
         // We continue with persistence disabled
         store->persistence_enabled = false;
-        pthread_mutex_unlock(&store->lock);
         return false;
     }
     
-    pthread_mutex_unlock(&store->lock);
     return true;
 }
 
-// Find the most recent snapshot file
-static char* find_latest_snapshot(const char* data_dir) {
+// Whether a file name is name_prefix<digits>suffix, such as snapshot_123.dat
+static bool is_data_file(const char* name, const char* prefix, const char* suffix) {
+    size_t prefix_len = strlen(prefix);
+    size_t suffix_len = strlen(suffix);
+    size_t len = strlen(name);
+    return len > prefix_len + suffix_len && strncmp(name, prefix, prefix_len) == 0 &&
+           strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+// Find the most recent snapshot file older than before_time
+static char* find_latest_snapshot(const char* data_dir, time_t before_time) {
     DIR* dir = opendir(data_dir);
     if (!dir) {
         return NULL;
@@ -203,13 +1698,11 @@ static char* find_latest_snapshot(const char* data_dir) {
     char* latest_snapshot = NULL;
     
     while ((entry = readdir(dir)) != NULL) {
-        if (strncmp(entry->d_name, "snapshot_", 9) == 0 && 
-            strstr(entry->d_name, ".dat") != NULL) {
-            
+        if (is_data_file(entry->d_name, "snapshot_", ".dat")) {
             // Extract timestamp from filename
             time_t snapshot_time = atol(entry->d_name + 9);
             
-            if (snapshot_time > latest_time) {
+            if (snapshot_time > latest_time && snapshot_time < before_time) {
                 latest_time = snapshot_time;
                 free(latest_snapshot);
                 latest_snapshot = strdup(entry->d_name);
@@ -221,6 +1714,13 @@ static char* find_latest_snapshot(const char* data_dir) {
     return latest_snapshot;
 }
 
+// qsort comparator: log names by the time in them
+static int compare_log_names(const void* a, const void* b) {
+    long time_a = atol(*(char* const*)a + 11);
+    long time_b = atol(*(char* const*)b + 11);
+    return (time_a > time_b) - (time_a < time_b);
+}
+
 // Find all log files newer than a given timestamp
 static char** find_newer_logs(const char* data_dir, time_t after_time, int* count) {
     DIR* dir = opendir(data_dir);
@@ -234,9 +1734,7 @@ static char** find_newer_logs(const char* data_dir, time_t after_time, int* coun
     *count = 0;
     
     while ((entry = readdir(dir)) != NULL) {
-        if (strncmp(entry->d_name, "operations_", 11) == 0 && 
-            strstr(entry->d_name, ".log") != NULL) {
-            
+        if (is_data_file(entry->d_name, "operations_", ".log")) {
             // Extract timestamp from filename
             time_t log_time = atol(entry->d_name + 11);
             
@@ -246,247 +1744,599 @@ static char** find_newer_logs(const char* data_dir, time_t after_time, int* coun
         }
     }
     
-    rewinddir(dir);
+    rewinddir(dir);
+    
+    if (*count == 0) {
+        closedir(dir);
+        return NULL;
+    }
+    
+    // Allocate array for filenames
+    char** log_files = (char**)malloc(sizeof(char*) * (*count));
+    if (!log_files) {
+        closedir(dir);
+        *count = 0;
+        return NULL;
+    }
+    
+    // Fill the array
+    int index = 0;
+    while ((entry = readdir(dir)) != NULL && index < *count) {
+        if (is_data_file(entry->d_name, "operations_", ".log")) {
+            // Extract timestamp from filename
+            time_t log_time = atol(entry->d_name + 11);
+            
+            if (log_time >= after_time) {
+                log_files[index++] = strdup(entry->d_name);
+            }
+        }
+    }
+    
+    closedir(dir);
+    
+    // Replay in the order the logs were written; records from before
+    // versioning have nothing else to order them by
+    qsort(log_files, index, sizeof(char*), compare_log_names);
+    *count = index;
+    return log_files;
+}
+
+// Operation log record as written before versioning: fixed-size, with the
+// key and value NUL-terminated in place
+typedef struct {
+    OperationCode op_code;
+    time_t timestamp;
+    char key[MAX_KEY_SIZE];
+    char value[MAX_VALUE_SIZE];
+} LegacyLogEntry;
+
+// A version for a record written before versioning: its time, or just past
+// the last version applied, so replaying such records in the order they
+// were written lets each one win over the one before
+uint64_t kv_store_legacy_version(KVStore* store, time_t when) {
+    uint64_t version = ((uint64_t)when * 1000) << (KV_VERSION_LOGICAL_BITS + KV_VERSION_NODE_BITS);
+    uint64_t last = atomic_load(&store->hlc) & ~KV_VERSION_NODE_MASK;
+    if (version <= last) {
+        version = last + (1ULL << KV_VERSION_NODE_BITS);
+    }
+    version |= store->node_id;
+    hlc_observe(store, version);
+    return version;
+}
+
+// Whether a log holds LegacyLogEntry records: a whole number of them, the
+// first a PUT or DELETE of a key, and not current records that happen to
+// end exactly at the end of the file
+static bool log_is_legacy(FILE* log_file) {
+    struct stat st;
+    if (fstat(fileno(log_file), &st) != 0 || st.st_size == 0 || st.st_size % sizeof(LegacyLogEntry) != 0) {
+        return false;
+    }
+    
+    LegacyLogEntry legacy;
+    bool legacy_start = fread(&legacy, sizeof(LegacyLogEntry), 1, log_file) == 1 &&
+                        (legacy.op_code == OP_PUT || legacy.op_code == OP_DELETE) && legacy.key[0] != '\0' &&
+                        memchr(legacy.key, '\0', MAX_KEY_SIZE) != NULL;
+    
+    off_t offset = 0;
+    LogEntry entry;
+    while (legacy_start && offset < st.st_size && fseeko(log_file, offset, SEEK_SET) == 0 &&
+           fread(&entry, sizeof(LogEntry), 1, log_file) == 1) {
+        OperationCode op = entry.op_code & ~KV_LOG_COMPRESSED;
+        if ((op != OP_PUT && op != OP_DELETE) || entry.key_len == 0 || entry.key_len >= MAX_KEY_SIZE ||
+            entry.value_len >= MAX_VALUE_SIZE) {
+            break;
+        }
+        offset += sizeof(LogEntry) + entry.key_len + entry.value_len;
+    }
+    
+    rewind(log_file);
+    return legacy_start && offset != st.st_size;
+}
+
+// Replay a log of LegacyLogEntry records
+static void replay_legacy_log(KVStore* store, FILE* log_file) {
+    LegacyLogEntry entry;
+    while (fread(&entry, sizeof(LegacyLogEntry), 1, log_file) == 1) {
+        if (entry.op_code != OP_PUT && entry.op_code != OP_DELETE) {
+            continue;
+        }
+        entry.key[MAX_KEY_SIZE - 1] = '\0';
+        entry.value[MAX_VALUE_SIZE - 1] = '\0';
+        PackedValue packed;
+        pack_value(store, entry.value, &packed);
+        apply_versioned(store, entry.op_code, entry.key, kv_key_hash(entry.key), &packed,
+                        kv_store_legacy_version(store, entry.timestamp), false);
+    }
+}
+
+// Replay a log of LogEntry records, each followed by its key and value
+static void replay_log(KVStore* store, FILE* log_file) {
+    LogEntry entry;
+    char key[MAX_KEY_SIZE];
+    char value[MAX_VALUE_SIZE];
+    
+    // Read and apply each operation
+    while (fread(&entry, sizeof(LogEntry), 1, log_file) == 1) {
+        // Stop at a corrupt or torn record
+        if (entry.key_len >= MAX_KEY_SIZE || entry.value_len >= MAX_VALUE_SIZE ||
+            fread(key, 1, entry.key_len, log_file) != entry.key_len ||
+            fread(value, 1, entry.value_len, log_file) != entry.value_len) {
+            break;
+        }
+        key[entry.key_len] = '\0';
+        value[entry.value_len] = '\0';
+        
+        // Compressed values go back into the store as they were logged
+        PackedValue packed;
+        OperationCode op = entry.op_code & ~KV_LOG_COMPRESSED;
+        if (entry.op_code & KV_LOG_COMPRESSED) {
+            packed.data = value;
+            packed.len = entry.value_len;
+            packed.flags = KV_RECORD_COMPRESSED;
+        } else {
+            pack_value(store, value, &packed);
+        }
+        
+        switch (op) {
+            case OP_PUT:
+            case OP_DELETE:
+                // Replay without re-logging; versions make this idempotent
+                apply_versioned(store, op, key, kv_key_hash(key), &packed, entry.version, false);
+                break;
+                
+            default:
+                // Ignore other operations
+                break;
+        }
+    }
+}
+
+// Replay a log file in whichever layout it was written
+static void replay_log_file(KVStore* store, const char* path) {
+    FILE* log_file = fopen(path, "rb");
+    if (!log_file) {
+        return;
+    }
+    
+    // Records are small; read them in large chunks
+    setvbuf(log_file, NULL, _IOFBF, 1 << 16);
+    if (log_is_legacy(log_file)) {
+        replay_legacy_log(store, log_file);
+    } else {
+        replay_log(store, log_file);
+    }
+    fclose(log_file);
+}
+
+// Recover data from logs and snapshots
+bool kv_store_recover_from_logs(KVStore* store) {
+    if (!store || !store->persistence_enabled) {
+        return false;
+    }
+    
+    // Load the latest snapshot that is intact. Falling back to an older one
+    // is safe even after part of a damaged one was applied: every record
+    // it held is at least as new as anything the older snapshot and the
+    // logs since can replay, and versions keep the newest.
+    time_t snapshot_time = 0;
+    time_t before_time = (time_t)INT64_MAX;
+    char* snapshot;
+    while ((snapshot = find_latest_snapshot(store->data_dir, before_time)) != NULL) {
+        char snapshot_path[512];
+        snprintf(snapshot_path, sizeof(snapshot_path), "%s/%s", store->data_dir, snapshot);
+        before_time = atol(snapshot + 9);
+        bool loaded = kv_snapshot_load(store, snapshot_path);
+        if (!loaded) {
+            fprintf(stderr, "Warning: snapshot %s is damaged, trying an older one\n", snapshot_path);
+        }
+        free(snapshot);
+        
+        if (loaded) {
+            snapshot_time = before_time;
+            break;
+        }
+    }
+    
+    // Find log files newer than the snapshot
+    int log_count = 0;
+    char** log_files = find_newer_logs(store->data_dir, snapshot_time, &log_count);
+    
+    // Before versioning, the server logged to operations.log until its
+    // first snapshot, so that log comes before everything else
+    char log_path[512];
+    if (snapshot_time == 0) {
+        snprintf(log_path, sizeof(log_path), "%s/operations.log", store->data_dir);
+        replay_log_file(store, log_path);
+    }
+    
+    // Process each log file
+    for (int i = 0; i < log_count; i++) {
+        snprintf(log_path, sizeof(log_path), "%s/%s", store->data_dir, log_files[i]);
+        replay_log_file(store, log_path);
+        free(log_files[i]);
+    }
+    
+    free(log_files);
+    
+    return true;
+}
+
+// Clean up resources
+void kv_store_destroy(KVStore* store) {
+    if (store) {
+        // Stop moving and dropping values before anything is torn down
+        if (atomic_exchange(&store->tier_running, false)) {
+            pthread_join(store->tier_thread, NULL);
+        }
+        if (atomic_exchange(&store->sweep_running, false)) {
+            pthread_join(store->sweep_thread, NULL);
+        }
+        
+        // Create a final snapshot if persistence is enabled
+        if (store->persistence_enabled) {
+            kv_store_create_snapshot(store);
+            
+            pthread_mutex_lock(&store->lock);
+            close_log_locked(store);
+            pthread_mutex_unlock(&store->lock);
+        }
+        
+        if (store->engine->close) {
+            store->engine->close(store);
+        }
+        
+        // No readers may remain at this point, so free directly
+        for (int i = 0; i < KV_SHARD_COUNT; i++) {
+            KVTable* table = atomic_load(&store->shards[i].table);
+            for (unsigned int j = 0; j <= table->mask; j++) {
+                KVRecord* rec = atomic_load(&table->slots[j]);
+                if (rec != NULL && rec != KV_TOMBSTONE) {
+                    kv_record_release(rec);
+                }
+            }
+            table_free(table);
+            deletion_free(&store->shards[i]);
+            pthread_mutex_destroy(&store->shards[i].lock);
+        }
+        kv_epoch_drain();
+        kv_vlog_close(store->vlog);
+        
+        pthread_mutex_destroy(&store->lock);
+        pthread_mutex_destroy(&store->index_lock);
+        kv_index_destroy(store->index);
+        free(store);
+    }
+}
+
+// Add or update a key-value pair
+bool kv_store_put(KVStore* store, const char* key, uint64_t key_hash, const char* value, uint64_t* version) {
+    if (!store || !key || !value) {
+        return false;
+    }
+    
+    PackedValue packed;
+    pack_value(store, value, &packed);
+    
+    unsigned int hash = table_hash(key_hash);
+    KVShard* shard = shard_for(store, hash);
+    
+    uint64_t held_since = lock_shard(shard);
+    bool result = commit_write_locked(store, shard, hash, key, &packed, version);
+    unlock_shard(shard, held_since);
+    
+    return result;
+}
+
+// Retrieve a value by key; takes no locks
+bool kv_store_get(KVStore* store, const char* key, uint64_t key_hash, char* value, uint64_t* version) {
+    if (!store || !key || !value) {
+        return false;
+    }
+    
+    unsigned int hash = table_hash(key_hash);
+    
+    KV_TRACE_BEGIN(trace_start);
+    kv_epoch_enter();
+    
+    KVRecord* rec = store->engine->lookup(store, hash, key);
+    if (rec && expired(store, rec)) {
+        rec = NULL;
+    }
+    if (rec) {
+        touch(rec);
+    }
+    bool found = rec && unpack_value(store, rec, value) >= 0;
+    if (found && version) {
+        *version = rec->version;
+    }
+    
+    kv_epoch_exit();
+    KV_TRACE_END(KV_TRACE_STORE, trace_start);
+    return found;
+}
+
+// Retrieve a key's record with a reference held; the caller sends straight
+// from it and then calls kv_record_release()
+KVRecord* kv_store_get_record(KVStore* store, const char* key, uint64_t key_hash) {
+    if (!store || !key) {
+        return NULL;
+    }
+    
+    unsigned int hash = table_hash(key_hash);
+    
+    // The epoch keeps the record from being released before we pin it
+    KV_TRACE_BEGIN(trace_start);
+    kv_epoch_enter();
+    KVRecord* rec = store->engine->lookup(store, hash, key);
+    if (rec && expired(store, rec)) {
+        rec = NULL;
+    }
+    if (rec) {
+        touch(rec);
+        if (rec->flags & KV_RECORD_SPILLED) {
+            rec = record_load(store, rec);
+        } else if (rec->flags & KV_RECORD_MAPPED) {
+            rec = record_copy(rec);
+        } else {
+            atomic_fetch_add_explicit(&rec->refs, 1, memory_order_relaxed);
+        }
+    }
+    kv_epoch_exit();
+    KV_TRACE_END(KV_TRACE_STORE, trace_start);
+    
+    return rec;
+}
+
+// Delete a key-value pair
+bool kv_store_delete(KVStore* store, const char* key, uint64_t key_hash, uint64_t* version) {
+    if (!store || !key) {
+        return false;
+    }
+    
+    unsigned int hash = table_hash(key_hash);
+    KVShard* shard = shard_for(store, hash);
+    
+    uint64_t held_since = lock_shard(shard);
+    
+    // A key past its TTL is already gone as far as clients can tell
+    bool live = store->ttl_ms == 0 || find_locked(store, shard, hash, key) != NULL;
+    if (!live || !store->engine->remove(store, shard, hash, key)) {
+        unlock_shard(shard, held_since);
+        return false;
+    }
+    
+    // Deletes get a version too so replicas can order them against writes
+    uint64_t new_version = hlc_next(store);
+    deletion_record_locked(shard, hash, key, new_version);
+    
+    // Log the operation if persistence is enabled
+    if (store->persistence_enabled) {
+        kv_store_log_operation(store, OP_DELETE, key, NULL, new_version);
+    }
+    
+    if (version) {
+        *version = new_version;
+    }
+    
+    unlock_shard(shard, held_since);
+    return true;
+}
+
+// Apply a record loaded from a snapshot without logging it. A compressed
+// value is kept as it is; a plain one must be NUL-terminated and is packed
+// like any other write.
+bool kv_store_restore(KVStore* store, const char* key, const char* value, uint16_t value_len, uint8_t flags,
+                      uint64_t version) {
+    PackedValue packed;
+    if (flags & KV_RECORD_COMPRESSED) {
+        packed.data = value;
+        packed.len = value_len;
+        packed.flags = KV_RECORD_COMPRESSED;
+    } else {
+        pack_value(store, value, &packed);
+    }
+    return apply_versioned(store, OP_PUT, key, kv_key_hash(key), &packed, version, false);
+}
+
+// Apply a replicated or rebalanced operation if it is newer than the local copy
+bool kv_store_apply(KVStore* store, OperationCode op, const char* key, uint64_t key_hash,
+                    const char* value, uint64_t version) {
+    if (!store || !key || (op == OP_PUT && !value)) {
+        return false;
+    }
+    
+    PackedValue packed;
+    if (value) {
+        pack_value(store, value, &packed);
+    }
+    return apply_versioned(store, op, key, key_hash, value ? &packed : NULL, version, true);
+}
+
+// Compare-and-set a value by version and/or current value
+bool kv_store_cas(KVStore* store, const char* key, uint64_t key_hash, uint32_t flags, const char* expected,
+                  uint64_t expected_version, const char* value, char* current, uint64_t* version) {
+    if (!store || !key || !value || ((flags & KV_CAS_VALUE) && !expected)) {
+        return false;
+    }
+    
+    PackedValue packed;
+    pack_value(store, value, &packed);
     
-    if (*count == 0) {
-        closedir(dir);
-        return NULL;
-    }
+    unsigned int hash = table_hash(key_hash);
+    KVShard* shard = shard_for(store, hash);
+    uint64_t held_since = lock_shard(shard);
     
-    // Allocate array for filenames
-    char** log_files = (char**)malloc(sizeof(char*) * (*count));
-    if (!log_files) {
-        closedir(dir);
-        *count = 0;
-        return NULL;
+    KVRecord* rec = find_locked(store, shard, hash, key);
+    uint64_t current_version = rec ? rec->version : 0;
+    
+    bool match = true;
+    if ((flags & KV_CAS_VERSION) && current_version != expected_version) {
+        match = false;
+    }
+    char scratch[MAX_VALUE_SIZE];
+    if ((flags & KV_CAS_VALUE) && (!rec || strcmp(record_value(store, rec, scratch), expected) != 0)) {
+        match = false;
     }
     
-    // Fill the array
-    int index = 0;
-    while ((entry = readdir(dir)) != NULL && index < *count) {
-        if (strncmp(entry->d_name, "operations_", 11) == 0 && 
-            strstr(entry->d_name, ".log") != NULL) {
-            
-            // Extract timestamp from filename
-            time_t log_time = atol(entry->d_name + 11);
-            
-            if (log_time >= after_time) {
-                log_files[index++] = strdup(entry->d_name);
+    if (!match) {
+        // Hand back what is there so the caller can retry without a GET
+        if (current) {
+            if (rec) {
+                unpack_value(store, rec, current);
+            } else {
+                current[0] = '\0';
             }
         }
+        if (version) {
+            *version = current_version;
+        }
+        unlock_shard(shard, held_since);
+        return false;
     }
     
-    closedir(dir);
-    return log_files;
+    bool result = commit_write_locked(store, shard, hash, key, &packed, version);
+    unlock_shard(shard, held_since);
+    
+    return result;
 }
 
-// Recover data from logs and snapshots
-bool kv_store_recover_from_logs(KVStore* store) {
-    if (!store || !store->persistence_enabled) {
+// Add delta to an integer value; a missing key counts as 0
+bool kv_store_incr(KVStore* store, const char* key, uint64_t key_hash, long long delta, long long* result,
+                   uint64_t* version) {
+    if (!store || !key) {
         return false;
     }
     
-    // Find the latest snapshot
-    char* latest_snapshot = find_latest_snapshot(store->data_dir);
-    time_t snapshot_time = 0;
-    
-    // Load data from snapshot if available
-    if (latest_snapshot) {
-        char snapshot_path[512];
-        snprintf(snapshot_path, sizeof(snapshot_path), "%s/%s", store->data_dir, latest_snapshot);
-        
-        FILE* snapshot_file = fopen(snapshot_path, "rb");
-        if (snapshot_file) {
-            // Extract timestamp from filename
-            snapshot_time = atol(latest_snapshot + 9);
-            
-            // Read the number of entries
-            int num_entries;
-            if (fread(&num_entries, sizeof(int), 1, snapshot_file) == 1) {
-                // Read each key-value pair
-                KeyValuePair pair;
-                for (int i = 0; i < num_entries; i++) {
-                    if (fread(&pair, sizeof(KeyValuePair), 1, snapshot_file) == 1) {
-                        // Find an empty slot and insert
-                        for (int j = 0; j < store->capacity; j++) {
-                            if (!store->data[j].valid) {
-                                memcpy(&store->data[j], &pair, sizeof(KeyValuePair));
-                                store->size++;
-                                break;
-                            }
-                        }
-                    }
-                }
-            }
-            
-            fclose(snapshot_file);
+    unsigned int hash = table_hash(key_hash);
+    KVShard* shard = shard_for(store, hash);
+    uint64_t held_since = lock_shard(shard);
+    
+    long long current = 0;
+    KVRecord* rec = find_locked(store, shard, hash, key);
+    if (rec) {
+        char scratch[MAX_VALUE_SIZE];
+        const char* text = record_value(store, rec, scratch);
+        char* end;
+        errno = 0;
+        current = strtoll(text, &end, 10);
+        if (errno != 0 || end == text || *end != '\0') {
+            // Not an integer
+            unlock_shard(shard, held_since);
+            return false;
         }
-        
-        free(latest_snapshot);
     }
     
-    // Find log files newer than the snapshot
-    int log_count = 0;
-    char** log_files = find_newer_logs(store->data_dir, snapshot_time, &log_count);
+    long long updated;
+    if (__builtin_add_overflow(current, delta, &updated)) {
+        unlock_shard(shard, held_since);
+        return false;
+    }
     
-    // Process each log file
-    for (int i = 0; i < log_count; i++) {
-        char log_path[512];
-        snprintf(log_path, sizeof(log_path), "%s/%s", store->data_dir, log_files[i]);
-        
-        FILE* log_file = fopen(log_path, "rb");
-        if (log_file) {
-            LogEntry entry;
-            
-            // Read and apply each operation
-            while (fread(&entry, sizeof(LogEntry), 1, log_file) == 1) {
-                switch (entry.op_code) {
-                    case OP_PUT:
-                        kv_store_put(store, entry.key, entry.value);
-                        break;
-                        
-                    case OP_DELETE:
-                        kv_store_delete(store, entry.key);
-                        break;
-                        
-                    default:
-                        // Ignore other operations
-                        break;
-                }
-            }
-            
-            fclose(log_file);
-        }
-        
-        free(log_files[i]);
+    char value[32];
+    snprintf(value, sizeof(value), "%lld", updated);
+    PackedValue packed;
+    pack_value(store, value, &packed);
+    if (!commit_write_locked(store, shard, hash, key, &packed, version)) {
+        unlock_shard(shard, held_since);
+        return false;
     }
     
-    free(log_files);
+    if (result) {
+        *result = updated;
+    }
     
+    unlock_shard(shard, held_since);
     return true;
 }
 
-// Clean up resources
-void kv_store_destroy(KVStore* store) {
-    if (store) {
-        // Create a final snapshot if persistence is enabled
-        if (store->persistence_enabled) {
-            kv_store_create_snapshot(store);
-            
-            if (store->log_file) {
-                fclose(store->log_file);
-            }
-        }
-        
-        pthread_mutex_destroy(&store->lock);
-        if (store->data) {
-            free(store->data);
-        }
-        free(store);
-    }
-}
-
-// Add or update a key-value pair
-bool kv_store_put(KVStore* store, const char* key, const char* value) {
-    if (!store || !key || !value) {
+// Append to a value; a missing key starts out empty
+bool kv_store_append(KVStore* store, const char* key, uint64_t key_hash, const char* suffix, char* result,
+                     uint64_t* version) {
+    if (!store || !key || !suffix) {
         return false;
     }
     
-    pthread_mutex_lock(&store->lock);
+    unsigned int hash = table_hash(key_hash);
+    KVShard* shard = shard_for(store, hash);
+    uint64_t held_since = lock_shard(shard);
     
-    // Check if key already exists
-    for (int i = 0; i < store->capacity; i++) {
-        if (store->data[i].valid && strcmp(store->data[i].key, key) == 0) {
-            // Update existing key
-            strncpy(store->data[i].value, value, MAX_VALUE_SIZE - 1);
-            store->data[i].value[MAX_VALUE_SIZE - 1] = '\0';
-            
-            // Log the operation if persistence is enabled
-            if (store->persistence_enabled) {
-                kv_store_log_operation(store, OP_PUT, key, value);
-            }
-            
-            pthread_mutex_unlock(&store->lock);
-            return true;
-        }
-    }
+    char value[MAX_VALUE_SIZE];
+    char scratch[MAX_VALUE_SIZE];
+    KVRecord* rec = find_locked(store, shard, hash, key);
+    int len = snprintf(value, sizeof(value), "%s%s", rec ? record_value(store, rec, scratch) : "", suffix);
     
-    // Key doesn't exist, find an empty slot
-    if (store->size >= store->capacity) {
-        // Store is full
-        pthread_mutex_unlock(&store->lock);
+    // Refuse rather than silently truncate
+    PackedValue packed;
+    if (len >= 0 && len < MAX_VALUE_SIZE) {
+        pack_value(store, value, &packed);
+    }
+    if (len < 0 || len >= MAX_VALUE_SIZE || !commit_write_locked(store, shard, hash, key, &packed, version)) {
+        unlock_shard(shard, held_since);
         return false;
     }
     
-    for (int i = 0; i < store->capacity; i++) {
-        if (!store->data[i].valid) {
-            // Found empty slot
-            strncpy(store->data[i].key, key, MAX_KEY_SIZE - 1);
-            strncpy(store->data[i].value, value, MAX_VALUE_SIZE - 1);
-            store->data[i].key[MAX_KEY_SIZE - 1] = '\0';
-            store->data[i].value[MAX_VALUE_SIZE - 1] = '\0';
-            store->data[i].valid = true;
-            store->size++;
-            
-            // Log the operation if persistence is enabled
-            if (store->persistence_enabled) {
-                kv_store_log_operation(store, OP_PUT, key, value);
-            }
-            
-            pthread_mutex_unlock(&store->lock);
-            return true;
-        }
+    if (result) {
+        strncpy(result, value, MAX_VALUE_SIZE);
     }
     
-    pthread_mutex_unlock(&store->lock);
-    return false;
+    unlock_shard(shard, held_since);
+    return true;
 }
 
-// Retrieve a value by key
-bool kv_store_get(KVStore* store, const char* key, char* value) {
+// Set a value and return the previous one (empty if the key was missing)
+bool kv_store_getset(KVStore* store, const char* key, uint64_t key_hash, const char* value, char* old_value,
+                     uint64_t* version) {
     if (!store || !key || !value) {
         return false;
     }
     
-    pthread_mutex_lock(&store->lock);
+    PackedValue packed;
+    pack_value(store, value, &packed);
     
-    for (int i = 0; i < store->capacity; i++) {
-        if (store->data[i].valid && strcmp(store->data[i].key, key) == 0) {
-            strncpy(value, store->data[i].value, MAX_VALUE_SIZE);
-            pthread_mutex_unlock(&store->lock);
-            return true;
-        }
+    unsigned int hash = table_hash(key_hash);
+    KVShard* shard = shard_for(store, hash);
+    uint64_t held_since = lock_shard(shard);
+    
+    char previous[MAX_VALUE_SIZE];
+    KVRecord* rec = find_locked(store, shard, hash, key);
+    if (rec) {
+        unpack_value(store, rec, previous);
+    } else {
+        previous[0] = '\0';
     }
     
-    pthread_mutex_unlock(&store->lock);
-    return false;
-}
-
-// Delete a key-value pair
-bool kv_store_delete(KVStore* store, const char* key) {
-    if (!store || !key) {
+    if (!commit_write_locked(store, shard, hash, key, &packed, version)) {
+        unlock_shard(shard, held_since);
         return false;
     }
     
-    pthread_mutex_lock(&store->lock);
+    if (old_value) {
+        strncpy(old_value, previous, MAX_VALUE_SIZE);
+    }
     
-    for (int i = 0; i < store->capacity; i++) {
-        if (store->data[i].valid && strcmp(store->data[i].key, key) == 0) {
-            store->data[i].valid = false;
-            store->size--;
-            
-            // Log the operation if persistence is enabled
-            if (store->persistence_enabled) {
-                kv_store_log_operation(store, OP_DELETE, key, NULL);
-            }
-            
-            pthread_mutex_unlock(&store->lock);
-            return true;
-        }
+    unlock_shard(shard, held_since);
+    return true;
+}
+
+typedef struct {
+    char* buffer;
+    int size;
+    int pos;
+} KeyList;
+
+// each callback: add a key while it fits
+static bool list_key(void* arg, const char* key, const KVRecord* rec) {
+    (void)rec;
+    KeyList* list = (KeyList*)arg;
+    int remaining = list->size - list->pos - 1;
+    int key_len = (int)strlen(key);
+    if (remaining < key_len + 1) { // +1 for newline or null terminator
+        return false;
     }
     
-    pthread_mutex_unlock(&store->lock);
-    return false;
+    list->pos += snprintf(list->buffer + list->pos, remaining + 1, "%s\n", key);
+    return true;
 }
 
 // List all keys in the store
@@ -498,30 +2348,167 @@ void kv_store_list_keys(KVStore* store, char* buffer, int buffer_size) {
         return;
     }
     
-    pthread_mutex_lock(&store->lock);
+    // The first page of a hash-order walk needs no index lock
+    uint64_t next;
+    if (kv_store_scan_cursor(store, 0, NULL, buffer, buffer_size, &next) >= 0) {
+        return;
+    }
     
     buffer[0] = '\0';
-    int pos = 0;
+    KeyList list = { buffer, buffer_size, 0 };
+    store->engine->each(store, NULL, false, false, list_key, &list);
+}
+
+typedef struct {
+    const char* end;
+    const char* prefix;
+    size_t prefix_len;
+    char* buffer;
+    int size;
+    int pos;
+    int count;
+    char* cursor;
+    bool* done;
+} ScanPage;
+
+// each callback: add a key to the page until the range ends or it is full
+static bool scan_key(void* arg, const char* key, const KVRecord* rec) {
+    (void)rec;
+    ScanPage* page = (ScanPage*)arg;
+    if (page->end && page->end[0] && strcmp(key, page->end) >= 0) {
+        return false;
+    }
+    if (page->prefix_len > 0 && strncmp(key, page->prefix, page->prefix_len) != 0) {
+        return false;
+    }
     
-    for (int i = 0; i < store->capacity && pos < buffer_size - 1; i++) {
-        if (store->data[i].valid) {
-            int remaining = buffer_size - pos - 1;
-            int key_len = strlen(store->data[i].key);
-            
-            if (remaining >= key_len + 1) { // +1 for newline or null terminator
-                pos += snprintf(buffer + pos, remaining + 1, "%s\n", store->data[i].key);
-            } else {
-                break;
-            }
+    // Stop when the page is full; the caller resumes after the cursor
+    int key_len = strlen(key);
+    if (page->pos + key_len + 1 >= page->size) {
+        *page->done = false;
+        return false;
+    }
+    
+    memcpy(page->buffer + page->pos, key, key_len);
+    page->buffer[page->pos + key_len] = '\n';
+    page->pos += key_len + 1;
+    page->count++;
+    
+    strncpy(page->cursor, key, MAX_KEY_SIZE - 1);
+    page->cursor[MAX_KEY_SIZE - 1] = '\0';
+    return true;
+}
+
+// Fill buffer with one page of newline-separated keys in sorted order, starting
+// at start (or just after it when exclusive) and stopping before end or at the
+// first key outside prefix. The last key written is copied to cursor and done
+// is set once the range is exhausted. Returns the number of keys written.
+int kv_store_scan(KVStore* store, const char* start, bool exclusive, const char* end, const char* prefix,
+                  char* buffer, int buffer_size, char* cursor, bool* done) {
+    if (!store || !buffer || buffer_size <= 0 || !cursor || !done) {
+        return 0;
+    }
+    
+    buffer[0] = '\0';
+    cursor[0] = '\0';
+    *done = true;
+    
+    // A prefix scan never needs to look at keys below the prefix itself
+    size_t prefix_len = prefix ? strlen(prefix) : 0;
+    if (prefix_len > 0 && (!start || strcmp(start, prefix) < 0)) {
+        start = prefix;
+        exclusive = false;
+    }
+    
+    ScanPage page = { end, prefix, prefix_len, buffer, buffer_size, 0, 0, cursor, done };
+    store->engine->each(store, start, exclusive, false, scan_key, &page);
+    buffer[page.pos] = '\0';
+    return page.count;
+}
+
+typedef struct {
+    const char* prefix;
+    size_t prefix_len;
+    char* buffer;
+    int size;
+    int pos;
+    int count;
+    bool full;
+} HashPage;
+
+// scan callback: add the keys of one home slot and tag if they all fit, so
+// a page never ends partway through keys the cursor cannot tell apart
+static bool hash_page_add(void* arg, const KVScanKey* keys, int count) {
+    HashPage* page = (HashPage*)arg;
+    int need = 0;
+    for (int i = 0; i < count; i++) {
+        if (strncmp(keys[i].key, page->prefix, page->prefix_len) == 0) {
+            need += strlen(keys[i].key) + 1;
         }
     }
+    if (page->pos > 0 && page->pos + need >= page->size) {
+        page->full = true;
+        return false;
+    }
     
-    pthread_mutex_unlock(&store->lock);
+    // Keys that overflow an empty page must also share a 16-bit tag, and
+    // there must be eight or more of the longest; the cursor cannot split
+    // them, so say which are left out
+    for (int i = 0; i < count; i++) {
+        int key_len = strlen(keys[i].key);
+        if (strncmp(keys[i].key, page->prefix, page->prefix_len) != 0) {
+            continue;
+        }
+        if (page->pos + key_len + 1 >= page->size) {
+            fprintf(stderr, "Warning: %d keys sharing a hash slot and tag do not fit one page; LIST leaves "
+                    "out %s and any after it\n", count, keys[i].key);
+            break;
+        }
+        memcpy(page->buffer + page->pos, keys[i].key, key_len);
+        page->buffer[page->pos + key_len] = '\n';
+        page->pos += key_len + 1;
+        page->count++;
+    }
+    return true;
+}
+
+// Fill buffer with one page of newline-separated keys in hash order,
+// starting at cursor and keeping only keys under prefix; next gets the
+// cursor to resume from, 0 once the walk is over. No lock is held between
+// groups, so writers and table growth go on during a walk, and a page can
+// come back empty with more to follow. Returns the number of keys written,
+// or -1 if the engine cannot walk in hash order.
+int kv_store_scan_cursor(KVStore* store, uint64_t cursor, const char* prefix, char* buffer, int buffer_size,
+                         uint64_t* next) {
+    if (!store || !buffer || buffer_size <= 0 || !next) {
+        return -1;
+    }
+    
+    buffer[0] = '\0';
+    *next = 0;
+    if (!store->engine->scan) {
+        return -1;
+    }
+    if (kv_cursor_shard(cursor) >= KV_SHARD_COUNT) {
+        return 0;
+    }
+    
+    HashPage page = { prefix ? prefix : "", prefix ? strlen(prefix) : 0, buffer, buffer_size, 0, 0, false };
+    for (int i = 0; i < KV_SCAN_CURSOR_GROUPS; i++) {
+        cursor = store->engine->scan(store, cursor, hash_page_add, &page);
+        if (cursor == 0 || page.full) {
+            break;
+        }
+    }
+    
+    buffer[page.pos] = '\0';
+    *next = cursor;
+    return page.count;
 }
 
 // Initialize node list
 NodeList* node_list_init() {
-    NodeList* list = (NodeList*)malloc(sizeof(NodeList));
+    NodeList* list = (NodeList*)aligned_alloc(KV_CACHE_LINE, sizeof(NodeList));
     if (!list) {
         return NULL;
     }
@@ -608,12 +2595,8 @@ bool node_list_remove(NodeList* list, const char* ip, int port) {
     return false;
 }
 
-// Determine which node should handle a key
-int node_for_key(NodeList* list, const char* key) {
-    if (!list || !key || list->count == 0) {
-        return -1;
-    }
-    
+// Map a key hash to the active node that owns it
+static int owner_of_hash(NodeList* list, uint64_t key_hash) {
     pthread_mutex_lock(&list->lock);
     
     // Count active nodes
@@ -629,9 +2612,8 @@ int node_for_key(NodeList* list, const char* key) {
         return -1;
     }
     
-    // Use consistent hashing to determine node
-    unsigned int hash = hash_key(key);
-    int node_idx = hash % active_count;
+    // Scale the high half of the hash onto the active nodes
+    int node_idx = (int)(((key_hash >> 32) * (uint64_t)active_count) >> 32);
     
     // Map to an actual active node
     int curr_active = 0;
@@ -649,17 +2631,216 @@ int node_for_key(NodeList* list, const char* key) {
     return -1;
 }
 
-// Redistribute data when node configuration changes
+// Determine which node should handle a key
+int node_for_key(NodeList* list, const char* key) {
+    if (!key) {
+        return -1;
+    }
+    return node_for_hash(list, kv_key_hash(key));
+}
+
+// Determine which node should handle a key, given its kv_key_hash()
+int node_for_hash(NodeList* list, uint64_t key_hash) {
+    if (!list || list->count == 0) {
+        return -1;
+    }
+    
+    KV_TRACE_BEGIN(trace_start);
+    int node_idx = owner_of_hash(list, key_hash);
+    KV_TRACE_END(KV_TRACE_ROUTE, trace_start);
+    return node_idx;
+}
+
+// One batch of pairs on their way to other nodes, and where the walk that
+// collects the next batch picks up
+typedef struct {
+    KVStore* store;
+    NodeList* list;
+    KeyValuePair* pairs;
+    int owners[KV_REBALANCE_BATCH];
+    int count;
+    char last[MAX_KEY_SIZE];   // Last key visited
+    bool more;                 // The walk stopped with the batch full
+} RebalanceBatch;
+
+// each callback: copy out a live pair that another node owns, until the
+// batch is full
+static bool collect_moving(void* arg, const char* key, const KVRecord* rec) {
+    RebalanceBatch* batch = (RebalanceBatch*)arg;
+    if (batch->count == KV_REBALANCE_BATCH) {
+        batch->more = true;
+        return false;
+    }
+    snprintf(batch->last, MAX_KEY_SIZE, "%s", key);
+    
+    int owner = node_for_key(batch->list, key);
+    if (owner < 0 || owner == batch->list->current_node_idx || expired(batch->store, rec)) {
+        return true;
+    }
+    
+    KeyValuePair* pair = &batch->pairs[batch->count];
+    snprintf(pair->key, MAX_KEY_SIZE, "%s", key);
+    unpack_value(batch->store, rec, pair->value);
+    pair->version = rec->version;
+    pair->valid = true;
+    batch->owners[batch->count++] = owner;
+    return true;
+}
+
+// Read one acknowledgement from an owner and give its bytes back to the
+// budget; without wait, only if a whole one has already arrived
+static bool collect_ack(int sockfd, Message* msg, bool wait) {
+    if (!wait && recv(sockfd, msg, sizeof(Message), MSG_PEEK | MSG_DONTWAIT) != (ssize_t)sizeof(Message)) {
+        return false;
+    }
+    if (!recv_message(sockfd, msg)) {
+        return false;
+    }
+    kv_peer_budget_release(sizeof(Message));
+    return true;
+}
+
+// Push the pairs owned by one node over a single connection. Sends are
+// pipelined, as many as the peer byte budget allows before acknowledgements
+// come back, so rebalancing neither waits a round trip per key nor crowds
+// out replication. Acknowledgements are picked up as they arrive, and no
+// more than KV_PEER_PIPELINE puts are ever outstanding, so the owner's
+// replies always fit in the socket buffers and it never blocks sending them
+// while we block sending to it. Returns the pairs the owner acknowledged.
+static int push_to_owner(NodeList* list, int node_idx, const KeyValuePair* pairs, const int* owners, int count,
+                         uint32_t flags) {
+    pthread_mutex_lock(&list->lock);
+    Node owner = list->nodes[node_idx];
+    pthread_mutex_unlock(&list->lock);
+    
+    int sockfd = connect_to_server(owner.ip, owner.port);
+    if (sockfd < 0) {
+        return 0;
+    }
+    
+    Message msg;
+    int sent = 0;
+    int acked = 0;
+    bool failed = false;
+    for (int i = 0; i < count; i++) {
+        if (owners[i] != node_idx) {
+            continue;
+        }
+        
+        // Wait for the owner to catch up once the pipeline is full
+        while (sent - acked >= KV_PEER_PIPELINE) {
+            if (!collect_ack(sockfd, &msg, true)) {
+                failed = true;
+                break;
+            }
+            acked++;
+        }
+        
+        // Collect acknowledgements to make room in the budget, and only
+        // wait on other senders when nothing of ours is outstanding
+        while (!failed && !kv_peer_budget_try_acquire(sizeof(Message))) {
+            if (acked == sent) {
+                kv_peer_budget_acquire(sizeof(Message));
+                break;
+            }
+            if (!collect_ack(sockfd, &msg, true)) {
+                failed = true;
+                break;
+            }
+            acked++;
+        }
+        if (failed) {
+            break;
+        }
+        
+        memset(&msg, 0, sizeof(Message));
+        msg.op_code = OP_REPLICATE;
+        msg.repl_op = OP_PUT;
+        msg.flags = flags;
+        msg.version = pairs[i].version;
+        strncpy(msg.key, pairs[i].key, MAX_KEY_SIZE - 1);
+        strncpy(msg.value, pairs[i].value, MAX_VALUE_SIZE - 1);
+        if (send(sockfd, &msg, sizeof(Message), MSG_NOSIGNAL) != sizeof(Message)) {
+            kv_peer_budget_release(sizeof(Message));
+            failed = true;
+            break;
+        }
+        sent++;
+        
+        // Pick up whatever acknowledgements have already come back
+        while (acked < sent && collect_ack(sockfd, &msg, false)) {
+            acked++;
+        }
+    }
+    
+    // Drain the rest; a lost connection gives back what is still outstanding
+    while (acked < sent && !failed && collect_ack(sockfd, &msg, true)) {
+        acked++;
+    }
+    for (int i = acked; i < sent; i++) {
+        kv_peer_budget_release(sizeof(Message));
+    }
+    
+    close(sockfd);
+    return acked;
+}
+
+// Redistribute data when node configuration changes. The store is walked a
+// batch of KV_REBALANCE_BATCH moving pairs at a time, and each batch is
+// pushed to its owners before the walk resumes after its last key, so memory
+// stays bounded however large the store is and no network I/O happens
+// inside the store.
 void distribute_data(KVStore* store, NodeList* list) {
     if (!store || !list) {
         return;
     }
     
-    // This is a simplified implementation
-    // In a real system, you would:
-    // 1. Collect all key-value pairs
-    // 2. Determine which node should own each pair
-    // 3. Send data to the appropriate nodes
+    RebalanceBatch* batch = (RebalanceBatch*)malloc(sizeof(RebalanceBatch));
+    KeyValuePair* pairs = (KeyValuePair*)malloc(sizeof(KeyValuePair) * KV_REBALANCE_BATCH);
+    if (!batch || !pairs) {
+        fprintf(stderr, "Error: no memory to rebalance keyspace %u; keys stay where they are\n", store->keyspace);
+        free(batch);
+        free(pairs);
+        return;
+    }
+    batch->store = store;
+    batch->list = list;
+    batch->pairs = pairs;
+    batch->last[0] = '\0';
+    
+    char resume[MAX_KEY_SIZE];
+    int moved = 0;
+    int missed = 0;
+    do {
+        // Resume after the last key visited, which the walk overwrites
+        memcpy(resume, batch->last, MAX_KEY_SIZE);
+        batch->count = 0;
+        batch->more = false;
+        store->engine->each(store, resume[0] ? resume : NULL, true, true, collect_moving, batch);
+        
+        // Push each owner its pairs; the owner keeps whichever version is newer
+        for (int node_idx = 0; node_idx < MAX_NODES; node_idx++) {
+            int owned = 0;
+            for (int i = 0; i < batch->count; i++) {
+                owned += batch->owners[i] == node_idx;
+            }
+            if (owned > 0) {
+                int acked = push_to_owner(list, node_idx, pairs, batch->owners, batch->count,
+                                          KV_KEYSPACE_FLAGS(store->keyspace));
+                moved += acked;
+                missed += owned - acked;
+            }
+        }
+    } while (batch->more);
+    
+    free(pairs);
+    free(batch);
     
-    printf("Data redistribution would happen here in a real implementation\n");
-} 
\ No newline at end of file
+    if (moved > 0) {
+        printf("Pushed %d keys to their owning nodes\n", moved);
+    }
+    if (missed > 0) {
+        fprintf(stderr, "Error: %d keys of keyspace %u could not be pushed to their owning nodes\n", missed,
+                store->keyspace);
+    }
+}
@@ -11,6 +11,9 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <netdb.h>  // For gethostbyname
 #include <fcntl.h>  // For file operations
 #include <sys/stat.h> // For file stats
@@ -24,6 +27,13 @@
 #define DATA_DIR "./data"
 #define SNAPSHOT_THRESHOLD 100 // Number of operations before creating a snapshot
 
+// Versions are hybrid logical clock (HLC) timestamps laid out as
+//   | 48-bit wall-clock milliseconds | 8-bit logical counter | 8-bit node id |
+// so comparing two versions as integers gives last-writer-wins order.
+#define KV_VERSION_NODE_BITS 8
+#define KV_VERSION_LOGICAL_BITS 8
+#define KV_VERSION_NODE_MASK ((1ULL << KV_VERSION_NODE_BITS) - 1)
+
 // Operation codes
 typedef enum {
     OP_GET = 1,
@@ -32,26 +42,398 @@ typedef enum {
     OP_REPLICATE = 4,
     OP_NODE_JOIN = 5,
     OP_NODE_LEAVE = 6,
-    OP_LIST_KEYS = 7
+    OP_LIST_KEYS = 7,
+    OP_CAS = 8,
+    OP_INCR = 9,
+    OP_DECR = 10,
+    OP_APPEND = 11,
+    OP_GETSET = 12,
+    OP_SCAN = 13,
+    OP_STATS = 14,
+    OP_HOTKEYS = 15,
+    OP_TRACE = 16,
+    OP_KEYSPACE = 17
 } OperationCode;
 
+// Flags for OP_CAS
+#define KV_CAS_VERSION 0x1  // Swap only if the current version equals msg.version (0 = key absent)
+#define KV_CAS_VALUE   0x2  // Swap only if the current value matches; msg.value holds "expected\0new"
+
+// Flags for OP_SCAN; msg.key is the start key and msg.value the end key (exclusive, empty = none)
+#define KV_SCAN_PREFIX 0x1  // msg.value is a key prefix instead of an end key
+#define KV_SCAN_AFTER  0x2  // msg.key is a cursor from an earlier page; start just after it
+#define KV_SCAN_HASH   0x4  // Walk in hash order: msg.key is a decimal hash cursor ("" or "0" starts)
+                            // and msg.value an optional key prefix
+
+// SCAN responses stream one page of newline-separated keys per frame. Every
+// frame carries its last key in msg.key as a resume cursor and has status 2
+// while more frames follow; the final frame has status 1. Hash-order frames
+// carry the hash cursor to resume from instead, "0" on the final frame; a
+// server whose engine cannot walk in hash order answers with status 0.
+#define KV_SCAN_MORE 2
+
+// OP_STATS replies stream the metrics text (Prometheus exposition format)
+// in msg.value using the same framing as SCAN
+
+// OP_HOTKEYS replies stream the most requested keys the same way, one
+// "key requests error gets puts" line per key, hottest first
+
+// OP_TRACE writes the trace rings to a Chrome trace JSON file on the server
+// and replies with its path in msg.value; status 0 if tracing is not built in
+
+// OP_KEYSPACE looks up the keyspace named in msg.key and replies with its id
+// in msg.value; status 0 if the server holds no such keyspace
+
+// Request flag for OP_GET: the client accepts a ResponseHeader followed by
+// the raw value bytes instead of a full Message
+#define KV_FLAG_VARLEN_REPLY 0x100
+
+// Request flag for OP_GET with KV_FLAG_VARLEN_REPLY: the client can take a
+// compressed value. Such a value is sent as stored, an LZ4 block, and the
+// reply header carries KV_FLAG_COMPRESSED; other clients get it decompressed.
+#define KV_FLAG_ACCEPT_COMPRESSED 0x200
+#define KV_FLAG_COMPRESSED 0x400
+
+// Reply status for a request the server is too loaded to take, whether for
+// want of capacity or over a rate limit: nothing was done, and the client
+// should back off and retry. The other statuses are 1 (done), 0 (not done),
+// -1 (another node owns the key), -2 (unknown operation) and
+// KV_STATUS_NO_KEYSPACE.
+#define KV_STATUS_BUSY -3
+#define KV_STATUS_NO_KEYSPACE -4   // The request names a keyspace this server does not hold
+
+// Every request names its keyspace by id in the top byte of msg.flags; 0,
+// what clients that know nothing of keyspaces send, is the default one
+#define KV_FLAG_KEYSPACE_SHIFT 24
+#define KV_FLAG_KEYSPACE_MASK 0xff000000U
+#define KV_KEYSPACE_FLAGS(id) ((uint32_t)(id) << KV_FLAG_KEYSPACE_SHIFT)
+#define KV_KEYSPACE_ID(flags) ((uint32_t)(flags) >> KV_FLAG_KEYSPACE_SHIFT)
+
+#define KV_INDEX_MAX_LEVEL 24
+
+#define KV_CACHE_LINE 64                     // Hot fields written by different threads get their own line
+
+#define KV_SHARD_BITS 4                      // The store is split into 2^KV_SHARD_BITS shards
+#define KV_SHARD_COUNT (1 << KV_SHARD_BITS)
+#define KV_EPOCH_MAX_THREADS 4096            // Threads that can be inside the store at once
+
+#define KV_STATS_MAX_THREADS 1024            // Threads that can record metrics at once
+#define KV_STATS_MAX_OPS 24                  // Opcodes with their own counters (must exceed the largest)
+#define KV_STATS_BUCKETS 26                  // Latency buckets: <= 2^i microseconds for i < 25, then +Inf
+
+// The io_uring backend is built on Linux when the kernel headers provide it;
+// define KV_NO_IO_URING to leave it out
+#if defined(__linux__) && !defined(KV_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define KV_HAVE_IO_URING 1
+#endif
+#endif
+
+// Tracing hooks record the stages of each request into per-thread rings.
+// They are only compiled in with -DKV_TRACING (make TRACING=1); otherwise
+// the macros expand to nothing.
+#define KV_TRACE_RING_SIZE 8192    // Events kept per thread; a power of two
+
+typedef enum {
+    KV_TRACE_ACCEPT = 0,
+    KV_TRACE_RECV,
+    KV_TRACE_PARSE,
+    KV_TRACE_ROUTE,
+    KV_TRACE_LOCK,
+    KV_TRACE_STORE,
+    KV_TRACE_LOG,
+    KV_TRACE_REPLICATE,
+    KV_TRACE_SEND,
+    KV_TRACE_STAGE_COUNT
+} KVTraceStage;
+
+#ifdef KV_TRACING
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+// Timestamps are raw TSC ticks, converted to time when the trace is dumped
+static inline uint64_t kv_trace_now(void) {
+    return __rdtsc();
+}
+#else
+static inline uint64_t kv_trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+#endif
+void kv_trace_record(KVTraceStage stage, uint64_t start);
+#define KV_TRACE_BEGIN(var) uint64_t var = kv_trace_now()
+#define KV_TRACE_END(stage, var) kv_trace_record(stage, var)
+#define KV_TRACE_NOW() kv_trace_now()
+#else
+#define KV_TRACE_BEGIN(var)
+#define KV_TRACE_END(stage, var)
+#define KV_TRACE_NOW() 0
+#endif
+
+#define KV_URING_ENTRIES 1024      // Submission queue entries per ring
+#define KV_URING_MAX_CONNS 512     // Connections served by each io_uring thread
+#define KV_URING_WORKERS 4         // Threads per ring for requests that wait on other nodes
+#define KV_LOG_SYNC_BATCH 32       // Async log writes between fsyncs
+
+// How log appends reach the disk
+typedef enum {
+    KV_DURABILITY_BUFFERED = 0,    // fflush after each record (page cache only)
+    KV_DURABILITY_FSYNC,           // fdatasync after each record
+    KV_DURABILITY_ASYNC            // io_uring writes, fsync every KV_LOG_SYNC_BATCH records
+} KVDurability;
+
+// What a store with a quota does once its records outgrow it
+typedef enum {
+    KV_EVICT_NONE = 0,             // Refuse writes until deletes make room
+    KV_EVICT_CLOCK                 // Drop keys that have not been read since the sweeper last passed them
+} KVEviction;
+
+#define KV_SWEEP_BATCHES 64        // Batches of slots the sweeper checks for expired keys each pause
+#define KV_QUOTA_SLACK 8           // With eviction, writes are refused past quota + quota / KV_QUOTA_SLACK
+
 // Data structures
+
+// Key-value pair, as moved between nodes and as written to version 1
+// snapshots
 typedef struct {
     char key[MAX_KEY_SIZE];
     char value[MAX_VALUE_SIZE];
+    uint64_t version;          // HLC version of the last write
     bool valid;
 } KeyValuePair;
 
+// Stored value. Records are immutable once published: writers build a new
+// record and swap the pointer, and the old one is released after an epoch
+// grace period, so readers can use a record without taking any lock.
+// The store holds one reference; senders take their own to keep the value
+// alive until the kernel is done with it.
+typedef struct {
+    uint64_t version;          // HLC version of the write that created it
+    _Atomic unsigned int refs; // References held by the store and by senders
+    unsigned int hash;         // Mixed hash of the key
+    uint16_t key_len;
+    uint16_t value_len;        // Stored bytes, after any compression
+    uint8_t flags;             // KV_RECORD_*
+    _Atomic uint8_t referenced; // Read since the tier thread last passed it
+    char data[];               // Key, NUL, value, NUL
+} KVRecord;
+
+#define KV_RECORD_COMPRESSED 0x1   // The value is an LZ4 block
+#define KV_RECORD_SPILLED 0x2      // The value is in the value log; data holds a KVValuePointer
+#define KV_RECORD_MAPPED 0x4       // The record is in the mmap engine's file; copied out, never referenced
+
+// Where a spilled value's stored bytes are in the value log
 typedef struct {
-    KeyValuePair* data;
+    uint32_t segment;
+    uint32_t offset;           // Of the value bytes within the segment
+} KVValuePointer;
+
+#define KV_RECORD_KEY(rec) ((rec)->data)
+#define KV_RECORD_VALUE(rec) ((rec)->data + (rec)->key_len + 1)
+
+// Control bytes. A full slot holds 7 bits of its key's hash as a tag, so a
+// probe compares a whole group of tags at once and only follows the slot
+// pointers whose tag matches.
+#define KV_CTRL_EMPTY 0x80
+#define KV_CTRL_DELETED 0xfe
+
+// Group probing for one instruction set; width is 16 or 32 control bytes
+typedef struct {
+    unsigned int width;
+    const char* name;
+    uint32_t (*match)(const uint8_t* group, uint8_t tag, uint32_t* empty);  // Tag matches; empties in *empty
+    uint32_t (*free)(const uint8_t* group);                                 // Empty or deleted slots
+} KVGroupOps;
+
+// Open-addressing table of record pointers, probed a group of slots at a
+// time. Readers load slots atomically; the control bytes only say which
+// slots are worth loading. A table is replaced wholesale when it needs to
+// grow.
+typedef struct {
+    unsigned int mask;         // Slot count - 1
+    int used;                  // Live slots plus tombstones (writer-only)
+    _Atomic uint8_t* ctrl;     // Control bytes, cache-line aligned, after the slots
+    _Atomic(KVRecord*) slots[];
+} KVTable;
+
+// Marks a slot whose record was deleted; probing continues past it
+#define KV_TOMBSTONE ((KVRecord*)1)
+
+// A deleted key's version, kept so that an older write arriving later
+// (delayed replication, rebalancing) cannot bring the key back
+typedef struct KVDeletion {
+    struct KVDeletion* next;
+    uint64_t version;
+    unsigned int hash;
+    char key[];
+} KVDeletion;
+
+// Deletions are forgotten once their version is this old; a write delayed
+// longer than this can still revive a deleted key
+#define KV_DELETION_HORIZON_MS (5 * 60 * 1000)
+#define KV_DELETION_BUCKETS 64
+
+// A shard's writer state fills one cache line of its own, so writers on
+// neighbouring shards never contend for a line
+typedef struct {
+    pthread_mutex_t lock;      // Serializes writers on this shard
+    _Atomic(KVTable*) table;
+    KVDeletion** deletions;    // Recent deletions by hash, allocated on first use (writer-only)
+    int size;                  // Live keys (writer-only)
+    int node;                  // NUMA node its tables are allocated on
+} __attribute__((aligned(KV_CACHE_LINE))) KVShard;
+
+// Ordered index node; the key is stored inline after the tower of next pointers
+typedef struct KVIndexNode {
+    char* key;
+    int level;
+    struct KVIndexNode* next[];
+} KVIndexNode;
+
+// Skip list of all keys, kept alongside the slot array for range scans
+typedef struct {
+    KVIndexNode* head;
+    int level;
+    int count;
+    unsigned int seed;
+} KVIndex;
+
+typedef struct KVStore KVStore;
+
+// Hash-order iteration, for walks that should not hold up writers. A cursor
+// names a shard in its top bits, a home slot within a group of the shard's
+// table below them, and the group in the low 32 bits as a reverse-binary
+// counter, as Redis SCAN does: the counter increments its high bits first,
+// so when a table doubles or halves between steps, the groups already
+// visited map onto groups the counter has passed and no key present for the
+// whole walk is skipped, though one may be returned twice. Keys sharing a
+// home slot are ordered by a 16-bit tag from their hash, kept in the top
+// bits, so a page can also end partway through a crowded slot. Cursor 0
+// starts a walk and is returned when it is over.
+#define KV_CURSOR_TAG_SHIFT 48
+#define KV_CURSOR_SHARD_SHIFT 40
+#define KV_CURSOR_SLOT_SHIFT 32
+#define KV_SCAN_GROUP_KEYS 64      // Keys of one group gathered on the stack before spilling to the heap
+#define KV_SCAN_CURSOR_GROUPS 1024 // Groups one page visits at most, so a sparse table still answers promptly
+
+static inline uint64_t kv_cursor_make(int shard, unsigned int slot, uint32_t group, uint16_t tag) {
+    return (uint64_t)tag << KV_CURSOR_TAG_SHIFT | (uint64_t)(shard & 0xff) << KV_CURSOR_SHARD_SHIFT |
+           (uint64_t)(slot & 0xff) << KV_CURSOR_SLOT_SHIFT | group;
+}
+
+static inline int kv_cursor_shard(uint64_t cursor) {
+    return (int)(cursor >> KV_CURSOR_SHARD_SHIFT) & 0xff;
+}
+
+static inline unsigned int kv_cursor_slot(uint64_t cursor) {
+    return (unsigned int)(cursor >> KV_CURSOR_SLOT_SHIFT) & 0xff;
+}
+
+static inline uint32_t kv_cursor_group(uint64_t cursor) {
+    return (uint32_t)cursor;
+}
+
+static inline uint16_t kv_cursor_tag(uint64_t cursor) {
+    return (uint16_t)(cursor >> KV_CURSOR_TAG_SHIFT);
+}
+
+// A key found on a group's probe chain, with its home slot in the group and
+// its tag within the slot
+typedef struct {
+    unsigned int slot;
+    uint16_t tag;
+    const char* key;
+} KVScanKey;
+
+// The keys with one home slot and tag; returns false to stop before them
+typedef bool (*KVScanFn)(void* arg, const KVScanKey* keys, int count);
+
+// Keys gathered from one group, on the stack until they outgrow it
+typedef struct {
+    KVScanKey* keys;
+    int count;
+    int cap;
+    KVScanKey local[KV_SCAN_GROUP_KEYS];
+} KVScanGroup;
+
+void kv_scan_group_init(KVScanGroup* group);
+void kv_scan_group_add(KVScanGroup* group, unsigned int slot, const char* key);
+uint64_t kv_scan_group_finish(KVScanGroup* group, uint64_t cursor, uint32_t groups_mask, KVScanFn fn, void* arg);
+
+// Storage engines. The store keeps versions, logging and the atomic
+// operations and asks its engine to hold the records. Records returned by
+// lookup stay valid until the caller leaves its epoch; insert and remove
+// are called with the key's shard lock held, and insert takes over the
+// store's reference to rec when it succeeds. each visits records in key
+// order from start until fn returns false; the record passed to fn is only
+// valid during the call, and is NULL for key-only walks of an engine that
+// can list keys without their values. scan visits the keys whose home is
+// the cursor's group, without locks, and returns the cursor that follows;
+// it is NULL for an engine that keeps no hash table.
+typedef struct {
+    const char* name;
+    bool (*open)(KVStore* store, const char* dir);      // NULL if the engine keeps nothing on disk
+    void (*close)(KVStore* store);
+    KVRecord* (*lookup)(KVStore* store, unsigned int hash, const char* key);
+    bool (*insert)(KVStore* store, KVShard* shard, KVRecord* rec);
+    bool (*remove)(KVStore* store, KVShard* shard, unsigned int hash, const char* key);
+    void (*each)(KVStore* store, const char* start, bool exclusive, bool values,
+                 bool (*fn)(void* arg, const char* key, const KVRecord* rec), void* arg);
+    uint64_t (*scan)(KVStore* store, uint64_t cursor, KVScanFn fn, void* arg);
+} KVEngineOps;
+
+// Fields are grouped by who writes them: settings that are read-only after
+// startup share a line, and each counter or lock that every writer touches
+// starts a line of its own. Allocate with aligned_alloc.
+struct KVStore {
+    KVShard shards[KV_SHARD_COUNT];
+
+    // Read-mostly settings
     int capacity;
-    int size;
-    pthread_mutex_t lock;
+    unsigned int node_id;      // Stamped into the low bits of local versions
+    bool persistence_enabled;  // Flag to enable/disable persistence
+    KVDurability durability;   // How log appends are flushed
+    const KVGroupOps* group;   // Control-byte probing picked for this CPU
+    const KVEngineOps* engine; // Where records are kept
+    struct KVLsm* lsm;         // LSM engine state (LSM engine only)
+    struct KVMmap* mmap;       // Mapped file state (mmap engine only)
+    size_t compress_min;       // Values at least this long are stored compressed (0 = never)
+    struct KVValueLog* vlog;   // Cold values (tiering only)
+    size_t memory_limit;       // Record and table bytes to keep in memory (tiering only)
+    size_t quota;              // Record bytes the store may hold (0 = no limit; memory engine only)
+    KVEviction eviction;       // What happens over the quota
+    uint64_t ttl_ms;           // Keys expire this long after their last write (0 = never)
+    uint32_t keyspace;         // Keyspace id stamped on what the store sends to peers
+    KVIndex* index;            // Keys in sorted order for range scans
     char data_dir[256];        // Directory for persistence
+
+    _Atomic int size __attribute__((aligned(KV_CACHE_LINE)));
+    _Atomic int64_t bytes;     // Record bytes held in the memory engine's tables
+    _Atomic uint64_t hlc __attribute__((aligned(KV_CACHE_LINE)));  // Last version issued or observed
+    pthread_mutex_t index_lock __attribute__((aligned(KV_CACHE_LINE)));  // Guards index; taken after a shard lock
+
+    // Log state, all guarded by lock
+    pthread_mutex_t lock __attribute__((aligned(KV_CACHE_LINE)));  // Guards the log, op_count and snapshots
     int op_count;              // Count of operations since last snapshot
     FILE* log_file;            // File handle for the append-only log
-    bool persistence_enabled;  // Flag to enable/disable persistence
-} KVStore;
+    struct KVLogRing* log_ring; // Async log writer (KV_DURABILITY_ASYNC only)
+
+    // Tier thread state
+    pthread_t tier_thread __attribute__((aligned(KV_CACHE_LINE)));
+    _Atomic bool tier_running;
+    int tier_shard;            // CLOCK hand: shard and slot the next pass starts at
+    unsigned int tier_slot;
+
+    // Sweeper state: expiry and eviction
+    pthread_t sweep_thread __attribute__((aligned(KV_CACHE_LINE)));
+    _Atomic bool sweep_running;
+    int sweep_shard;           // CLOCK hand of its own
+    unsigned int sweep_slot;
+    _Atomic uint64_t expired;  // Keys removed for outliving the TTL
+    _Atomic uint64_t evicted;  // Keys dropped to get back under the quota
+    _Atomic uint64_t rejected; // Writes refused over the quota
+};
 
 typedef struct {
     char ip[16];
@@ -59,11 +441,13 @@ typedef struct {
     bool active;
 } Node;
 
+// Routing reads nodes and count on every request; the lock is only taken
+// for membership changes and sits on its own line
 typedef struct {
     Node nodes[MAX_NODES];
     int count;
     int current_node_idx;
-    pthread_mutex_t lock;
+    pthread_mutex_t lock __attribute__((aligned(KV_CACHE_LINE)));
 } NodeList;
 
 // Message format for network communication
@@ -72,30 +456,393 @@ typedef struct {
     char key[MAX_KEY_SIZE];
     char value[MAX_VALUE_SIZE];
     int status;
+    uint64_t version;          // Version of the value (0 if none)
+    OperationCode repl_op;     // Wrapped operation for OP_REPLICATE
+    uint32_t flags;            // Operation-specific flags (KV_CAS_*)
 } Message;
 
-// Persistence-related log entry
+// Variable-length GET reply, followed on the wire by value_len bytes of value
+typedef struct {
+    OperationCode op_code;
+    int status;
+    uint32_t flags;
+    uint32_t value_len;
+    uint64_t version;
+} ResponseHeader;
+
+// Persistence-related log record header, followed on disk by key_len bytes
+// of key and value_len bytes of value. Compressed values are logged as
+// stored, with KV_LOG_COMPRESSED set in op_code.
+#define KV_LOG_COMPRESSED 0x10000
+
 typedef struct {
     OperationCode op_code;    // Operation type (PUT, DELETE)
+    uint16_t key_len;         // Length of the key that follows
+    uint16_t value_len;       // Length of the value that follows (PUT only)
     time_t timestamp;         // When the operation occurred
-    char key[MAX_KEY_SIZE];   // Key affected
-    char value[MAX_VALUE_SIZE]; // Value (for PUT operations)
+    uint64_t version;         // HLC version of the operation
 } LogEntry;
 
 // KVStore functions
 KVStore* kv_store_init(int capacity);
 void kv_store_destroy(KVStore* store);
-bool kv_store_put(KVStore* store, const char* key, const char* value);
-bool kv_store_get(KVStore* store, const char* key, char* value);
-bool kv_store_delete(KVStore* store, const char* key);
+// Keyed functions take the key's kv_key_hash() so callers hash it only once
+bool kv_store_put(KVStore* store, const char* key, uint64_t key_hash, const char* value, uint64_t* version);
+bool kv_store_get(KVStore* store, const char* key, uint64_t key_hash, char* value, uint64_t* version);
+KVRecord* kv_store_get_record(KVStore* store, const char* key, uint64_t key_hash);
+void kv_record_release(KVRecord* rec);
+bool kv_store_delete(KVStore* store, const char* key, uint64_t key_hash, uint64_t* version);
+bool kv_store_apply(KVStore* store, OperationCode op, const char* key, uint64_t key_hash,
+                    const char* value, uint64_t version);
+void kv_store_set_node_id(KVStore* store, unsigned int node_id);
+void kv_store_set_compression(KVStore* store, size_t min_bytes);
+bool kv_store_enable_tiering(KVStore* store, const char* dir, size_t memory_limit);
+bool kv_store_set_engine(KVStore* store, const char* name, const char* dir);
+bool kv_store_set_limits(KVStore* store, size_t quota, KVEviction eviction, uint64_t ttl_ms);
+void kv_store_observe_version(KVStore* store, uint64_t version);
+uint64_t kv_store_legacy_version(KVStore* store, time_t when);
+KVRecord* kv_record_create(const char* key, unsigned int hash, const char* value, uint16_t value_len, uint8_t flags,
+                           uint64_t version);
+KVRecord* kv_record_unpack(KVRecord* rec);
+
+// Atomic read-modify-write functions; each runs under the store lock and
+// logs its result as a single PUT record
+bool kv_store_cas(KVStore* store, const char* key, uint64_t key_hash, uint32_t flags, const char* expected,
+                  uint64_t expected_version, const char* value, char* current, uint64_t* version);
+bool kv_store_incr(KVStore* store, const char* key, uint64_t key_hash, long long delta, long long* result,
+                   uint64_t* version);
+bool kv_store_append(KVStore* store, const char* key, uint64_t key_hash, const char* suffix, char* result,
+                     uint64_t* version);
+bool kv_store_getset(KVStore* store, const char* key, uint64_t key_hash, const char* value, char* old_value,
+                     uint64_t* version);
 void kv_store_list_keys(KVStore* store, char* buffer, int buffer_size);
+int kv_store_scan(KVStore* store, const char* start, bool exclusive, const char* end, const char* prefix,
+                  char* buffer, int buffer_size, char* cursor, bool* done);
+int kv_store_scan_cursor(KVStore* store, uint64_t cursor, const char* prefix, char* buffer, int buffer_size,
+                         uint64_t* next);
+
+// Metrics. Every thread records into its own cache-line aligned slot with
+// plain relaxed stores; readers add the slots up. Gauges are kept as
+// counters of signed deltas.
+typedef enum {
+    KV_STAT_BYTES_IN = 0,      // Request bytes received
+    KV_STAT_BYTES_OUT,         // Reply bytes sent
+    KV_STAT_CONNECTIONS,       // Connections accepted
+    KV_STAT_CONNECTIONS_ACTIVE, // Gauge
+    KV_STAT_REDIRECTS,         // Requests for keys owned by another node
+    KV_STAT_STORE_BYTES,       // Gauge: memory held by records and tables
+    KV_STAT_LOG_BYTES,         // Bytes appended to the log
+    KV_STAT_LOG_RECORDS,       // Records appended to the log
+    KV_STAT_SLOW_REQUESTS,     // Requests over the slow-log threshold
+    KV_STAT_SLOW_DROPPED,      // Slow-log entries lost to a full ring
+    KV_STAT_COMPRESS_RAW_BYTES, // Bytes of values before compression
+    KV_STAT_COMPRESS_PACKED_BYTES, // The same values after compression
+    KV_STAT_COMPRESS_SKIPPED,  // Values over the threshold that did not shrink
+    KV_STAT_COMPRESS_NS,       // Time spent compressing
+    KV_STAT_DECOMPRESSIONS,    // Values decompressed for a reader
+    KV_STAT_DECOMPRESS_NS,     // Time spent decompressing
+    KV_STAT_SPILLS,            // Values moved to the value log
+    KV_STAT_SPILL_READS,       // Values read back from the value log
+    KV_STAT_VLOG_BYTES,        // Gauge: value log bytes on disk
+    KV_STAT_VLOG_DEAD_BYTES,   // Gauge: the part of them no record points at
+    KV_STAT_VLOG_GC_BYTES,     // Live value bytes rewritten by garbage collection
+    KV_STAT_LSM_FLUSHES,       // Memtables written out as level-0 tables
+    KV_STAT_LSM_COMPACTIONS,   // Compactions, including tables moved down a level unchanged
+    KV_STAT_LSM_COMPACTION_BYTES, // Table bytes written by compactions
+    KV_STAT_LSM_BLOCK_READS,   // SSTable blocks read from disk
+    KV_STAT_LSM_BLOOM_SKIPS,   // Table lookups the Bloom filter answered
+    KV_STAT_LSM_STALLS,        // Writes that waited for a flush or compaction
+    KV_STAT_LSM_BLOOM_BYTES,   // Gauge: memory held by SSTable Bloom filters
+    KV_STAT_LSM_BLOOM_FALSE_POSITIVES, // Table lookups the Bloom filter let through for an absent key
+    KV_STAT_LSM_FILTER_BYTES,  // Gauge: memory held by the per-shard key filters
+    KV_STAT_LSM_FILTER_NEGATIVES,      // Lookups the key filter answered
+    KV_STAT_LSM_FILTER_FALSE_POSITIVES, // Lookups the key filter let through for an absent key
+    KV_STAT_LSM_FILTER_REBUILDS,       // Key filters rebuilt after filling up
+    KV_STAT_MMAP_FILE_BYTES,   // Gauge: size of the mmap engine's data file
+    KV_STAT_MMAP_CHECKPOINTS,  // Checkpoints of the mmap engine's data file
+    KV_STAT_SHED_BUSY,         // Requests answered busy for want of an in-flight slot
+    KV_STAT_SHED_RATE,         // Requests answered busy by a token bucket
+    KV_STAT_SHED_CONNECTIONS,  // Connections turned away over the connection cap
+    KV_STAT_ADMIT_WAITS,       // Requests that queued for an in-flight slot
+    KV_STAT_PEER_BUDGET_WAITS, // Peer sends that waited for the in-flight byte budget
+    KV_STAT_COUNTER_COUNT
+} KVStatCounter;
+
+typedef enum {
+    KV_HIST_FSYNC = KV_STATS_MAX_OPS, // Per-opcode request latency comes first
+    KV_HIST_SNAPSHOT,
+    KV_HIST_COUNT
+} KVStatHistogram;
+
+uint64_t kv_stats_now(void);
+int64_t kv_stats_counter(KVStatCounter counter);
+void kv_stats_add(KVStatCounter counter, int64_t delta);
+void kv_stats_observe(int histogram, uint64_t ns);
+void kv_stats_record_op(OperationCode op, uint64_t ns);
+void kv_stats_replication(int peer, bool ok, uint64_t ns);
+void kv_stats_keyspace_request(uint32_t id);
+char* kv_stats_render(KVStore* store, NodeList* list);
+
+// Slow-request log. A request that takes longer than the threshold is
+// written out with its key, sizes, client and where the time went. Entries
+// go through a lock-free ring to a writer thread, so a slow request never
+// waits on the log file. While a request is being processed the store
+// charges lock waits and log appends on the same thread to it.
+#define KV_SLOWLOG_RING_SIZE 1024   // Entries; a power of two
+
+typedef enum {
+    KV_PHASE_LOCK_WAIT = 0,    // Blocked on shard and index locks
+    KV_PHASE_LOG,              // Appending to the operation log
+    KV_PHASE_COUNT
+} KVRequestPhase;
+
+typedef struct {
+    bool active;               // The slow log was enabled when the request arrived
+    OperationCode op;
+    char key[MAX_KEY_SIZE];
+    uint32_t request_bytes;    // Key and value payload
+    uint32_t reply_bytes;      // Value payload of the reply
+    uint64_t started;          // kv_stats_now() when the request was read
+    uint64_t replied;          // When the first reply byte was ready
+    uint64_t phases[KV_PHASE_COUNT];
+} KVSlowRequest;
+
+bool kv_slowlog_start(uint64_t threshold_us, const char* path);
+void kv_slowlog_begin(KVSlowRequest* req, const Message* msg, uint64_t started);
+void kv_slowlog_processed(KVSlowRequest* req, size_t reply_bytes);
+void kv_slowlog_end(KVSlowRequest* req, int client_fd);
+void kv_slowlog_attach(KVSlowRequest* req);
+void kv_slowlog_phase(KVRequestPhase phase, uint64_t ns);
+
+// Hot-key tracking. One GET or PUT in every sample_rate is counted into a
+// space-saving summary of KV_HOTKEYS_CAPACITY keys, so memory stays fixed
+// and any key above 1/KV_HOTKEYS_CAPACITY of the sampled traffic is kept.
+#define KV_HOTKEYS_CAPACITY 64
+#define KV_HOTKEYS_SAMPLE 16       // Default sample rate
+
+void kv_hotkeys_set_sample_rate(unsigned int rate);
+void kv_hotkeys_sample(OperationCode op, const char* key);
+char* kv_hotkeys_render(void);
+
+// Admission control. Requests run in a fixed number of in-flight slots;
+// connection threads queue briefly for a slot, and a request that cannot get
+// one, or that a per-address or per-connection token bucket turns away, is
+// answered KV_STATUS_BUSY so the client can back off and retry. Connections
+// over the cap get the same answer. Replication and rebalancing share a cap
+// on bytes sent to peers and not yet acknowledged.
+#define KV_ADMIT_INFLIGHT 256      // Default requests served at once
+#define KV_ADMIT_QUEUE 1024        // Default requests waiting for a slot
+#define KV_ADMIT_WAIT_US 50000     // Default longest wait for a slot
+#define KV_MAX_CONNECTIONS 4096    // Default open client connections
+#define KV_LISTEN_BACKLOG 1024     // Pending connections the kernel may hold
+#define KV_RATE_ADDRS 4096         // Token buckets for client addresses; a power of two
+#define KV_RATE_STRIPES 64         // Locks over the address buckets
+#define KV_PEER_INFLIGHT_BYTES (1 << 20)  // Default replication and rebalancing bytes in flight
+#define KV_PEER_PIPELINE 32        // Rebalancing puts outstanding on one connection
+#define KV_REBALANCE_BATCH 256     // Pairs rebalancing copies out of the store between pushes
+
+typedef struct {
+    uint64_t rate;             // Requests a second; 0 = unlimited
+    uint64_t burst;            // Requests the bucket holds when full
+    uint64_t tokens;           // Millionths of a request
+    uint64_t last;             // kv_stats_now() the tokens were counted at
+} KVTokenBucket;
+
+void kv_admit_configure(int max_inflight, int max_waiting, uint64_t wait_us);
+void kv_admit_set_max_connections(int max);
+void kv_rate_configure(uint64_t per_addr, uint64_t per_addr_burst, uint64_t per_conn, uint64_t per_conn_burst);
+void kv_rate_conn_init(KVTokenBucket* bucket);
+void kv_rate_bucket_init(KVTokenBucket* bucket, uint64_t rate, uint64_t burst);
+bool kv_rate_bucket_take(KVTokenBucket* bucket);
+bool kv_admit_request(const Message* msg, uint32_t addr, KVTokenBucket* conn, bool wait);
+void kv_admit_exit(void);
+int kv_admit_inflight(void);
+bool kv_admit_connection(void);
+void kv_admit_connection_closed(void);
+void kv_admit_shed_connection(int fd);
+bool kv_send_busy(int fd, const Message* request);
+bool kv_send_status(int fd, const Message* request, int status);
+void kv_peer_budget_configure(size_t bytes);
+bool kv_peer_budget_try_acquire(size_t bytes);
+void kv_peer_budget_acquire(size_t bytes);
+void kv_peer_budget_release(size_t bytes);
+size_t kv_peer_budget_used(void);
+
+// Keyspaces. Besides the default keyspace, the server's own store, a server
+// holds up to KV_MAX_KEYSPACES - 1 named ones, each a store of its own with
+// its own shards, capacity, memory quota, eviction policy, TTL and
+// persistence settings, and optionally a request rate of its own. Named
+// keyspaces are numbered from 1 in the order they are declared, so every
+// node of a cluster must declare the same ones in the same order.
+#define KV_MAX_KEYSPACES 64
+#define KV_KEYSPACE_NAME_SIZE 32
+#define KV_KEYSPACE_DIR_PREFIX "keyspace-"  // Each one persists under data_dir/keyspace-NAME
+
+typedef struct {
+    char name[KV_KEYSPACE_NAME_SIZE];
+    uint32_t id;
+    KVStore* store;
+    pthread_mutex_t lock;      // Guards bucket
+    KVTokenBucket bucket;      // Requests a second across all clients (rate 0 = unlimited)
+    _Atomic uint64_t shed;     // Requests the bucket turned away
+} KVKeyspace;
+
+// Settings a keyspace takes from the server unless its spec overrides them
+typedef struct {
+    int capacity;
+    const char* engine;
+    bool persistence;
+    KVDurability durability;
+    size_t compress_min;
+    unsigned int node_id;
+    const char* data_dir;      // Parent of the keyspaces' own directories
+} KVKeyspaceDefaults;
+
+bool kv_keyspace_add(const char* spec, const KVKeyspaceDefaults* defaults);
+void kv_keyspaces_destroy(void);
+int kv_keyspace_count(void);
+int kv_keyspace_lookup(const char* name);
+const KVKeyspace* kv_keyspace_get(uint32_t id);
+KVStore* kv_keyspace_route(KVStore* store, const Message* msg);
+bool kv_keyspace_admit(const Message* msg);
+void kv_keyspaces_distribute(KVStore* store, NodeList* list);
+bool kv_parse_eviction(const char* name, KVEviction* eviction);
+
+// Trace dumping; both return NULL/false when tracing is not built in
+char* kv_trace_render(void);
+bool kv_trace_dump(const char* path);
+
+// NUMA placement and thread pinning
+int kv_numa_node_count(void);
+int kv_numa_node_of_cpu(int cpu);
+int kv_numa_cpu(int i);
+void* kv_numa_alloc(size_t size, int node);
+void kv_numa_free(void* ptr, size_t size);
+bool kv_numa_pin_cpu(int cpu);
+bool kv_numa_pin_node(int node);
+
+// Snapshots. A snapshot is a header, a run of blocks of records and an
+// index of the blocks, written to a temporary file that is fsynced and then
+// renamed into place. Each block is LZ4-compressed when that makes it
+// smaller and carries its own CRC32C, so a restart can load blocks on
+// several threads and stop at damage instead of loading it.
+#define KV_SNAPSHOT_MAGIC 0x4b56534eU  // "NSVK" on disk
+#define KV_SNAPSHOT_VERSION 2          // Version 1 is a count and raw KeyValuePairs
+#define KV_SNAPSHOT_BLOCK_SIZE 65536   // Record bytes per block before compression
+#define KV_SNAPSHOT_MAX_THREADS 8      // Loader threads
+
+bool kv_snapshot_write(KVStore* store, const char* path);
+bool kv_snapshot_load(KVStore* store, const char* path);
+
+// Value log. With tiering on, a background thread moves values that have
+// not been read since its last pass to append-only segment files, leaving a
+// KVValuePointer in the record, and reads fetch them back with pread. It is
+// a cache tier: the operation log and snapshots still hold every value, and
+// segments are discarded on restart. Segments that are at least half
+// garbage are compacted in the background.
+#define KV_VLOG_SEGMENT_SIZE (64 * 1024 * 1024)
+#define KV_VLOG_MAX_SEGMENTS 65536
+#define KV_TIER_MIN_VALUE 64       // Smaller values stay in memory
+#define KV_TIER_INTERVAL_MS 50     // Pause between tier thread passes
+#define KV_TIER_BATCH 256          // Slots examined per shard lock hold
+
+struct KVValueLog* kv_vlog_open(const char* dir);
+void kv_vlog_close(struct KVValueLog* vlog);
+bool kv_vlog_append(struct KVValueLog* vlog, const char* key, uint16_t key_len, const char* value,
+                    uint16_t value_len, KVValuePointer* ptr);
+bool kv_vlog_flush(struct KVValueLog* vlog);
+bool kv_vlog_read(struct KVValueLog* vlog, KVValuePointer ptr, uint16_t len, char* dst);
+void kv_vlog_discard(struct KVValueLog* vlog, KVValuePointer ptr, uint16_t key_len, uint16_t value_len);
+int64_t kv_vlog_gc_victim(struct KVValueLog* vlog);
+bool kv_vlog_scan(struct KVValueLog* vlog, uint32_t segment,
+                  bool (*fn)(void* arg, const char* key, uint16_t key_len, const char* value, uint16_t value_len,
+                             KVValuePointer ptr),
+                  void* arg);
+bool kv_vlog_drop(struct KVValueLog* vlog, uint32_t segment);
+
+// LSM engine (kv_lsm.c). Writes go to a log and a memtable; full memtables
+// become level-0 SSTables, and a background thread merges tables down the
+// levels. Only each table's block index and Bloom filter stay in memory,
+// along with a cuckoo filter per shard over every live key that turns away
+// lookups for missing keys before they reach a memtable or table.
+#define KV_LSM_MEMTABLE_SIZE (4 * 1024 * 1024)  // Record bytes before a memtable is flushed
+#define KV_LSM_BLOCK_SIZE 4096                   // Entry bytes per SSTable block before compression
+#define KV_LSM_TABLE_SIZE (2 * 1024 * 1024)      // Compactions split their output at about this size
+#define KV_LSM_LEVELS 7
+#define KV_LSM_L0_COMPACT 4        // Level-0 tables that start a compaction
+#define KV_LSM_L0_STALL 12         // Level-0 tables at which writers wait
+#define KV_LSM_L1_SIZE (10 * 1024 * 1024)        // Level 1 target; each level below is larger
+#define KV_LSM_LEVEL_RATIO 10
+#define KV_LSM_BLOOM_BITS 10       // Bloom filter bits per key
+#define KV_LSM_FILTER_MIN_KEYS 4096 // Smallest key filter, per shard
+
+extern const KVEngineOps kv_engine_memory;
+extern const KVEngineOps kv_engine_lsm;
+int kv_lsm_level_tables(KVStore* store, int level, uint64_t* bytes);
+
+// Memory-mapped engine (kv_mmap.c). Records live in a slab heap in a data
+// file and each shard's hash index in a file of its own, all mapped and
+// addressed by file offset, so a restart maps them and serves at once.
+// Writes are also logged; a checkpoint syncs the heap and records the last
+// log sequence number it covers, and only later records are replayed.
+#define KV_MMAP_SLAB_SIZE (1024 * 1024)            // Heap bytes carved for one slot size at a time
+#define KV_MMAP_GROW (64 * 1024 * 1024)            // Bytes the data file grows by
+#define KV_MMAP_MAX_BYTES (1ULL << 40)             // Address space reserved for the data file
+#define KV_MMAP_CHECKPOINT_BYTES (64 * 1024 * 1024) // Log bytes between checkpoints
+#define KV_MMAP_INDEX_MIN 1024     // Entries in a new shard index; a power of two
+
+extern const KVEngineOps kv_engine_mmap;
+
+// Key filters (kv_filter.c). Hashes are 64-bit; a filter never reports a
+// key it holds as absent.
+#define KV_BLOOM_BLOCK 64          // Bytes per blocked Bloom filter block, one cache line
+#define KV_CUCKOO_SLOTS 4          // Fingerprints per cuckoo filter bucket
+#define KV_CUCKOO_MAX_KICKS 500    // Evictions before an insert gives up
+
+size_t kv_bloom_bytes(uint64_t keys, int bits_per_key);
+int kv_bloom_probes(int bits_per_key);
+void kv_bloom_add(uint8_t* bloom, size_t bytes, int probes, uint64_t hash);
+bool kv_bloom_may_contain(const uint8_t* bloom, size_t bytes, int probes, uint64_t hash);
+
+struct KVCuckoo* kv_cuckoo_create(uint64_t keys);
+void kv_cuckoo_free(struct KVCuckoo* filter);
+bool kv_cuckoo_add(struct KVCuckoo* filter, uint64_t hash);
+bool kv_cuckoo_may_contain(struct KVCuckoo* filter, uint64_t hash);
+bool kv_cuckoo_full(struct KVCuckoo* filter);
+uint64_t kv_cuckoo_count(const struct KVCuckoo* filter);
+size_t kv_cuckoo_bytes(const struct KVCuckoo* filter);
+
+// LZ4 block compression
+int kv_lz4_compress(const char* src, int src_len, char* dst, int dst_capacity);
+int kv_lz4_decompress(const char* src, int src_len, char* dst, int dst_capacity);
+
+// Control-byte group functions
+const KVGroupOps* kv_group_ops(void);
+
+// Epoch-based reclamation functions
+void kv_epoch_enter(void);
+void kv_epoch_exit(void);
+void kv_epoch_retire(void* ptr, void (*free_fn)(void*));
+void kv_epoch_drain(void);
+
+// Ordered index functions
+KVIndex* kv_index_init();
+void kv_index_destroy(KVIndex* index);
+bool kv_index_insert(KVIndex* index, const char* key);
+bool kv_index_remove(KVIndex* index, const char* key);
+KVIndexNode* kv_index_seek(KVIndex* index, const char* start, bool exclusive);
 
 // Persistence functions
 bool kv_store_enable_persistence(KVStore* store, const char* data_dir);
-bool kv_store_log_operation(KVStore* store, OperationCode op, const char* key, const char* value);
+void kv_store_set_durability(KVStore* store, KVDurability durability);
+bool kv_store_log_operation(KVStore* store, OperationCode op, const char* key, const char* value, uint64_t version);
 bool kv_store_create_snapshot(KVStore* store);
 bool kv_store_recover_from_logs(KVStore* store);
+bool kv_store_restore(KVStore* store, const char* key, const char* value, uint16_t value_len, uint8_t flags,
+                      uint64_t version);
 bool ensure_directory_exists(const char* path);
+void kv_store_allow_placement_migration(bool allow);
+bool kv_store_check_placement(const char* data_dir);
 
 // Node management functions
 NodeList* node_list_init();
@@ -103,6 +850,7 @@ void node_list_destroy(NodeList* list);
 bool node_list_add(NodeList* list, const char* ip, int port);
 bool node_list_remove(NodeList* list, const char* ip, int port);
 int node_for_key(NodeList* list, const char* key);
+int node_for_hash(NodeList* list, uint64_t key_hash);
 void distribute_data(KVStore* store, NodeList* list);
 
 // Network functions for server
@@ -110,14 +858,113 @@ int start_server(KVStore* store, NodeList* list, int port);
 void handle_client(int client_fd, KVStore* store, NodeList* list);
 void replicate_to_nodes(NodeList* list, Message* msg);
 
+// Request processing shared by the server backends
+typedef struct {
+    char start[MAX_KEY_SIZE];  // Resume point
+    char bound[MAX_VALUE_SIZE]; // End key or prefix
+    bool by_prefix;
+    bool exclusive;            // Start just after start
+    bool by_hash;              // Walk in hash order from hash_cursor
+    uint64_t hash_cursor;
+} ScanState;
+
+void process_request(Message* msg, KVStore* store, NodeList* list);
+KVRecord* prepare_get_reply(KVStore* store, NodeList* list, Message* msg, ResponseHeader* header);
+void scan_begin(ScanState* scan, const Message* msg);
+bool scan_next_frame(KVStore* store, ScanState* scan, Message* msg);
+bool stats_next_frame(const char* text, size_t* offset, Message* msg);
+
+// io_uring wrappers; the SQE/CQE layouts come from <linux/io_uring.h>
+typedef struct KVRing KVRing;
+typedef struct KVLogRing KVLogRing;
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct iovec;
+
+KVRing* kv_ring_create(unsigned int entries);
+void kv_ring_destroy(KVRing* ring);
+struct io_uring_sqe* kv_ring_get_sqe(KVRing* ring);
+int kv_ring_submit(KVRing* ring, unsigned int wait_nr);
+struct io_uring_cqe* kv_ring_peek(KVRing* ring);
+void kv_ring_advance(KVRing* ring);
+bool kv_ring_register_buffers(KVRing* ring, const struct iovec* iov, unsigned int count);
+
+KVLogRing* kv_log_ring_create(int fd);
+bool kv_log_ring_append(KVLogRing* log, const void* data, size_t len);
+bool kv_log_ring_flush(KVLogRing* log);
+void kv_log_ring_destroy(KVLogRing* log);
+
+// io_uring server loop; returns false if io_uring is unavailable
+bool kv_uring_serve(int server_fd, KVStore* store, NodeList* list, int io_threads, bool pin_threads);
+
 // Network functions for client
 int connect_to_server(const char* ip, int port);
-bool kv_client_put(int sockfd, const char* key, const char* value);
-bool kv_client_get(int sockfd, const char* key, char* value);
+bool recv_message(int sockfd, Message* msg);
+void kv_client_set_keyspace(uint32_t id);
+void kv_client_prepare(Message* msg, OperationCode op);
+bool kv_client_keyspace(int sockfd, const char* name, uint32_t* id);
+bool kv_client_pipeline(int sockfd, const Message* requests, Message* replies, int count);
+bool kv_client_put(int sockfd, const char* key, const char* value, uint64_t* version);
+bool kv_client_get(int sockfd, const char* key, char* value, uint64_t* version);
 bool kv_client_delete(int sockfd, const char* key);
 bool kv_client_list_keys(int sockfd, char* buffer, int buffer_size);
+bool kv_client_cas(int sockfd, const char* key, uint64_t expected_version, const char* value,
+                   char* current, uint64_t* version);
+bool kv_client_cas_value(int sockfd, const char* key, const char* expected, const char* value,
+                         char* current, uint64_t* version);
+bool kv_client_incr(int sockfd, const char* key, long long delta, long long* result);
+bool kv_client_append(int sockfd, const char* key, const char* suffix, char* result);
+bool kv_client_getset(int sockfd, const char* key, const char* value, char* old_value);
+bool kv_client_scan(int sockfd, const char* start, const char* end, const char* prefix,
+                    void (*callback)(const char* key, void* arg), void* arg);
+bool kv_client_scan_cursor(int sockfd, uint64_t* cursor, const char* prefix,
+                           void (*callback)(const char* key, void* arg), void* arg);
+bool kv_client_stats(int sockfd, void (*callback)(const char* text, void* arg), void* arg);
+bool kv_client_hot_keys(int sockfd, void (*callback)(const char* text, void* arg), void* arg);
+bool kv_client_trace(int sockfd, char* path, int path_size);
+
+// Client batch modes (kv_client --batch, --import, --export). Batch mode
+// runs commands from a stream, one per line, pipelining runs of PUT, GET and
+// DELETE. Import and export move key-value dumps over several connections,
+// each keeping a window of requests in flight. A dump is either
+// tab-separated, one "key<TAB>value" line per key with backslash escapes for
+// tab, newline, carriage return and backslash, or CSV with two fields per
+// record, quoted as needed.
+#define KV_BATCH_PIPELINE 64       // Default requests in flight per connection
+#define KV_BATCH_MAX_PIPELINE 1024
+#define KV_BATCH_PARALLEL 4        // Default connections for import and export
+#define KV_BATCH_MAX_PARALLEL 64
+
+typedef enum {
+    KV_DUMP_TSV,
+    KV_DUMP_CSV
+} KVDumpFormat;
+
+typedef struct {
+    const char* ip;
+    int port;
+    int parallel;              // Connections, each served by its own thread
+    int pipeline;              // Requests in flight per connection
+    KVDumpFormat format;
+    const char* prefix;        // Export only keys under this prefix (NULL for all)
+} KVTransferOptions;
+
+bool kv_batch_run(int sockfd, FILE* in, int pipeline);
+bool kv_import(FILE* in, const KVTransferOptions* options);
+bool kv_export(FILE* out, const KVTransferOptions* options);
+
+// Key hashing (wyhash). A key's 64-bit hash is computed once per request:
+// the high 32 bits pick the owning node, the low 32 bits the shard and the
+// table slot.
+#define KV_HASH_DEFAULT_SEED 0x6b762d73746f7265ULL
+
+uint64_t kv_hash(const void* data, size_t len, uint64_t seed);
+uint64_t kv_key_hash(const char* key);
+void kv_hash_set_seed(uint64_t seed);
+uint64_t kv_hash_get_seed(void);
+bool kv_hash_seed_is_set(void);
 
-// Hashing function for consistent hashing
-unsigned int hash_key(const char* key);
+// CRC32C (Castagnoli) for on-disk checksums; pass 0 to start
+uint32_t kv_crc32c(uint32_t crc, const void* data, size_t len);
 
 #endif // KV_STORE_H 
\ No newline at end of file
@@ -0,0 +1,216 @@
+#include "kv_store.h"
+
+#ifdef KV_TRACING
+
+#include <sys/syscall.h>
+
+// Request tracing
+//
+// Each thread records completed spans into its own ring, overwriting the
+// oldest once it is full. Recording is a few plain stores and a release
+// store of the ring head; a dump copies the rings and discards any event
+// that may have been overwritten while it was being copied.
+
+typedef struct {
+    uint64_t start;            // kv_trace_now() ticks
+    uint64_t end;
+    uint32_t stage;
+    int32_t tid;               // Rings outlive threads, so each event names its own
+} TraceEvent;
+
+typedef struct TraceRing {
+    TraceEvent events[KV_TRACE_RING_SIZE];
+    _Atomic uint64_t head;     // Events ever recorded into this ring
+    _Atomic bool in_use;
+    struct TraceRing* next;
+} TraceRing;
+
+static const char* stage_names[KV_TRACE_STAGE_COUNT] = {
+    "accept", "recv", "parse", "route", "lock", "store", "log", "replicate", "send"
+};
+
+static TraceRing* trace_rings = NULL;       // Every ring ever created
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+
+// Clock pair taken at startup, used to turn ticks into nanoseconds
+static uint64_t origin_ticks;
+static uint64_t origin_ns;
+
+static __thread TraceRing* thread_ring = NULL;
+static __thread int32_t thread_id = 0;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void release_ring(void* arg) {
+    atomic_store(&((TraceRing*)arg)->in_use, false);
+}
+
+static void trace_init(void) {
+    pthread_key_create(&trace_key, release_ring);
+    origin_ticks = kv_trace_now();
+    origin_ns = monotonic_ns();
+}
+
+// Reuse a ring left by an exited thread, keeping its events, or add a new one
+static TraceRing* acquire_ring(void) {
+    pthread_once(&trace_once, trace_init);
+
+    pthread_mutex_lock(&trace_lock);
+    TraceRing* ring;
+    for (ring = trace_rings; ring; ring = ring->next) {
+        if (!atomic_load(&ring->in_use)) {
+            break;
+        }
+    }
+    if (!ring) {
+        ring = (TraceRing*)calloc(1, sizeof(TraceRing));
+        if (!ring) {
+            pthread_mutex_unlock(&trace_lock);
+            return NULL;
+        }
+        ring->next = trace_rings;
+        trace_rings = ring;
+    }
+    atomic_store(&ring->in_use, true);
+    pthread_mutex_unlock(&trace_lock);
+
+    pthread_setspecific(trace_key, ring);
+    return ring;
+}
+
+// Record a span that started at start and ends now
+void kv_trace_record(KVTraceStage stage, uint64_t start) {
+    uint64_t end = kv_trace_now();
+    if (!thread_ring) {
+        thread_ring = acquire_ring();
+        if (!thread_ring) {
+            return;
+        }
+        thread_id = (int32_t)syscall(SYS_gettid);
+    }
+
+    uint64_t head = atomic_load_explicit(&thread_ring->head, memory_order_relaxed);
+    TraceEvent* event = &thread_ring->events[head & (KV_TRACE_RING_SIZE - 1)];
+    event->start = start;
+    event->end = end;
+    event->stage = stage;
+    event->tid = thread_id;
+    atomic_store_explicit(&thread_ring->head, head + 1, memory_order_release);
+}
+
+// Render every ring as Chrome trace event JSON (also readable by Perfetto);
+// the caller frees the result
+char* kv_trace_render(void) {
+    pthread_once(&trace_once, trace_init);
+
+    // Ticks per nanosecond, measured over the whole run so far
+    uint64_t now_ticks = kv_trace_now();
+    uint64_t now_ns = monotonic_ns();
+    double ns_per_tick = now_ticks > origin_ticks ?
+                         (double)(now_ns - origin_ns) / (double)(now_ticks - origin_ticks) : 1.0;
+
+    size_t size = 65536;
+    size_t len = 0;
+    char* text = (char*)malloc(size);
+    TraceEvent* copy = (TraceEvent*)malloc(sizeof(TraceEvent) * KV_TRACE_RING_SIZE);
+    if (!text || !copy) {
+        free(text);
+        free(copy);
+        return NULL;
+    }
+    len += snprintf(text, size, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    bool first = true;
+    int pid = (int)getpid();
+
+    pthread_mutex_lock(&trace_lock);
+    for (TraceRing* ring = trace_rings; ring; ring = ring->next) {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        memcpy(copy, ring->events, sizeof(TraceEvent) * KV_TRACE_RING_SIZE);
+        uint64_t after = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        // Events the writer may have reused during the copy are skipped
+        uint64_t oldest = after + 1 > KV_TRACE_RING_SIZE ? after + 1 - KV_TRACE_RING_SIZE : 0;
+        uint64_t begin = head > KV_TRACE_RING_SIZE ? head - KV_TRACE_RING_SIZE : 0;
+        if (begin < oldest) {
+            begin = oldest;
+        }
+
+        for (uint64_t i = begin; i < head; i++) {
+            TraceEvent* event = &copy[i & (KV_TRACE_RING_SIZE - 1)];
+            if (event->stage >= KV_TRACE_STAGE_COUNT || event->end < event->start) {
+                continue;
+            }
+
+            // Chrome trace timestamps are in microseconds
+            double ts = ((double)(int64_t)(event->start - origin_ticks) * ns_per_tick) / 1000.0;
+            double dur = ((double)(event->end - event->start) * ns_per_tick) / 1000.0;
+
+            if (size - len < 160) {
+                char* grown = (char*)realloc(text, size * 2);
+                if (!grown) {
+                    pthread_mutex_unlock(&trace_lock);
+                    free(text);
+                    free(copy);
+                    return NULL;
+                }
+                text = grown;
+                size *= 2;
+            }
+            len += snprintf(text + len, size - len,
+                            "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                            first ? "" : ",", stage_names[event->stage], pid, event->tid, ts, dur);
+            first = false;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    free(copy);
+    if (size - len < 8) {
+        char* grown = (char*)realloc(text, size + 8);
+        if (!grown) {
+            free(text);
+            return NULL;
+        }
+        text = grown;
+        size += 8;
+    }
+    snprintf(text + len, size - len, "\n]}\n");
+    return text;
+}
+
+// Write the trace to a file
+bool kv_trace_dump(const char* path) {
+    char* text = kv_trace_render();
+    if (!text) {
+        return false;
+    }
+
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        free(text);
+        return false;
+    }
+    bool written = fputs(text, file) >= 0;
+    written = fclose(file) == 0 && written;
+    free(text);
+    return written;
+}
+
+#else
+
+char* kv_trace_render(void) {
+    return NULL;
+}
+
+bool kv_trace_dump(const char* path) {
+    (void)path;
+    return false;
+}
+
+#endif
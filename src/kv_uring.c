@@ -0,0 +1,411 @@
+#include "kv_store.h"
+
+// Thin io_uring wrapper over the raw syscalls, plus an asynchronous writer
+// for the append-only log. Builds without io_uring get stubs that report it
+// as unavailable so callers fall back to blocking I/O.
+
+#ifdef KV_HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+struct KVRing {
+    int fd;
+    unsigned int sq_entries;
+
+    // Submission queue, shared with the kernel
+    _Atomic unsigned int* sq_head;
+    _Atomic unsigned int* sq_tail;
+    unsigned int sq_mask;
+    unsigned int* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned int sqe_tail;     // Tail including SQEs not yet published
+
+    // Completion queue, shared with the kernel
+    _Atomic unsigned int* cq_head;
+    _Atomic unsigned int* cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_map;
+    size_t sq_map_len;
+    void* cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Create a ring; returns NULL (with errno set) if the kernel refuses
+KVRing* kv_ring_create(unsigned int entries) {
+    KVRing* ring = (KVRing*)calloc(1, sizeof(KVRing));
+    if (!ring) {
+        return NULL;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+
+    // Map the rings; newer kernels let both share one mapping
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap && ring->cq_map_len > ring->sq_map_len) {
+        ring->sq_map_len = ring->cq_map_len;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    if (single_mmap) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            munmap(ring->sq_map, ring->sq_map_len);
+            close(ring->fd);
+            free(ring);
+            return NULL;
+        }
+    }
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_map != ring->sq_map) {
+            munmap(ring->cq_map, ring->cq_map_len);
+        }
+        munmap(ring->sq_map, ring->sq_map_len);
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    char* sq = (char*)ring->sq_map;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (_Atomic unsigned int*)(sq + params.sq_off.head);
+    ring->sq_tail = (_Atomic unsigned int*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned int*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*)(sq + params.sq_off.array);
+    ring->sqe_tail = atomic_load(ring->sq_tail);
+
+    char* cq = (char*)ring->cq_map;
+    ring->cq_head = (_Atomic unsigned int*)(cq + params.cq_off.head);
+    ring->cq_tail = (_Atomic unsigned int*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return ring;
+}
+
+// Tear down a ring; in-flight requests are cancelled by the kernel
+void kv_ring_destroy(KVRing* ring) {
+    if (!ring) {
+        return;
+    }
+
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_len);
+    }
+    munmap(ring->sq_map, ring->sq_map_len);
+    close(ring->fd);
+    free(ring);
+}
+
+// Get a cleared SQE to fill in, or NULL if the submission queue is full
+struct io_uring_sqe* kv_ring_get_sqe(KVRing* ring) {
+    unsigned int head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+
+    unsigned int index = ring->sqe_tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+
+    return sqe;
+}
+
+// Publish every prepared SQE in one syscall, optionally waiting for completions
+int kv_ring_submit(KVRing* ring, unsigned int wait_nr) {
+    atomic_store_explicit(ring->sq_tail, ring->sqe_tail, memory_order_release);
+
+    int ret;
+    do {
+        // The kernel moves the head past whatever it has consumed
+        unsigned int to_submit = ring->sqe_tail - atomic_load_explicit(ring->sq_head, memory_order_acquire);
+        if (to_submit == 0 && wait_nr == 0) {
+            return 0;
+        }
+        ret = sys_io_uring_enter(ring->fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+// Next completion, or NULL if none is ready
+struct io_uring_cqe* kv_ring_peek(KVRing* ring) {
+    unsigned int head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(ring->cq_tail, memory_order_acquire)) {
+        return NULL;
+    }
+
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+// Hand the completion returned by kv_ring_peek back to the kernel
+void kv_ring_advance(KVRing* ring) {
+    unsigned int head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+}
+
+// Pin buffers for READ_FIXED/WRITE_FIXED
+bool kv_ring_register_buffers(KVRing* ring, const struct iovec* iov, unsigned int count) {
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, count) == 0;
+}
+
+// Asynchronous log writer
+//
+// Records are written at tracked offsets without waiting for them, and a
+// drained fdatasync is queued every KV_LOG_SYNC_BATCH records. Callers
+// serialize access (the store holds its log lock).
+
+typedef struct {
+    size_t len;                // 0 for an fsync
+    uint64_t submitted;        // When it was queued, for fsync latency
+    char data[];
+} LogWrite;
+
+struct KVLogRing {
+    KVRing* ring;
+    int fd;
+    off_t offset;              // Where the next record goes
+    int inflight;              // Submitted requests not yet completed
+    int unsynced;              // Records written since the last fsync
+    bool failed;               // A write or fsync has failed
+};
+
+// Create a writer appending to fd; returns NULL if io_uring is unavailable
+KVLogRing* kv_log_ring_create(int fd) {
+    KVLogRing* log = (KVLogRing*)calloc(1, sizeof(KVLogRing));
+    if (!log) {
+        return NULL;
+    }
+
+    log->ring = kv_ring_create(KV_LOG_SYNC_BATCH * 4);
+    if (!log->ring) {
+        free(log);
+        return NULL;
+    }
+
+    // Writes carry explicit offsets, so they may complete in any order;
+    // O_APPEND would make the kernel ignore those offsets
+    int flags = fcntl(fd, F_GETFL);
+    log->fd = fd;
+    log->offset = lseek(fd, 0, SEEK_END);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_APPEND) < 0 || log->offset < 0) {
+        kv_ring_destroy(log->ring);
+        free(log);
+        return NULL;
+    }
+
+    return log;
+}
+
+// Retire finished requests; with wait, block until at least one finishes
+static void log_reap(KVLogRing* log, bool wait) {
+    if (wait && log->inflight > 0) {
+        kv_ring_submit(log->ring, 1);
+    }
+
+    struct io_uring_cqe* cqe;
+    while ((cqe = kv_ring_peek(log->ring)) != NULL) {
+        LogWrite* write = (LogWrite*)(uintptr_t)cqe->user_data;
+        if (write && write->len == 0) {
+            kv_stats_observe(KV_HIST_FSYNC, kv_stats_now() - write->submitted);
+        }
+        if (cqe->res < 0 || (write && write->len > 0 && (size_t)cqe->res != write->len)) {
+            if (!log->failed) {
+                fprintf(stderr, "Error writing log: %s\n", cqe->res < 0 ? strerror(-cqe->res) : "short write");
+            }
+            log->failed = true;
+        }
+
+        free(write);
+        log->inflight--;
+        kv_ring_advance(log->ring);
+    }
+}
+
+// Get an SQE, waiting for completions to free space if needed
+static struct io_uring_sqe* log_get_sqe(KVLogRing* log) {
+    struct io_uring_sqe* sqe;
+    while ((sqe = kv_ring_get_sqe(log->ring)) == NULL) {
+        kv_ring_submit(log->ring, 0);
+        log_reap(log, true);
+    }
+    return sqe;
+}
+
+// Queue an fdatasync that runs after every write before it
+static void log_queue_sync(KVLogRing* log) {
+    LogWrite* sync = (LogWrite*)malloc(sizeof(LogWrite));
+    if (sync) {
+        sync->len = 0;
+        sync->submitted = kv_stats_now();
+    }
+
+    struct io_uring_sqe* sqe = log_get_sqe(log);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = log->fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->flags = IOSQE_IO_DRAIN;
+    sqe->user_data = (uintptr_t)sync;
+    log->inflight++;
+    log->unsynced = 0;
+}
+
+// Append a record; the data is copied, so the caller's buffer can be reused
+bool kv_log_ring_append(KVLogRing* log, const void* data, size_t len) {
+    if (log->failed) {
+        return false;
+    }
+
+    LogWrite* write = (LogWrite*)malloc(sizeof(LogWrite) + len);
+    if (!write) {
+        return false;
+    }
+    write->len = len;
+    memcpy(write->data, data, len);
+
+    struct io_uring_sqe* sqe = log_get_sqe(log);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = log->fd;
+    sqe->addr = (uintptr_t)write->data;
+    sqe->len = (unsigned int)len;
+    sqe->off = (uint64_t)log->offset;
+    sqe->user_data = (uintptr_t)write;
+    log->offset += (off_t)len;
+    log->inflight++;
+
+    if (++log->unsynced >= KV_LOG_SYNC_BATCH) {
+        log_queue_sync(log);
+    }
+
+    if (kv_ring_submit(log->ring, 0) < 0) {
+        log->failed = true;
+        return false;
+    }
+
+    log_reap(log, false);
+    return !log->failed;
+}
+
+// Sync everything written so far and wait for it
+bool kv_log_ring_flush(KVLogRing* log) {
+    if (log->unsynced > 0) {
+        log_queue_sync(log);
+    }
+
+    while (log->inflight > 0) {
+        log_reap(log, true);
+    }
+
+    return !log->failed;
+}
+
+// Flush and free the writer; the file descriptor stays open
+void kv_log_ring_destroy(KVLogRing* log) {
+    if (!log) {
+        return;
+    }
+
+    kv_log_ring_flush(log);
+    kv_ring_destroy(log->ring);
+    free(log);
+}
+
+#else
+
+KVRing* kv_ring_create(unsigned int entries) {
+    (void)entries;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void kv_ring_destroy(KVRing* ring) {
+    (void)ring;
+}
+
+struct io_uring_sqe* kv_ring_get_sqe(KVRing* ring) {
+    (void)ring;
+    return NULL;
+}
+
+int kv_ring_submit(KVRing* ring, unsigned int wait_nr) {
+    (void)ring;
+    (void)wait_nr;
+    return -1;
+}
+
+struct io_uring_cqe* kv_ring_peek(KVRing* ring) {
+    (void)ring;
+    return NULL;
+}
+
+void kv_ring_advance(KVRing* ring) {
+    (void)ring;
+}
+
+bool kv_ring_register_buffers(KVRing* ring, const struct iovec* iov, unsigned int count) {
+    (void)ring;
+    (void)iov;
+    (void)count;
+    return false;
+}
+
+KVLogRing* kv_log_ring_create(int fd) {
+    (void)fd;
+    return NULL;
+}
+
+bool kv_log_ring_append(KVLogRing* log, const void* data, size_t len) {
+    (void)log;
+    (void)data;
+    (void)len;
+    return false;
+}
+
+bool kv_log_ring_flush(KVLogRing* log) {
+    (void)log;
+    return false;
+}
+
+void kv_log_ring_destroy(KVLogRing* log) {
+    (void)log;
+}
+
+#endif
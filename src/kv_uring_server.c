@@ -0,0 +1,772 @@
+#include "kv_store.h"
+
+// io_uring server backend
+//
+// Each I/O thread owns a ring and a fixed table of connections. The listening
+// socket is shared through a multishot accept on every ring (or, with pinned
+// threads, each ring accepts on its own listener for the port); a connection
+// always has exactly one request in flight (a read, a write or a sendmsg),
+// so its state can only change when that request completes. Completions are
+// handled in batches and everything they queue goes out in one submit.
+//
+// Requests that wait on other nodes, replicated writes and the rebalancing
+// after a membership change, are handed to a few worker threads per ring so
+// that one slow peer never stalls the ring's other connections. While a
+// worker has it the connection has no I/O in flight; the worker then posts
+// it back through an eventfd the ring keeps a read armed on, and the ring
+// sends the reply or reads the next request.
+
+#ifdef KV_HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+// Completion kinds, kept in the low bits of user_data next to the connection
+#define EV_ACCEPT  0
+#define EV_READ    1
+#define EV_WRITE   2
+#define EV_SENDMSG 3
+#define EV_WAKE    4           // Workers finished requests
+#define EV_MASK    7
+
+// Work a connection can be handed to a worker for
+#define JOB_NONE       0
+#define JOB_PROCESS    1       // Run the request in buf, then send the reply
+#define JOB_DISTRIBUTE 2       // Rebalance after a membership change, then read
+
+typedef struct Connection {
+    int fd;                    // -1 when the slot is free
+    Message* buf;              // Registered buffer: request in, reply out
+    size_t done;               // Bytes of the current transfer finished
+    size_t len;                // Bytes in the current transfer
+    bool scanning;             // Streaming SCAN, STATS or HOTKEYS frames
+    bool scan_last;            // The frame in buf is the final one
+    ScanState scan;
+    char* stats_text;          // Rendered text while streaming STATS or HOTKEYS
+    size_t stats_offset;
+    OperationCode op;          // Request being served, for metrics
+    uint64_t started;
+    KVSlowRequest slow;
+    bool admitted;             // Holds an admission slot
+    bool shed;                 // The reply going out is a busy or no-keyspace answer
+    KVStore* store;            // Store of the keyspace the request names
+    uint32_t addr;             // Client address, for its rate limit
+    KVTokenBucket bucket;
+
+    // Variable-length GET reply; the record is held until the send completes
+    ResponseHeader header;
+    KVRecord* rec;
+    struct iovec iov[2];
+    struct msghdr mh;
+
+    int job;                   // JOB_* while a worker has the connection
+    struct Connection* job_next;
+} Connection;
+
+_Static_assert(_Alignof(Connection) > EV_MASK, "completion kinds share user_data with connection pointers");
+
+typedef struct {
+    KVRing* ring;
+    int server_fd;
+    bool own_listener;         // server_fd was opened for this thread
+    int cpu;                   // CPU the thread is pinned to, or -1
+    KVStore* store;
+    NodeList* list;
+    bool fixed;                // Buffers are registered with the ring
+    bool multishot;            // Kernel supports multishot accept
+    Message* buffers;          // One per connection slot
+    Connection conns[KV_URING_MAX_CONNS];
+    int free_slots[KV_URING_MAX_CONNS];
+    int free_count;
+
+    // Workers for requests that wait on other nodes
+    pthread_t workers[KV_URING_WORKERS];
+    int worker_count;
+    pthread_mutex_t jobs_lock;
+    pthread_cond_t jobs_ready;
+    Connection* jobs;          // Waiting for a worker, oldest first
+    Connection* jobs_tail;
+    Connection* finished;      // Done by a worker, waiting for the ring
+    bool stopping;
+    int wake_fd;               // eventfd the workers signal the ring on
+    uint64_t wake_count;       // Read target for wake_fd
+} IOThread;
+
+// Get an SQE, flushing the queue to the kernel if it is full
+static struct io_uring_sqe* get_sqe(IOThread* t) {
+    struct io_uring_sqe* sqe;
+    while ((sqe = kv_ring_get_sqe(t->ring)) == NULL) {
+        kv_ring_submit(t->ring, 0);
+    }
+    return sqe;
+}
+
+static void arm_accept(IOThread* t) {
+    struct io_uring_sqe* sqe = get_sqe(t);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = t->server_fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = t->multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->user_data = EV_ACCEPT;
+}
+
+static void arm_wake(IOThread* t) {
+    struct io_uring_sqe* sqe = get_sqe(t);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = t->wake_fd;
+    sqe->addr = (uintptr_t)&t->wake_count;
+    sqe->len = sizeof(t->wake_count);
+    sqe->user_data = EV_WAKE;
+}
+
+// Queue a read or write of conn->buf from conn->done up to conn->len
+static void queue_transfer(IOThread* t, Connection* conn, int kind) {
+    struct io_uring_sqe* sqe = get_sqe(t);
+    if (kind == EV_READ) {
+        sqe->opcode = t->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    } else {
+        sqe->opcode = t->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    }
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)((char*)conn->buf + conn->done);
+    sqe->len = (unsigned int)(conn->len - conn->done);
+    sqe->buf_index = 0;
+    sqe->user_data = (uintptr_t)conn | kind;
+}
+
+static void queue_sendmsg(IOThread* t, Connection* conn) {
+    struct io_uring_sqe* sqe = get_sqe(t);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)&conn->mh;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)conn | EV_SENDMSG;
+}
+
+// Start reading the next request
+static void start_read(IOThread* t, Connection* conn) {
+    conn->done = 0;
+    conn->len = sizeof(Message);
+    queue_transfer(t, conn, EV_READ);
+}
+
+// Send the reply that is in conn->buf
+static void start_write(IOThread* t, Connection* conn) {
+    conn->done = 0;
+    conn->len = sizeof(Message);
+    queue_transfer(t, conn, EV_WRITE);
+}
+
+static void open_connection(IOThread* t, int fd) {
+    if (!kv_admit_connection()) {
+        kv_admit_shed_connection(fd);
+        return;
+    }
+    if (t->free_count == 0) {
+        // Connection table is full
+        kv_admit_connection_closed();
+        kv_admit_shed_connection(fd);
+        return;
+    }
+
+    KV_TRACE_BEGIN(trace_start);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    int slot = t->free_slots[--t->free_count];
+    Connection* conn = &t->conns[slot];
+    conn->fd = fd;
+    conn->scanning = false;
+    conn->stats_text = NULL;
+    conn->rec = NULL;
+    conn->slow.active = false;
+    conn->admitted = false;
+    conn->shed = false;
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    conn->addr = getpeername(fd, (struct sockaddr*)&peer, &peer_len) == 0 ? peer.sin_addr.s_addr : 0;
+    kv_rate_conn_init(&conn->bucket);
+    kv_stats_add(KV_STAT_CONNECTIONS, 1);
+    kv_stats_add(KV_STAT_CONNECTIONS_ACTIVE, 1);
+    start_read(t, conn);
+    KV_TRACE_END(KV_TRACE_ACCEPT, trace_start);
+}
+
+// Give back the connection's admission slot once its request is done with the store
+static void release_slot(Connection* conn) {
+    if (conn->admitted) {
+        conn->admitted = false;
+        kv_admit_exit();
+    }
+}
+
+static void close_connection(IOThread* t, Connection* conn) {
+    release_slot(conn);
+    kv_record_release(conn->rec);
+    conn->rec = NULL;
+    free(conn->stats_text);
+    conn->stats_text = NULL;
+    close(conn->fd);
+    conn->fd = -1;
+    kv_stats_add(KV_STAT_CONNECTIONS_ACTIVE, -1);
+    kv_admit_connection_closed();
+    t->free_slots[t->free_count++] = (int)(conn - t->conns);
+}
+
+// Answer the request in conn->buf with a bare status, in the shape of reply
+// the client expects
+static void send_status(IOThread* t, Connection* conn, int status) {
+    Message* msg = conn->buf;
+    conn->shed = true;
+    conn->done = 0;
+    if (msg->op_code == OP_GET && (msg->flags & KV_FLAG_VARLEN_REPLY)) {
+        ResponseHeader header;
+        memset(&header, 0, sizeof(header));
+        header.op_code = OP_GET;
+        header.status = status;
+        memcpy(msg, &header, sizeof(header));
+        conn->len = sizeof(header);
+    } else {
+        OperationCode op = msg->op_code;
+        memset(msg, 0, sizeof(Message));
+        msg->op_code = op;
+        msg->status = status;
+        conn->len = sizeof(Message);
+    }
+    queue_transfer(t, conn, EV_WRITE);
+}
+
+// Hand a connection to a worker; the ring does nothing more for it until
+// the worker posts it back
+static void queue_job(IOThread* t, Connection* conn, int job) {
+    conn->job = job;
+    conn->job_next = NULL;
+    pthread_mutex_lock(&t->jobs_lock);
+    if (t->jobs_tail) {
+        t->jobs_tail->job_next = conn;
+    } else {
+        t->jobs = conn;
+    }
+    t->jobs_tail = conn;
+    pthread_cond_signal(&t->jobs_ready);
+    pthread_mutex_unlock(&t->jobs_lock);
+}
+
+static void* worker_main(void* arg) {
+    IOThread* t = (IOThread*)arg;
+    while (true) {
+        pthread_mutex_lock(&t->jobs_lock);
+        while (!t->jobs && !t->stopping) {
+            pthread_cond_wait(&t->jobs_ready, &t->jobs_lock);
+        }
+        Connection* conn = t->jobs;
+        if (conn) {
+            t->jobs = conn->job_next;
+            if (!t->jobs) {
+                t->jobs_tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&t->jobs_lock);
+        if (!conn) {
+            return NULL;
+        }
+
+        if (conn->job == JOB_PROCESS) {
+            kv_slowlog_attach(&conn->slow);
+            process_request(conn->buf, conn->store, t->list);
+            kv_slowlog_processed(&conn->slow, strnlen(conn->buf->value, MAX_VALUE_SIZE));
+        } else {
+            kv_keyspaces_distribute(t->store, t->list);
+        }
+
+        pthread_mutex_lock(&t->jobs_lock);
+        conn->job_next = t->finished;
+        t->finished = conn;
+        pthread_mutex_unlock(&t->jobs_lock);
+
+        // An eventfd write only fails when the counter is full, and then the ring is awake anyway
+        uint64_t one = 1;
+        ssize_t written = write(t->wake_fd, &one, sizeof(one));
+        (void)written;
+    }
+}
+
+// Carry on with the connections the workers have finished with
+static void jobs_finished(IOThread* t) {
+    pthread_mutex_lock(&t->jobs_lock);
+    Connection* conn = t->finished;
+    t->finished = NULL;
+    pthread_mutex_unlock(&t->jobs_lock);
+
+    while (conn) {
+        Connection* next = conn->job_next;
+        int job = conn->job;
+        conn->job = JOB_NONE;
+        if (job == JOB_PROCESS) {
+            release_slot(conn);
+            start_write(t, conn);
+        } else {
+            start_read(t, conn);
+        }
+        conn = next;
+    }
+}
+
+// Whether serving a request may wait on other nodes: a write is replicated
+// to every peer, with a connect and a round trip each
+static bool waits_on_peers(IOThread* t, OperationCode op) {
+    switch (op) {
+        case OP_PUT:
+        case OP_DELETE:
+        case OP_CAS:
+        case OP_INCR:
+        case OP_DECR:
+        case OP_APPEND:
+        case OP_GETSET:
+            break;
+        default:
+            return false;
+    }
+
+    pthread_mutex_lock(&t->list->lock);
+    bool peers = t->list->count > 1;
+    pthread_mutex_unlock(&t->list->lock);
+    return peers;
+}
+
+// Act on a complete request in conn->buf
+static void dispatch(IOThread* t, Connection* conn) {
+    Message* msg = conn->buf;
+    KV_TRACE_BEGIN(trace_start);
+    conn->op = msg->op_code;
+    conn->started = kv_stats_now();
+    kv_stats_add(KV_STAT_BYTES_IN, sizeof(Message));
+
+    // The event loop cannot wait for a slot, so a request without one is
+    // answered busy at once
+    if (!kv_admit_request(msg, conn->addr, &conn->bucket, false)) {
+        KV_TRACE_END(KV_TRACE_PARSE, trace_start);
+        send_status(t, conn, KV_STATUS_BUSY);
+        return;
+    }
+    conn->admitted = true;
+
+    conn->store = kv_keyspace_route(t->store, msg);
+    if (!conn->store) {
+        release_slot(conn);
+        KV_TRACE_END(KV_TRACE_PARSE, trace_start);
+        send_status(t, conn, KV_STATUS_NO_KEYSPACE);
+        return;
+    }
+    kv_slowlog_begin(&conn->slow, msg, conn->started);
+    kv_hotkeys_sample(msg->op_code, msg->key);
+    KV_TRACE_END(KV_TRACE_PARSE, trace_start);
+
+    if (msg->op_code == OP_SCAN) {
+        scan_begin(&conn->scan, msg);
+        conn->scanning = true;
+        conn->scan_last = scan_next_frame(conn->store, &conn->scan, msg);
+        if (conn->scan_last) {
+            release_slot(conn);
+        }
+        kv_slowlog_processed(&conn->slow, strlen(msg->value));
+        start_write(t, conn);
+        return;
+    }
+
+    if (msg->op_code == OP_STATS || msg->op_code == OP_HOTKEYS) {
+        if (msg->op_code == OP_STATS) {
+            conn->stats_text = kv_stats_render(t->store, t->list);
+        } else {
+            conn->stats_text = kv_hotkeys_render();
+        }
+        conn->stats_offset = 0;
+        conn->scanning = true;
+        conn->scan_last = stats_next_frame(conn->stats_text ? conn->stats_text : "",
+                                           &conn->stats_offset, msg);
+        if (conn->scan_last) {
+            release_slot(conn);
+        }
+        kv_slowlog_processed(&conn->slow, strlen(msg->value));
+        start_write(t, conn);
+        return;
+    }
+
+    if (msg->op_code == OP_GET && (msg->flags & KV_FLAG_VARLEN_REPLY)) {
+        msg->key[MAX_KEY_SIZE - 1] = '\0';
+        conn->rec = prepare_get_reply(conn->store, t->list, msg, &conn->header);
+        release_slot(conn);
+        kv_slowlog_processed(&conn->slow, conn->header.value_len);
+
+        // The value goes out straight from the record
+        int iov_count = 1;
+        conn->iov[0].iov_base = &conn->header;
+        conn->iov[0].iov_len = sizeof(ResponseHeader);
+        if (conn->rec && conn->rec->value_len > 0) {
+            conn->iov[1].iov_base = KV_RECORD_VALUE(conn->rec);
+            conn->iov[1].iov_len = conn->rec->value_len;
+            iov_count = 2;
+        }
+        memset(&conn->mh, 0, sizeof(conn->mh));
+        conn->mh.msg_iov = conn->iov;
+        conn->mh.msg_iovlen = iov_count;
+        queue_sendmsg(t, conn);
+        return;
+    }
+
+    if (waits_on_peers(t, msg->op_code)) {
+        kv_slowlog_attach(NULL);
+        queue_job(t, conn, JOB_PROCESS);
+        return;
+    }
+
+    process_request(msg, conn->store, t->list);
+    release_slot(conn);
+    kv_slowlog_processed(&conn->slow, strnlen(msg->value, MAX_VALUE_SIZE));
+    start_write(t, conn);
+}
+
+// A reply finished sending
+static void reply_sent(IOThread* t, Connection* conn) {
+    Message* msg = conn->buf;
+    kv_stats_add(KV_STAT_BYTES_OUT, conn->len);
+    if (conn->shed) {
+        conn->shed = false;
+        start_read(t, conn);
+        return;
+    }
+
+    if (conn->scanning) {
+        if (!conn->scan_last) {
+            if (conn->op == OP_SCAN) {
+                conn->scan_last = scan_next_frame(conn->store, &conn->scan, msg);
+            } else {
+                conn->scan_last = stats_next_frame(conn->stats_text, &conn->stats_offset, msg);
+            }
+            if (conn->scan_last) {
+                release_slot(conn);
+            }
+            kv_slowlog_processed(&conn->slow, strlen(msg->value));
+            start_write(t, conn);
+            return;
+        }
+        conn->scanning = false;
+        free(conn->stats_text);
+        conn->stats_text = NULL;
+    }
+    kv_slowlog_end(&conn->slow, conn->fd);
+    kv_stats_record_op(conn->op, kv_stats_now() - conn->started);
+
+    // Membership changes redistribute data after the reply has gone out,
+    // on a worker; the connection reads its next request once that is done
+    if (msg->op_code == OP_NODE_JOIN || msg->op_code == OP_NODE_LEAVE) {
+        queue_job(t, conn, JOB_DISTRIBUTE);
+        return;
+    }
+
+    start_read(t, conn);
+}
+
+static void handle_completion(IOThread* t, uint64_t user_data, int res, unsigned int flags) {
+    int kind = (int)(user_data & EV_MASK);
+    Connection* conn = (Connection*)(uintptr_t)(user_data & ~(uint64_t)EV_MASK);
+
+    switch (kind) {
+        case EV_WAKE: {
+            if (res < 0 && res != -EINTR) {
+                fprintf(stderr, "eventfd read: %s\n", strerror(-res));
+            }
+            arm_wake(t);
+            jobs_finished(t);
+            break;
+        }
+
+        case EV_ACCEPT: {
+            if (res >= 0) {
+                open_connection(t, res);
+            } else if (res == -EINVAL && t->multishot) {
+                // Older kernel; fall back to one accept per request
+                t->multishot = false;
+            } else if (res != -EINTR && res != -ECONNABORTED) {
+                fprintf(stderr, "accept: %s\n", strerror(-res));
+            }
+
+            // A multishot accept stays armed until a completion lacks F_MORE
+            if (!(flags & IORING_CQE_F_MORE)) {
+                arm_accept(t);
+            }
+            break;
+        }
+
+        case EV_READ: {
+            if (res <= 0) {
+                close_connection(t, conn);
+                break;
+            }
+
+            conn->done += res;
+            if (conn->done < conn->len) {
+                queue_transfer(t, conn, EV_READ);
+            } else {
+                dispatch(t, conn);
+            }
+            break;
+        }
+
+        case EV_WRITE: {
+            if (res <= 0) {
+                close_connection(t, conn);
+                break;
+            }
+
+            conn->done += res;
+            if (conn->done < conn->len) {
+                queue_transfer(t, conn, EV_WRITE);
+            } else {
+                reply_sent(t, conn);
+            }
+            break;
+        }
+
+        case EV_SENDMSG: {
+            if (res <= 0) {
+                close_connection(t, conn);
+                break;
+            }
+
+            // Skip past what went out and resend the rest
+            struct iovec* iov = conn->mh.msg_iov;
+            size_t sent = (size_t)res;
+            while (conn->mh.msg_iovlen > 0 && sent >= iov->iov_len) {
+                sent -= iov->iov_len;
+                iov++;
+                conn->mh.msg_iovlen--;
+            }
+
+            if (conn->mh.msg_iovlen > 0) {
+                iov->iov_base = (char*)iov->iov_base + sent;
+                iov->iov_len -= sent;
+                conn->mh.msg_iov = iov;
+                queue_sendmsg(t, conn);
+                break;
+            }
+
+            kv_record_release(conn->rec);
+            conn->rec = NULL;
+            kv_stats_add(KV_STAT_BYTES_OUT, sizeof(ResponseHeader) + conn->header.value_len);
+            kv_slowlog_end(&conn->slow, conn->fd);
+            kv_stats_record_op(conn->op, kv_stats_now() - conn->started);
+            start_read(t, conn);
+            break;
+        }
+    }
+}
+
+static void io_thread_destroy(IOThread* t) {
+    // Workers finish what they hold first; their connections are closed below
+    pthread_mutex_lock(&t->jobs_lock);
+    t->stopping = true;
+    pthread_cond_broadcast(&t->jobs_ready);
+    pthread_mutex_unlock(&t->jobs_lock);
+    for (int i = 0; i < t->worker_count; i++) {
+        pthread_join(t->workers[i], NULL);
+    }
+
+    for (int i = 0; i < KV_URING_MAX_CONNS; i++) {
+        if (t->conns[i].fd >= 0) {
+            close_connection(t, &t->conns[i]);
+        }
+    }
+    kv_ring_destroy(t->ring);
+    close(t->wake_fd);
+    pthread_mutex_destroy(&t->jobs_lock);
+    pthread_cond_destroy(&t->jobs_ready);
+    if (t->own_listener) {
+        close(t->server_fd);
+    }
+    kv_numa_free(t->buffers, KV_URING_MAX_CONNS * sizeof(Message));
+    kv_numa_free(t, sizeof(IOThread));
+}
+
+// Set up a thread's ring, connection table and registered buffers, in the
+// memory of the node the thread will run on (cpu -1 for no pinning)
+static IOThread* io_thread_create(int server_fd, KVStore* store, NodeList* list, int cpu) {
+    int node = cpu >= 0 ? kv_numa_node_of_cpu(cpu) : -1;
+    IOThread* t = (IOThread*)kv_numa_alloc(sizeof(IOThread), node);
+    if (!t) {
+        return NULL;
+    }
+
+    t->ring = kv_ring_create(KV_URING_ENTRIES);
+    t->buffers = (Message*)kv_numa_alloc(KV_URING_MAX_CONNS * sizeof(Message), node);
+    t->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (!t->ring || !t->buffers || t->wake_fd < 0) {
+        if (t->wake_fd >= 0) {
+            close(t->wake_fd);
+        }
+        kv_ring_destroy(t->ring);
+        kv_numa_free(t->buffers, KV_URING_MAX_CONNS * sizeof(Message));
+        kv_numa_free(t, sizeof(IOThread));
+        return NULL;
+    }
+
+    t->server_fd = server_fd;
+    t->cpu = cpu;
+    t->store = store;
+    t->list = list;
+    t->multishot = true;
+
+    for (int i = 0; i < KV_URING_MAX_CONNS; i++) {
+        t->conns[i].fd = -1;
+        t->conns[i].job = JOB_NONE;
+        t->conns[i].buf = &t->buffers[i];
+        t->free_slots[i] = KV_URING_MAX_CONNS - 1 - i;
+    }
+    t->free_count = KV_URING_MAX_CONNS;
+
+    // All connection buffers are registered as one region; if pinning them
+    // is not allowed, plain reads and writes still work
+    struct iovec region;
+    region.iov_base = t->buffers;
+    region.iov_len = KV_URING_MAX_CONNS * sizeof(Message);
+    t->fixed = kv_ring_register_buffers(t->ring, &region, 1);
+
+    pthread_mutex_init(&t->jobs_lock, NULL);
+    pthread_cond_init(&t->jobs_ready, NULL);
+    t->jobs = t->jobs_tail = t->finished = NULL;
+    t->stopping = false;
+    t->worker_count = 0;
+    while (t->worker_count < KV_URING_WORKERS &&
+           pthread_create(&t->workers[t->worker_count], NULL, worker_main, t) == 0) {
+        t->worker_count++;
+    }
+    if (t->worker_count == 0) {
+        perror("pthread_create");
+        io_thread_destroy(t);
+        return NULL;
+    }
+
+    return t;
+}
+
+// Event loop: submit everything queued, wait for at least one completion,
+// then handle every completion that is ready
+static void* io_thread_run(void* arg) {
+    IOThread* t = (IOThread*)arg;
+
+    if (t->cpu >= 0 && !kv_numa_pin_cpu(t->cpu)) {
+        fprintf(stderr, "Warning: Failed to pin io_uring thread to CPU %d\n", t->cpu);
+    }
+    arm_accept(t);
+    arm_wake(t);
+
+    while (1) {
+        if (kv_ring_submit(t->ring, 1) < 0 && errno != EBUSY) {
+            perror("io_uring_enter");
+            break;
+        }
+
+        struct io_uring_cqe* cqe;
+        while ((cqe = kv_ring_peek(t->ring)) != NULL) {
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned int flags = cqe->flags;
+            kv_ring_advance(t->ring);
+
+            handle_completion(t, user_data, res, flags);
+        }
+    }
+
+    io_thread_destroy(t);
+    return NULL;
+}
+
+// Open another listener on server_fd's port for a thread pinned to cpu.
+// Within an SO_REUSEPORT group the kernel hands a new connection to the
+// listener whose SO_INCOMING_CPU is the CPU that received it, so each
+// connection is served on the CPU, and node, that handles its packets.
+static int open_steered_listener(int server_fd, int cpu) {
+    struct sockaddr_in address;
+    socklen_t address_len = sizeof(address);
+    if (getsockname(server_fd, (struct sockaddr*)&address, &address_len) < 0) {
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0 ||
+        bind(fd, (struct sockaddr*)&address, address_len) < 0 || listen(fd, 128) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Serve clients on server_fd with io_threads io_uring event loops; with
+// pin_threads, thread i runs on kv_numa_cpu(i) and accepts the connections
+// that arrive there
+bool kv_uring_serve(int server_fd, KVStore* store, NodeList* list, int io_threads, bool pin_threads) {
+    // The first ring decides whether io_uring is usable at all
+    int cpu = pin_threads ? kv_numa_cpu(0) : -1;
+    IOThread* first = io_thread_create(server_fd, store, list, cpu);
+    if (!first) {
+        return false;
+    }
+    if (pin_threads) {
+        setsockopt(server_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+    }
+
+    // Socket writes through the ring cannot pass MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Serving with io_uring on %d thread(s)%s%s\n", io_threads < 1 ? 1 : io_threads,
+           first->fixed ? "" : " without registered buffers",
+           pin_threads ? ", pinned across NUMA nodes" : "");
+
+    for (int i = 1; i < io_threads; i++) {
+        cpu = pin_threads ? kv_numa_cpu(i) : -1;
+        int listener = pin_threads ? open_steered_listener(server_fd, cpu) : -1;
+        IOThread* t = io_thread_create(listener >= 0 ? listener : server_fd, store, list, cpu);
+        if (!t) {
+            if (listener >= 0) {
+                close(listener);
+            }
+            fprintf(stderr, "Warning: Failed to create io_uring thread %d\n", i);
+            break;
+        }
+        t->own_listener = listener >= 0;
+
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, io_thread_run, t) != 0) {
+            perror("pthread_create");
+            io_thread_destroy(t);
+            break;
+        }
+        pthread_detach(tid);
+    }
+
+    io_thread_run(first);
+    return true;
+}
+
+#else
+
+bool kv_uring_serve(int server_fd, KVStore* store, NodeList* list, int io_threads, bool pin_threads) {
+    (void)server_fd;
+    (void)store;
+    (void)list;
+    (void)io_threads;
+    (void)pin_threads;
+    return false;
+}
+
+#endif
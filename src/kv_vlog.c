@@ -0,0 +1,313 @@
+#include "kv_store.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+
+// Value log segments
+//
+// Spilled values are appended to the active segment through a staging
+// buffer; the tier thread is the only writer, so appends take no lock. A
+// value becomes readable once kv_vlog_flush has written it, and the tier
+// thread only publishes pointers after flushing. Each entry is a small
+// header, the key and the value; the key lets garbage collection find the
+// record that still points at an entry. Segments are dropped through the
+// epoch, so a reader that found a pointer can still read it.
+
+#define VLOG_STAGING_SIZE (1024 * 1024)
+
+typedef struct {
+    uint16_t key_len;
+    uint16_t value_len;
+} VlogEntry;
+
+typedef struct VlogSegment {
+    struct KVValueLog* vlog;
+    uint32_t id;
+    int fd;
+    uint64_t size;             // Bytes written (tier thread only)
+    _Atomic uint64_t dead;     // Bytes of entries no record points at any more
+    bool dropping;
+    char path[300];
+} VlogSegment;
+
+struct KVValueLog {
+    char dir[256];
+    uint32_t oldest;           // Lowest id that may still be in use
+    uint32_t active;           // Segment being appended to
+    char* staging;             // Appends not yet written to the active segment
+    size_t staged;
+    _Atomic(VlogSegment*) segments[KV_VLOG_MAX_SEGMENTS];
+};
+
+static VlogSegment* segment_create(struct KVValueLog* vlog, uint32_t id) {
+    VlogSegment* seg = (VlogSegment*)calloc(1, sizeof(VlogSegment));
+    if (!seg) {
+        return NULL;
+    }
+
+    seg->vlog = vlog;
+    seg->id = id;
+    atomic_init(&seg->dead, 0);
+    snprintf(seg->path, sizeof(seg->path), "%s/vlog_%08u.dat", vlog->dir, id);
+    seg->fd = open(seg->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (seg->fd < 0) {
+        fprintf(stderr, "Error creating value log segment %s: %s\n", seg->path, strerror(errno));
+        free(seg);
+        return NULL;
+    }
+
+    atomic_store_explicit(&vlog->segments[id], seg, memory_order_release);
+    return seg;
+}
+
+static void segment_free(VlogSegment* seg) {
+    close(seg->fd);
+    unlink(seg->path);
+    kv_stats_add(KV_STAT_VLOG_BYTES, -(int64_t)seg->size);
+    kv_stats_add(KV_STAT_VLOG_DEAD_BYTES, -(int64_t)atomic_load(&seg->dead));
+    free(seg);
+}
+
+// Epoch callback: no reader can still be looking at the segment
+static void segment_retire(void* ptr) {
+    VlogSegment* seg = (VlogSegment*)ptr;
+    atomic_store_explicit(&seg->vlog->segments[seg->id], NULL, memory_order_relaxed);
+    segment_free(seg);
+}
+
+// Segments left by an earlier run hold nothing the logs do not
+static void remove_stale_segments(const char* dir) {
+    DIR* d = opendir(dir);
+    if (!d) {
+        return;
+    }
+
+    struct dirent* entry;
+    char path[600];
+    while ((entry = readdir(d)) != NULL) {
+        if (strncmp(entry->d_name, "vlog_", 5) == 0) {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+}
+
+struct KVValueLog* kv_vlog_open(const char* dir) {
+    if (!ensure_directory_exists(dir)) {
+        return NULL;
+    }
+
+    struct KVValueLog* vlog = (struct KVValueLog*)calloc(1, sizeof(struct KVValueLog));
+    if (!vlog) {
+        return NULL;
+    }
+    strncpy(vlog->dir, dir, sizeof(vlog->dir) - 1);
+    vlog->staging = (char*)malloc(VLOG_STAGING_SIZE);
+    remove_stale_segments(dir);
+
+    if (!vlog->staging || !segment_create(vlog, 0)) {
+        free(vlog->staging);
+        free(vlog);
+        return NULL;
+    }
+    return vlog;
+}
+
+// Close and delete every segment; no reader may remain
+void kv_vlog_close(struct KVValueLog* vlog) {
+    if (!vlog) {
+        return;
+    }
+
+    for (uint32_t id = vlog->oldest; id <= vlog->active; id++) {
+        VlogSegment* seg = atomic_load(&vlog->segments[id]);
+        if (seg) {
+            segment_free(seg);
+        }
+    }
+    free(vlog->staging);
+    free(vlog);
+}
+
+// Write staged appends to the active segment
+bool kv_vlog_flush(struct KVValueLog* vlog) {
+    if (vlog->staged == 0) {
+        return true;
+    }
+
+    VlogSegment* seg = atomic_load_explicit(&vlog->segments[vlog->active], memory_order_relaxed);
+    const char* p = vlog->staging;
+    size_t left = vlog->staged;
+    off_t offset = (off_t)seg->size;
+    while (left > 0) {
+        ssize_t n = pwrite(seg->fd, p, left, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // The staged entries are lost; their pointers must not be used
+            fprintf(stderr, "Error writing value log segment %s: %s\n", seg->path, strerror(errno));
+            vlog->staged = 0;
+            return false;
+        }
+        p += n;
+        left -= (size_t)n;
+        offset += n;
+    }
+
+    seg->size += vlog->staged;
+    kv_stats_add(KV_STAT_VLOG_BYTES, (int64_t)vlog->staged);
+    vlog->staged = 0;
+    return true;
+}
+
+// Stage a value for the active segment and say where it will be. The
+// pointer is only good once kv_vlog_flush has returned true.
+bool kv_vlog_append(struct KVValueLog* vlog, const char* key, uint16_t key_len, const char* value,
+                    uint16_t value_len, KVValuePointer* ptr) {
+    size_t size = sizeof(VlogEntry) + key_len + value_len;
+    VlogSegment* seg = atomic_load_explicit(&vlog->segments[vlog->active], memory_order_relaxed);
+
+    if (seg->size + vlog->staged + size > KV_VLOG_SEGMENT_SIZE) {
+        if (vlog->active + 1 >= KV_VLOG_MAX_SEGMENTS || !kv_vlog_flush(vlog) ||
+            !segment_create(vlog, vlog->active + 1)) {
+            return false;
+        }
+        vlog->active++;
+        seg = atomic_load_explicit(&vlog->segments[vlog->active], memory_order_relaxed);
+    }
+    if (vlog->staged + size > VLOG_STAGING_SIZE && !kv_vlog_flush(vlog)) {
+        return false;
+    }
+
+    VlogEntry entry = { key_len, value_len };
+    char* p = vlog->staging + vlog->staged;
+    memcpy(p, &entry, sizeof(VlogEntry));
+    memcpy(p + sizeof(VlogEntry), key, key_len);
+    memcpy(p + sizeof(VlogEntry) + key_len, value, value_len);
+
+    ptr->segment = vlog->active;
+    ptr->offset = (uint32_t)(seg->size + vlog->staged + sizeof(VlogEntry) + key_len);
+    vlog->staged += size;
+    return true;
+}
+
+// Read a spilled value's stored bytes (caller is inside an epoch or holds
+// the lock of the shard whose record points here)
+bool kv_vlog_read(struct KVValueLog* vlog, KVValuePointer ptr, uint16_t len, char* dst) {
+    VlogSegment* seg = ptr.segment < KV_VLOG_MAX_SEGMENTS
+                           ? atomic_load_explicit(&vlog->segments[ptr.segment], memory_order_acquire)
+                           : NULL;
+    if (!seg) {
+        return false;
+    }
+
+    kv_stats_add(KV_STAT_SPILL_READS, 1);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(seg->fd, dst + done, len - done, (off_t)ptr.offset + (off_t)done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += (size_t)n;
+    }
+    return true;
+}
+
+// Count an entry as garbage once no record points at it
+void kv_vlog_discard(struct KVValueLog* vlog, KVValuePointer ptr, uint16_t key_len, uint16_t value_len) {
+    VlogSegment* seg = ptr.segment < KV_VLOG_MAX_SEGMENTS
+                           ? atomic_load_explicit(&vlog->segments[ptr.segment], memory_order_acquire)
+                           : NULL;
+    if (seg) {
+        uint64_t size = sizeof(VlogEntry) + key_len + value_len;
+        atomic_fetch_add_explicit(&seg->dead, size, memory_order_relaxed);
+        kv_stats_add(KV_STAT_VLOG_DEAD_BYTES, (int64_t)size);
+    }
+}
+
+// The sealed segment with the most garbage, if at least half of it is; -1
+// if there is none
+int64_t kv_vlog_gc_victim(struct KVValueLog* vlog) {
+    int64_t victim = -1;
+    uint64_t most_dead = 0;
+
+    while (vlog->oldest < vlog->active && !atomic_load(&vlog->segments[vlog->oldest])) {
+        vlog->oldest++;
+    }
+    for (uint32_t id = vlog->oldest; id < vlog->active; id++) {
+        VlogSegment* seg = atomic_load_explicit(&vlog->segments[id], memory_order_relaxed);
+        if (!seg || seg->dropping) {
+            continue;
+        }
+        uint64_t dead = atomic_load_explicit(&seg->dead, memory_order_relaxed);
+        if (dead * 2 >= seg->size && dead > most_dead) {
+            victim = id;
+            most_dead = dead;
+        }
+    }
+    return victim;
+}
+
+// Call fn for every entry of a sealed segment; stops early if fn returns false
+bool kv_vlog_scan(struct KVValueLog* vlog, uint32_t segment,
+                  bool (*fn)(void* arg, const char* key, uint16_t key_len, const char* value, uint16_t value_len,
+                             KVValuePointer ptr),
+                  void* arg) {
+    VlogSegment* seg = atomic_load_explicit(&vlog->segments[segment], memory_order_relaxed);
+    if (!seg || segment == vlog->active) {
+        return false;
+    }
+
+    char* data = (char*)malloc(seg->size);
+    if (!data) {
+        return false;
+    }
+    size_t done = 0;
+    while (done < seg->size) {
+        ssize_t n = pread(seg->fd, data + done, seg->size - done, (off_t)done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(data);
+            return false;
+        }
+        done += (size_t)n;
+    }
+
+    bool ok = true;
+    size_t pos = 0;
+    while (ok && pos + sizeof(VlogEntry) <= seg->size) {
+        VlogEntry entry;
+        memcpy(&entry, data + pos, sizeof(VlogEntry));
+        const char* key = data + pos + sizeof(VlogEntry);
+        KVValuePointer ptr = { segment, (uint32_t)(pos + sizeof(VlogEntry) + entry.key_len) };
+        pos += sizeof(VlogEntry) + entry.key_len + entry.value_len;
+        if (pos > seg->size) {
+            break;
+        }
+        ok = fn(arg, key, entry.key_len, key + entry.key_len, entry.value_len, ptr);
+    }
+
+    free(data);
+    return ok;
+}
+
+// Delete a segment once every entry in it is garbage; it goes away after
+// the epoch grace period
+bool kv_vlog_drop(struct KVValueLog* vlog, uint32_t segment) {
+    VlogSegment* seg = atomic_load_explicit(&vlog->segments[segment], memory_order_relaxed);
+    if (!seg || seg->dropping || segment == vlog->active || atomic_load(&seg->dead) < seg->size) {
+        return false;
+    }
+
+    seg->dropping = true;
+    kv_epoch_retire(seg, segment_retire);
+    return true;
+}